@@ -6,90 +6,65 @@
 
 vicmil::Window window;
 vicmil::DefaultGpuPrograms gpu_programs;
-std::vector<vicmil::VertexTextureCoord> vertices;
+std::vector<vicmil::VertexTextureCoordColor> vertices;
 
 vicmil::TextInput text_input;
-vicmil::ImageTextureManager* texture_manager;
+vicmil::ImageTextureManagerA8* texture_manager;
 vicmil::MultiFontLoader font_loader;
+vicmil::TextLayout text_layout;
+vicmil::TextRenderer text_renderer;
 vicmil::GuiEngine gui_engine;
 
 int window_w = 800;
 int window_h = 512;
 
-// Returns true if the unicode did not exist before
-bool add_unicode(int unicode_char) {
-    std::string char_label = vicmil::ImageTextureManager::get_unicode_label(unicode_char);
-    if(texture_manager->contains_image(char_label)) {
-        return false;
-    }
-
-    vicmil::ImageRGBA_UChar char_image = font_loader.get_character_image_rgba(unicode_char);
-
-    if(texture_manager->add_image(char_label, char_image)) {
-        return true;
-    }
-    return false;
-}
-
 void add_cursor_image() {
     std::string char_label = "cursor";
     if(texture_manager->contains_image(char_label)) {
         return;
     }
 
-    vicmil::ImageRGBA_UChar char_image = vicmil::ImageRGBA_UChar();
+    vicmil::ImageA8 char_image = vicmil::ImageA8();
     char_image.resize(2, 64);
-    char_image.fill(vicmil::ColorRGBA_UChar(255, 255, 255, 255));
+    std::fill(char_image.pixels.begin(), char_image.pixels.end(), 255);
 
-    texture_manager->add_image(char_label, char_image);
+    texture_manager->add_image(char_label, char_image.view());
 }
 
 void update() {
     std::vector<SDL_Event> events = vicmil::update_SDL();
-    if(text_input.update(events)) {
+    for(const SDL_Event& event : events) {
+        // One event at a time, each one inserts text at the cursor, erases the character before it or moves it
+        size_t old_size = text_input.inputText.size();
+        size_t old_cursor = text_input.cursorPos;
+        if(!text_input.update({event})) {
+            continue;
+        }
         Print("Text: " << text_input.getInputTextUTF8WithCursor());
         Print("Composition text: " << text_input.getCompositionTextUTF8());
-    }
-
-    std::vector<int> character_unicodes = vicmil::utf8ToUnicodeCodePoints(text_input.getInputTextUTF8());
-
-    bool updated_unicode = false;
-    for(int character_unicode: character_unicodes) {
-        if(add_unicode(character_unicode)) {
-            updated_unicode = true;
+        size_t new_size = text_input.inputText.size();
+        if(new_size > old_size) {
+            text_layout.insert(old_cursor, std::vector<int>(text_input.inputText.begin() + old_cursor, 
+                                                            text_input.inputText.begin() + old_cursor + (new_size - old_size)));
+        }
+        else if(new_size < old_size) {
+            text_layout.erase(text_input.cursorPos, old_size - new_size);
         }
-    }
-    add_cursor_image(); // Add the cursor too
-
-    if(updated_unicode) {
-        texture_manager->update_gpu_texture();
     }
 
-    std::vector<vicmil::RectT<int>> character_image_positions = font_loader.get_character_image_positions(character_unicodes);
+    // Glyphs are added to the texture the first time they are drawn
     vertices = {};
-    for(int i = 0; i < character_unicodes.size(); i++) {
-        vicmil::RectT<int> char_pos = character_image_positions[i];
-        vicmil::GuiEngine::RectGL screen_pos = gui_engine.rect_to_rect_gl(vicmil::GuiEngine::Rect(char_pos.x, char_pos.y+100, char_pos.w, char_pos.h));
-        vicmil::GuiEngine::RectGL texture_pos = texture_manager->get_image_pos_gl(vicmil::ImageTextureManager::get_unicode_label(character_unicodes[i]));
-        vicmil::add_texture_rect_to_triangle_buffer(vertices, screen_pos, 1, texture_pos);
-    }
+    text_renderer.add_text_layout(vertices, text_layout, 0, 100, 0, window_h);
 
     // Draw the cursor too
-    vicmil::RectT<int> cursor_pos = vicmil::RectT<int>(0, -55, 2, 64);
-    if(text_input.cursorPos > 0) {
-        cursor_pos.x += character_image_positions[text_input.cursorPos-1].x + character_image_positions[text_input.cursorPos-1].w;
-        for(int i = 0; i < text_input.cursorPos-1; i++) {
-            if(character_unicodes[i] == '\n') {
-                cursor_pos.y += 64;
-            }
-        }
-    }
-    vicmil::GuiEngine::RectGL screen_pos = gui_engine.rect_to_rect_gl(vicmil::GuiEngine::Rect(cursor_pos.x, cursor_pos.y+100, cursor_pos.w, cursor_pos.h));
+    add_cursor_image();
+    vicmil::RectT<int> cursor_pos = text_layout.get_cursor_rect(text_input.cursorPos);
+    vicmil::GuiEngine::RectGL screen_pos = gui_engine.rect_to_rect_gl(vicmil::GuiEngine::Rect(cursor_pos.x, cursor_pos.y+100, 2, cursor_pos.h));
     vicmil::GuiEngine::RectGL texture_pos = texture_manager->get_image_pos_gl("cursor");
-    vicmil::add_texture_rect_to_triangle_buffer(vertices, screen_pos, 2, texture_pos);
+    vicmil::add_text_rect_to_triangle_buffer(vertices, screen_pos, 2, texture_pos);
 
     vicmil::clear_screen();
-    gpu_programs.draw_2d_VertexTextureCoord_vertex_buffer(vertices, texture_manager->gpu_texture);
+    text_renderer.draw(gpu_programs, vertices);
     window.show_on_screen();
 }
 
@@ -107,8 +82,12 @@ void init() {
 
     font_loader.load_font_from_memory(NOTO_SANS_MONO_HPP_data, NOTO_SANS_MONO_HPP_size);
     font_loader.load_font_from_memory(NOTO_SANS_MONO_JP_HPP_data, NOTO_SANS_MONO_JP_HPP_size);
-    texture_manager = new vicmil::ImageTextureManager(512, 512);
+    texture_manager = new vicmil::ImageTextureManagerA8(512, 512);
     texture_manager->update_gpu_texture();
+    text_layout = vicmil::TextLayout(&font_loader);
+    text_layout.set_text(text_input.inputText);
+    text_renderer = vicmil::TextRenderer(&font_loader, texture_manager);
+    text_renderer.set_screen_size(window_w, window_h);
     gui_engine.set_screen_size(window_w, window_h);
 }
 
@@ -44,6 +44,7 @@ struct Vertex {
     VertexCoord vertex_cord;
     TexCoord tex_cord;
     Normal norm;
+    bool has_norm = false; // Set by the loader if the .obj file has a normal for the vertex
     unsigned int material_id;
 };
 
@@ -170,6 +171,381 @@ struct VertexTextureCoord {
         "}                                            \n";
 };
 
+// A textured vertex with a color, e.g. for text where the glyphs are stored as coverage only
+//  and the color is applied when drawing
+struct VertexTextureCoordColor {
+    float x = 0.0;
+    float y = 0.0;
+    float z = 0.0;
+    float u = 0.0;
+    float v = 1.0;
+    float r = 1.0;
+    float g = 1.0;
+    float b = 1.0;
+    float a = 1.0;
+    VertexTextureCoordColor() {}
+    VertexTextureCoordColor(float x_, float y_, float z_, float u_, float v_, float r_, float g_, float b_, float a_ = 1.0) {
+        x = x_;
+        y = y_;
+        z = z_;
+        u = u_;
+        v = v_;
+        r = r_;
+        g = g_;
+        b = b_;
+        a = a_;
+    }
+    // Vertex shader
+    static constexpr const char* gles_vert_src =
+        "uniform mat4 u_MVP;                                   \n"
+        "attribute vec4 position_in;                           \n"
+        "attribute vec2 texcoord_in;                           \n"
+        "attribute vec4 color_in;                              \n"
+        "varying vec2 tex_coord;                               \n"
+        "varying vec4 color;                                   \n"
+        "void main()                                           \n"
+        "{                                                     \n"
+        "    gl_Position = u_MVP * vec4(position_in.xyz, 1.0); \n"
+        "    tex_coord = texcoord_in.xy;                       \n"
+        "    color = color_in;                                 \n"
+        "}                                                     \n";
+    // Vertex shader without projection
+    static constexpr const char* gles_no_proj_vert_src =
+        "attribute vec4 position_in;                           \n"
+        "attribute vec2 texcoord_in;                           \n"
+        "attribute vec4 color_in;                              \n"
+        "varying vec2 tex_coord;                               \n"
+        "varying vec4 color;                                   \n"
+        "void main()                                           \n"
+        "{                                                     \n"
+        "    gl_Position = vec4(position_in.xyz, 1.0);         \n"
+        "    tex_coord = texcoord_in.xy;                       \n"
+        "    color = color_in;                                 \n"
+        "}                                                     \n";
+    // Fragment/pixel shader for single channel(GL_ALPHA) textures, the texture only decides the coverage
+    static constexpr const char* gles_alpha_frag_src =
+        "precision mediump float;                     \n"
+        "varying vec2 tex_coord;                      \n"
+        "varying vec4 color;                          \n"
+        "uniform sampler2D our_texture;               \n"
+        "void main()                                  \n"
+        "{                                            \n"
+        "  gl_FragColor = vec4(color.rgb, color.a * texture2D(our_texture, tex_coord).a); \n"
+        "}                                            \n";
+    /**
+     * Fragment/pixel shader for signed distance field glyphs(see GlyphSDFOptions), with an optional outline and shadow
+     * All widths are in texture values(0 to 1) and are set by DefaultGpuPrograms::draw_2d_sdf_text_vertex_buffer
+     * u_edge_width: half the width of the antialiased edge, u_outline_width: 0 for no outline
+     * u_shadow_offset: in texture coordinates, u_shadow_color.a = 0 for no shadow
+    */
+    static constexpr const char* gles_sdf_frag_src =
+        "precision mediump float;                     \n"
+        "varying vec2 tex_coord;                      \n"
+        "varying vec4 color;                          \n"
+        "uniform sampler2D our_texture;               \n"
+        "uniform float u_edge_value;                  \n"
+        "uniform float u_edge_width;                  \n"
+        "uniform float u_outline_width;               \n"
+        "uniform vec4 u_outline_color;                \n"
+        "uniform vec2 u_shadow_offset;                \n"
+        "uniform float u_shadow_softness;             \n"
+        "uniform vec4 u_shadow_color;                 \n"
+        "void main()                                  \n"
+        "{                                            \n"
+        "  float dist = texture2D(our_texture, tex_coord).a;                                          \n"
+        "  float outer_edge = u_edge_value - u_outline_width;                                         \n"
+        "  float fill = smoothstep(u_edge_value - u_edge_width, u_edge_value + u_edge_width, dist);     \n"
+        "  float coverage = smoothstep(outer_edge - u_edge_width, outer_edge + u_edge_width, dist);     \n"
+        "  vec4 outline = u_outline_width > 0.0 ? u_outline_color : color;                            \n"
+        "  vec4 text = vec4(mix(outline.rgb, color.rgb, fill), mix(outline.a, color.a, fill) * coverage); \n"
+        "  float shadow_dist = texture2D(our_texture, tex_coord - u_shadow_offset).a;                 \n"
+        "  float shadow_width = u_edge_width + u_shadow_softness;                                     \n"
+        "  float shadow = u_shadow_color.a * smoothstep(outer_edge - shadow_width, outer_edge + shadow_width, shadow_dist); \n"
+        "  float alpha = text.a + shadow * (1.0 - text.a);                                            \n"
+        "  vec3 rgb = (text.rgb * text.a + u_shadow_color.rgb * shadow * (1.0 - text.a)) / max(alpha, 0.0001); \n"
+        "  gl_FragColor = vec4(rgb, alpha);           \n"
+        "}                                            \n";
+};
+
+// ============================================================
+//                   Batched vertex transforms
+// ============================================================
+
+/**
+ * Apply a 4x4 matrix to many xyz coordinates at once
+ * The coordinates are read from arrays of structs with any stride (e.g. VertexCoord, VertexCoordColor or Vertex)
+ *  and processed in chunks of 4 (SSE) or 8 (AVX) as separate x, y and z arrays
+ * Matrices are column major like glm and OpenGL, pass &mat[0][0] for a glm::mat4
+*/
+const int _transform_chunk_size = 8;
+
+// The vector operations of _transform_vec3_chunk, 8 lanes with AVX and 4 with SSE
+#if defined(__AVX2__)
+const int _transform_lane_count = 8;
+typedef __m256 _transform_vec;
+inline _transform_vec _transform_load(const float* p) { return _mm256_loadu_ps(p); }
+inline void _transform_store(float* p, _transform_vec v) { _mm256_storeu_ps(p, v); }
+inline _transform_vec _transform_set1(float f) { return _mm256_set1_ps(f); }
+inline _transform_vec _transform_add(_transform_vec a, _transform_vec b) { return _mm256_add_ps(a, b); }
+inline _transform_vec _transform_mul(_transform_vec a, _transform_vec b) { return _mm256_mul_ps(a, b); }
+inline _transform_vec _transform_div(_transform_vec a, _transform_vec b) { return _mm256_div_ps(a, b); }
+inline _transform_vec _transform_sqrt(_transform_vec a) { return _mm256_sqrt_ps(a); }
+inline _transform_vec _transform_max(_transform_vec a, _transform_vec b) { return _mm256_max_ps(a, b); }
+#elif defined(__SSE2__)
+const int _transform_lane_count = 4;
+typedef __m128 _transform_vec;
+inline _transform_vec _transform_load(const float* p) { return _mm_loadu_ps(p); }
+inline void _transform_store(float* p, _transform_vec v) { _mm_storeu_ps(p, v); }
+inline _transform_vec _transform_set1(float f) { return _mm_set1_ps(f); }
+inline _transform_vec _transform_add(_transform_vec a, _transform_vec b) { return _mm_add_ps(a, b); }
+inline _transform_vec _transform_mul(_transform_vec a, _transform_vec b) { return _mm_mul_ps(a, b); }
+inline _transform_vec _transform_div(_transform_vec a, _transform_vec b) { return _mm_div_ps(a, b); }
+inline _transform_vec _transform_sqrt(_transform_vec a) { return _mm_sqrt_ps(a); }
+inline _transform_vec _transform_max(_transform_vec a, _transform_vec b) { return _mm_max_ps(a, b); }
+#endif
+
+/**
+ * @arg w: 1 for positions (translation is applied), 0 for directions
+ * @arg perspective_divide: divide the result by its w, e.g. when unprojecting points with an inverse projection matrix
+ * @arg normalize: normalize the result to length 1, used for normals
+*/
+inline void _transform_vec3_chunk(const float* m, float* x, float* y, float* z, float w, bool perspective_divide, bool normalize) {
+    #if defined(__AVX2__) || defined(__SSE2__)
+    for(int i = 0; i < _transform_chunk_size; i += _transform_lane_count) {
+        _transform_vec vx = _transform_load(x + i);
+        _transform_vec vy = _transform_load(y + i);
+        _transform_vec vz = _transform_load(z + i);
+        _transform_vec out[4];
+        for(int r = 0; r < 4; r++) {
+            out[r] = _transform_add(_transform_add(_transform_mul(_transform_set1(m[r]), vx), _transform_mul(_transform_set1(m[4 + r]), vy)), 
+                                    _transform_add(_transform_mul(_transform_set1(m[8 + r]), vz), _transform_set1(m[12 + r] * w)));
+        }
+        if(perspective_divide) {
+            for(int r = 0; r < 3; r++) {
+                out[r] = _transform_div(out[r], out[3]);
+            }
+        }
+        if(normalize) {
+            _transform_vec length = _transform_sqrt(_transform_add(_transform_add(_transform_mul(out[0], out[0]), _transform_mul(out[1], out[1])), 
+                                                                   _transform_mul(out[2], out[2])));
+            length = _transform_max(length, _transform_set1(1e-20f));
+            for(int r = 0; r < 3; r++) {
+                out[r] = _transform_div(out[r], length);
+            }
+        }
+        _transform_store(x + i, out[0]);
+        _transform_store(y + i, out[1]);
+        _transform_store(z + i, out[2]);
+    }
+    #else
+    for(int i = 0; i < _transform_chunk_size; i++) {
+        float out[4];
+        for(int r = 0; r < 4; r++) {
+            out[r] = m[r] * x[i] + m[4 + r] * y[i] + m[8 + r] * z[i] + m[12 + r] * w;
+        }
+        if(perspective_divide) {
+            out[0] /= out[3];
+            out[1] /= out[3];
+            out[2] /= out[3];
+        }
+        if(normalize) {
+            float length = std::max(sqrtf(out[0] * out[0] + out[1] * out[1] + out[2] * out[2]), 1e-20f);
+            out[0] /= length;
+            out[1] /= length;
+            out[2] /= length;
+        }
+        x[i] = out[0];
+        y[i] = out[1];
+        z[i] = out[2];
+    }
+    #endif
+}
+
+inline void _transform_vec3_strided(const float* matrix, const void* src, void* dst, size_t stride, size_t count, float w, bool perspective_divide, bool normalize) {
+    float x[_transform_chunk_size];
+    float y[_transform_chunk_size];
+    float z[_transform_chunk_size];
+    const unsigned char* src_bytes = (const unsigned char*)src;
+    unsigned char* dst_bytes = (unsigned char*)dst;
+    for(size_t chunk_begin = 0; chunk_begin < count; chunk_begin += _transform_chunk_size) {
+        int chunk_count = std::min((size_t)_transform_chunk_size, count - chunk_begin);
+        // Gather into separate x, y, z arrays
+        for(int i = 0; i < _transform_chunk_size; i++) {
+            float xyz[3] = {0.0f, 0.0f, 0.0f};
+            if(i < chunk_count) {
+                std::memcpy(xyz, src_bytes + (chunk_begin + i) * stride, sizeof(xyz));
+            }
+            x[i] = xyz[0];
+            y[i] = xyz[1];
+            z[i] = xyz[2];
+        }
+        _transform_vec3_chunk(matrix, x, y, z, w, perspective_divide, normalize);
+        for(int i = 0; i < chunk_count; i++) {
+            float xyz[3] = {x[i], y[i], z[i]};
+            std::memcpy(dst_bytes + (chunk_begin + i) * stride, xyz, sizeof(xyz));
+        }
+    }
+}
+
+/**
+ * Transform positions (x, y, z, 1) that are stored stride bytes apart, src and dst may be the same
+*/
+void transform_positions_strided(const float* matrix, const void* src, void* dst, size_t stride, size_t count, bool perspective_divide = false) {
+    _transform_vec3_strided(matrix, src, dst, stride, count, 1.0f, perspective_divide, false);
+}
+
+/**
+ * Same as transform_positions_strided, but split across the worker pool
+*/
+void transform_positions_strided_parallel(const float* matrix, const void* src, void* dst, size_t stride, size_t count, bool perspective_divide = false) {
+    const unsigned char* src_bytes = (const unsigned char*)src;
+    unsigned char* dst_bytes = (unsigned char*)dst;
+    vicmil::parallel_for(0, count, [&](size_t begin, size_t end) {
+        _transform_vec3_strided(matrix, src_bytes + begin * stride, dst_bytes + begin * stride, stride, end - begin, 1.0f, perspective_divide, false);
+    }, 16384);
+}
+
+/**
+ * Get the matrix to use for normals, the inverse transpose of the upper 3x3 part of matrix
+ * Written into a 4x4 column major matrix with no translation
+*/
+void get_normal_matrix(const float* matrix, float* out_matrix) {
+    // Cofactors of the 3x3 part, m(column, row)
+    auto m = [&](int c, int r) { return matrix[c * 4 + r]; };
+    float c00 = m(1, 1) * m(2, 2) - m(2, 1) * m(1, 2);
+    float c01 = m(2, 1) * m(0, 2) - m(0, 1) * m(2, 2);
+    float c02 = m(0, 1) * m(1, 2) - m(1, 1) * m(0, 2);
+    float c10 = m(2, 0) * m(1, 2) - m(1, 0) * m(2, 2);
+    float c11 = m(0, 0) * m(2, 2) - m(2, 0) * m(0, 2);
+    float c12 = m(1, 0) * m(0, 2) - m(0, 0) * m(1, 2);
+    float c20 = m(1, 0) * m(2, 1) - m(2, 0) * m(1, 1);
+    float c21 = m(2, 0) * m(0, 1) - m(0, 0) * m(2, 1);
+    float c22 = m(0, 0) * m(1, 1) - m(1, 0) * m(0, 1);
+    float det = m(0, 0) * c00 + m(1, 0) * c01 + m(2, 0) * c02;
+    float inv_det = det != 0.0f ? 1.0f / det : 0.0f;
+    // The inverse is the transposed cofactors / det, so the inverse transpose is the cofactors / det
+    float normal_matrix[16] = {
+        c00 * inv_det, c10 * inv_det, c20 * inv_det, 0.0f,
+        c01 * inv_det, c11 * inv_det, c21 * inv_det, 0.0f,
+        c02 * inv_det, c12 * inv_det, c22 * inv_det, 0.0f,
+        0.0f, 0.0f, 0.0f, 1.0f
+    };
+    std::memcpy(out_matrix, normal_matrix, sizeof(normal_matrix));
+}
+
+/**
+ * Transform normals stored stride bytes apart by the normal matrix of matrix, and renormalize them
+*/
+void transform_normals_strided(const float* matrix, const void* src, void* dst, size_t stride, size_t count) {
+    float normal_matrix[16];
+    get_normal_matrix(matrix, normal_matrix);
+    _transform_vec3_strided(normal_matrix, src, dst, stride, count, 0.0f, false, true);
+}
+
+void transform_vertex_coords(const float* matrix, std::vector<VertexCoord>& coords, bool perspective_divide = false) {
+    transform_positions_strided(matrix, coords.data(), coords.data(), sizeof(VertexCoord), coords.size(), perspective_divide);
+}
+void transform_vertex_coords(const float* matrix, std::vector<VertexCoordColor>& vertices) {
+    transform_positions_strided(matrix, vertices.data(), vertices.data(), sizeof(VertexCoordColor), vertices.size());
+}
+void transform_vertex_coords(const float* matrix, std::vector<VertexTextureCoord>& vertices) {
+    transform_positions_strided(matrix, vertices.data(), vertices.data(), sizeof(VertexTextureCoord), vertices.size());
+}
+void transform_normals(const float* matrix, std::vector<Normal>& normals) {
+    transform_normals_strided(matrix, normals.data(), normals.data(), sizeof(Normal), normals.size());
+}
+
+/**
+ * Get the min and max corners of the box containing all the positions
+ * Returns false(and leaves min/max untouched) if count is zero
+*/
+bool get_bounding_box_strided(const void* src, size_t stride, size_t count, VertexCoord& out_min, VertexCoord& out_max) {
+    if(count == 0) {
+        return false;
+    }
+    const unsigned char* src_bytes = (const unsigned char*)src;
+    float min_v[3];
+    float max_v[3];
+    std::memcpy(min_v, src_bytes, sizeof(min_v));
+    std::memcpy(max_v, src_bytes, sizeof(max_v));
+    size_t i = 1;
+    #if defined(__SSE2__)
+    // Keep x, y, z in one register each, 4 points at a time
+    __m128 min_vec[3];
+    __m128 max_vec[3];
+    for(int c = 0; c < 3; c++) {
+        min_vec[c] = _mm_set1_ps(min_v[c]);
+        max_vec[c] = _mm_set1_ps(max_v[c]);
+    }
+    for(; i + 4 <= count; i += 4) {
+        float xyz[4][3];
+        for(int j = 0; j < 4; j++) {
+            std::memcpy(xyz[j], src_bytes + (i + j) * stride, sizeof(xyz[j]));
+        }
+        for(int c = 0; c < 3; c++) {
+            __m128 v = _mm_set_ps(xyz[3][c], xyz[2][c], xyz[1][c], xyz[0][c]);
+            min_vec[c] = _mm_min_ps(min_vec[c], v);
+            max_vec[c] = _mm_max_ps(max_vec[c], v);
+        }
+    }
+    for(int c = 0; c < 3; c++) {
+        float lanes[4];
+        _mm_storeu_ps(lanes, min_vec[c]);
+        min_v[c] = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+        _mm_storeu_ps(lanes, max_vec[c]);
+        max_v[c] = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    }
+    #endif
+    for(; i < count; i++) {
+        float xyz[3];
+        std::memcpy(xyz, src_bytes + i * stride, sizeof(xyz));
+        for(int c = 0; c < 3; c++) {
+            min_v[c] = std::min(min_v[c], xyz[c]);
+            max_v[c] = std::max(max_v[c], xyz[c]);
+        }
+    }
+    out_min = VertexCoord(min_v[0], min_v[1], min_v[2]);
+    out_max = VertexCoord(max_v[0], max_v[1], max_v[2]);
+    return true;
+}
+
+/**
+ * Get the average position. Sums in float over short runs, and accumulates the runs in double to keep precision for large meshes
+*/
+VertexCoord get_centroid_strided(const void* src, size_t stride, size_t count) {
+    if(count == 0) {
+        return VertexCoord(0, 0, 0);
+    }
+    const unsigned char* src_bytes = (const unsigned char*)src;
+    double sum[3] = {0.0, 0.0, 0.0};
+    const size_t run_length = 1024;
+    for(size_t run_begin = 0; run_begin < count; run_begin += run_length) {
+        size_t run_end = std::min(run_begin + run_length, count);
+        float run_sum[4][3] = {{0}}; // Four independent sums so the additions can run in parallel
+        size_t i = run_begin;
+        for(; i + 4 <= run_end; i += 4) {
+            for(int j = 0; j < 4; j++) {
+                float xyz[3];
+                std::memcpy(xyz, src_bytes + (i + j) * stride, sizeof(xyz));
+                run_sum[j][0] += xyz[0];
+                run_sum[j][1] += xyz[1];
+                run_sum[j][2] += xyz[2];
+            }
+        }
+        for(; i < run_end; i++) {
+            float xyz[3];
+            std::memcpy(xyz, src_bytes + i * stride, sizeof(xyz));
+            run_sum[0][0] += xyz[0];
+            run_sum[0][1] += xyz[1];
+            run_sum[0][2] += xyz[2];
+        }
+        for(int c = 0; c < 3; c++) {
+            sum[c] += (double)run_sum[0][c] + run_sum[1][c] + run_sum[2][c] + run_sum[3][c];
+        }
+    }
+    return VertexCoord(sum[0] / count, sum[1] / count, sum[2] / count);
+}
+
 struct Mesh {
     std::vector<Vertex> vertices;
     std::vector<Face> faces;
@@ -229,19 +605,102 @@ struct Mesh {
         return faces.size();
     }
     VertexCoord get_avarage_vert_coord() {
-        double x = 0;
-        double y = 0;
-        double z = 0;
-        for(int i = 0; i < vertices.size(); i++) {
-            x += vertices[i].vertex_cord.x;
-            y += vertices[i].vertex_cord.y;
-            z += vertices[i].vertex_cord.z;
+        return get_centroid();
+    }
+    VertexCoord get_centroid() {
+        return get_centroid_strided(vertices.data(), sizeof(Vertex), vertices.size());
+    }
+    // Returns false if the mesh has no vertices
+    bool get_bounding_box(VertexCoord& out_min, VertexCoord& out_max) {
+        return get_bounding_box_strided(vertices.data(), sizeof(Vertex), vertices.size(), out_min, out_max);
+    }
+    // Normals are only loaded for the faces that have them in the .obj file, see Vertex::has_norm
+    bool has_normals() {
+        for(const Vertex& vertex : vertices) {
+            if(vertex.has_norm) {
+                return true;
+            }
         }
-        VertexCoord avg_coord = VertexCoord(x / vertices.size(), y / vertices.size(), z / vertices.size());
-        return avg_coord;
+        return false;
+    }
+    /**
+     * Transform all vertex positions, and the normals of the vertices that have one, by a column major 4x4 matrix
+     * Large meshes are split across the worker pool
+    */
+    void transform(const float* matrix) {
+        if(vertices.size() >= 65536) {
+            transform_positions_strided_parallel(matrix, vertices.data(), vertices.data(), sizeof(Vertex), vertices.size());
+        }
+        else {
+            transform_positions_strided(matrix, vertices.data(), vertices.data(), sizeof(Vertex), vertices.size());
+        }
+        // The normals are transformed in runs of vertices that have one, so the default value of the others is kept
+        size_t i = 0;
+        while(i < vertices.size()) {
+            if(!vertices[i].has_norm) {
+                i++;
+                continue;
+            }
+            size_t run_begin = i;
+            while(i < vertices.size() && vertices[i].has_norm) {
+                i++;
+            }
+            unsigned char* normals = (unsigned char*)&vertices[run_begin] + offsetof(Vertex, norm);
+            transform_normals_strided(matrix, normals, normals, sizeof(Vertex), i - run_begin);
+        }
+    }
+    // For example a glm::mat4, only matrix classes so that a float* still goes to transform(const float*)
+    template<class MAT4, class = typename std::enable_if<std::is_class<MAT4>::value>::type>
+    void transform(const MAT4& matrix) {
+        transform(&matrix[0][0]);
     }
 };
 
+void TEST_mesh_transform() {
+    // Some vertices without normals, and a count that is not a multiple of the chunk size
+    Mesh mesh;
+    for(int i = 0; i < 21; i++) {
+        Vertex vertex;
+        vertex.vertex_cord = VertexCoord(i, -i * 0.5f, 3);
+        if(i % 3 != 0) {
+            vertex.norm = Normal(0, 0, 2);
+            vertex.has_norm = true;
+        }
+        mesh.vertices.push_back(vertex);
+    }
+    VertexCoord min_coord;
+    VertexCoord max_coord;
+    Assert(mesh.get_bounding_box(min_coord, max_coord));
+    Assert(min_coord.x == 0 && min_coord.y == -10 && min_coord.z == 3);
+    Assert(max_coord.x == 20 && max_coord.y == 0 && max_coord.z == 3);
+    VertexCoord centroid = mesh.get_centroid();
+    Assert(fabs(centroid.x - 10) < 1e-4 && fabs(centroid.y + 5) < 1e-4 && fabs(centroid.z - 3) < 1e-4);
+
+    // Column major: x -> (2, 0, -1), y -> (0, 1, 0), z -> (1, 0, 0), translated by (1, 2, 3)
+    float matrix[16] = {
+        2, 0, -1, 0,
+        0, 1, 0, 0,
+        1, 0, 0, 0,
+        1, 2, 3, 1
+    };
+    mesh.transform(matrix);
+    for(int i = 0; i < 21; i++) {
+        const Vertex& vertex = mesh.vertices[i];
+        Assert(fabs(vertex.vertex_cord.x - (2 * i + 3 + 1)) < 1e-4);
+        Assert(fabs(vertex.vertex_cord.y - (-i * 0.5f + 2)) < 1e-4);
+        Assert(fabs(vertex.vertex_cord.z - (-i + 3)) < 1e-4);
+        if(vertex.has_norm) {
+            // Perpendicular to the transformed x and y axes, and normalized
+            Assert(fabs(vertex.norm.x - 1 / sqrtf(5)) < 1e-4 && fabs(vertex.norm.y) < 1e-4 && fabs(vertex.norm.z - 2 / sqrtf(5)) < 1e-4);
+        }
+        else {
+            Assert(vertex.norm.x == Normal().x && vertex.norm.y == Normal().y && vertex.norm.z == Normal().z);
+        }
+    }
+    Assert(mesh.has_normals());
+}
+AddTest(TEST_mesh_transform);
+
 struct _RawMesh {
     tinyobj::attrib_t attrib;
     std::vector<tinyobj::shape_t> shapes;
@@ -336,6 +795,7 @@ Mesh _load_obj_file(_RawMesh& raw_mesh) {
                         attrib.normals[3 * idx.normal_index + 1],
                         attrib.normals[3 * idx.normal_index + 2]
                     );
+                    vertex.has_norm = true;
                 }
 
                 if (idx.texcoord_index >= 0) {
@@ -613,6 +613,28 @@ public:
     }
 };
 
+// glm versions of the batched transforms in util_obj_loader.hpp, e.g. to transform vertices once on the cpu instead of every frame on the gpu
+void transform_vertex_coords(const glm::mat4& matrix, std::vector<VertexCoord>& coords, bool perspective_divide = false) {
+    transform_vertex_coords(&matrix[0][0], coords, perspective_divide);
+}
+void transform_vertex_coords(const glm::mat4& matrix, std::vector<VertexCoordColor>& vertices) {
+    transform_vertex_coords(&matrix[0][0], vertices);
+}
+void transform_vertex_coords(const glm::mat4& matrix, std::vector<VertexTextureCoord>& vertices) {
+    transform_vertex_coords(&matrix[0][0], vertices);
+}
+void transform_normals(const glm::mat4& matrix, std::vector<Normal>& normals) {
+    transform_normals(&matrix[0][0], normals);
+}
+
+// Convert a depth screenshot to distances from the camera, using the near and far planes of the perspective
+void linearize_depth(Image_float& depth_image, const Perspective3DParameters& perspective) {
+    depth_image.linearize_depth(perspective.min_depth, perspective.max_depth);
+}
+void linearize_depth(Image_half& depth_image, const Perspective3DParameters& perspective) {
+    depth_image.linearize_depth(perspective.min_depth, perspective.max_depth);
+}
+
 /*
 void uniform_buffer_exmple() {
     gpu_program_3d.bind_program();
@@ -634,6 +656,36 @@ void uniform_buffer_exmple() {
  * You can also render to a texture instead of the main window.
 */
 
+// OpenGL enums for the block compressed formats, not all OpenGL headers define them
+const GLenum _GL_COMPRESSED_RGBA_S3TC_DXT1 = 0x83F1;
+const GLenum _GL_COMPRESSED_RGBA_S3TC_DXT5 = 0x83F3;
+const GLenum _GL_COMPRESSED_RGBA8_ETC2_EAC = 0x9278;
+
+inline GLenum get_gl_compressed_format(CompressedFormat format) {
+    switch(format) {
+        case COMPRESSED_BC1: return _GL_COMPRESSED_RGBA_S3TC_DXT1;
+        case COMPRESSED_BC3: return _GL_COMPRESSED_RGBA_S3TC_DXT5;
+        case COMPRESSED_ETC2_RGBA: return _GL_COMPRESSED_RGBA8_ETC2_EAC;
+    }
+    return 0;
+}
+
+/**
+ * Check if the GPU can use textures in the compressed format directly(requires an OpenGL context)
+ * BC1/BC3 usually works on desktop, and ETC2 on OpenGL ES 3 and WebGL 2 on mobile
+*/
+inline bool is_compressed_format_supported(CompressedFormat format) {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &count);
+    if(count <= 0) {
+        return false;
+    }
+    std::vector<GLint> formats = std::vector<GLint>(count);
+    glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, formats.data());
+    GLint wanted = get_gl_compressed_format(format);
+    return std::find(formats.begin(), formats.end(), wanted) != formats.end();
+}
+
 class GPUTexture {
 public:
     // The texture id, a reference to the GPU texture
@@ -653,12 +705,89 @@ public:
      * @param raw_image The image with pixel data to use
      * @return A reference to the texture on the GPU
     */
-    static GPUTexture from_raw_image_rgba(ImageRGBA_UChar& raw_image) {
-        return GPUTexture(raw_image.w, raw_image.h, raw_image.get_pixel_data());
+    static GPUTexture from_raw_image_rgba(const ImageRGBA_UChar& raw_image) {
+        return GPUTexture(raw_image.w, raw_image.h, raw_image.get_pixel_data_const());
+    }
+    // Same as from_raw_image_rgba, but the view may be a rectangle inside a larger image
+    static GPUTexture from_image_view(ConstImageViewRGBA image) {
+        if(image.is_contiguous()) {
+            return GPUTexture(image.w, image.h, (const unsigned char*)image.data);
+        }
+        GPUTexture new_texture = GPUTexture(image.w, image.h);
+        _upload_image_view(0, 0, image);
+        return new_texture;
+    }
+
+    /**
+     * Create a single channel texture, stored as GL_ALPHA so shaders read the value from the alpha channel
+     * e.g. for glyph coverage, see VertexTextureCoordColor::gles_alpha_frag_src
+     * GL_ALPHA is available in both OpenGL ES 2/WebGL 1 and the desktop compatibility profile(GL_R8 would need GL 3/ES 3)
+    */
+    static GPUTexture from_image_a8(ConstImageViewA8 image) {
+        Assert(vicmil::is_power_of_two(image.w) == true);
+        Assert(vicmil::is_power_of_two(image.h) == true);
+        GPUTexture new_texture = GPUTexture();
+        new_texture._width = image.w;
+        new_texture._height = image.h;
+        new_texture.no_texture = false;
+        glGenTextures(1, &new_texture.renderedTexture);
+        glBindTexture(GL_TEXTURE_2D, new_texture.renderedTexture);
+        GLCall(glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, image.w, image.h, 0, GL_ALPHA, GL_UNSIGNED_BYTE, nullptr));
+        _upload_image_view(0, 0, image);
+        set_pixel_parameters_nearest();
+        return new_texture;
+    }
+
+    /**
+     * Create a texture from block compressed data, the blocks are uploaded as they are if the GPU supports the format
+     * Otherwise they are decompressed on the cpu and uploaded as GL_RGBA
+     * Note! Compressed textures can not be partially overwritten, overwrite the whole texture instead
+    */
+    static GPUTexture from_compressed_image(const CompressedImage& image) {
+        if(!is_compressed_format_supported(image.format)) {
+            return from_raw_image_rgba(decompress_image(image));
+        }
+        return _from_compressed_data(image.format, image.w, image.h, image.data.data(), image.data.size());
+    }
+    static GPUTexture _from_compressed_data(CompressedFormat format, int w, int h, const unsigned char* data, size_t size) {
+        Assert(vicmil::is_power_of_two(w) == true);
+        Assert(vicmil::is_power_of_two(h) == true);
+        GPUTexture new_texture = GPUTexture();
+        new_texture._width = w;
+        new_texture._height = h;
+        new_texture.no_texture = false;
+        glGenTextures(1, &new_texture.renderedTexture);
+        glBindTexture(GL_TEXTURE_2D, new_texture.renderedTexture);
+        GLCall(glCompressedTexImage2D(GL_TEXTURE_2D, 0, get_gl_compressed_format(format), w, h, 0, size, data));
+        set_pixel_parameters_nearest();
+        return new_texture;
+    }
+
+    /**
+     * Create a texture from an image loaded through the TextureCache, the pixels are uploaded straight from the mapped entry
+     * Mip chains are uploaded as the mip levels of the texture, and sampled with trilinear filtering
+    */
+    static GPUTexture from_cached_texture(const CachedTexture& texture) {
+        Assert(texture.empty() == false);
+        if(texture.content == TEXTURE_CACHE_COMPRESSED) {
+            if(!is_compressed_format_supported(texture.compressed_format)) {
+                return from_raw_image_rgba(texture.to_image_rgba());
+            }
+            return _from_compressed_data(texture.compressed_format, texture.w, texture.h, texture.level_data[0], texture.level_sizes[0]);
+        }
+        GPUTexture new_texture = from_image_view(texture.level(0));
+        if(texture.level_count() > 1) {
+            for(int i = 1; i < texture.level_count(); i++) {
+                GLCall(glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA, texture.level_widths[i], texture.level_heights[i], 0, GL_RGBA, GL_UNSIGNED_BYTE, texture.level_data[i]));
+            }
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        }
+        return new_texture;
     }
 
     GPUTexture() {}
-    GPUTexture(unsigned int width, unsigned int height, unsigned char* pixel_data = nullptr) {
+    GPUTexture(unsigned int width, unsigned int height, const unsigned char* pixel_data = nullptr) {
         Assert(vicmil::is_power_of_two(width) == true);
         Assert(vicmil::is_power_of_two(height) == true);
         _width = width;
@@ -678,7 +807,7 @@ public:
     /*
     Overwrite the image data stored on the texture on the gpu
     */
-    void overwrite_texture_data(unsigned int width, unsigned int height, unsigned char* pixel_data = nullptr) {
+    void overwrite_texture_data(unsigned int width, unsigned int height, const unsigned char* pixel_data = nullptr) {
         Assert(vicmil::is_power_of_two(width) == true);
         Assert(vicmil::is_power_of_two(height) == true);
         Assert(no_texture == false);
@@ -696,8 +825,75 @@ public:
             glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixel_data);
         }
     }
-    void overwrite_texture_data(ImageRGBA_UChar& raw_image) {
-        overwrite_texture_data(raw_image.w, raw_image.h, raw_image.get_pixel_data());
+    void overwrite_texture_data(const ImageRGBA_UChar& raw_image) {
+        overwrite_texture_data(raw_image.w, raw_image.h, raw_image.get_pixel_data_const());
+    }
+    void overwrite_texture_data(ConstImageViewRGBA image) {
+        if(image.is_contiguous()) {
+            overwrite_texture_data(image.w, image.h, (const unsigned char*)image.data);
+            return;
+        }
+        overwrite_texture_data(image.w, image.h); // Resize if needed
+        _upload_image_view(0, 0, image);
+    }
+    /**
+     * Overwrite only a rectangle of the texture, with its top left corner at x, y
+     * Cheaper than overwriting the whole texture when only a small part has changed
+    */
+    void overwrite_texture_region(int x, int y, ConstImageViewRGBA image) {
+        Assert(no_texture == false);
+        if(image.empty()) {
+            return;
+        }
+        glBindTexture(GL_TEXTURE_2D, renderedTexture);
+        _upload_image_view(x, y, image);
+    }
+    // Same as overwrite_texture_region, for textures created with from_image_a8
+    void overwrite_texture_region(int x, int y, ConstImageViewA8 image) {
+        Assert(no_texture == false);
+        if(image.empty()) {
+            return;
+        }
+        glBindTexture(GL_TEXTURE_2D, renderedTexture);
+        _upload_image_view(x, y, image);
+    }
+    // Upload single channel pixels to the bound texture
+    // Rows of one byte pixels are not 4 byte aligned, so the unpack alignment is set to 1 while uploading
+    static void _upload_image_view(int x, int y, ConstImageViewA8 image) {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        if(image.is_contiguous()) {
+            GLCall(glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, image.w, image.h, GL_ALPHA, GL_UNSIGNED_BYTE, image.data));
+        }
+        else {
+            #if defined(__EMSCRIPTEN__)
+                // GL_UNPACK_ROW_LENGTH is not available in WebGL 1, so upload one row at a time
+                for(int row = 0; row < image.h; row++) {
+                    GLCall(glTexSubImage2D(GL_TEXTURE_2D, 0, x, y + row, image.w, 1, GL_ALPHA, GL_UNSIGNED_BYTE, image.get_row(row)));
+                }
+            #else
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, image.stride);
+                GLCall(glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, image.w, image.h, GL_ALPHA, GL_UNSIGNED_BYTE, image.data));
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+            #endif
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+    // Upload pixels to the bound texture, taking the row stride of the view into account
+    static void _upload_image_view(int x, int y, ConstImageViewRGBA image) {
+        if(image.is_contiguous()) {
+            GLCall(glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, image.w, image.h, GL_RGBA, GL_UNSIGNED_BYTE, image.data));
+            return;
+        }
+        #if defined(__EMSCRIPTEN__)
+            // GL_UNPACK_ROW_LENGTH is not available in WebGL 1, so upload one row at a time
+            for(int row = 0; row < image.h; row++) {
+                GLCall(glTexSubImage2D(GL_TEXTURE_2D, 0, x, y + row, image.w, 1, GL_RGBA, GL_UNSIGNED_BYTE, image.get_row(row)));
+            }
+        #else
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, image.stride);
+            GLCall(glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, image.w, image.h, GL_RGBA, GL_UNSIGNED_BYTE, image.data));
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        #endif
     }
 
     /**
@@ -748,26 +944,55 @@ public:
     }
 
     // Capture what is currently displayed on the screen
-    // Note! Will be flipped upside down when returned(can be handled by just calling flip_vertical)
-    static ImageRGBA_UChar get_screenshot(int out_texture_width, int out_texture_height) {
+    // Note! Will be flipped upside down when returned, unless flip_vertical is set
+    static ImageRGBA_UChar get_screenshot(int out_texture_width, int out_texture_height, bool flip_vertical = false) {
         ImageRGBA_UChar texture_image;
         texture_image.resize(out_texture_width, out_texture_height);
 
         // Get the texture data
         glReadPixels(0, 0, out_texture_width, out_texture_height, GL_RGBA, GL_UNSIGNED_BYTE, texture_image.get_pixel_data());
 
+        if(flip_vertical) {
+            texture_image.flip_vertical();
+        }
         return texture_image;
     }
 
     // Capture the depth map of what is being displayed on the screen
-    // Note! Will be flipped upside down when returned
-    static Image_float get_depth_screenshot(int out_texture_width, int out_texture_height) {
+    // Note! Will be flipped upside down when returned, unless flip_vertical is set
+    static Image_float get_depth_screenshot(int out_texture_width, int out_texture_height, bool flip_vertical = false) {
         Image_float texture_image;
         texture_image.resize(out_texture_width, out_texture_height);
 
         // Get the texture data
         glReadPixels(0, 0, out_texture_width, out_texture_height, GL_DEPTH_COMPONENT, GL_FLOAT, texture_image.get_pixel_data());
 
+        if(flip_vertical) {
+            texture_image.flip_vertical();
+        }
+        return texture_image;
+    }
+
+    /**
+     * Same as get_depth_screenshot, but stored as 16 bit floats to use half the memory
+     * The depth is read in bands of rows, so the whole screenshot never has to be stored as 32 bit floats
+    */
+    static Image_half get_depth_screenshot_half(int out_texture_width, int out_texture_height, bool flip_vertical = false) {
+        Image_half texture_image;
+        texture_image.resize(out_texture_width, out_texture_height);
+        if(out_texture_width <= 0 || out_texture_height <= 0) {
+            return texture_image;
+        }
+        int band_rows = std::max(1, (256 * 1024) / out_texture_width);
+        std::vector<float> band = std::vector<float>((size_t)band_rows * out_texture_width);
+        for(int y = 0; y < out_texture_height; y += band_rows) {
+            int row_count = std::min(band_rows, out_texture_height - y);
+            glReadPixels(0, y, out_texture_width, row_count, GL_DEPTH_COMPONENT, GL_FLOAT, band.data());
+            for(int row = 0; row < row_count; row++) {
+                int dst_y = flip_vertical ? out_texture_height - 1 - (y + row) : y + row;
+                texture_image.set_pixel_values((size_t)dst_y * out_texture_width, &band[(size_t)row * out_texture_width], out_texture_width);
+            }
+        }
         return texture_image;
     }
 
@@ -803,26 +1028,153 @@ public:
     GPUImage() {
 
     }
-    static GPUImage from_CPUImage(ImageRGBA_UChar cpu_image) {
+    static GPUImage from_CPUImage(ConstImageViewRGBA cpu_image) {
         GPUImage new_gpu_image;
-        new_gpu_image.texture = vicmil::GPUTexture::from_raw_image_rgba(cpu_image);
+        new_gpu_image.texture = vicmil::GPUTexture::from_image_view(cpu_image);
         return new_gpu_image;
     }
     /*
     Overwrite the previously loaded gpu image with new content
     */
-    void overwrite_with_CPUImage(ImageRGBA_UChar cpu_image) {
+    void overwrite_with_CPUImage(ConstImageViewRGBA cpu_image) {
         texture.overwrite_texture_data(cpu_image);
     }
     ImageRGBA_UChar to_CPUImage() {
         texture.start_render_to_texture(); // Must be rendering to the texture in order to get the image
-        ImageRGBA_UChar new_cpu_image = texture.get_screenshot(texture._width, texture._height);
+        ImageRGBA_UChar new_cpu_image = texture.get_screenshot(texture._width, texture._height, true);
         texture.stop_rendering_to_texture();
-        new_cpu_image.flip_vertical();
         return new_cpu_image;
     }
 };
 
+/**
+ * Record what is drawn on the screen, without stalling rendering, see FrameEncoder
+ * On desktop the pixels are read into pixel buffer objects, which the GPU fills in the background,
+ *  and each buffer is only read on the cpu pbo_count frames later when it is long done.
+ *  WebGL 1 has no pixel buffer objects, so there the pixels are read directly(this waits for the GPU)
+ * Flipping and encoding is done by the encoder workers, not on the main thread
+ * 
+ * FrameRecorder recorder;
+ * FrameEncoderOptions options = FrameEncoderOptions();
+ * options.path = "recording"; // The directory must exist
+ * recorder.start(options);
+ * // Each frame after drawing, before swapping the buffers
+ * recorder.capture(window_width, window_height);
+ * // When done, get the frames still being read and wait for them to be written
+ * recorder.finish();
+*/
+class FrameRecorder {
+public:
+    FrameEncoder encoder;
+    int pbo_count = 3; // Frames in flight, the pixels of a frame are read this many captures later
+    std::vector<GLuint> _pbos;
+    std::vector<int> _pbo_widths;
+    std::vector<int> _pbo_heights;
+    std::vector<bool> _pbo_pending;
+    int _next_pbo = 0;
+
+    FrameRecorder() {}
+    FrameRecorder(const FrameRecorder&) = delete;
+    FrameRecorder& operator=(const FrameRecorder&) = delete;
+
+    bool start(const FrameEncoderOptions& options) {
+        return encoder.start(options);
+    }
+    bool is_recording() const {
+        return encoder.is_started();
+    }
+    int recorded_count() const {
+        return encoder.written_count;
+    }
+    // Frames that were skipped because the encoder could not keep up
+    int dropped_count() const {
+        return encoder.dropped_count;
+    }
+
+    // Capture the w*h pixels at the bottom left of the bound framebuffer(e.g. the window), call it once per frame
+    void capture(int w, int h) {
+        if(!encoder.is_started() || w <= 0 || h <= 0) {
+            return;
+        }
+        #if defined(__EMSCRIPTEN__)
+            if(encoder.is_queue_full()) {
+                encoder.dropped_count++; // Skip the read as well, it would be thrown away
+                return;
+            }
+            ImageRGBA_UChar frame = encoder.acquire_frame();
+            frame.resize(w, h);
+            glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, frame.get_pixel_data());
+            encoder.submit(frame, true);
+        #else
+            if(_pbos.size() == 0) {
+                _pbos.resize(std::max(pbo_count, 1));
+                glGenBuffers(_pbos.size(), _pbos.data());
+                _pbo_widths.assign(_pbos.size(), 0);
+                _pbo_heights.assign(_pbos.size(), 0);
+                _pbo_pending.assign(_pbos.size(), false);
+            }
+            int index = _next_pbo;
+            if(_pbo_pending[index]) {
+                _read_pbo(index); // Read the frame from pbo_count captures ago, to reuse its buffer
+            }
+            if(encoder.is_queue_full()) {
+                encoder.dropped_count++; // Skip the read as well, it would be thrown away
+                return;
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, _pbos[index]);
+            if(_pbo_widths[index] != w || _pbo_heights[index] != h) {
+                glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)w * h * sizeof(ColorRGBA_UChar), nullptr, GL_STREAM_READ);
+                _pbo_widths[index] = w;
+                _pbo_heights[index] = h;
+            }
+            // With a pack buffer bound, the pixels are copied into the buffer and the call returns without waiting
+            glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            _pbo_pending[index] = true;
+            _next_pbo = (index + 1) % _pbos.size();
+        #endif
+    }
+
+    #if !defined(__EMSCRIPTEN__)
+    // Copy the pixels out of a pixel buffer and hand them to the encoder
+    void _read_pbo(int index) {
+        _pbo_pending[index] = false;
+        ImageRGBA_UChar frame = encoder.acquire_frame();
+        frame.resize(_pbo_widths[index], _pbo_heights[index]);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, _pbos[index]);
+        const unsigned char* pixels = (const unsigned char*)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        if(pixels != nullptr) {
+            std::memcpy(frame.get_pixel_data(), pixels, frame.pixels.size() * sizeof(ColorRGBA_UChar));
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        if(pixels == nullptr) {
+            encoder.failed_count++;
+            encoder.image_pool.release(frame);
+            return;
+        }
+        encoder.submit(frame, true);
+    }
+    #endif
+
+    // Read the frames still in flight(oldest first), wait for every frame to be written and free the buffers
+    bool finish() {
+        #if !defined(__EMSCRIPTEN__)
+            for(size_t i = 0; i < _pbos.size(); i++) {
+                int index = (_next_pbo + i) % _pbos.size();
+                if(_pbo_pending[index]) {
+                    _read_pbo(index);
+                }
+            }
+            if(_pbos.size() != 0) {
+                glDeleteBuffers(_pbos.size(), _pbos.data());
+                _pbos.clear();
+            }
+        #endif
+        return encoder.finish();
+    }
+};
+
 // ============================================================
 //                      GPU Settings and setup
 // ============================================================
@@ -1467,12 +1819,56 @@ inline void add_texture_rect_to_triangle_buffer(
                                                   texture_pos.y + texture_pos.h));
 }
 
+// Add a 2d rectangle with a single channel image on it(e.g. a glyph), drawn in the specified color
+inline void add_text_rect_to_triangle_buffer(
+    std::vector<vicmil::VertexTextureCoordColor>& vertices, 
+    vicmil::GuiEngine::RectGL layout_pos, // The position of the rectangle
+    unsigned int layer, // supports over 1 000 000 layers, where the higher layers will be drawn first
+    vicmil::GuiEngine::RectGL texture_pos,
+    ColorRGBA_UChar color = ColorRGBA_UChar(255, 255, 255, 255)) {
+    float z = 1.0f - (layer+1)/2000000.0f;
+    float r = color.r / 255.0f;
+    float g = color.g / 255.0f;
+    float b = color.b / 255.0f;
+    float a = color.a / 255.0f;
+    float x1 = layout_pos.x;
+    float x2 = layout_pos.x + layout_pos.w;
+    float y1 = layout_pos.y;
+    float y2 = layout_pos.y - layout_pos.h;
+    float u1 = texture_pos.x;
+    float u2 = texture_pos.x + texture_pos.w;
+    float v1 = texture_pos.y;
+    float v2 = texture_pos.y + texture_pos.h;
+    vertices.push_back(vicmil::VertexTextureCoordColor(x1, y1, z, u1, v1, r, g, b, a));
+    vertices.push_back(vicmil::VertexTextureCoordColor(x2, y1, z, u2, v1, r, g, b, a));
+    vertices.push_back(vicmil::VertexTextureCoordColor(x1, y2, z, u1, v2, r, g, b, a));
+    vertices.push_back(vicmil::VertexTextureCoordColor(x2, y2, z, u2, v2, r, g, b, a));
+    vertices.push_back(vicmil::VertexTextureCoordColor(x2, y1, z, u2, v1, r, g, b, a));
+    vertices.push_back(vicmil::VertexTextureCoordColor(x1, y2, z, u1, v2, r, g, b, a));
+}
+
+/**
+ * How signed distance field text is drawn, see DefaultGpuPrograms::draw_2d_sdf_text_vertex_buffer
+ * All sizes are in screen pixels, and are kept the same at every text size
+*/
+struct SDFTextStyle {
+    float smoothing = 1.0; // The width of the antialiased edge
+    float outline_width = 0.0; // 0 for no outline
+    ColorRGBA_UChar outline_color = ColorRGBA_UChar(0, 0, 0, 255);
+    float shadow_offset_x = 0.0;
+    float shadow_offset_y = 0.0;
+    float shadow_softness = 0.0; // How much the edge of the shadow is blurred
+    ColorRGBA_UChar shadow_color = ColorRGBA_UChar(0, 0, 0, 0); // Alpha 0 for no shadow
+};
+
 class DefaultGpuPrograms {
 public:
     vicmil::GPUProgram gpu_program_VertexCoordColor_no_proj;   // no projection using uniform buffer matrix
     vicmil::GPUProgram gpu_program_VertexCoordColor_proj;      // with projection using uniform buffer matrix
     vicmil::GPUProgram gpu_program_VertexTextureCoord_no_proj; // no projection using uniform buffer matrix
     vicmil::GPUProgram gpu_program_VertexTextureCoord_proj;    // with projection using uniform buffer matrix
+    vicmil::GPUProgram gpu_program_text_no_proj;               // VertexTextureCoordColor with a single channel texture, no projection
+    vicmil::GPUProgram gpu_program_text_sdf_no_proj;           // VertexTextureCoordColor with a signed distance field texture, no projection
 
     vicmil::VertexBuffer default_vertex_buffer;
     vicmil::UniformBufferMat4f default_uniform_buffer;
@@ -1489,6 +1885,13 @@ public:
         vicmil::VertexBufferLayout vertex_layout = vicmil::VertexBufferLayout({position_layout_element, tex_coord_layout_element});
         vertex_layout.set_vertex_buffer_layout(gpu_program);
     }
+    static void set_vertex_buffer_layout_VertexTextureCoordColor(vicmil::GPUProgram& gpu_program) {
+        auto position_layout_element = vicmil::VertexBufferElement(GL_FLOAT, 3, "position_in", GL_FALSE); // x, y, z
+        auto tex_coord_layout_element = vicmil::VertexBufferElement(GL_FLOAT, 2, "texcoord_in", GL_FALSE); // u, v
+        auto color_layout_element = vicmil::VertexBufferElement(GL_FLOAT, 4, "color_in", GL_FALSE); // r, g, b, a
+        vicmil::VertexBufferLayout vertex_layout = vicmil::VertexBufferLayout({position_layout_element, tex_coord_layout_element, color_layout_element});
+        vertex_layout.set_vertex_buffer_layout(gpu_program);
+    }
     void init_VertexCoordColor_no_proj() {
         gpu_program_VertexCoordColor_no_proj = vicmil::GPUProgram::from_strings(vicmil::VertexCoordColor::gles_no_proj_vert_src, vicmil::VertexCoordColor::gles_frag_src);
         gpu_program_VertexCoordColor_no_proj.bind_program();
@@ -1505,6 +1908,14 @@ public:
         gpu_program_VertexTextureCoord_proj = vicmil::GPUProgram::from_strings(vicmil::VertexTextureCoord::gles_vert_src, vicmil::VertexTextureCoord::gles_frag_src);
         gpu_program_VertexTextureCoord_proj.bind_program();
     }
+    void init_text_no_proj() {
+        gpu_program_text_no_proj = vicmil::GPUProgram::from_strings(vicmil::VertexTextureCoordColor::gles_no_proj_vert_src, vicmil::VertexTextureCoordColor::gles_alpha_frag_src);
+        gpu_program_text_no_proj.bind_program();
+    }
+    void init_text_sdf_no_proj() {
+        gpu_program_text_sdf_no_proj = vicmil::GPUProgram::from_strings(vicmil::VertexTextureCoordColor::gles_no_proj_vert_src, vicmil::VertexTextureCoordColor::gles_sdf_frag_src);
+        gpu_program_text_sdf_no_proj.bind_program();
+    }
     void init_default_gpu_programs() {
         /*
         Initialize programs to be run on the gpu, i.e. shaders
@@ -1517,6 +1928,10 @@ public:
         init_VertexTextureCoord_no_proj(); // Just draw to the screen
         init_VertexTextureCoord_proj(); // Add perspective and camera position to draw things in 3d using a uniform buffer
 
+        // Used for drawing text from single channel glyph textures, the color is specified per vertex
+        init_text_no_proj();
+        init_text_sdf_no_proj(); // Signed distance field glyphs, one texture for every text size
+
         // Create a default vertex buffer
         default_vertex_buffer = create_vertex_buffer();
 
@@ -1558,6 +1973,45 @@ public:
     void draw_2d_VertexTextureCoord_vertex_buffer(std::vector<vicmil::VertexTextureCoord>& vertices, vicmil::GPUImage gpu_image) {
         draw_2d_VertexTextureCoord_vertex_buffer(vertices, gpu_image.texture);
     }
+    // Draw glyphs from a texture created with GPUTexture::from_image_a8(e.g. ImageTextureManagerA8), see add_text_rect_to_triangle_buffer
+    void draw_2d_text_vertex_buffer(std::vector<vicmil::VertexTextureCoordColor>& vertices, vicmil::GPUTexture gpu_texture) {
+        gpu_program_text_no_proj.bind_program();
+        vicmil::DefaultGpuPrograms::set_vertex_buffer_layout_VertexTextureCoordColor(gpu_program_text_no_proj);
+        gpu_texture.bind();
+        default_vertex_buffer.bind();
+        default_vertex_buffer.overwrite_vertex_vector(vertices);
+        default_vertex_buffer.draw_triangles();
+    }
+    /**
+     * Draw signed distance field glyphs, e.g. from ImageTextureManagerA8::add_character_sdf
+     * @arg draw_line_height: the line height in screen pixels the text is drawn at, so the style can be converted from screen pixels
+     * @arg options: the options the glyphs were rendered with
+    */
+    void draw_2d_sdf_text_vertex_buffer(std::vector<vicmil::VertexTextureCoordColor>& vertices, vicmil::GPUTexture gpu_texture, 
+                                        const SDFTextStyle& style, float draw_line_height, const GlyphSDFOptions& options = GlyphSDFOptions()) {
+        gpu_program_text_sdf_no_proj.bind_program();
+        vicmil::DefaultGpuPrograms::set_vertex_buffer_layout_VertexTextureCoordColor(gpu_program_text_sdf_no_proj);
+        GLuint program_id = gpu_program_text_sdf_no_proj.id;
+
+        // Screen pixels per texture pixel, and how much the texture value changes per screen pixel
+        float scale = draw_line_height / options.line_height;
+        float value_per_pixel = options.get_value_per_pixel() / 255.0f / scale;
+        glUniform1f(glGetUniformLocation(program_id, "u_edge_value"), options.on_edge_value / 255.0f);
+        glUniform1f(glGetUniformLocation(program_id, "u_edge_width"), std::max(style.smoothing, 0.0001f) * 0.5f * value_per_pixel);
+        glUniform1f(glGetUniformLocation(program_id, "u_outline_width"), style.outline_width * value_per_pixel);
+        glUniform4f(glGetUniformLocation(program_id, "u_outline_color"), style.outline_color.r / 255.0f, style.outline_color.g / 255.0f, 
+                    style.outline_color.b / 255.0f, style.outline_color.a / 255.0f);
+        glUniform2f(glGetUniformLocation(program_id, "u_shadow_offset"), style.shadow_offset_x / scale / gpu_texture._width, 
+                    style.shadow_offset_y / scale / gpu_texture._height);
+        glUniform1f(glGetUniformLocation(program_id, "u_shadow_softness"), style.shadow_softness * value_per_pixel);
+        glUniform4f(glGetUniformLocation(program_id, "u_shadow_color"), style.shadow_color.r / 255.0f, style.shadow_color.g / 255.0f, 
+                    style.shadow_color.b / 255.0f, style.shadow_color.a / 255.0f);
+
+        gpu_texture.bind();
+        default_vertex_buffer.bind();
+        default_vertex_buffer.overwrite_vertex_vector(vertices);
+        default_vertex_buffer.draw_triangles();
+    }
     void draw_3d_VertexCoordColor_vertex_buffer(std::vector<vicmil::VertexCoordColor>& vertices, glm::mat4 transform_matrix) {
         gpu_program_VertexCoordColor_proj.bind_program();
         vicmil::DefaultGpuPrograms::set_vertex_buffer_layout_VertexCoordColor(gpu_program_VertexCoordColor_proj);
@@ -1717,17 +2171,102 @@ public:
     }
 };
 
+/**
+ * Bookkeeping for images with identical pixels sharing one rect in a RectPack, see ImageTextureManager::deduplicate
+ * A shared rect is labeled by the hash of its pixels and counts the images that use it
+*/
+class _SharedRects {
+public:
+    struct SharedRect {
+        Hash128 hash;
+        int ref_count = 0;
+    };
+    std::map<std::string, std::string> rect_labels; // Image label -> the label of its shared rect in the RectPack
+    std::map<std::string, SharedRect> rects; // Shared rect label -> the hash and number of images using it
+    std::map<Hash128, std::string> rects_by_hash;
+
+    // The control character keeps the rect labels apart from the labels of images
+    static std::string get_rect_label(const Hash128& hash) {
+        return "\x1f" "shared_" + hash.to_string();
+    }
+    // The label of the rect in the RectPack that holds an image, the image label itself if the image is not shared
+    std::string get_rect_label(const std::string& label) const {
+        auto it = rect_labels.find(label);
+        return it == rect_labels.end() ? label : it->second;
+    }
+    // The label of the shared rect with pixels matching the hash, or an empty string if there is none
+    std::string find(const Hash128& hash) const {
+        auto it = rects_by_hash.find(hash);
+        return it == rects_by_hash.end() ? std::string() : it->second;
+    }
+    void add_reference(const std::string& label, const Hash128& hash) {
+        std::string rect_label = get_rect_label(hash);
+        rect_labels[label] = rect_label;
+        rects[rect_label].hash = hash;
+        rects[rect_label].ref_count++;
+        rects_by_hash[hash] = rect_label;
+    }
+    /**
+     * Forget an image, returns true if its rect is no longer used by any image and should be removed from the RectPack
+     * Images that are not shared always return true, with rect_label set to their own label
+    */
+    bool remove_reference(const std::string& label, std::string& rect_label) {
+        auto it = rect_labels.find(label);
+        if(it == rect_labels.end()) {
+            rect_label = label;
+            return true;
+        }
+        rect_label = it->second;
+        rect_labels.erase(it);
+        SharedRect& rect = rects[rect_label];
+        rect.ref_count--;
+        if(rect.ref_count > 0) {
+            return false;
+        }
+        rects_by_hash.erase(rect.hash);
+        rects.erase(rect_label);
+        return true;
+    }
+};
+
 class ImageTextureManager{
 public:
     vicmil::GPUTexture gpu_texture = vicmil::GPUTexture(); // Optional, does not create a texture unless update_gpu_texture is called
     vicmil::ImageRGBA_UChar cpu_texture = vicmil::ImageRGBA_UChar(); // Create a mirror of the gpu texture on the cpu
-    std::map<std::string, vicmil::ImageRGBA_UChar> images = {}; // Contains a copy of all the images that have been added(and not removed)
+    std::set<std::string> images = {}; // The labels of all the images that have been added(and not removed), the pixels are only stored in cpu_texture
     RectPack image_packing; // Packs the images in an efficient manner
+    // Let images with identical pixels(e.g. the same icon under different labels) share one rect, see add_image
+    bool deduplicate = false;
+    _SharedRects _shared_rects;
+
+    // The part of cpu_texture that has changed since the last update_gpu_texture
+    int _dirty_min_x = 0;
+    int _dirty_min_y = 0;
+    int _dirty_max_x = 0;
+    int _dirty_max_y = 0;
+
     ImageTextureManager() {}
     ImageTextureManager(int width, int height) : image_packing(RectPack(width, height)){
         cpu_texture = vicmil::ImageRGBA_UChar();
         cpu_texture.resize(width, height);
     }
+    void _mark_dirty(int x, int y, int w, int h) {
+        if(_dirty_max_x <= _dirty_min_x || _dirty_max_y <= _dirty_min_y) {
+            _dirty_min_x = x;
+            _dirty_min_y = y;
+            _dirty_max_x = x + w;
+            _dirty_max_y = y + h;
+            return;
+        }
+        _dirty_min_x = std::min(_dirty_min_x, x);
+        _dirty_min_y = std::min(_dirty_min_y, y);
+        _dirty_max_x = std::max(_dirty_max_x, x + w);
+        _dirty_max_y = std::max(_dirty_max_y, y + h);
+    }
+    /**
+     * Upload the cpu texture to the gpu
+     * Only the rectangle that changed since the last call is uploaded once the texture exists
+    */
     void update_gpu_texture() {
         if(gpu_texture.no_texture) {
             // If no texture has been allocated to the gpu
@@ -1735,44 +2274,88 @@ public:
             // Copy the cpu texture to the gpu
             gpu_texture = vicmil::GPUTexture::from_raw_image_rgba(cpu_texture);
         }
-        else {
-            gpu_texture.overwrite_texture_data(cpu_texture);
+        else if(_dirty_max_x > _dirty_min_x && _dirty_max_y > _dirty_min_y) {
+            ConstImageViewRGBA dirty_region = cpu_texture.sub_view(_dirty_min_x, _dirty_min_y, _dirty_max_x - _dirty_min_x, _dirty_max_y - _dirty_min_y);
+            gpu_texture.overwrite_texture_region(_dirty_min_x, _dirty_min_y, dirty_region);
         }
+        _dirty_min_x = _dirty_min_y = _dirty_max_x = _dirty_max_y = 0;
     }
     void delete_gpu_texture() {
         gpu_texture.delete_texture();
     }
-    bool add_image(std::string label, vicmil::ImageRGBA_UChar image) {
+    /**
+     * Accepts an ImageRGBA_UChar directly, or a view of a rectangle inside another image
+     * If deduplicate is set and an image with the same pixels has already been added, the image shares its rect
+     *  instead of taking more space, and nothing has to be uploaded
+    */
+    bool add_image(std::string label, ConstImageViewRGBA image) {
         // Returns true if it successfully allocated the image
         if(images.count(label) != 0) {
             return false; // Image with that label already exists!
         }
+        if(deduplicate && !image.empty()) {
+            Hash128 hash = hash_image(image);
+            std::string rect_label = _shared_rects.find(hash);
+            if(rect_label != "" && equal_pixels(image, _get_rect_view(rect_label))) {
+                _shared_rects.add_reference(label, hash);
+                images.insert(label);
+                return true;
+            }
+            if(rect_label == "") {
+                rect_label = _SharedRects::get_rect_label(hash);
+                if(!image_packing.add_rect(rect_label, image.w, image.h)) {
+                    return false; // Could not find enough available space for the image
+                }
+                _shared_rects.add_reference(label, hash);
+                images.insert(label);
+                RectPack::Rect rect = image_packing.get_rect(rect_label);
+                vicmil::blit(image, cpu_texture, rect.x, rect.y);
+                _mark_dirty(rect.x, rect.y, image.w, image.h);
+                return true;
+            }
+            // Same hash but different pixels, store it on its own
+        }
         //Print("Add rect");
         if(!image_packing.add_rect(label, image.w, image.h)) {
             return false; // Could not find enough available space for the image
         }
-        //Print("Assign image");
-        images[label] = image;
+        images.insert(label);
 
         //Print("Get rect");
         auto rect = image_packing.get_rect(label);
 
         //Print("Copy image");
-        image.copy_to_image(&cpu_texture, rect.x, rect.y);
+        vicmil::blit(image, cpu_texture, rect.x, rect.y);
+        _mark_dirty(rect.x, rect.y, image.w, image.h);
         return true;
     }
+    ConstImageViewRGBA _get_rect_view(std::string rect_label) {
+        RectPack::Rect rect = image_packing.get_rect(rect_label);
+        return cpu_texture.sub_view(rect.x, rect.y, rect.w, rect.h);
+    }
+    // Get the pixels of an added image, as a view into the cpu texture
+    ConstImageViewRGBA get_image_view(std::string label) {
+        if(images.count(label) == 0) {
+            return ConstImageViewRGBA();
+        }
+        return _get_rect_view(_shared_rects.get_rect_label(label));
+    }
+    // The rect is only freed once no other image shares it
     void remove_image(std::string label) {
         if(images.count(label) == 0) {
             return; // No image with that label exists!
         }
         images.erase(label);
-        image_packing.remove_rect(label);
+        std::string rect_label;
+        if(_shared_rects.remove_reference(label, rect_label)) {
+            image_packing.remove_rect(rect_label);
+        }
     }
     bool contains_image(std::string label) {
         return images.count(label) != 0;
     }
     RectPack::Rect get_image_pos(std::string label) {
-        return image_packing.get_rect(label);
+        return image_packing.get_rect(_shared_rects.get_rect_label(label));
     }
     vicmil::GuiEngine::RectGL get_image_pos_gl(std::string label) {
         RectPack::Rect rect = get_image_pos(label);
@@ -1783,4 +2366,813 @@ public:
         return "U_" + std::to_string(unicode_char);
     }
 };
-}
\ No newline at end of file
+
+/**
+ * Same as ImageTextureManager, but for single channel images such as glyphs
+ * Both the cpu mirror and the GL_ALPHA texture use one byte per pixel, a quarter of the RGBA version
+ * Characters are rasterized straight into the cpu mirror, see add_character
+ * Signed distance field glyphs can be added with add_character_sdf, set linear_filtering before the gpu texture is created
+*/
+class ImageTextureManagerA8 {
+public:
+    vicmil::GPUTexture gpu_texture = vicmil::GPUTexture(); // Optional, does not create a texture unless update_gpu_texture is called
+    vicmil::ImageA8 cpu_texture = vicmil::ImageA8(); // Create a mirror of the gpu texture on the cpu
+    std::set<std::string> images = {}; // The labels of all the images that have been added(and not removed)
+    RectPack image_packing; // Packs the images in an efficient manner
+    bool deduplicate = false; // Let images with identical pixels share one rect, see ImageTextureManager::add_image
+    bool linear_filtering = false; // Interpolate between texture pixels, needed for signed distance fields
+    _SharedRects _shared_rects;
+
+    // The part of cpu_texture that has changed since the last update_gpu_texture
+    int _dirty_min_x = 0;
+    int _dirty_min_y = 0;
+    int _dirty_max_x = 0;
+    int _dirty_max_y = 0;
+
+    ImageTextureManagerA8() {}
+    ImageTextureManagerA8(int width, int height) : image_packing(RectPack(width, height)){
+        cpu_texture = vicmil::ImageA8();
+        cpu_texture.resize(width, height);
+    }
+    void _mark_dirty(int x, int y, int w, int h) {
+        if(_dirty_max_x <= _dirty_min_x || _dirty_max_y <= _dirty_min_y) {
+            _dirty_min_x = x;
+            _dirty_min_y = y;
+            _dirty_max_x = x + w;
+            _dirty_max_y = y + h;
+            return;
+        }
+        _dirty_min_x = std::min(_dirty_min_x, x);
+        _dirty_min_y = std::min(_dirty_min_y, y);
+        _dirty_max_x = std::max(_dirty_max_x, x + w);
+        _dirty_max_y = std::max(_dirty_max_y, y + h);
+    }
+    // Upload the cpu texture to the gpu, only the rectangle that changed once the texture exists
+    void update_gpu_texture() {
+        if(gpu_texture.no_texture) {
+            gpu_texture = vicmil::GPUTexture::from_image_a8(cpu_texture);
+            if(linear_filtering) {
+                vicmil::GPUTexture::set_pixel_parameters_linear(); // The new texture is still bound
+            }
+        }
+        else if(_dirty_max_x > _dirty_min_x && _dirty_max_y > _dirty_min_y) {
+            ConstImageViewA8 dirty_region = cpu_texture.sub_view(_dirty_min_x, _dirty_min_y, _dirty_max_x - _dirty_min_x, _dirty_max_y - _dirty_min_y);
+            gpu_texture.overwrite_texture_region(_dirty_min_x, _dirty_min_y, dirty_region);
+        }
+        _dirty_min_x = _dirty_min_y = _dirty_max_x = _dirty_max_y = 0;
+    }
+    void delete_gpu_texture() {
+        gpu_texture.delete_texture();
+    }
+    // Reserve a w*h rectangle for label, returns an empty view if it could not be allocated
+    ImageViewA8 _allocate(std::string label, int w, int h) {
+        if(images.count(label) != 0) {
+            return ImageViewA8(); // Image with that label already exists!
+        }
+        if(!image_packing.add_rect(label, w, h)) {
+            return ImageViewA8(); // Could not find enough available space for the image
+        }
+        images.insert(label);
+        return _get_dirty_rect_view(label);
+    }
+    ImageViewA8 _get_dirty_rect_view(std::string rect_label) {
+        RectPack::Rect rect = image_packing.get_rect(rect_label);
+        _mark_dirty(rect.x, rect.y, rect.w, rect.h);
+        return cpu_texture.sub_view(rect.x, rect.y, rect.w, rect.h);
+    }
+    bool add_image(std::string label, ConstImageViewA8 image) {
+        // Returns true if it successfully allocated the image
+        if(deduplicate && !image.empty() && images.count(label) == 0) {
+            Hash128 hash = hash_image(image);
+            std::string rect_label = _shared_rects.find(hash);
+            if(rect_label != "" && equal_pixels(image, _get_rect_view(rect_label))) {
+                _shared_rects.add_reference(label, hash);
+                images.insert(label);
+                return true;
+            }
+            if(rect_label == "") {
+                rect_label = _SharedRects::get_rect_label(hash);
+                if(!image_packing.add_rect(rect_label, image.w, image.h)) {
+                    return false; // Could not find enough available space for the image
+                }
+                _shared_rects.add_reference(label, hash);
+                images.insert(label);
+                vicmil::blit(image, _get_dirty_rect_view(rect_label), 0, 0);
+                return true;
+            }
+            // Same hash but different pixels, store it on its own
+        }
+        ImageViewA8 dst = _allocate(label, image.w, image.h);
+        if(dst.empty()) {
+            return false;
+        }
+        vicmil::blit(image, dst, 0, 0);
+        return true;
+    }
+    /**
+     * Rasterize a character from a FontLoader or MultiFontLoader directly into the atlas, labeled get_unicode_label(character)
+     * Returns true if the character was added, or had already been added. Characters without an outline(e.g. space) are not added
+    */
+    template<class FONT>
+    bool add_character(FONT& font, int character) {
+        std::string label = get_unicode_label(character);
+        if(images.count(label) != 0) {
+            return true;
+        }
+        RectT<int> bounding_box = font._get_character_bounding_box(character);
+        if(bounding_box.w <= 0 || bounding_box.h <= 0) {
+            return true; // Nothing to draw(e.g. space)
+        }
+        if(deduplicate) {
+            // The pixels have to be known before the rect is chosen, so the same glyph from another label or font can share it
+            ImageA8 glyph = ImageA8();
+            glyph.resize(bounding_box.w, bounding_box.h);
+            font.render_character_a8(character, glyph.view());
+            return add_image(label, glyph.view());
+        }
+        ImageViewA8 dst = _allocate(label, bounding_box.w, bounding_box.h);
+        if(dst.empty()) {
+            return false;
+        }
+        // Removed images leave their old pixels behind, and glyphs without an outline are never written by the rasterizer
+        for(int y = 0; y < dst.h; y++) {
+            std::memset(dst.get_row(y), 0, dst.w);
+        }
+        font.render_character_a8(character, dst);
+        return true;
+    }
+    /**
+     * Add the signed distance field of a character from a FontLoader or MultiFontLoader, labeled get_unicode_label(character)
+     * The same image is used for every text size, see FontLoader::get_character_sdf_positions for where to draw it
+     * Returns true if the character was added, or had already been added. Characters without an outline(e.g. space) are not added
+    */
+    template<class FONT>
+    bool add_character_sdf(FONT& font, int character, const GlyphSDFOptions& options = GlyphSDFOptions()) {
+        std::string label = get_unicode_label(character);
+        if(images.count(label) != 0) {
+            return true;
+        }
+        ImageA8 sdf = font.get_character_sdf(character, options);
+        if(sdf.w == 0 || sdf.h == 0) {
+            return true; // Nothing to draw
+        }
+        return add_image(label, sdf.view());
+    }
+    ConstImageViewA8 _get_rect_view(std::string rect_label) {
+        RectPack::Rect rect = image_packing.get_rect(rect_label);
+        return cpu_texture.sub_view(rect.x, rect.y, rect.w, rect.h);
+    }
+    // Get the pixels of an added image, as a view into the cpu texture
+    ConstImageViewA8 get_image_view(std::string label) {
+        if(images.count(label) == 0) {
+            return ConstImageViewA8();
+        }
+        return _get_rect_view(_shared_rects.get_rect_label(label));
+    }
+    // The rect is only freed once no other image shares it
+    void remove_image(std::string label) {
+        if(images.count(label) == 0) {
+            return; // No image with that label exists!
+        }
+        images.erase(label);
+        std::string rect_label;
+        if(_shared_rects.remove_reference(label, rect_label)) {
+            image_packing.remove_rect(rect_label);
+        }
+    }
+    bool contains_image(std::string label) {
+        return images.count(label) != 0;
+    }
+    RectPack::Rect get_image_pos(std::string label) {
+        return image_packing.get_rect(_shared_rects.get_rect_label(label));
+    }
+    vicmil::GuiEngine::RectGL get_image_pos_gl(std::string label) {
+        RectPack::Rect rect = get_image_pos(label);
+        return vicmil::GuiEngine::RectGL(rect.x / (double)image_packing.width, rect.y / (double)image_packing.height,
+                                    rect.w / (double)image_packing.width, rect.h / (double)image_packing.height);
+    }
+    static std::string get_unicode_label(int unicode_char) {
+        return ImageTextureManager::get_unicode_label(unicode_char);
+    }
+};
+
+/**
+ * Produces the vertices of whole strings in one pass, with glyphs from a glyph atlas(ImageTextureManagerA8)
+ * Glyphs are rasterized into the atlas the first time they are drawn, and are then found through glyph handles
+ *  indexed by character instead of string labels. Positions are in pixels from the top left of the screen
+ * When the line height of the font changes, the glyphs are removed from the atlas and rasterized again at the new size
+ * Note! Do not remove the characters from the atlas while the renderer uses it, call clear_glyph_cache instead
+ * 
+ * TextRenderer text_renderer = TextRenderer(&font_loader, &texture_manager);
+ * text_renderer.set_screen_size(window_w, window_h);
+ * std::vector<vicmil::VertexTextureCoordColor> vertices;
+ * text_renderer.add_static_text(vertices, "Score", 10, 10); // Cached, e.g. for labels that never change
+ * text_renderer.add_text(vertices, std::to_string(score), 100, 10);
+ * text_renderer.draw(gpu_programs, vertices);
+*/
+class TextRenderer {
+public:
+    typedef int GlyphHandle; // Index into glyphs
+    struct Glyph {
+        int character = 0;
+        bool has_image = false; // False if there is nothing to draw, or the atlas was full
+        vicmil::GuiEngine::RectGL texture_pos = vicmil::GuiEngine::RectGL(0, 0, 0, 0);
+    };
+    vicmil::MultiFontLoader* font = nullptr;
+    vicmil::ImageTextureManagerA8* texture_manager = nullptr;
+    std::vector<Glyph> glyphs;
+    std::unordered_map<int, GlyphHandle> _glyph_handles;
+    int screen_w = 1;
+    int screen_h = 1;
+
+    // The vertices of static strings at (0, 0), the cost is the number of vertices
+    LRUCache<std::string, std::vector<vicmil::VertexTextureCoordColor> > _static_runs = 
+        LRUCache<std::string, std::vector<vicmil::VertexTextureCoordColor> >(1 << 16);
+    int _glyph_line_height = 0; // The line height of the font when the glyphs were rasterized
+
+    TextRenderer() {}
+    TextRenderer(vicmil::MultiFontLoader* font_, vicmil::ImageTextureManagerA8* texture_manager_) {
+        font = font_;
+        texture_manager = texture_manager_;
+    }
+    void set_screen_size(int screen_w_, int screen_h_) {
+        if(screen_w != screen_w_ || screen_h != screen_h_) {
+            screen_w = screen_w_;
+            screen_h = screen_h_;
+            _static_runs.clear();
+        }
+    }
+    // Forget all glyphs and remove their characters from the atlas, e.g. after the line height of the font has changed
+    void clear_glyph_cache() {
+        for(const Glyph& glyph : glyphs) {
+            if(glyph.has_image) {
+                texture_manager->remove_image(vicmil::ImageTextureManagerA8::get_unicode_label(glyph.character));
+            }
+        }
+        glyphs.clear();
+        _glyph_handles.clear();
+        _static_runs.clear();
+    }
+    // The glyphs are rasterized at the line height of the font, so they are rasterized again if it has changed
+    void _check_line_height() {
+        if(_glyph_line_height != font->line_height) {
+            clear_glyph_cache();
+            _glyph_line_height = font->line_height;
+        }
+    }
+
+    // Get the handle of the glyph of a character, the glyph is rasterized into the atlas the first time
+    GlyphHandle get_glyph_handle(int character) {
+        auto it = _glyph_handles.find(character);
+        if(it != _glyph_handles.end()) {
+            return it->second;
+        }
+        Glyph glyph = Glyph();
+        glyph.character = character;
+        std::string label = vicmil::ImageTextureManagerA8::get_unicode_label(character);
+        RectT<int> bounding_box = font->_get_character_bounding_box(character);
+        if(bounding_box.w > 0 && bounding_box.h > 0 && texture_manager->add_character(*font, character)) {
+            glyph.has_image = true;
+            glyph.texture_pos = texture_manager->get_image_pos_gl(label);
+        }
+        glyphs.push_back(glyph);
+        _glyph_handles[character] = glyphs.size() - 1;
+        return glyphs.size() - 1;
+    }
+
+    // Add the two triangles of a glyph, position in pixels
+    void _add_glyph(std::vector<vicmil::VertexTextureCoordColor>& vertices, const Glyph& glyph, RectT<int> position, 
+                    unsigned int layer, ColorRGBA_UChar color) {
+        float scale_x = 2.0f / screen_w;
+        float scale_y = 2.0f / screen_h;
+        vicmil::GuiEngine::RectGL screen_pos = vicmil::GuiEngine::RectGL(position.x * scale_x - 1.0f, 1.0f - position.y * scale_y, 
+                                                                         position.w * scale_x, position.h * scale_y);
+        add_text_rect_to_triangle_buffer(vertices, screen_pos, layer, glyph.texture_pos, color);
+    }
+
+    /**
+     * Add the vertices of a text, with the top left of the first line at (x, y)
+     * The characters are placed like TextLayout without word wrap
+    */
+    void add_text(std::vector<vicmil::VertexTextureCoordColor>& vertices, const std::vector<int>& characters, int x, int y, 
+                  unsigned int layer = 1, ColorRGBA_UChar color = ColorRGBA_UChar(255, 255, 255, 255)) {
+        _check_line_height();
+        int ascent = 0;
+        for(const FontLoader& loader : font->fontLoaders) {
+            ascent = std::max(ascent, loader.ascent);
+        }
+        vertices.reserve(vertices.size() + characters.size() * 6);
+        int pen_x = x;
+        int pen_y = y;
+        for(size_t i = 0; i < characters.size(); i++) {
+            int character = characters[i];
+            if(character == '\n') {
+                pen_x = x;
+                pen_y += font->line_height;
+                continue;
+            }
+            int font_index = font->find_font_index(character);
+            if(font_index < 0) {
+                continue;
+            }
+            FontLoader& loader = font->fontLoaders[font_index];
+            const GlyphMetrics& metrics = loader.get_glyph_metrics(character);
+            const Glyph& glyph = glyphs[get_glyph_handle(character)];
+            if(glyph.has_image) {
+                RectT<int> position = metrics.bounding_box;
+                position.x += pen_x + metrics.left_side_bearing;
+                position.y += pen_y + ascent;
+                _add_glyph(vertices, glyph, position, layer, color);
+            }
+            pen_x += metrics.advance_width;
+            if(i + 1 < characters.size() && font->find_font_index(characters[i + 1]) == font_index) {
+                pen_x += loader._get_glyph_kerning(metrics.glyph_index, font->get_glyph_index(characters[i + 1]));
+            }
+        }
+    }
+    void add_text(std::vector<vicmil::VertexTextureCoordColor>& vertices, const std::string& utf8_text, int x, int y, 
+                  unsigned int layer = 1, ColorRGBA_UChar color = ColorRGBA_UChar(255, 255, 255, 255)) {
+        add_text(vertices, vicmil::utf8ToUnicodeCodePoints(utf8_text), x, y, layer, color);
+    }
+    /**
+     * Same as add_text, but the vertices of the text are cached and only moved to (x, y) on later calls
+     * For text that rarely changes, e.g. labels and menus. The least recently used texts are evicted from the cache
+    */
+    void add_static_text(std::vector<vicmil::VertexTextureCoordColor>& vertices, const std::string& utf8_text, int x, int y, 
+                         unsigned int layer = 1, ColorRGBA_UChar color = ColorRGBA_UChar(255, 255, 255, 255)) {
+        _check_line_height();
+        std::string key = std::to_string(layer) + "_" + std::to_string(color.r) + "_" + std::to_string(color.g) + "_" + 
+                          std::to_string(color.b) + "_" + std::to_string(color.a) + "_" + utf8_text;
+        std::vector<vicmil::VertexTextureCoordColor>* run = _static_runs.get(key);
+        if(run == nullptr) {
+            std::vector<vicmil::VertexTextureCoordColor> new_run;
+            add_text(new_run, utf8_text, 0, 0, layer, color);
+            size_t cost = new_run.size() + 1;
+            run = &_static_runs.put(key, std::move(new_run), cost);
+        }
+        float offset_x = x * 2.0f / screen_w;
+        float offset_y = -y * 2.0f / screen_h;
+        vertices.reserve(vertices.size() + run->size());
+        for(vicmil::VertexTextureCoordColor vertex : *run) {
+            vertex.x += offset_x;
+            vertex.y += offset_y;
+            vertices.push_back(vertex);
+        }
+    }
+    /**
+     * Add the characters of a TextLayout that are between visible_y_min and visible_y_max in the layout
+     * The top left of the layout is drawn at (x, y), e.g. y = -scroll for scrolling text
+    */
+    void add_text_layout(std::vector<vicmil::VertexTextureCoordColor>& vertices, const TextLayout& layout, int x, int y, 
+                         int visible_y_min, int visible_y_max, unsigned int layer = 1, ColorRGBA_UChar color = ColorRGBA_UChar(255, 255, 255, 255)) {
+        _check_line_height();
+        layout.for_each_character(visible_y_min, visible_y_max, [&](size_t, int character, RectT<int> position) {
+            const Glyph& glyph = glyphs[get_glyph_handle(character)];
+            if(glyph.has_image) {
+                position.x += x;
+                position.y += y;
+                _add_glyph(vertices, glyph, position, layer, color);
+            }
+        });
+    }
+
+    // Upload the glyphs that have been added to the atlas
+    void update_gpu_texture() {
+        texture_manager->update_gpu_texture();
+    }
+    void draw(DefaultGpuPrograms& gpu_programs, std::vector<vicmil::VertexTextureCoordColor>& vertices) {
+        update_gpu_texture();
+        gpu_programs.draw_2d_text_vertex_buffer(vertices, texture_manager->gpu_texture);
+    }
+};
+
+// ============================================================
+//                    Tiled image viewer
+// ============================================================
+
+/**
+ * Draw the visible part of a TiledImage(see util_stb.hpp), using the pyramid level that matches the zoom
+ * Only visible tiles are uploaded, at most max_uploads_per_update per update so that a fast pan never stalls a frame,
+ *  and the tile textures are kept in an LRU cache within gpu_budget_bytes
+ * While a tile is not uploaded yet, the part of the closest coarser tile that is uploaded is drawn in its place
+ * 
+ * TiledImage image;
+ * image.open("large.vti");
+ * TiledImageViewer viewer = TiledImageViewer(&image);
+ * // Every frame, the view is a rectangle in pixels of the full image that is shown on the whole screen
+ * viewer.update(view_x, view_y, view_w, view_h, screen_w, screen_h);
+ * viewer.draw(programs);
+*/
+class TiledImageViewer {
+public:
+    struct VisibleTile {
+        vicmil::GPUTexture texture;
+        vicmil::GuiEngine::RectGL screen_pos;
+        vicmil::GuiEngine::RectGL texture_pos;
+        int level = 0;
+    };
+    TiledImage* image = nullptr;
+    size_t gpu_budget_bytes = 64 * 1024 * 1024;
+    int max_uploads_per_update = 4;
+    LRUCache<uint64_t, vicmil::GPUTexture> gpu_tiles; // Key from TiledImage::get_tile_key, evicted by the viewer so textures can be reused
+    std::vector<vicmil::GPUTexture> _free_textures; // Evicted tile textures, reused for the next uploads
+    std::vector<VisibleTile> visible_tiles; // What draw will draw, set by update
+    int level = 0; // The level selected by the last update
+    int missing_tile_count = 0; // Visible tiles at the selected level that are not uploaded yet, keep updating until it is zero
+    double _view_x = 0;
+    double _view_y = 0;
+    double _view_w = 1;
+    double _view_h = 1;
+    std::vector<vicmil::VertexTextureCoord> _vertices;
+
+    TiledImageViewer() {}
+    TiledImageViewer(TiledImage* image_, size_t gpu_budget_bytes_ = 64 * 1024 * 1024) {
+        image = image_;
+        gpu_budget_bytes = gpu_budget_bytes_;
+    }
+
+    /**
+     * The level to draw when every screen pixel covers image_pixels_per_screen_pixel pixels of the full image
+     * Picks the most detailed level that is not more than twice as detailed as the screen
+    */
+    static int select_level(double image_pixels_per_screen_pixel, int level_count) {
+        int selected_level = 0;
+        while(selected_level + 1 < level_count && image_pixels_per_screen_pixel >= 2.0) {
+            image_pixels_per_screen_pixel /= 2.0;
+            selected_level++;
+        }
+        return selected_level;
+    }
+
+    // Convert a rectangle in pixels of the full image to where it is on the screen
+    vicmil::GuiEngine::RectGL _to_screen_pos(double x, double y, double w, double h) const {
+        return vicmil::GuiEngine::RectGL(-1.0 + 2.0 * (x - _view_x) / _view_w, 1.0 - 2.0 * (y - _view_y) / _view_h,
+                                         2.0 * w / _view_w, 2.0 * h / _view_h);
+    }
+
+    vicmil::GPUTexture* _upload_tile(int tile_level, int64_t tx, int64_t ty) {
+        std::shared_ptr<const ImageRGBA_UChar> pixels = image->get_tile(tile_level, tx, ty);
+        if(!pixels) {
+            return nullptr;
+        }
+        vicmil::GPUTexture texture = vicmil::GPUTexture();
+        if(_free_textures.size() != 0) {
+            texture = _free_textures.back();
+            _free_textures.pop_back();
+        }
+        else {
+            texture = vicmil::GPUTexture(image->tile_size, image->tile_size);
+        }
+        // Tiles at the right and bottom edge only fill part of the texture
+        texture.overwrite_texture_region(0, 0, *pixels);
+        size_t texture_bytes = (size_t)image->tile_size * image->tile_size * sizeof(ColorRGBA_UChar);
+        return &gpu_tiles.put(TiledImage::get_tile_key(tile_level, tx, ty), texture, texture_bytes);
+    }
+
+    // Evict the least recently used tiles until within budget, but never the keep_count most recently used(e.g. the visible tiles)
+    void _evict_to_budget(size_t keep_count) {
+        while(gpu_tiles.total_cost > gpu_budget_bytes && gpu_tiles.size() > keep_count) {
+            uint64_t key = gpu_tiles.entries.back().key;
+            vicmil::GPUTexture texture = gpu_tiles.entries.back().value;
+            gpu_tiles.erase(key);
+            if(_free_textures.size() < (size_t)max_uploads_per_update) {
+                _free_textures.push_back(texture);
+            }
+            else {
+                texture.delete_texture();
+            }
+        }
+    }
+
+    /**
+     * Select the tiles to draw for a view, and upload the missing ones
+     * @arg view_x, view_y, view_w, view_h: The part of the image to show on the whole screen, in pixels of the full image
+     * @arg screen_w, screen_h: The size of the screen in pixels, used to select the level
+    */
+    void update(double view_x, double view_y, double view_w, double view_h, int screen_w, int screen_h) {
+        visible_tiles.clear();
+        missing_tile_count = 0;
+        if(image == nullptr || !image->is_open() || view_w <= 0 || view_h <= 0 || screen_w <= 0 || screen_h <= 0) {
+            return;
+        }
+        _view_x = view_x;
+        _view_y = view_y;
+        _view_w = view_w;
+        _view_h = view_h;
+        level = select_level(std::max(view_w / screen_w, view_h / screen_h), image->level_count);
+        double scale = std::ldexp(1.0, level); // Pixels of the full image per pixel of the level
+        int tile_size = image->tile_size;
+        int64_t min_tx = std::max<int64_t>(0, (int64_t)std::floor(view_x / scale / tile_size));
+        int64_t min_ty = std::max<int64_t>(0, (int64_t)std::floor(view_y / scale / tile_size));
+        int64_t max_tx = std::min<int64_t>(image->tiles_x(level) - 1, (int64_t)std::floor((view_x + view_w) / scale / tile_size));
+        int64_t max_ty = std::min<int64_t>(image->tiles_y(level) - 1, (int64_t)std::floor((view_y + view_h) / scale / tile_size));
+
+        std::set<uint64_t> used_keys; // Tiles used this update, they are the most recently used in gpu_tiles
+        std::vector<VisibleTile> fallback_tiles;
+        int upload_count = 0;
+        for(int64_t ty = min_ty; ty <= max_ty; ty++) {
+            for(int64_t tx = min_tx; tx <= max_tx; tx++) {
+                uint64_t key = TiledImage::get_tile_key(level, tx, ty);
+                int tile_w = image->tile_width(level, tx);
+                int tile_h = image->tile_height(level, ty);
+                vicmil::GPUTexture* texture = gpu_tiles.get(key);
+                if(texture == nullptr && upload_count < max_uploads_per_update) {
+                    texture = _upload_tile(level, tx, ty);
+                    upload_count++;
+                }
+                vicmil::GuiEngine::RectGL screen_pos = _to_screen_pos(tx * tile_size * scale, ty * tile_size * scale, tile_w * scale, tile_h * scale);
+                if(texture != nullptr) {
+                    used_keys.insert(key);
+                    VisibleTile tile = VisibleTile();
+                    tile.texture = *texture;
+                    tile.screen_pos = screen_pos;
+                    tile.texture_pos = vicmil::GuiEngine::RectGL(0, 0, tile_w / (double)tile_size, tile_h / (double)tile_size);
+                    tile.level = level;
+                    visible_tiles.push_back(tile);
+                    continue;
+                }
+                missing_tile_count++;
+                // Draw the same area from a coarser tile until this one is uploaded
+                for(int parent_level = level + 1; parent_level < image->level_count; parent_level++) {
+                    int shift = parent_level - level;
+                    uint64_t parent_key = TiledImage::get_tile_key(parent_level, tx >> shift, ty >> shift);
+                    vicmil::GPUTexture* parent_texture = gpu_tiles.get(parent_key);
+                    if(parent_texture == nullptr) {
+                        continue;
+                    }
+                    used_keys.insert(parent_key);
+                    double parent_scale = std::ldexp(1.0, shift); // Pixels of this level per pixel of the parent level
+                    VisibleTile tile = VisibleTile();
+                    tile.texture = *parent_texture;
+                    tile.screen_pos = screen_pos;
+                    tile.texture_pos = vicmil::GuiEngine::RectGL(
+                        (tx * tile_size / parent_scale - (tx >> shift) * tile_size) / tile_size,
+                        (ty * tile_size / parent_scale - (ty >> shift) * tile_size) / tile_size,
+                        tile_w / parent_scale / tile_size, tile_h / parent_scale / tile_size);
+                    tile.level = parent_level;
+                    fallback_tiles.push_back(tile);
+                    break;
+                }
+            }
+        }
+        _evict_to_budget(used_keys.size());
+        // The fallback tiles never overlap the tiles of the selected level, but are drawn first anyway
+        visible_tiles.insert(visible_tiles.begin(), fallback_tiles.begin(), fallback_tiles.end());
+    }
+
+    // Draw the tiles selected by the last update
+    void draw(vicmil::DefaultGpuPrograms& programs, unsigned int layer = 0) {
+        for(size_t i = 0; i < visible_tiles.size(); i++) {
+            _vertices.clear();
+            add_texture_rect_to_triangle_buffer(_vertices, visible_tiles[i].screen_pos, layer, visible_tiles[i].texture_pos);
+            programs.draw_2d_VertexTextureCoord_vertex_buffer(_vertices, visible_tiles[i].texture);
+        }
+    }
+
+    // Free all tile textures, e.g. before the OpenGL context is destroyed
+    void delete_textures() {
+        for(auto it = gpu_tiles.entries.begin(); it != gpu_tiles.entries.end(); it++) {
+            it->value.delete_texture();
+        }
+        gpu_tiles.clear();
+        for(size_t i = 0; i < _free_textures.size(); i++) {
+            _free_textures[i].delete_texture();
+        }
+        _free_textures.clear();
+        visible_tiles.clear();
+    }
+};
+
+// ============================================================
+//                    Pipelined rendering
+// ============================================================
+
+/**
+ * Optionally run the simulation(input handling, game logic, building vertices) on its own thread,
+ *  so that it overlaps with the OpenGL calls on the main thread
+ * 
+ * The simulation thread describes each frame as a FrameSnapshot, which is handed to the main thread through a TripleBuffer.
+ * The main thread polls SDL, forwards the events to the simulation thread, and draws the latest snapshot.
+ * This adds about one frame of latency, which is measured in PipelinedApp
+*/
+
+enum DrawCommandType {
+    DRAW_2D_COLOR_TRIANGLES,
+    DRAW_3D_COLOR_TRIANGLES,
+    DRAW_3D_COLOR_POINTS,
+    DRAW_2D_TEXTURE_TRIANGLES,
+    DRAW_3D_TEXTURE_TRIANGLES
+};
+
+struct DrawCommand {
+    DrawCommandType type = DRAW_2D_COLOR_TRIANGLES;
+    std::vector<VertexCoordColor> color_vertices; // Used by the color draw types
+    std::vector<VertexTextureCoord> texture_vertices; // Used by the texture draw types
+    GPUTexture texture; // Used by the texture draw types
+    glm::mat4 transform_matrix = glm::mat4(1); // Used by the 3d draw types
+};
+
+/**
+ * Everything needed to draw one frame, the main thread only reads it
+ * The draw commands are reused between frames to avoid reallocating the vertex vectors
+*/
+struct FrameSnapshot {
+    uint64_t frame_index = 0;
+    std::chrono::steady_clock::time_point created_time;
+    bool clear_screen = true;
+    ColorRGBA_UChar clear_color = ColorRGBA_UChar(0, 0, 0, 255);
+    std::vector<DrawCommand> draw_commands;
+    size_t draw_command_count = 0;
+
+    void reset() {
+        draw_command_count = 0;
+    }
+    // Get a new draw command with empty vertex vectors
+    DrawCommand& add_draw_command(DrawCommandType type) {
+        if(draw_command_count == draw_commands.size()) {
+            draw_commands.push_back(DrawCommand());
+        }
+        DrawCommand& command = draw_commands[draw_command_count];
+        draw_command_count++;
+        command.type = type;
+        command.color_vertices.clear();
+        command.texture_vertices.clear();
+        command.texture = GPUTexture();
+        command.transform_matrix = glm::mat4(1);
+        return command;
+    }
+    void add_2d_triangles(const std::vector<VertexCoordColor>& vertices) {
+        add_draw_command(DRAW_2D_COLOR_TRIANGLES).color_vertices = vertices;
+    }
+    void add_3d_triangles(const std::vector<VertexCoordColor>& vertices, glm::mat4 transform_matrix) {
+        DrawCommand& command = add_draw_command(DRAW_3D_COLOR_TRIANGLES);
+        command.color_vertices = vertices;
+        command.transform_matrix = transform_matrix;
+    }
+    void add_3d_points(const std::vector<VertexCoordColor>& vertices, glm::mat4 transform_matrix) {
+        DrawCommand& command = add_draw_command(DRAW_3D_COLOR_POINTS);
+        command.color_vertices = vertices;
+        command.transform_matrix = transform_matrix;
+    }
+    void add_2d_texture_triangles(const std::vector<VertexTextureCoord>& vertices, GPUTexture texture) {
+        DrawCommand& command = add_draw_command(DRAW_2D_TEXTURE_TRIANGLES);
+        command.texture_vertices = vertices;
+        command.texture = texture;
+    }
+    void add_3d_texture_triangles(const std::vector<VertexTextureCoord>& vertices, GPUTexture texture, glm::mat4 transform_matrix) {
+        DrawCommand& command = add_draw_command(DRAW_3D_TEXTURE_TRIANGLES);
+        command.texture_vertices = vertices;
+        command.texture = texture;
+        command.transform_matrix = transform_matrix;
+    }
+};
+
+/**
+ * Draw all the commands in a frame snapshot, must be called from the thread with the OpenGL context
+*/
+void draw_frame_snapshot(FrameSnapshot& frame, DefaultGpuPrograms& programs) {
+    if(frame.clear_screen) {
+        clear_screen(frame.clear_color);
+    }
+    for(size_t i = 0; i < frame.draw_command_count; i++) {
+        DrawCommand& command = frame.draw_commands[i];
+        bool is_texture_command = command.type == DRAW_2D_TEXTURE_TRIANGLES || command.type == DRAW_3D_TEXTURE_TRIANGLES;
+        if((is_texture_command && command.texture_vertices.size() == 0) || (!is_texture_command && command.color_vertices.size() == 0)) {
+            continue; // Nothing to draw
+        }
+        switch(command.type) {
+            case DRAW_2D_COLOR_TRIANGLES:
+                programs.draw_2d_VertexCoordColor_vertex_buffer(command.color_vertices);
+                break;
+            case DRAW_3D_COLOR_TRIANGLES:
+                programs.draw_3d_VertexCoordColor_vertex_buffer(command.color_vertices, command.transform_matrix);
+                break;
+            case DRAW_3D_COLOR_POINTS:
+                programs.draw_3d_VertexCoordColor_vertex_buffer_as_points(command.color_vertices, command.transform_matrix);
+                break;
+            case DRAW_2D_TEXTURE_TRIANGLES:
+                programs.draw_2d_VertexTextureCoord_vertex_buffer(command.texture_vertices, command.texture);
+                break;
+            case DRAW_3D_TEXTURE_TRIANGLES: {
+                GPUImage gpu_image;
+                gpu_image.texture = command.texture;
+                programs.draw_3d_VertexTextureCoord_vertex_buffer(command.texture_vertices, gpu_image, command.transform_matrix);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Run simulate and render either on the same thread, or pipelined on two threads
+ * 
+ * simulate(events, frame): handle the SDL events and fill the frame snapshot, runs on the simulation thread when threaded.
+ *     It must not make any OpenGL calls
+ * render(frame): draw the snapshot(e.g. with draw_frame_snapshot) and show it on screen, always runs on the thread calling update()
+ * 
+ * Call update() once per frame from the main thread, e.g. from the function passed to set_app_update
+*/
+class PipelinedApp {
+public:
+    typedef std::function<void(const std::vector<SDL_Event>& events, FrameSnapshot& frame)> SimulateFunction;
+    typedef std::function<void(FrameSnapshot& frame)> RenderFunction;
+
+    SimulateFunction simulate;
+    RenderFunction render;
+    bool threaded = true;
+
+    // Stop the simulation thread from running more than one frame ahead of rendering, this is what bounds the latency
+    // If false, the simulation runs as fast as it can and frames that are never drawn are dropped
+    bool pace_to_renderer = true;
+
+    // Time from a snapshot being created until render(snapshot) returned
+    double last_latency_s = 0;
+    double average_latency_s = 0;
+    double max_latency_s = 0;
+    uint64_t rendered_frame_count = 0;
+    uint64_t repeated_frame_count = 0; // Times no new snapshot was ready, so the previous one was drawn again
+
+    TripleBuffer<FrameSnapshot> _frames;
+    ConcurrentQueue<SDL_Event> _events;
+    std::thread _simulation_thread;
+    std::atomic<bool> _running;
+    uint64_t _next_frame_index = 1;
+
+    PipelinedApp(SimulateFunction simulate_, RenderFunction render_, bool threaded_ = true) {
+        simulate = simulate_;
+        render = render_;
+        threaded = threaded_;
+        #if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+        threaded = false; // No threads available
+        #endif
+        _running = false;
+    }
+    PipelinedApp(const PipelinedApp&) = delete;
+    PipelinedApp& operator=(const PipelinedApp&) = delete;
+    ~PipelinedApp() {
+        stop();
+    }
+
+    void start() {
+        if(!threaded || _running) {
+            return;
+        }
+        _running = true;
+        _simulation_thread = std::thread([this]() { _simulation_loop(); });
+    }
+    void stop() {
+        if(!_running) {
+            return;
+        }
+        _running = false;
+        _simulation_thread.join();
+    }
+    uint64_t dropped_frame_count() {
+        return _frames.dropped_count();
+    }
+
+    void update() {
+        std::vector<SDL_Event> events = update_SDL();
+        if(threaded) {
+            start();
+            _events.push_all(events);
+        }
+        else {
+            _simulate_frame(events);
+        }
+
+        bool is_new_frame = _frames.acquire();
+        FrameSnapshot& frame = _frames.get_read_buffer();
+        if(frame.frame_index == 0) {
+            return; // Nothing has been simulated yet
+        }
+        render(frame);
+        if(!is_new_frame) {
+            repeated_frame_count++;
+            return;
+        }
+        last_latency_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - frame.created_time).count();
+        rendered_frame_count++;
+        average_latency_s += (last_latency_s - average_latency_s) / rendered_frame_count;
+        max_latency_s = std::max(max_latency_s, last_latency_s);
+    }
+
+    void _simulate_frame(const std::vector<SDL_Event>& events) {
+        FrameSnapshot& frame = _frames.get_write_buffer();
+        frame.reset();
+        simulate(events, frame);
+        frame.frame_index = _next_frame_index;
+        _next_frame_index++;
+        frame.created_time = std::chrono::steady_clock::now();
+        _frames.publish();
+    }
+    void _simulation_loop() {
+        while(_running) {
+            _simulate_frame(_events.pop_all());
+            if(pace_to_renderer) {
+                while(_running && !_frames.wait_until_consumed(0.05)) {}
+            }
+        }
+    }
+};
+}
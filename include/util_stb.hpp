@@ -4,6 +4,19 @@
 // ============================================================
 
 #pragma once
+
+// Let stb_image allocate through vicmil, so images can be decoded straight into existing buffers, see "Decoding images"
+#if !defined(STBI_MALLOC)
+namespace vicmil {
+void* _stbi_malloc(size_t size);
+void* _stbi_realloc(void* ptr, size_t new_size);
+void _stbi_free(void* ptr);
+}
+#define STBI_MALLOC(size) vicmil::_stbi_malloc(size)
+#define STBI_REALLOC(ptr, new_size) vicmil::_stbi_realloc(ptr, new_size)
+#define STBI_FREE(ptr) vicmil::_stbi_free(ptr)
+#endif
+
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
@@ -12,6 +25,14 @@
 #define STB_TRUETYPE_IMPLEMENTATION 
 #include "stb/stb_truetype.h"
 
+// Use miniz for encoding png files if it is available, it is faster than stb_image_write and can use several threads
+#if !defined(VICMIL_NO_MINIZ_PNG) && defined(__has_include)
+    #if __has_include("miniz/miniz.h")
+        #include "miniz/miniz.h"
+        #define VICMIL_USE_MINIZ_PNG
+    #endif
+#endif
+
 namespace vicmil {
 struct ColorRGBA_UChar {
     unsigned char r = 0;
@@ -36,6 +57,394 @@ struct ColorRGBA_UChar {
     }
 };
 
+// ============================================================
+//                    Image transform kernels
+// ============================================================
+
+/**
+ * Flip, rotate and transpose pixel arrays, used by the image types below
+ * Works on any 4 byte pixel type, e.g. ColorRGBA_UChar or float
+*/
+
+// Swap whole rows top to bottom
+inline void _flip_rows_vertical(unsigned char* data, int h, size_t row_bytes) {
+    unsigned char buffer[4096];
+    for(int y = 0; y < h / 2; y++) {
+        unsigned char* top_row = data + y * row_bytes;
+        unsigned char* bottom_row = data + (h - 1 - y) * row_bytes;
+        for(size_t offset = 0; offset < row_bytes; offset += sizeof(buffer)) {
+            size_t byte_count = std::min(sizeof(buffer), row_bytes - offset);
+            std::memcpy(buffer, top_row + offset, byte_count);
+            std::memcpy(top_row + offset, bottom_row + offset, byte_count);
+            std::memcpy(bottom_row + offset, buffer, byte_count);
+        }
+    }
+}
+
+// Copy rows from src to dst, optionally in reverse order
+inline void _copy_rows(const unsigned char* src, unsigned char* dst, int h, size_t row_bytes, bool flip_vertical) {
+    if(!flip_vertical) {
+        std::memcpy(dst, src, h * row_bytes);
+        return;
+    }
+    for(int y = 0; y < h; y++) {
+        std::memcpy(dst + (h - 1 - y) * row_bytes, src + y * row_bytes, row_bytes);
+    }
+}
+
+// Reverse the order of count pixels
+template<class PIXEL>
+void _reverse_pixels(PIXEL* data, size_t count) {
+    static_assert(sizeof(PIXEL) == 4, "Only 4 byte pixels are supported");
+    size_t begin = 0;
+    size_t end = count;
+    #if defined(__SSE2__)
+    // Swap 4 pixels from each end at a time, reversing them with a shuffle
+    while(end - begin >= 8) {
+        __m128i front = _mm_loadu_si128((const __m128i*)(data + begin));
+        __m128i back = _mm_loadu_si128((const __m128i*)(data + end - 4));
+        _mm_storeu_si128((__m128i*)(data + begin), _mm_shuffle_epi32(back, _MM_SHUFFLE(0, 1, 2, 3)));
+        _mm_storeu_si128((__m128i*)(data + end - 4), _mm_shuffle_epi32(front, _MM_SHUFFLE(0, 1, 2, 3)));
+        begin += 4;
+        end -= 4;
+    }
+    #endif
+    std::reverse(data + begin, data + end);
+}
+
+template<class PIXEL>
+void _flip_pixels_horizontal(PIXEL* data, int w, int h) {
+    for(int y = 0; y < h; y++) {
+        _reverse_pixels(data + (size_t)y * w, w);
+    }
+}
+
+/**
+ * Write the transpose of the w*h image src to dst, which will be h pixels wide
+ * Works in 32x32 tiles so both the reads and the writes stay in cache, with 4x4 SSE2 transposes inside each tile
+*/
+template<class PIXEL>
+void _transpose_pixels(const PIXEL* src, int w, int h, PIXEL* dst) {
+    static_assert(sizeof(PIXEL) == 4, "Only 4 byte pixels are supported");
+    const int tile_size = 32;
+    for(int tile_y = 0; tile_y < h; tile_y += tile_size) {
+        for(int tile_x = 0; tile_x < w; tile_x += tile_size) {
+            int y_end = std::min(tile_y + tile_size, h);
+            int x_end = std::min(tile_x + tile_size, w);
+            int y = tile_y;
+            #if defined(__SSE2__)
+            for(; y + 4 <= y_end; y += 4) {
+                int x = tile_x;
+                for(; x + 4 <= x_end; x += 4) {
+                    __m128i row0 = _mm_loadu_si128((const __m128i*)(src + (size_t)(y + 0) * w + x));
+                    __m128i row1 = _mm_loadu_si128((const __m128i*)(src + (size_t)(y + 1) * w + x));
+                    __m128i row2 = _mm_loadu_si128((const __m128i*)(src + (size_t)(y + 2) * w + x));
+                    __m128i row3 = _mm_loadu_si128((const __m128i*)(src + (size_t)(y + 3) * w + x));
+                    __m128i t0 = _mm_unpacklo_epi32(row0, row1);
+                    __m128i t1 = _mm_unpacklo_epi32(row2, row3);
+                    __m128i t2 = _mm_unpackhi_epi32(row0, row1);
+                    __m128i t3 = _mm_unpackhi_epi32(row2, row3);
+                    _mm_storeu_si128((__m128i*)(dst + (size_t)(x + 0) * h + y), _mm_unpacklo_epi64(t0, t1));
+                    _mm_storeu_si128((__m128i*)(dst + (size_t)(x + 1) * h + y), _mm_unpackhi_epi64(t0, t1));
+                    _mm_storeu_si128((__m128i*)(dst + (size_t)(x + 2) * h + y), _mm_unpacklo_epi64(t2, t3));
+                    _mm_storeu_si128((__m128i*)(dst + (size_t)(x + 3) * h + y), _mm_unpackhi_epi64(t2, t3));
+                }
+                for(; x < x_end; x++) {
+                    for(int i = 0; i < 4; i++) {
+                        dst[(size_t)x * h + y + i] = src[(size_t)(y + i) * w + x];
+                    }
+                }
+            }
+            #endif
+            for(; y < y_end; y++) {
+                for(int x = tile_x; x < x_end; x++) {
+                    dst[(size_t)x * h + y] = src[(size_t)y * w + x];
+                }
+            }
+        }
+    }
+}
+
+enum ImageRotation {
+    ROTATE_90,  // Clockwise
+    ROTATE_180,
+    ROTATE_270, // Clockwise, i.e. 90 degrees counter clockwise
+    TRANSPOSE   // Mirror along the diagonal from the top left corner
+};
+
+/**
+ * Rotate or transpose the w*h pixels, w and h are updated to the new size
+*/
+template<class PIXEL>
+void _rotate_pixels(std::vector<PIXEL>& pixels, int& w, int& h, ImageRotation rotation) {
+    if(pixels.size() == 0) {
+        return;
+    }
+    if(rotation == ROTATE_180) {
+        _reverse_pixels(pixels.data(), pixels.size()); // Same as flipping both vertically and horizontally
+        return;
+    }
+    std::vector<PIXEL> transposed = std::vector<PIXEL>(pixels.size());
+    _transpose_pixels(pixels.data(), w, h, transposed.data());
+    pixels.swap(transposed);
+    std::swap(w, h);
+    if(rotation == ROTATE_90) {
+        _flip_pixels_horizontal(pixels.data(), w, h);
+    }
+    else if(rotation == ROTATE_270) {
+        _flip_rows_vertical((unsigned char*)pixels.data(), h, w * sizeof(PIXEL));
+    }
+}
+
+// ============================================================
+//                      Float image kernels
+// ============================================================
+
+/**
+ * Kernels for images with one float per pixel, e.g. depth buffers
+ * They work on plain arrays so they can be used both for Image_float and in blocks for Image_half
+*/
+
+/**
+ * Get the smallest and largest value, values >= exclude_from are skipped(e.g. 1.0 to skip the far plane in depth buffers)
+ * Returns false if there were no values left
+*/
+inline bool _float_min_max(const float* values, size_t count, float exclude_from, float& out_min, float& out_max) {
+    float min_value = INFINITY;
+    float max_value = -INFINITY;
+    size_t i = 0;
+    #if defined(__SSE2__)
+    __m128 min_4 = _mm_set1_ps(INFINITY);
+    __m128 max_4 = _mm_set1_ps(-INFINITY);
+    const __m128 exclude_4 = _mm_set1_ps(exclude_from);
+    for(; i + 4 <= count; i += 4) {
+        __m128 v = _mm_loadu_ps(values + i);
+        __m128 keep = _mm_cmplt_ps(v, exclude_4);
+        min_4 = _mm_min_ps(min_4, _mm_or_ps(_mm_and_ps(keep, v), _mm_andnot_ps(keep, _mm_set1_ps(INFINITY))));
+        max_4 = _mm_max_ps(max_4, _mm_or_ps(_mm_and_ps(keep, v), _mm_andnot_ps(keep, _mm_set1_ps(-INFINITY))));
+    }
+    float mins[4];
+    float maxs[4];
+    _mm_storeu_ps(mins, min_4);
+    _mm_storeu_ps(maxs, max_4);
+    for(int j = 0; j < 4; j++) {
+        min_value = std::min(min_value, mins[j]);
+        max_value = std::max(max_value, maxs[j]);
+    }
+    #endif
+    for(; i < count; i++) {
+        if(values[i] < exclude_from) {
+            min_value = std::min(min_value, values[i]);
+            max_value = std::max(max_value, values[i]);
+        }
+    }
+    out_min = min_value;
+    out_max = max_value;
+    return min_value <= max_value;
+}
+
+// values = values * scale + offset
+inline void _float_scale_offset(float* values, size_t count, float scale, float offset) {
+    size_t i = 0;
+    #if defined(__SSE2__)
+    const __m128 scale_4 = _mm_set1_ps(scale);
+    const __m128 offset_4 = _mm_set1_ps(offset);
+    for(; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(values + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(values + i), scale_4), offset_4));
+    }
+    #endif
+    for(; i < count; i++) {
+        values[i] = values[i] * scale + offset;
+    }
+}
+
+/**
+ * Convert values from the depth buffer(0 to 1) to the distance from the camera(near_plane to far_plane)
+ * Assumes a standard perspective projection such as glm::perspective
+*/
+inline void _linearize_depth(float* values, size_t count, float near_plane, float far_plane) {
+    // With z_ndc = 2 * depth - 1: distance = 2nf / (f + n - z_ndc * (f - n)) = nf / (f - depth * (f - n))
+    const float numerator = near_plane * far_plane;
+    const float depth_scale = far_plane - near_plane;
+    size_t i = 0;
+    #if defined(__SSE2__)
+    const __m128 numerator_4 = _mm_set1_ps(numerator);
+    const __m128 depth_scale_4 = _mm_set1_ps(depth_scale);
+    const __m128 far_4 = _mm_set1_ps(far_plane);
+    for(; i + 4 <= count; i += 4) {
+        __m128 depth = _mm_loadu_ps(values + i);
+        _mm_storeu_ps(values + i, _mm_div_ps(numerator_4, _mm_sub_ps(far_4, _mm_mul_ps(depth, depth_scale_4))));
+    }
+    #endif
+    for(; i < count; i++) {
+        values[i] = numerator / (far_plane - values[i] * depth_scale);
+    }
+}
+
+enum ColorMap {
+    COLORMAP_RED_GREEN, // Red for low values and green for high values
+    COLORMAP_GRAYSCALE,
+    COLORMAP_TURBO,     // Rainbow like, easy to see small differences
+    COLORMAP_VIRIDIS    // Perceptually uniform, from dark blue to yellow
+};
+
+/**
+ * A table of 256 colors for the colormap, built once
+*/
+inline const ColorRGBA_UChar* _colormap_lut(ColorMap colormap) {
+    struct Luts {
+        ColorRGBA_UChar colors[4][256];
+        Luts() {
+            for(int i = 0; i < 256; i++) {
+                double x = i / 255.0;
+                colors[COLORMAP_RED_GREEN][i] = ColorRGBA_UChar((1.0 - x) * 255 + 0.5, x * 255 + 0.5, 0, 255);
+                colors[COLORMAP_GRAYSCALE][i] = ColorRGBA_UChar(i, i, i, 255);
+
+                // Polynomial approximation of turbo, by Anton Mikhailov
+                double x2 = x * x;
+                double x3 = x2 * x;
+                double x4 = x3 * x;
+                double x5 = x4 * x;
+                double r = 0.13572138 + 4.61539260 * x - 42.66032258 * x2 + 132.13108234 * x3 - 152.94239396 * x4 + 59.28637943 * x5;
+                double g = 0.09140261 + 2.19418839 * x + 4.84296658 * x2 - 14.18503333 * x3 + 4.27729857 * x4 + 2.82956604 * x5;
+                double b = 0.10667330 + 12.64194608 * x - 60.58204836 * x2 + 110.36276771 * x3 - 89.90310912 * x4 + 27.34824973 * x5;
+                colors[COLORMAP_TURBO][i] = _colormap_color(r, g, b);
+
+                // Polynomial approximation of viridis
+                r = 0.2777273272234177 + x * (0.1050930431085774 + x * (-0.3308618287255563 + x * (-4.634230498983486 + x * (6.228269936347081 + x * (4.776384997670288 + x * -5.435455855934631)))));
+                g = 0.005407344544966578 + x * (1.404613529898575 + x * (0.214847559468213 + x * (-5.799100973351585 + x * (14.17993336680509 + x * (-13.74514537774601 + x * 4.645852612178535)))));
+                b = 0.3340998053353061 + x * (1.384590162594685 + x * (0.09509516302823659 + x * (-19.33244095627987 + x * (56.69055260068105 + x * (-65.35303263337234 + x * 26.3124352495832)))));
+                colors[COLORMAP_VIRIDIS][i] = _colormap_color(r, g, b);
+            }
+        }
+        static ColorRGBA_UChar _colormap_color(double r, double g, double b) {
+            return ColorRGBA_UChar(
+                std::max(std::min(r, 1.0), 0.0) * 255 + 0.5, 
+                std::max(std::min(g, 1.0), 0.0) * 255 + 0.5, 
+                std::max(std::min(b, 1.0), 0.0) * 255 + 0.5, 
+                255);
+        }
+    };
+    static const Luts luts = Luts();
+    return luts.colors[colormap];
+}
+
+/**
+ * Map values in the range min_value to max_value to colors, values outside the range are clamped
+*/
+inline void _floats_to_colormap(const float* values, size_t count, float min_value, float max_value, const ColorRGBA_UChar* lut, ColorRGBA_UChar* out) {
+    float scale = max_value > min_value ? 255.0f / (max_value - min_value) : 0.0f;
+    float offset = 0.5f - min_value * scale; // Round to nearest when truncating
+    size_t i = 0;
+    #if defined(__SSE2__)
+    const __m128 scale_4 = _mm_set1_ps(scale);
+    const __m128 offset_4 = _mm_set1_ps(offset);
+    const __m128 zero_4 = _mm_setzero_ps();
+    const __m128 max_4 = _mm_set1_ps(255.0f);
+    int indices[4];
+    for(; i + 4 <= count; i += 4) {
+        __m128 v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(values + i), scale_4), offset_4);
+        v = _mm_min_ps(_mm_max_ps(v, zero_4), max_4); // Clamping also turns nan into 0
+        _mm_storeu_si128((__m128i*)indices, _mm_cvttps_epi32(v));
+        out[i] = lut[indices[0]];
+        out[i + 1] = lut[indices[1]];
+        out[i + 2] = lut[indices[2]];
+        out[i + 3] = lut[indices[3]];
+    }
+    #endif
+    for(; i < count; i++) {
+        float v = values[i] * scale + offset;
+        v = v > 0.0f ? (v < 255.0f ? v : 255.0f) : 0.0f;
+        out[i] = lut[(int)v];
+    }
+}
+
+// Convert between 32 bit and 16 bit(half precision) floats, rounding to nearest even
+inline uint16_t _float_to_half(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, 4);
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs_bits = bits & 0x7fffffff;
+    if(abs_bits >= 0x7f800000) { // inf or nan
+        return sign | 0x7c00 | (abs_bits > 0x7f800000 ? 0x200 : 0);
+    }
+    if(abs_bits >= 0x477ff000) { // Rounds to larger than the largest half
+        return sign | 0x7c00;
+    }
+    if(abs_bits < 0x38800000) { // Subnormal half, or zero
+        if(abs_bits < 0x33000000) {
+            return sign;
+        }
+        uint32_t exponent = abs_bits >> 23;
+        uint32_t mantissa = (abs_bits & 0x7fffff) | 0x800000;
+        uint32_t shift = 126 - exponent; // 14 to 24
+        uint32_t half = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if(remainder > halfway || (remainder == halfway && (half & 1))) {
+            half++;
+        }
+        return sign | half;
+    }
+    uint32_t half = ((abs_bits - 0x38000000) >> 13);
+    uint32_t remainder = abs_bits & 0x1fff;
+    if(remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+        half++; // May carry into the exponent, which is still correct
+    }
+    return sign | half;
+}
+
+inline float _half_to_float(uint16_t half) {
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    uint32_t bits = 0;
+    if(exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    }
+    else if(exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    else if(mantissa != 0) { // Subnormal, normalize it
+        exponent = 113;
+        while((mantissa & 0x400) == 0) {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    else {
+        bits = sign;
+    }
+    float value;
+    std::memcpy(&value, &bits, 4);
+    return value;
+}
+
+inline void _floats_to_halves(const float* values, size_t count, uint16_t* out) {
+    size_t i = 0;
+    #if defined(__F16C__)
+    for(; i + 8 <= count; i += 8) {
+        _mm_storeu_si128((__m128i*)(out + i), _mm256_cvtps_ph(_mm256_loadu_ps(values + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    #endif
+    for(; i < count; i++) {
+        out[i] = _float_to_half(values[i]);
+    }
+}
+
+inline void _halves_to_floats(const uint16_t* values, size_t count, float* out) {
+    size_t i = 0;
+    #if defined(__F16C__)
+    for(; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(values + i))));
+    }
+    #endif
+    for(; i < count; i++) {
+        out[i] = _half_to_float(values[i]);
+    }
+}
+
 // ============================================================
 //                           Loading images
 // ============================================================
@@ -127,31 +536,157 @@ typedef RectT<double> Rect;
 void _write_to_vector(void *vector_ptr, void *data, int size) {
     std::vector<unsigned char>* vec = (std::vector<unsigned char>*)vector_ptr;
     //PrintExpr(vicmil::to_binary_str(vec));
-    vec->resize(size);
-    memcpy(&(*vec)[0], data, size);
+    vec->insert(vec->end(), (unsigned char*)data, (unsigned char*)data + size); // Append, so the output can go straight into an existing buffer
 }
 
 
+/**
+ * A non-owning view of w*h pixels, where each row starts stride pixels after the previous one
+ * Lets images and rectangles inside them be passed around without copying the pixels
+ * Note! The image the view points into must stay alive(and not be resized) while the view is used
+*/
+template<class PIXEL>
+struct ImageView {
+    PIXEL* data = nullptr;
+    int w = 0;
+    int h = 0;
+    int stride = 0; // Pixels from the start of one row to the start of the next
+    ImageView() {}
+    ImageView(PIXEL* data_, int w_, int h_, int stride_ = -1) {
+        data = data_;
+        w = w_;
+        h = h_;
+        stride = stride_ < 0 ? w_ : stride_;
+    }
+    // A view of mutable pixels can be used as a view of const pixels
+    template<class OTHER_PIXEL, class = typename std::enable_if<std::is_convertible<OTHER_PIXEL*, PIXEL*>::value>::type>
+    ImageView(const ImageView<OTHER_PIXEL>& other) {
+        data = other.data;
+        w = other.w;
+        h = other.h;
+        stride = other.stride;
+    }
+    PIXEL* get_pixel(int x, int y) const {
+        return data + (size_t)y * stride + x;
+    }
+    PIXEL* get_row(int y) const {
+        return data + (size_t)y * stride;
+    }
+    bool empty() const {
+        return w <= 0 || h <= 0;
+    }
+    // True if there is no padding between rows, so the pixels can be treated as one array
+    bool is_contiguous() const {
+        return stride == w || h <= 1;
+    }
+    /**
+     * Get a view of a rectangle inside this view
+     * The rectangle is clipped to the view, so the result may be smaller than requested
+    */
+    ImageView sub_view(int x, int y, int sub_w, int sub_h) const {
+        int min_x = std::max(x, 0);
+        int min_y = std::max(y, 0);
+        int max_x = std::min(x + sub_w, w);
+        int max_y = std::min(y + sub_h, h);
+        if(max_x <= min_x || max_y <= min_y) {
+            return ImageView();
+        }
+        return ImageView(get_pixel(min_x, min_y), max_x - min_x, max_y - min_y, stride);
+    }
+};
+
+typedef ImageView<ColorRGBA_UChar> ImageViewRGBA;
+typedef ImageView<const ColorRGBA_UChar> ConstImageViewRGBA;
+// Views of single channel images, one byte per pixel, see ImageA8
+typedef ImageView<unsigned char> ImageViewA8;
+typedef ImageView<const unsigned char> ConstImageViewA8;
+
+enum PNGFilter {
+    PNG_FILTER_NONE = 0,
+    PNG_FILTER_SUB = 1,
+    PNG_FILTER_UP = 2,
+    PNG_FILTER_AVERAGE = 3,
+    PNG_FILTER_PAETH = 4,
+    PNG_FILTER_ADAPTIVE = 5 // Pick the filter for each row that is likely to compress best
+};
+
+struct PNGEncodeOptions {
+    int level = 6; // 0 stores the data without compressing it, 1 is the fastest compression and 9 the smallest files
+    PNGFilter filter = PNG_FILTER_ADAPTIVE;
+    bool multithreaded = true;
+
+    // Biggest files, for when the time spent matters more than the size
+    static PNGEncodeOptions store() {
+        PNGEncodeOptions options = PNGEncodeOptions();
+        options.level = 0;
+        options.filter = PNG_FILTER_NONE;
+        return options;
+    }
+    static PNGEncodeOptions fast() {
+        PNGEncodeOptions options = PNGEncodeOptions();
+        options.level = 1;
+        options.filter = PNG_FILTER_SUB;
+        return options;
+    }
+    static PNGEncodeOptions small() {
+        PNGEncodeOptions options = PNGEncodeOptions();
+        options.level = 9;
+        return options;
+    }
+};
+
+bool append_png(ConstImageViewRGBA image, std::vector<unsigned char>& out, const PNGEncodeOptions& options = PNGEncodeOptions());
+std::vector<unsigned char> to_png_as_bytes(ConstImageViewRGBA image, const PNGEncodeOptions& options = PNGEncodeOptions());
+bool save_as_png(ConstImageViewRGBA image, std::string filename, const PNGEncodeOptions& options = PNGEncodeOptions());
+
+struct ImageRGBA_UChar;
+bool decode_image(const unsigned char* bytes, int length, ImageRGBA_UChar& out, bool flip_vertical = false, std::string* error = nullptr);
+bool decode_image_file(std::string filename, ImageRGBA_UChar& out, bool flip_vertical = false, std::string* error = nullptr);
+
 struct ImageRGBA_UChar {
-    int w;
-    int h;
+    int w = 0;
+    int h = 0;
     std::vector<ColorRGBA_UChar> pixels;
+
+    ImageRGBA_UChar() {}
+    // Copy the pixels of a view into a new image
+    static ImageRGBA_UChar from_view(ConstImageViewRGBA view) {
+        ImageRGBA_UChar new_image = ImageRGBA_UChar();
+        new_image.resize(view.w, view.h);
+        for(int y = 0; y < view.h; y++) {
+            std::memcpy(&new_image.pixels[(size_t)y * view.w], view.get_row(y), view.w * sizeof(ColorRGBA_UChar));
+        }
+        return new_image;
+    }
+    ImageViewRGBA view() {
+        return ImageViewRGBA(pixels.data(), w, h);
+    }
+    ConstImageViewRGBA view() const {
+        return ConstImageViewRGBA(pixels.data(), w, h);
+    }
+    // A view of a rectangle in the image, clipped to the image
+    ImageViewRGBA sub_view(int x, int y, int sub_w, int sub_h) {
+        return view().sub_view(x, y, sub_w, sub_h);
+    }
+    ConstImageViewRGBA sub_view(int x, int y, int sub_w, int sub_h) const {
+        return view().sub_view(x, y, sub_w, sub_h);
+    }
+    // Images can be passed directly to functions taking views
+    operator ImageViewRGBA() {
+        return view();
+    }
+    operator ConstImageViewRGBA() const {
+        return view();
+    }
     void resize(unsigned int new_width, unsigned int new_height) {
         // Note! Will not preserve content of image. Only the pixel vector will be resized
         w = new_width;
         h = new_height;
         pixels.resize(new_width * new_height);
     }
-    void copy_to_image(ImageRGBA_UChar* other_image, int x, int y) {
-        // Copy this image to other image, so that this image start corner is at x, y of other image
-        int copy_max_x = std::min(other_image->w - x, w);
-        int copy_max_y = std::min(other_image->h - y, h);
-        for(int x2 = 0; x2 < copy_max_x; x2++) {
-            for(int y2 = 0; y2 < copy_max_y; y2++) {
-                *other_image->get_pixel(x2 + x, y2 + y) = *get_pixel(x2, y2);
-            }
-        }
-    }
+    // Copy this image to other image, so that this image start corner is at x, y of other image
+    // Parts outside the other image are skipped, see blit for blending
+    void copy_to_image(ImageRGBA_UChar* other_image, int x, int y);
     ColorRGBA_UChar* get_pixel(int x, int y) {
         return &pixels[y * w + x];
     }
@@ -166,64 +701,49 @@ struct ImageRGBA_UChar {
         std::memcpy(&pixels[0], data, byte_count);
     }
 
-    static ImageRGBA_UChar load_png_from_file(std::string filename) {
+    // Set the pixels from w*h*4 bytes, optionally with the rows in reverse order(e.g. to get OpenGL's bottom up order)
+    void set_pixel_data_rows(const unsigned char* data, bool flip_vertical) {
+        _copy_rows(data, get_pixel_data(), h, w * sizeof(ColorRGBA_UChar), flip_vertical);
+    }
+
+    /**
+     * @arg flip_vertical: flip the image while copying it from the decoder, instead of calling flip_vertical afterwards
+    */
+    static ImageRGBA_UChar load_png_from_file(std::string filename, bool flip_vertical = false) {
         // If it failed to load the file, the width will be zero for the returned image object
         ImageRGBA_UChar return_image = ImageRGBA_UChar();
-        int w = 0;
-        int h = 0;
-        int n = 0;
-        int comp = 4; // r, g, b, a
-        unsigned char *data = stbi_load(filename.c_str(), &w, &h, &n, comp);
-        return_image.resize(w, h);
-        if(w != 0) {
-            return_image.set_pixel_data(data, w * h * 4);
-        }
-        stbi_image_free(data);
+        decode_image_file(filename, return_image, flip_vertical);
         return return_image;
     }
-    void save_as_png(std::string filename) const {
-        int comp = 4; // r, g, b, a
-        const void *data = get_pixel_data_const();
-        int stride_in_bytes = 0;
-        stbi_write_png(filename.c_str(), w, h, comp, data, stride_in_bytes);
+    bool save_as_png(std::string filename, const PNGEncodeOptions& options = PNGEncodeOptions()) const {
+        return vicmil::save_as_png(view(), filename, options);
     }
 
-    std::vector<unsigned char> to_png_as_bytes() const {
-        int comp = 4; // r, g, b, a
-        const void* data = &pixels[0];
-        int stride_in_bytes = 0;
-        stbi_write_func& write_func = _write_to_vector;
-
-        std::vector<unsigned char> vec = std::vector<unsigned char>();
-        std::vector<unsigned char>* vec_ptr = &vec;
-        stbi_write_png_to_func(write_func, vec_ptr, w, h, comp, data, stride_in_bytes);
-        return vec;
+    std::vector<unsigned char> to_png_as_bytes(const PNGEncodeOptions& options = PNGEncodeOptions()) const {
+        return vicmil::to_png_as_bytes(view(), options);
     }
-    static ImageRGBA_UChar png_as_bytes_to_image(const unsigned char* bytes, int length) {
-        int w;
-        int h;
-        int n;
-        int comp = 4; // r, g, b, a
-
+    // Encode as png at the end of out, without any extra copies
+    bool append_png(std::vector<unsigned char>& out, const PNGEncodeOptions& options = PNGEncodeOptions()) const {
+        return vicmil::append_png(view(), out, options);
+    }
+    // If it failed to decode the image, the width will be zero for the returned image object
+    static ImageRGBA_UChar png_as_bytes_to_image(const unsigned char* bytes, int length, bool flip_vertical = false) {
         ImageRGBA_UChar return_image = ImageRGBA_UChar();
-
-        unsigned char *data = stbi_load_from_memory(bytes, length, &w, &h, &n, comp);
-        return_image.resize(w, h);
-        return_image.set_pixel_data(data, w * h * 4);
-        stbi_image_free(data);
+        decode_image(bytes, length, return_image, flip_vertical);
         return return_image;
     }
-    static ImageRGBA_UChar png_as_bytes_to_image(const std::vector<unsigned char>& data) {
-        return png_as_bytes_to_image(&data[0], data.size());
+    static ImageRGBA_UChar png_as_bytes_to_image(const std::vector<unsigned char>& data, bool flip_vertical = false) {
+        return png_as_bytes_to_image(data.data(), data.size(), flip_vertical);
     }
     void flip_vertical() {
-        for(int x = 0; x < w; x++) {
-            for(int y = 0; y < h/2; y++) {
-                ColorRGBA_UChar tmp = *get_pixel(x, y);
-                *get_pixel(x, y) = *get_pixel(x, h - y - 1);
-                *get_pixel(x, h - y - 1) = tmp;
-            }
-        }
+        _flip_rows_vertical((unsigned char*)pixels.data(), h, w * sizeof(ColorRGBA_UChar));
+    }
+    void flip_horizontal() {
+        _flip_pixels_horizontal(pixels.data(), w, h);
+    }
+    // Rotate or transpose the image, swaps w and h for everything except ROTATE_180
+    void rotate(ImageRotation rotation) {
+        _rotate_pixels(pixels, w, h, rotation);
     }
     // Set the entire image to the selected color
     void fill(ColorRGBA_UChar new_color) {
@@ -234,11 +754,15 @@ struct ImageRGBA_UChar {
 };
 
 // Image of floats, typically in the range [0,1], can be used to store depth images for example
+struct Image_half;
+
 struct Image_float {
-    int w;
-    int h;
+    int w = 0;
+    int h = 0;
     std::vector<float> pixels;
     void resize(unsigned int new_width, unsigned int new_height) {
+        w = new_width;
+        h = new_height;
         pixels.resize(new_width * new_height);
     }
     float* get_pixel(int x, int y) {
@@ -255,110 +779,5518 @@ struct Image_float {
         std::memcpy(&pixels[0], data, byte_count);
     }
     void flip_vertical() {
-        for(int x = 0; x < w; x++) {
-            for(int y = 0; y < h/2; y++) {
-                float tmp = *get_pixel(x, y);
-                *get_pixel(x, y) = *get_pixel(x, h - y - 1);
-                *get_pixel(x, h - y - 1) = tmp;
-            }
+        _flip_rows_vertical((unsigned char*)pixels.data(), h, w * sizeof(float));
+    }
+    void flip_horizontal() {
+        _flip_pixels_horizontal(pixels.data(), w, h);
+    }
+    // Rotate or transpose the image, swaps w and h for everything except ROTATE_180
+    void rotate(ImageRotation rotation) {
+        _rotate_pixels(pixels, w, h, rotation);
+    }
+    /**
+     * Get the smallest and largest value in the image
+     * Values >= exclude_from are skipped, e.g. use 1.0 to skip the background of a depth screenshot
+     * Returns false if there were no values left
+    */
+    bool get_min_max(float* out_min, float* out_max, float exclude_from = INFINITY) const {
+        return _float_min_max(pixels.data(), pixels.size(), exclude_from, *out_min, *out_max);
+    }
+    // Map the values in min_value to max_value to the range 0 to 1(values outside the range end up outside 0 to 1)
+    void normalize(float min_value, float max_value) {
+        float scale = max_value > min_value ? 1.0f / (max_value - min_value) : 0.0f;
+        _float_scale_offset(pixels.data(), pixels.size(), scale, -min_value * scale);
+    }
+    // Map the smallest value to 0 and the largest to 1
+    void normalize() {
+        float min_value;
+        float max_value;
+        if(get_min_max(&min_value, &max_value)) {
+            normalize(min_value, max_value);
         }
     }
-    ImageRGBA_UChar to_image_rgba_uchar() {
+    /**
+     * Convert a depth screenshot(values from 0 to 1) to the distance from the camera
+     * near_plane and far_plane should be the same as for the projection, see Perspective3DParameters min_depth and max_depth
+    */
+    void linearize_depth(float near_plane, float far_plane) {
+        _linearize_depth(pixels.data(), pixels.size(), near_plane, far_plane);
+    }
+    /**
+     * Color the image using a colormap, values between min_value and max_value are spread out over the colormap
+     * By default values are assumed to be between 0 and 1, going from red to green
+    */
+    ImageRGBA_UChar to_image_rgba_uchar(ColorMap colormap = COLORMAP_RED_GREEN, float min_value = 0.0f, float max_value = 1.0f) const {
         ImageRGBA_UChar new_image;
-        // Assume float values are in the range 0 and 1
-        // make interval between green and red, where red is 0 and green is 1
         new_image.resize(w, h);
-        for(int i = 0; i < pixels.size(); i++) {
-            float pixel_value = std::max(std::min(pixels[i], 1.0f), 0.0f); // Clip it in range 0 and 1
-            new_image.pixels[i] = ColorRGBA_UChar((1.0-pixel_value)*255, pixel_value*255, 0, 1);
-        }
+        _floats_to_colormap(pixels.data(), pixels.size(), min_value, max_value, _colormap_lut(colormap), new_image.pixels.data());
         return new_image;
     }
+    Image_half to_image_half() const;
 };
 
-// ============================================================
-//                           Loading fonts
-// ============================================================
+/**
+ * Stores each pixel as a 16 bit float, half the memory of Image_float
+ * Good enough for visualizing depth screenshots(about 3 significant digits), use Image_float for calculations
+*/
+struct Image_half {
+    int w = 0;
+    int h = 0;
+    std::vector<uint16_t> pixels;
+    void resize(unsigned int new_width, unsigned int new_height) {
+        w = new_width;
+        h = new_height;
+        pixels.resize(new_width * new_height);
+    }
+    float get_pixel_value(int x, int y) const {
+        return _half_to_float(pixels[y * w + x]);
+    }
+    void set_pixel_value(int x, int y, float value) {
+        pixels[y * w + x] = _float_to_half(value);
+    }
+    // Convert count floats to the pixels starting at index first
+    void set_pixel_values(size_t first, const float* values, size_t count) {
+        _floats_to_halves(values, count, &pixels[first]);
+    }
+    void flip_vertical() {
+        _flip_rows_vertical((unsigned char*)pixels.data(), h, w * sizeof(uint16_t));
+    }
+    static Image_half from_image_float(const Image_float& image) {
+        Image_half new_image = Image_half();
+        new_image.resize(image.w, image.h);
+        _floats_to_halves(image.pixels.data(), image.pixels.size(), new_image.pixels.data());
+        return new_image;
+    }
+    Image_float to_image_float() const {
+        Image_float new_image = Image_float();
+        new_image.resize(w, h);
+        _halves_to_floats(pixels.data(), pixels.size(), new_image.pixels.data());
+        return new_image;
+    }
 
-// For loading true type fonts (.ttf, and .otf fonts)
-struct FontLoader {
-    stbtt_fontinfo info;
-    std::vector<unsigned char> font_data;
+    // The functions below work on blocks of pixels converted to float, so the image is never converted all at once
+    template<class FUNC>
+    void _for_each_block(FUNC func) const {
+        float block[1024];
+        for(size_t i = 0; i < pixels.size(); i += 1024) {
+            size_t count = std::min((size_t)1024, pixels.size() - i);
+            _halves_to_floats(&pixels[i], count, block);
+            func(i, block, count);
+        }
+    }
+    bool get_min_max(float* out_min, float* out_max, float exclude_from = INFINITY) const {
+        float min_value = INFINITY;
+        float max_value = -INFINITY;
+        _for_each_block([&](size_t, float* block, size_t count) {
+            float block_min;
+            float block_max;
+            if(_float_min_max(block, count, exclude_from, block_min, block_max)) {
+                min_value = std::min(min_value, block_min);
+                max_value = std::max(max_value, block_max);
+            }
+        });
+        *out_min = min_value;
+        *out_max = max_value;
+        return min_value <= max_value;
+    }
+    // See Image_float::linearize_depth, note that half floats loose precision for far away distances
+    void linearize_depth(float near_plane, float far_plane) {
+        _for_each_block([&](size_t first, float* block, size_t count) {
+            _linearize_depth(block, count, near_plane, far_plane);
+            _floats_to_halves(block, count, &pixels[first]);
+        });
+    }
+    ImageRGBA_UChar to_image_rgba_uchar(ColorMap colormap = COLORMAP_RED_GREEN, float min_value = 0.0f, float max_value = 1.0f) const {
+        ImageRGBA_UChar new_image;
+        new_image.resize(w, h);
+        const ColorRGBA_UChar* lut = _colormap_lut(colormap);
+        _for_each_block([&](size_t first, float* block, size_t count) {
+            _floats_to_colormap(block, count, min_value, max_value, lut, &new_image.pixels[first]);
+        });
+        return new_image;
+    }
+};
 
-    // Calculated from line height
-    int line_height;
-    float scale;
-    int ascent; // Line spacing in y direction
-    int descent;
-    int lineGap;
+Image_half Image_float::to_image_half() const {
+    return Image_half::from_image_float(*this);
+}
 
-    void load_font_from_memory(unsigned char* fontBuffer_, int size, int line_height_=64) {
-        // Load font into buffer
-        font_data.resize(size);
-        memcpy(&font_data[0], fontBuffer_, size);
+/**
+ * Image with a single byte per pixel, e.g. the coverage of font glyphs
+ * Uses a quarter of the memory(and upload bandwidth) of an ImageRGBA_UChar, the color is added when it is drawn
+*/
+struct ImageA8 {
+    int w = 0;
+    int h = 0;
+    std::vector<unsigned char> pixels;
 
-        // Prepare font
-        if (!stbtt_InitFont(&info, &font_data[0], 0))
-        {
-            printf("failed\n");
+    ImageA8() {}
+    // Copy the pixels of a view into a new image
+    static ImageA8 from_view(ConstImageViewA8 view) {
+        ImageA8 new_image = ImageA8();
+        new_image.resize(view.w, view.h);
+        for(int y = 0; y < view.h; y++) {
+            std::memcpy(&new_image.pixels[(size_t)y * view.w], view.get_row(y), view.w);
         }
-        set_line_height(line_height_); // Set default line height
+        return new_image;
     }
-    void load_font_from_file(std::string filepath, int line_height_=64) {
-        vicmil::FileManager file = vicmil::FileManager(filepath);
-        std::vector<char> data = file.read_entire_file();
-        load_font_from_memory((unsigned char*)&data[0], data.size(), line_height_);
+    ImageViewA8 view() {
+        return ImageViewA8(pixels.data(), w, h);
     }
-
-    void set_line_height(int new_line_height) {
-        line_height = new_line_height;
-        scale = stbtt_ScaleForPixelHeight(&info, line_height);
-        int ascent; // Line spacing in y direction
-        int descent;
-        int lineGap;
-        stbtt_GetFontVMetrics(&info, &ascent, &descent, &lineGap);
-        ascent = roundf(ascent * scale);
-        descent = roundf(descent * scale);
+    ConstImageViewA8 view() const {
+        return ConstImageViewA8(pixels.data(), w, h);
     }
-
-    void _get_character_advancement(const int character, int* advanceWidth, int* leftSideBearing) {
-        // Advance width is how much to advance to the right
-        // leftSideBearing means that it overlaps a little with the previous character
-        stbtt_GetCodepointHMetrics(&info, character, advanceWidth, leftSideBearing);
-        *advanceWidth = roundf(*advanceWidth * scale);
-        *leftSideBearing = roundf(*leftSideBearing * scale);
+    // A view of a rectangle in the image, clipped to the image
+    ImageViewA8 sub_view(int x, int y, int sub_w, int sub_h) {
+        return view().sub_view(x, y, sub_w, sub_h);
     }
-
-    int _get_kernal_advancement(const int character1, const int character2) {
-        int kern = stbtt_GetCodepointKernAdvance(&info, character1, character2);
-        return roundf(kern * scale);
+    ConstImageViewA8 sub_view(int x, int y, int sub_w, int sub_h) const {
+        return view().sub_view(x, y, sub_w, sub_h);
     }
-
-    RectT<int> _get_character_bounding_box(const int character) {
-        int ax;
-        int lsb;
-        stbtt_GetCodepointHMetrics(&info, character, &ax, &lsb);
-
-        // Get bounding box for character (may be offset to account for chars that dip above or below the line)
-        int c_x1, c_y1, c_x2, c_y2;
-        stbtt_GetCodepointBitmapBox(&info, character, scale, scale, &c_x1, &c_y1, &c_x2, &c_y2);
-        return RectT<int>(c_x1, c_y1, c_x2 - c_x1, c_y2 - c_y1);
+    // Images can be passed directly to functions taking views
+    operator ImageViewA8() {
+        return view();
+    }
+    operator ConstImageViewA8() const {
+        return view();
+    }
+    void resize(unsigned int new_width, unsigned int new_height) {
+        // Note! Will not preserve content of image. Only the pixel vector will be resized
+        w = new_width;
+        h = new_height;
+        pixels.resize(new_width * new_height);
+    }
+    unsigned char* get_pixel(int x, int y) {
+        return &pixels[y * w + x];
+    }
+    void fill(unsigned char value) {
+        std::fill(pixels.begin(), pixels.end(), value);
+    }
+    void flip_vertical() {
+        _flip_rows_vertical(pixels.data(), h, w);
+    }
+    // Expand to RGBA, every pixel gets the color with its alpha multiplied by the coverage
+    ImageRGBA_UChar to_image_rgba(ColorRGBA_UChar color = ColorRGBA_UChar(255, 255, 255, 255)) const;
+};
+
+// ============================================================
+//                      Blitting images
+// ============================================================
+
+/**
+ * Copy or blend a rectangle of one image into another, clipped against both images
+ * Works one row at a time, so plain copies are one memcpy per row
+*/
+enum BlendMode {
+    BLEND_COPY,       // Overwrite the destination
+    BLEND_ALPHA_OVER, // Draw the source on top of the destination using the source alpha
+    BLEND_ADDITIVE,   // Add the source to the destination, saturating at 255
+    BLEND_TINT        // Multiply the source by a tint color, then draw it like BLEND_ALPHA_OVER, e.g. for white glyphs
+};
+
+/**
+ * Clip a w*h copy from (src_x, src_y) in the source to (dst_x, dst_y) in the destination, so it is inside both images
+ * Returns false if nothing is left to copy
+*/
+inline bool _clip_blit(int src_w, int src_h, int dst_w, int dst_h, int& src_x, int& src_y, int& dst_x, int& dst_y, int& w, int& h) {
+    // Clip against the top left corners
+    int shift_x = std::max(std::max(-src_x, -dst_x), 0);
+    int shift_y = std::max(std::max(-src_y, -dst_y), 0);
+    src_x += shift_x;
+    dst_x += shift_x;
+    w -= shift_x;
+    src_y += shift_y;
+    dst_y += shift_y;
+    h -= shift_y;
+    // Clip against the bottom right corners
+    w = std::min(w, std::min(src_w - src_x, dst_w - dst_x));
+    h = std::min(h, std::min(src_h - src_y, dst_h - dst_y));
+    return w > 0 && h > 0;
+}
+
+// x / 255 rounded to nearest, exact for x <= 65535
+inline unsigned int _div255(unsigned int x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+#if defined(__SSE2__)
+inline __m128i _div255_epu16(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+// Blend two pixels stored as 16 bit channels, the same math as the scalar version
+inline __m128i _alpha_over_epu16(__m128i src, __m128i dst) {
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, 0xFF), 0xFF);
+    __m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    // The color channels are weighted by alpha, the alpha channel by 255
+    __m128i src_factor = _mm_or_si128(_mm_andnot_si128(alpha_lanes, alpha), _mm_and_si128(alpha_lanes, _mm_set1_epi16(255)));
+    __m128i dst_factor = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+    return _div255_epu16(_mm_add_epi16(_mm_mullo_epi16(src, src_factor), _mm_mullo_epi16(dst, dst_factor)));
+}
+#endif
+
+inline void _blend_pixel_alpha_over(const unsigned char* src, unsigned char* dst) {
+    unsigned int alpha = src[3];
+    for(int c = 0; c < 3; c++) {
+        dst[c] = _div255(src[c] * alpha + dst[c] * (255 - alpha));
+    }
+    dst[3] = _div255(255 * alpha + dst[3] * (255 - alpha));
+}
+
+/**
+ * Blend one row of pixel_count RGBA pixels from src into dst
+*/
+void blend_row_rgba(const unsigned char* src, unsigned char* dst, int pixel_count, BlendMode mode, ColorRGBA_UChar tint = ColorRGBA_UChar(255, 255, 255, 255)) {
+    if(mode == BLEND_COPY) {
+        std::memcpy(dst, src, pixel_count * 4);
+        return;
+    }
+    int i = 0;
+    #if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i tint_vec = _mm_set_epi16(tint.a, tint.b, tint.g, tint.r, tint.a, tint.b, tint.g, tint.r);
+    for(; i + 4 <= pixel_count; i += 4) {
+        __m128i src_vec = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i dst_vec = _mm_loadu_si128((const __m128i*)(dst + i * 4));
+        if(mode == BLEND_ADDITIVE) {
+            _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_adds_epu8(src_vec, dst_vec));
+            continue;
+        }
+        __m128i src_low = _mm_unpacklo_epi8(src_vec, zero);
+        __m128i src_high = _mm_unpackhi_epi8(src_vec, zero);
+        if(mode == BLEND_TINT) {
+            src_low = _div255_epu16(_mm_mullo_epi16(src_low, tint_vec));
+            src_high = _div255_epu16(_mm_mullo_epi16(src_high, tint_vec));
+        }
+        __m128i out_low = _alpha_over_epu16(src_low, _mm_unpacklo_epi8(dst_vec, zero));
+        __m128i out_high = _alpha_over_epu16(src_high, _mm_unpackhi_epi8(dst_vec, zero));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_packus_epi16(out_low, out_high));
+    }
+    #endif
+    const unsigned char tint_channels[4] = {tint.r, tint.g, tint.b, tint.a};
+    for(; i < pixel_count; i++) {
+        const unsigned char* src_pixel = src + i * 4;
+        unsigned char* dst_pixel = dst + i * 4;
+        if(mode == BLEND_ADDITIVE) {
+            for(int c = 0; c < 4; c++) {
+                dst_pixel[c] = std::min(src_pixel[c] + dst_pixel[c], 255);
+            }
+        }
+        else if(mode == BLEND_TINT) {
+            unsigned char tinted[4];
+            for(int c = 0; c < 4; c++) {
+                tinted[c] = _div255(src_pixel[c] * tint_channels[c]);
+            }
+            _blend_pixel_alpha_over(tinted, dst_pixel);
+        }
+        else {
+            _blend_pixel_alpha_over(src_pixel, dst_pixel);
+        }
+    }
+}
+
+/**
+ * Blit a w*h rectangle starting at (src_x, src_y) in src, to (dst_x, dst_y) in dst
+ * Parts outside either image are skipped, negative positions are allowed
+ * Images can be passed directly, or views to blit between rectangles inside images
+*/
+void blit(ConstImageViewRGBA src, int src_x, int src_y, int w, int h, ImageViewRGBA dst, int dst_x, int dst_y, 
+          BlendMode mode = BLEND_COPY, ColorRGBA_UChar tint = ColorRGBA_UChar(255, 255, 255, 255)) {
+    if(!_clip_blit(src.w, src.h, dst.w, dst.h, src_x, src_y, dst_x, dst_y, w, h)) {
+        return;
+    }
+    for(int y = 0; y < h; y++) {
+        blend_row_rgba((const unsigned char*)src.get_pixel(src_x, src_y + y), 
+                       (unsigned char*)dst.get_pixel(dst_x, dst_y + y), w, mode, tint);
+    }
+}
+
+// Blit all of src with its top left corner at (dst_x, dst_y) in dst
+void blit(ConstImageViewRGBA src, ImageViewRGBA dst, int dst_x, int dst_y, 
+          BlendMode mode = BLEND_COPY, ColorRGBA_UChar tint = ColorRGBA_UChar(255, 255, 255, 255)) {
+    blit(src, 0, 0, src.w, src.h, dst, dst_x, dst_y, mode, tint);
+}
+
+// Copy all of a single channel image with its top left corner at (dst_x, dst_y) in dst
+void blit(ConstImageViewA8 src, ImageViewA8 dst, int dst_x, int dst_y) {
+    int src_x = 0;
+    int src_y = 0;
+    int w = src.w;
+    int h = src.h;
+    if(!_clip_blit(src.w, src.h, dst.w, dst.h, src_x, src_y, dst_x, dst_y, w, h)) {
+        return;
+    }
+    for(int y = 0; y < h; y++) {
+        std::memcpy(dst.get_pixel(dst_x, dst_y + y), src.get_pixel(src_x, src_y + y), w);
+    }
+}
+
+/**
+ * Draw a single channel image on top of an RGBA image, as color with its alpha multiplied by the coverage in src
+ * e.g. to draw glyphs from FontLoader::get_character_image_a8 on the cpu
+*/
+void blit_coverage(ConstImageViewA8 src, ImageViewRGBA dst, int dst_x, int dst_y, ColorRGBA_UChar color) {
+    int src_x = 0;
+    int src_y = 0;
+    int w = src.w;
+    int h = src.h;
+    if(!_clip_blit(src.w, src.h, dst.w, dst.h, src_x, src_y, dst_x, dst_y, w, h)) {
+        return;
+    }
+    for(int y = 0; y < h; y++) {
+        const unsigned char* src_row = src.get_pixel(src_x, src_y + y);
+        unsigned char* dst_row = (unsigned char*)dst.get_pixel(dst_x, dst_y + y);
+        for(int x = 0; x < w; x++) {
+            if(src_row[x] == 0) {
+                continue;
+            }
+            const unsigned char src_pixel[4] = {color.r, color.g, color.b, (unsigned char)_div255(src_row[x] * color.a)};
+            _blend_pixel_alpha_over(src_pixel, dst_row + x * 4);
+        }
+    }
+}
+
+ImageRGBA_UChar ImageA8::to_image_rgba(ColorRGBA_UChar color) const {
+    ImageRGBA_UChar new_image = ImageRGBA_UChar();
+    new_image.resize(w, h);
+    for(size_t i = 0; i < pixels.size(); i++) {
+        new_image.pixels[i] = ColorRGBA_UChar(color.r, color.g, color.b, _div255(pixels[i] * color.a));
+    }
+    return new_image;
+}
+
+struct BlitJob {
+    ConstImageViewRGBA src;
+    int src_x = 0;
+    int src_y = 0;
+    int w = 0;
+    int h = 0;
+    int dst_x = 0;
+    int dst_y = 0;
+    BlendMode mode = BLEND_COPY;
+    ColorRGBA_UChar tint = ColorRGBA_UChar(255, 255, 255, 255);
+    BlitJob() {}
+    BlitJob(ConstImageViewRGBA src_, int dst_x_, int dst_y_, BlendMode mode_ = BLEND_COPY) {
+        src = src_;
+        w = src_.w;
+        h = src_.h;
+        dst_x = dst_x_;
+        dst_y = dst_y_;
+        mode = mode_;
+    }
+};
+
+/**
+ * Perform many blits into the same image on the worker pool
+ * The destination is split into bands of rows, and each band applies the jobs in order,
+ *  so overlapping jobs give the same result as running them one after another
+*/
+void blit_batch(const std::vector<BlitJob>& jobs, ImageViewRGBA dst) {
+    const int band_height = 32;
+    int band_count = (dst.h + band_height - 1) / band_height;
+    vicmil::parallel_for(0, band_count, [&](size_t band_begin, size_t band_end) {
+        int band_min_y = band_begin * band_height;
+        int band_max_y = std::min((int)band_end * band_height, dst.h);
+        for(size_t i = 0; i < jobs.size(); i++) {
+            const BlitJob& job = jobs[i];
+            int skip_y = std::max(band_min_y - job.dst_y, 0);
+            int h = std::min(job.h, band_max_y - job.dst_y) - skip_y;
+            if(h <= 0) {
+                continue;
+            }
+            blit(job.src, job.src_x, job.src_y + skip_y, job.w, h, dst, job.dst_x, job.dst_y + skip_y, job.mode, job.tint);
+        }
+    });
+}
+
+void TEST_blit_batch() {
+    // Overlapping jobs in every blend mode, partly outside the destination, across several bands
+    PCG32 random = PCG32(31);
+    std::vector<ImageRGBA_UChar> sources = std::vector<ImageRGBA_UChar>(4);
+    for(ImageRGBA_UChar& source : sources) {
+        source.resize(1 + random.next_bounded(60), 1 + random.next_bounded(60));
+        for(ColorRGBA_UChar& pixel : source.pixels) {
+            pixel = ColorRGBA_UChar(random.next_bounded(256), random.next_bounded(256), random.next_bounded(256), random.next_bounded(256));
+        }
+    }
+    std::vector<BlitJob> jobs;
+    for(int i = 0; i < 60; i++) {
+        const ImageRGBA_UChar& source = sources[random.next_bounded(sources.size())];
+        BlitJob job = BlitJob(source.view(), (int)random.next_bounded(140) - 20, (int)random.next_bounded(190) - 20, (BlendMode)random.next_bounded(4));
+        job.src_x = random.next_bounded(source.w);
+        job.w -= job.src_x;
+        job.tint = ColorRGBA_UChar(random.next_bounded(256), random.next_bounded(256), random.next_bounded(256), random.next_bounded(256));
+        jobs.push_back(job);
+    }
+    ImageRGBA_UChar batched = ImageRGBA_UChar();
+    batched.resize(100, 150);
+    for(ColorRGBA_UChar& pixel : batched.pixels) {
+        pixel = ColorRGBA_UChar(random.next_bounded(256), random.next_bounded(256), random.next_bounded(256), random.next_bounded(256));
+    }
+    ImageRGBA_UChar sequential = batched;
+    blit_batch(jobs, batched.view());
+    for(const BlitJob& job : jobs) {
+        blit(job.src, job.src_x, job.src_y, job.w, job.h, sequential.view(), job.dst_x, job.dst_y, job.mode, job.tint);
+    }
+    Assert(std::memcmp(batched.pixels.data(), sequential.pixels.data(), batched.pixels.size() * sizeof(ColorRGBA_UChar)) == 0);
+}
+AddTest(TEST_blit_batch);
+
+void ImageRGBA_UChar::copy_to_image(ImageRGBA_UChar* other_image, int x, int y) {
+    blit(*this, *other_image, x, y, BLEND_COPY);
+}
+
+/**
+ * Hash the size and pixels of an image, e.g. to find images that are identical
+ * The row stride is not part of the hash, so a view into a larger image hashes the same as a copy of it
+*/
+template<class PIXEL>
+Hash128 _hash_image_view(ImageView<PIXEL> image) {
+    StreamingHash hasher = StreamingHash();
+    int size[2] = {image.w, image.h};
+    hasher.update(size, sizeof(size));
+    for(int y = 0; y < image.h; y++) {
+        hasher.update(image.get_row(y), image.w * sizeof(PIXEL));
+    }
+    return hasher.digest128();
+}
+Hash128 hash_image(ConstImageViewRGBA image) {
+    return _hash_image_view(image);
+}
+Hash128 hash_image(ConstImageViewA8 image) {
+    return _hash_image_view(image);
+}
+
+// True if the images have the same size and pixels
+template<class PIXEL>
+bool _equal_image_views(ImageView<PIXEL> a, ImageView<PIXEL> b) {
+    if(a.w != b.w || a.h != b.h) {
+        return false;
+    }
+    for(int y = 0; y < a.h; y++) {
+        if(std::memcmp(a.get_row(y), b.get_row(y), a.w * sizeof(PIXEL)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+bool equal_pixels(ConstImageViewRGBA a, ConstImageViewRGBA b) {
+    return _equal_image_views(a, b);
+}
+bool equal_pixels(ConstImageViewA8 a, ConstImageViewA8 b) {
+    return _equal_image_views(a, b);
+}
+
+// ============================================================
+//                      Resampling images
+// ============================================================
+
+/**
+ * Scale images on the cpu with a separable filter, first along x and then along y
+ * Each output row band is handled by one worker, which filters the input rows it needs along x into a small buffer
+*/
+enum ResampleFilter {
+    RESAMPLE_BOX,      // Average of the covered pixels, nearest neighbour when scaling up
+    RESAMPLE_BILINEAR, // Linear interpolation(a triangle filter, widened when scaling down)
+    RESAMPLE_LANCZOS3  // Sharper, but may ring around hard edges
+};
+
+struct ResampleOptions {
+    ResampleFilter filter = RESAMPLE_BILINEAR;
+    // Filter in linear light instead of on the sRGB values, avoids dark fringes when scaling down
+    bool gamma_correct = false;
+    // Weight colors by alpha while filtering, so that fully transparent pixels do not bleed their color into the result
+    bool premultiply_alpha = false;
+    ResampleOptions() {}
+    ResampleOptions(ResampleFilter filter_, bool gamma_correct_ = false, bool premultiply_alpha_ = false) {
+        filter = filter_;
+        gamma_correct = gamma_correct_;
+        premultiply_alpha = premultiply_alpha_;
+    }
+};
+
+inline float _srgb_to_linear(float v) {
+    return v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f);
+}
+inline float _linear_to_srgb(float v) {
+    return v <= 0.0031308f ? v * 12.92f : 1.055f * powf(v, 1.0f / 2.4f) - 0.055f;
+}
+
+// sRGB byte to linear float in [0, 1]
+inline const float* _srgb_to_linear_lut() {
+    static std::vector<float> lut = []() {
+        std::vector<float> values = std::vector<float>(256);
+        for(int i = 0; i < 256; i++) {
+            values[i] = _srgb_to_linear(i / 255.0f);
+        }
+        return values;
+    }();
+    return lut.data();
+}
+
+const int _LINEAR_TO_SRGB_LUT_SIZE = 16384;
+
+// Linear float in [0, 1], scaled to [0, _LINEAR_TO_SRGB_LUT_SIZE - 1], to sRGB byte
+inline const unsigned char* _linear_to_srgb_lut() {
+    static std::vector<unsigned char> lut = []() {
+        std::vector<unsigned char> values = std::vector<unsigned char>(_LINEAR_TO_SRGB_LUT_SIZE);
+        for(int i = 0; i < _LINEAR_TO_SRGB_LUT_SIZE; i++) {
+            values[i] = (unsigned char)lrintf(_linear_to_srgb(i / float(_LINEAR_TO_SRGB_LUT_SIZE - 1)) * 255.0f);
+        }
+        return values;
+    }();
+    return lut.data();
+}
+
+inline float _resample_filter_support(ResampleFilter filter) {
+    switch(filter) {
+        case RESAMPLE_BOX: return 0.5f;
+        case RESAMPLE_BILINEAR: return 1.0f;
+        case RESAMPLE_LANCZOS3: return 3.0f;
+    }
+    return 1.0f;
+}
+
+inline double _resample_filter_weight(ResampleFilter filter, double x) {
+    x = std::abs(x);
+    switch(filter) {
+        case RESAMPLE_BOX:
+            return x < 0.5 ? 1.0 : (x == 0.5 ? 0.5 : 0.0);
+        case RESAMPLE_BILINEAR:
+            return x < 1.0 ? 1.0 - x : 0.0;
+        case RESAMPLE_LANCZOS3: {
+            if(x < 1e-8) {
+                return 1.0;
+            }
+            if(x >= 3.0) {
+                return 0.0;
+            }
+            double pi_x = vicmil::PI * x;
+            return 3.0 * sin(pi_x) * sin(pi_x / 3.0) / (pi_x * pi_x);
+        }
+    }
+    return 0.0;
+}
+
+/**
+ * Which input pixels, and with what weights, make up each output pixel along one axis
+*/
+struct _ResampleContributions {
+    std::vector<int> first; // The first input pixel for each output pixel
+    std::vector<int> count; // How many input pixels for each output pixel
+    std::vector<float> weights; // max_count weights for each output pixel
+    int max_count = 0;
+
+    _ResampleContributions(int in_size, int out_size, ResampleFilter filter) {
+        double scale = (double)out_size / in_size;
+        double filter_scale = scale < 1.0 ? 1.0 / scale : 1.0; // Widen the filter when scaling down, to cover all input pixels
+        double radius = _resample_filter_support(filter) * filter_scale;
+        max_count = (int)floor(radius * 2.0) + 1;
+        first.resize(out_size);
+        count.resize(out_size);
+        weights.resize((size_t)out_size * max_count);
+        for(int o = 0; o < out_size; o++) {
+            double center = (o + 0.5) / scale - 0.5; // The output pixel center in input pixel coordinates
+            // Pixels further away than the radius have no weight
+            int begin = std::max((int)ceil(center - radius), 0);
+            int end = std::min((int)floor(center + radius) + 1, in_size);
+            end = std::min(end, begin + max_count);
+            double total = 0.0;
+            for(int i = begin; i < end; i++) {
+                total += _resample_filter_weight(filter, (i - center) / filter_scale);
+            }
+            if(total == 0.0) {
+                // Can happen with the box filter when the center lands exactly between two pixels at the edge
+                begin = std::min(std::max((int)floor(center + 0.5), 0), in_size - 1);
+                end = begin + 1;
+            }
+            first[o] = begin;
+            count[o] = end - begin;
+            for(int i = begin; i < end; i++) {
+                double weight = total == 0.0 ? 1.0 : _resample_filter_weight(filter, (i - center) / filter_scale) / total;
+                weights[(size_t)o * max_count + (i - begin)] = (float)weight;
+            }
+        }
+    }
+};
+
+// Convert a row of bytes to floats in [0, 1], optionally to linear light and premultiplied by alpha
+inline void _resample_decode_row(const ColorRGBA_UChar* src, int pixel_count, float* out, const ResampleOptions& options) {
+    const float* color_lut = options.gamma_correct ? _srgb_to_linear_lut() : nullptr;
+    for(int x = 0; x < pixel_count; x++) {
+        float alpha = src[x].a * (1.0f / 255.0f);
+        float color_scale = options.premultiply_alpha ? alpha : 1.0f;
+        if(color_lut) {
+            out[x * 4 + 0] = color_lut[src[x].r] * color_scale;
+            out[x * 4 + 1] = color_lut[src[x].g] * color_scale;
+            out[x * 4 + 2] = color_lut[src[x].b] * color_scale;
+        }
+        else {
+            out[x * 4 + 0] = src[x].r * (1.0f / 255.0f) * color_scale;
+            out[x * 4 + 1] = src[x].g * (1.0f / 255.0f) * color_scale;
+            out[x * 4 + 2] = src[x].b * (1.0f / 255.0f) * color_scale;
+        }
+        out[x * 4 + 3] = alpha;
+    }
+}
+
+// The inverse of _resample_decode_row, the floats are modified
+inline void _resample_encode_row(float* row, int pixel_count, ColorRGBA_UChar* dst, const ResampleOptions& options) {
+    if(options.premultiply_alpha) {
+        for(int x = 0; x < pixel_count; x++) {
+            float alpha = row[x * 4 + 3];
+            float inverse_alpha = alpha > 1e-6f ? 1.0f / alpha : 0.0f;
+            row[x * 4 + 0] *= inverse_alpha;
+            row[x * 4 + 1] *= inverse_alpha;
+            row[x * 4 + 2] *= inverse_alpha;
+        }
+    }
+    int x = 0;
+    if(options.gamma_correct) {
+        const unsigned char* color_lut = _linear_to_srgb_lut();
+        const float lut_scale = _LINEAR_TO_SRGB_LUT_SIZE - 1;
+        for(; x < pixel_count; x++) {
+            unsigned char channels[4];
+            for(int c = 0; c < 3; c++) {
+                float v = std::min(std::max(row[x * 4 + c], 0.0f), 1.0f);
+                channels[c] = color_lut[(int)(v * lut_scale + 0.5f)];
+            }
+            channels[3] = (unsigned char)lrintf(std::min(std::max(row[x * 4 + 3], 0.0f), 1.0f) * 255.0f);
+            dst[x] = ColorRGBA_UChar(channels[0], channels[1], channels[2], channels[3]);
+        }
+        return;
+    }
+    #if defined(__SSE2__)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(255.0f);
+    for(; x + 4 <= pixel_count; x += 4) {
+        __m128i values[4];
+        for(int i = 0; i < 4; i++) {
+            __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(row + (x + i) * 4), zero), one);
+            values[i] = _mm_cvtps_epi32(_mm_mul_ps(v, scale)); // Rounds to nearest even, like lrintf
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(values[0], values[1]), _mm_packs_epi32(values[2], values[3]));
+        _mm_storeu_si128((__m128i*)(dst + x), packed);
+    }
+    #endif
+    for(; x < pixel_count; x++) {
+        unsigned char channels[4];
+        for(int c = 0; c < 4; c++) {
+            channels[c] = (unsigned char)lrintf(std::min(std::max(row[x * 4 + c], 0.0f), 1.0f) * 255.0f);
+        }
+        dst[x] = ColorRGBA_UChar(channels[0], channels[1], channels[2], channels[3]);
+    }
+}
+
+// Filter one row of float pixels along x
+inline void _resample_row_x(const float* in, float* out, const _ResampleContributions& contributions) {
+    int out_size = contributions.first.size();
+    for(int o = 0; o < out_size; o++) {
+        const float* in_pixel = in + (size_t)contributions.first[o] * 4;
+        const float* weights = &contributions.weights[(size_t)o * contributions.max_count];
+        int count = contributions.count[o];
+        #if defined(__SSE2__)
+        __m128 sum = _mm_setzero_ps();
+        for(int i = 0; i < count; i++) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[i]), _mm_loadu_ps(in_pixel + i * 4)));
+        }
+        _mm_storeu_ps(out + (size_t)o * 4, sum);
+        #else
+        float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        for(int i = 0; i < count; i++) {
+            for(int c = 0; c < 4; c++) {
+                sum[c] += weights[i] * in_pixel[i * 4 + c];
+            }
+        }
+        for(int c = 0; c < 4; c++) {
+            out[(size_t)o * 4 + c] = sum[c];
+        }
+        #endif
+    }
+}
+
+// out += in * weight, for float_count floats
+inline void _resample_add_scaled(float* out, const float* in, float weight, size_t float_count) {
+    size_t i = 0;
+    #if defined(__SSE2__)
+    __m128 weight_vec = _mm_set1_ps(weight);
+    for(; i + 4 <= float_count; i += 4) {
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(weight_vec, _mm_loadu_ps(in + i))));
+    }
+    #endif
+    for(; i < float_count; i++) {
+        out[i] += in[i] * weight;
+    }
+}
+
+/**
+ * Scale src to the size of dst
+ * Works on views, so rectangles inside images(e.g. atlas entries) can be scaled without copying them out first
+*/
+void resample(ConstImageViewRGBA src, ImageViewRGBA dst, ResampleOptions options = ResampleOptions()) {
+    if(src.empty() || dst.empty()) {
+        return;
+    }
+    _ResampleContributions contributions_x = _ResampleContributions(src.w, dst.w, options.filter);
+    _ResampleContributions contributions_y = _ResampleContributions(src.h, dst.h, options.filter);
+    const size_t row_floats = (size_t)dst.w * 4;
+    vicmil::parallel_for(0, dst.h, [&](size_t y_begin, size_t y_end) {
+        // The input rows needed by this band of output rows
+        int in_begin = contributions_y.first[y_begin];
+        int in_end = in_begin;
+        for(size_t y = y_begin; y < y_end; y++) {
+            in_end = std::max(in_end, contributions_y.first[y] + contributions_y.count[y]);
+        }
+        std::vector<float> input_row = std::vector<float>((size_t)src.w * 4);
+        std::vector<float> rows = std::vector<float>((in_end - in_begin) * row_floats);
+        for(int in_y = in_begin; in_y < in_end; in_y++) {
+            _resample_decode_row(src.get_row(in_y), src.w, input_row.data(), options);
+            _resample_row_x(input_row.data(), &rows[(in_y - in_begin) * row_floats], contributions_x);
+        }
+        std::vector<float> output_row = std::vector<float>(row_floats);
+        for(size_t y = y_begin; y < y_end; y++) {
+            std::fill(output_row.begin(), output_row.end(), 0.0f);
+            const float* weights = &contributions_y.weights[y * contributions_y.max_count];
+            for(int i = 0; i < contributions_y.count[y]; i++) {
+                const float* row = &rows[(contributions_y.first[y] + i - in_begin) * row_floats];
+                _resample_add_scaled(output_row.data(), row, weights[i], row_floats);
+            }
+            _resample_encode_row(output_row.data(), dst.w, dst.get_row(y), options);
+        }
+    }, 32);
+}
+
+// Get a scaled copy of an image
+ImageRGBA_UChar resize_image(ConstImageViewRGBA src, int new_width, int new_height, ResampleOptions options = ResampleOptions()) {
+    ImageRGBA_UChar new_image = ImageRGBA_UChar();
+    new_image.resize(new_width, new_height);
+    resample(src, new_image, options);
+    return new_image;
+}
+
+/**
+ * All the mip levels of an image in one allocation, level 0 is the full image and each level is half the size of the previous
+*/
+struct MipChain {
+    std::vector<ColorRGBA_UChar> pixels; // All the levels after each other
+    std::vector<size_t> level_offsets; // Where each level starts in pixels
+    std::vector<int> level_widths;
+    std::vector<int> level_heights;
+
+    int level_count() const {
+        return level_offsets.size();
+    }
+    ImageViewRGBA level(int i) {
+        return ImageViewRGBA(&pixels[level_offsets[i]], level_widths[i], level_heights[i]);
+    }
+    ConstImageViewRGBA level(int i) const {
+        return ConstImageViewRGBA(&pixels[level_offsets[i]], level_widths[i], level_heights[i]);
+    }
+};
+
+/**
+ * Build the mip chain down to 1x1, each level is filtered from the level before it
+ * @arg max_levels: stop after this many levels(including level 0), -1 for all of them
+*/
+MipChain build_mip_chain(ConstImageViewRGBA src, ResampleOptions options = ResampleOptions(RESAMPLE_BOX), int max_levels = -1) {
+    MipChain chain = MipChain();
+    if(src.empty()) {
+        return chain;
+    }
+    // Find the size of all the levels first, so everything fits in one allocation
+    size_t total_pixels = 0;
+    int w = src.w;
+    int h = src.h;
+    while(true) {
+        chain.level_offsets.push_back(total_pixels);
+        chain.level_widths.push_back(w);
+        chain.level_heights.push_back(h);
+        total_pixels += (size_t)w * h;
+        if((w == 1 && h == 1) || chain.level_count() == max_levels) {
+            break;
+        }
+        w = std::max(w / 2, 1);
+        h = std::max(h / 2, 1);
+    }
+    chain.pixels.resize(total_pixels);
+    blit(src, chain.level(0), 0, 0);
+    for(int i = 1; i < chain.level_count(); i++) {
+        resample(chain.level(i - 1), chain.level(i), options);
+    }
+    return chain;
+}
+
+/**
+ * Measure how fast images are scaled, in megapixels of input per second
+*/
+double benchmark_resample_mpixels_per_s(ResampleOptions options, int src_w = 2048, int src_h = 2048, int dst_w = 1024, int dst_h = 1024, int iterations = 5) {
+    ImageRGBA_UChar src = ImageRGBA_UChar();
+    src.resize(src_w, src_h);
+    for(size_t i = 0; i < src.pixels.size(); i++) {
+        src.pixels[i] = ColorRGBA_UChar(i & 255, (i >> 8) & 255, (i * 7) & 255, 255);
+    }
+    ImageRGBA_UChar dst = ImageRGBA_UChar();
+    dst.resize(dst_w, dst_h);
+    double time_s = vicmil::time_function_s([&]() {
+        resample(src, dst, options);
+    }, iterations);
+    return (double(src_w) * src_h) / time_s / 1000000.0;
+}
+
+void TEST_resample() {
+    ImageRGBA_UChar src = ImageRGBA_UChar();
+    src.resize(37, 29);
+    PCG32 random = PCG32(34);
+    for(ColorRGBA_UChar& pixel : src.pixels) {
+        pixel = ColorRGBA_UChar(random.next_bounded(256), random.next_bounded(256), random.next_bounded(256), 64 + random.next_bounded(192));
+    }
+    // Compare the banded SIMD path with a direct scalar sum over the same contributions, scaling down and up
+    const ResampleFilter filters[] = {RESAMPLE_BOX, RESAMPLE_BILINEAR, RESAMPLE_LANCZOS3};
+    const int sizes[][2] = {{17, 11}, {53, 41}};
+    for(ResampleFilter filter : filters) {
+        for(int option_index = 0; option_index < 3; option_index++) {
+            ResampleOptions options = ResampleOptions(filter, option_index == 1, option_index == 2);
+            std::vector<float> decoded = std::vector<float>(src.pixels.size() * 4);
+            for(int y = 0; y < src.h; y++) {
+                _resample_decode_row(src.view().get_row(y), src.w, &decoded[(size_t)y * src.w * 4], options);
+            }
+            for(int s = 0; s < 2; s++) {
+                ImageRGBA_UChar result = resize_image(src, sizes[s][0], sizes[s][1], options);
+                _ResampleContributions contributions_x = _ResampleContributions(src.w, result.w, filter);
+                _ResampleContributions contributions_y = _ResampleContributions(src.h, result.h, filter);
+                for(int y = 0; y < result.h; y++) {
+                    for(int x = 0; x < result.w; x++) {
+                        float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+                        for(int j = 0; j < contributions_y.count[y]; j++) {
+                            for(int i = 0; i < contributions_x.count[x]; i++) {
+                                float weight = contributions_y.weights[(size_t)y * contributions_y.max_count + j] * 
+                                               contributions_x.weights[(size_t)x * contributions_x.max_count + i];
+                                size_t in_index = ((size_t)(contributions_y.first[y] + j) * src.w + contributions_x.first[x] + i) * 4;
+                                for(int c = 0; c < 4; c++) {
+                                    sum[c] += weight * decoded[in_index + c];
+                                }
+                            }
+                        }
+                        ColorRGBA_UChar expected;
+                        _resample_encode_row(sum, 1, &expected, options); // A single pixel takes the scalar path
+                        ColorRGBA_UChar actual = *result.get_pixel(x, y);
+                        Assert(std::abs(actual.r - expected.r) <= 1 && std::abs(actual.g - expected.g) <= 1 && 
+                               std::abs(actual.b - expected.b) <= 1 && std::abs(actual.a - expected.a) <= 1);
+                    }
+                }
+            }
+        }
+    }
+
+    // Each mip level is the previous one scaled to half its size, all in one pixel vector
+    MipChain chain = build_mip_chain(src);
+    const int level_sizes[][2] = {{37, 29}, {18, 14}, {9, 7}, {4, 3}, {2, 1}, {1, 1}};
+    Assert(chain.level_count() == 6);
+    size_t offset = 0;
+    for(int i = 0; i < chain.level_count(); i++) {
+        Assert(chain.level_widths[i] == level_sizes[i][0] && chain.level_heights[i] == level_sizes[i][1]);
+        Assert(chain.level_offsets[i] == offset);
+        offset += (size_t)level_sizes[i][0] * level_sizes[i][1];
+        ImageRGBA_UChar expected = i == 0 ? src : resize_image(chain.level(i - 1), level_sizes[i][0], level_sizes[i][1], ResampleOptions(RESAMPLE_BOX));
+        Assert(std::memcmp(chain.level(i).get_row(0), expected.pixels.data(), expected.pixels.size() * sizeof(ColorRGBA_UChar)) == 0);
+    }
+    Assert(chain.pixels.size() == offset);
+}
+AddTest(TEST_resample);
+
+// ============================================================
+//                   Pixel format conversion
+// ============================================================
+
+/**
+ * Convert pixels between formats, e.g. after stb loads, for glReadPixels results or before sending images over a socket
+ * The common conversions to and from RGBA8 have their own SIMD kernels,
+ *  everything else(and sRGB/alpha handling) goes through a row of RGBA floats in [0, 1]
+*/
+enum PixelFormat {
+    PIXEL_FORMAT_RGBA8,
+    PIXEL_FORMAT_BGRA8,
+    PIXEL_FORMAT_RGB8,
+    PIXEL_FORMAT_GRAY8,      // Also used for single channel images such as ImageA8
+    PIXEL_FORMAT_RGBA_FLOAT,
+    PIXEL_FORMAT_GRAY_FLOAT, // e.g. Image_float
+    PIXEL_FORMAT_RGBA_HALF,
+    PIXEL_FORMAT_GRAY_HALF   // e.g. Image_half
+};
+
+inline int get_pixel_format_channels(PixelFormat format) {
+    switch(format) {
+        case PIXEL_FORMAT_RGB8: return 3;
+        case PIXEL_FORMAT_GRAY8:
+        case PIXEL_FORMAT_GRAY_FLOAT:
+        case PIXEL_FORMAT_GRAY_HALF: return 1;
+        default: return 4;
+    }
+}
+
+// Bytes per pixel
+inline int get_pixel_format_size(PixelFormat format) {
+    switch(format) {
+        case PIXEL_FORMAT_RGBA_FLOAT:
+        case PIXEL_FORMAT_GRAY_FLOAT: return get_pixel_format_channels(format) * 4;
+        case PIXEL_FORMAT_RGBA_HALF:
+        case PIXEL_FORMAT_GRAY_HALF: return get_pixel_format_channels(format) * 2;
+        default: return get_pixel_format_channels(format);
+    }
+}
+
+inline bool _is_8bit_pixel_format(PixelFormat format) {
+    return get_pixel_format_size(format) == get_pixel_format_channels(format);
+}
+
+/**
+ * A non-owning view of pixels in any PixelFormat, where each row starts row_bytes after the previous one
+ * Can be created from the image types and views, or from raw buffers such as socket data
+ * Note! Views created from const images may only be used as the source of a conversion
+*/
+struct PixelView {
+    unsigned char* data = nullptr;
+    PixelFormat format = PIXEL_FORMAT_RGBA8;
+    int w = 0;
+    int h = 0;
+    size_t row_bytes = 0;
+    PixelView() {}
+    // If row_bytes is 0 the rows are assumed to be tightly packed
+    PixelView(const void* data_, PixelFormat format_, int w_, int h_, size_t row_bytes_ = 0) {
+        data = (unsigned char*)data_;
+        format = format_;
+        w = w_;
+        h = h_;
+        row_bytes = row_bytes_ != 0 ? row_bytes_ : (size_t)w_ * get_pixel_format_size(format_);
+    }
+    PixelView(ImageViewRGBA view) : PixelView(view.data, PIXEL_FORMAT_RGBA8, view.w, view.h, (size_t)view.stride * 4) {}
+    PixelView(ConstImageViewRGBA view) : PixelView(view.data, PIXEL_FORMAT_RGBA8, view.w, view.h, (size_t)view.stride * 4) {}
+    PixelView(ImageViewA8 view) : PixelView(view.data, PIXEL_FORMAT_GRAY8, view.w, view.h, view.stride) {}
+    PixelView(ConstImageViewA8 view) : PixelView(view.data, PIXEL_FORMAT_GRAY8, view.w, view.h, view.stride) {}
+    PixelView(const ImageRGBA_UChar& image) : PixelView(image.view()) {}
+    PixelView(const ImageA8& image) : PixelView(image.view()) {}
+    PixelView(const Image_float& image) : PixelView(image.pixels.data(), PIXEL_FORMAT_GRAY_FLOAT, image.w, image.h) {}
+    PixelView(const Image_half& image) : PixelView(image.pixels.data(), PIXEL_FORMAT_GRAY_HALF, image.w, image.h) {}
+    unsigned char* get_row(int y) const {
+        return data + (size_t)y * row_bytes;
+    }
+    bool empty() const {
+        return w <= 0 || h <= 0;
+    }
+};
+
+struct PixelConvertOptions {
+    bool srgb_to_linear = false;      // The source colors are sRGB, convert them to linear light(alpha is left as it is)
+    bool linear_to_srgb = false;      // Store the colors as sRGB in the destination
+    bool premultiply_alpha = false;   // Multiply the colors by alpha
+    bool unpremultiply_alpha = false; // Divide the colors by alpha, pixels with zero alpha get black
+    bool flip_vertical = false;       // Write the rows in reverse order, e.g. for glReadPixels results
+    bool multithreaded = true;
+    bool _needs_float_row() const {
+        return srgb_to_linear || linear_to_srgb || premultiply_alpha || unpremultiply_alpha;
+    }
+};
+
+// Swap the red and blue channels, RGBA8 <-> BGRA8. src and dst may be the same
+inline void _swap_red_blue(const unsigned char* src, unsigned char* dst, size_t count) {
+    size_t i = 0;
+    #if defined(__AVX2__)
+    const __m256i green_alpha_8 = _mm256_set1_epi32(0xFF00FF00);
+    const __m256i low_byte_8 = _mm256_set1_epi32(0xFF);
+    for(; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i swapped = _mm256_or_si256(_mm256_and_si256(v, green_alpha_8), 
+                          _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(v, 16), low_byte_8), _mm256_slli_epi32(_mm256_and_si256(v, low_byte_8), 16)));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), swapped);
+    }
+    #endif
+    #if defined(__SSE2__)
+    const __m128i green_alpha_4 = _mm_set1_epi32(0xFF00FF00);
+    const __m128i low_byte_4 = _mm_set1_epi32(0xFF);
+    for(; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i swapped = _mm_or_si128(_mm_and_si128(v, green_alpha_4), 
+                          _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low_byte_4), _mm_slli_epi32(_mm_and_si128(v, low_byte_4), 16)));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), swapped);
+    }
+    #endif
+    for(; i < count; i++) {
+        unsigned char r = src[i * 4];
+        unsigned char b = src[i * 4 + 2];
+        dst[i * 4] = b;
+        dst[i * 4 + 1] = src[i * 4 + 1];
+        dst[i * 4 + 2] = r;
+        dst[i * 4 + 3] = src[i * 4 + 3];
+    }
+}
+
+inline void _rgba8_to_rgb8(const unsigned char* src, unsigned char* dst, size_t count) {
+    size_t i = 0;
+    #if defined(__SSSE3__)
+    // 16 bytes are stored for every 4 pixels, so stop while there is room for the extra 4 bytes
+    const __m128i drop_alpha = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    for(; i + 6 <= count; i += 4) {
+        _mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i * 4)), drop_alpha));
+    }
+    #endif
+    for(; i < count; i++) {
+        dst[i * 3] = src[i * 4];
+        dst[i * 3 + 1] = src[i * 4 + 1];
+        dst[i * 3 + 2] = src[i * 4 + 2];
+    }
+}
+
+inline void _rgb8_to_rgba8(const unsigned char* src, unsigned char* dst, size_t count) {
+    size_t i = 0;
+    #if defined(__SSSE3__)
+    // 16 bytes are loaded for every 4 pixels, so stop while there is room for the extra 4 bytes
+    const __m128i add_alpha = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32(0xFF000000);
+    for(; i + 6 <= count; i += 4) {
+        __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i * 3)), add_alpha);
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(v, alpha));
+    }
+    #endif
+    for(; i < count; i++) {
+        dst[i * 4] = src[i * 3];
+        dst[i * 4 + 1] = src[i * 3 + 1];
+        dst[i * 4 + 2] = src[i * 3 + 2];
+        dst[i * 4 + 3] = 255;
+    }
+}
+
+// Luma with the Rec. 601 weights, in 8 bit fixed point so that white stays 255
+inline void _rgba8_to_gray8(const unsigned char* src, unsigned char* dst, size_t count) {
+    size_t i = 0;
+    #if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights = _mm_setr_epi16(77, 150, 29, 0, 77, 150, 29, 0);
+    const __m128i rounding = _mm_set1_epi32(128);
+    for(; i + 8 <= count; i += 8) {
+        __m128i sums[2];
+        for(int half = 0; half < 2; half++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + (i + half * 4) * 4));
+            // Each pixel gives two partial sums(r*77 + g*150 and b*29), which are added below
+            __m128i low = _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weights);
+            __m128i high = _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), weights);
+            __m128i even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i odd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(3, 1, 3, 1)));
+            sums[half] = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(even, odd), rounding), 8);
+        }
+        __m128i gray = _mm_packus_epi16(_mm_packs_epi32(sums[0], sums[1]), zero);
+        _mm_storel_epi64((__m128i*)(dst + i), gray);
+    }
+    #endif
+    for(; i < count; i++) {
+        dst[i] = (src[i * 4] * 77 + src[i * 4 + 1] * 150 + src[i * 4 + 2] * 29 + 128) >> 8;
+    }
+}
+
+inline void _gray8_to_rgba8(const unsigned char* src, unsigned char* dst, size_t count) {
+    size_t i = 0;
+    #if defined(__SSE2__)
+    const __m128i alpha = _mm_set1_epi32(0xFF000000);
+    for(; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i pairs_low = _mm_unpacklo_epi8(v, v);
+        __m128i pairs_high = _mm_unpackhi_epi8(v, v);
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(_mm_unpacklo_epi16(pairs_low, pairs_low), alpha));
+        _mm_storeu_si128((__m128i*)(dst + i * 4 + 16), _mm_or_si128(_mm_unpackhi_epi16(pairs_low, pairs_low), alpha));
+        _mm_storeu_si128((__m128i*)(dst + i * 4 + 32), _mm_or_si128(_mm_unpacklo_epi16(pairs_high, pairs_high), alpha));
+        _mm_storeu_si128((__m128i*)(dst + i * 4 + 48), _mm_or_si128(_mm_unpackhi_epi16(pairs_high, pairs_high), alpha));
+    }
+    #endif
+    for(; i < count; i++) {
+        dst[i * 4] = dst[i * 4 + 1] = dst[i * 4 + 2] = src[i];
+        dst[i * 4 + 3] = 255;
+    }
+}
+
+// Bytes to floats in [0, 1], count is the number of values
+inline void _bytes_to_floats(const unsigned char* src, float* dst, size_t count) {
+    size_t i = 0;
+    #if defined(__AVX2__)
+    const __m256 scale_8 = _mm256_set1_ps(1.0f / 255.0f);
+    for(; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale_8));
+    }
+    #endif
+    #if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 scale_4 = _mm_set1_ps(1.0f / 255.0f);
+    for(; i + 4 <= count; i += 4) {
+        int packed;
+        std::memcpy(&packed, src + i, 4);
+        __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale_4));
+    }
+    #endif
+    for(; i < count; i++) {
+        dst[i] = src[i] * (1.0f / 255.0f);
+    }
+}
+
+// Floats in [0, 1] to bytes, rounded to nearest and clamped
+inline void _floats_to_bytes(const float* src, unsigned char* dst, size_t count) {
+    size_t i = 0;
+    #if defined(__AVX2__)
+    const __m256 scale_8 = _mm256_set1_ps(255.0f);
+    for(; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + i), scale_8));
+        __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(words, words));
+    }
+    #endif
+    #if defined(__SSE2__)
+    const __m128 scale_4 = _mm_set1_ps(255.0f);
+    for(; i + 4 <= count; i += 4) {
+        __m128i v = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i), scale_4));
+        __m128i words = _mm_packs_epi32(v, v);
+        int packed = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+        std::memcpy(dst + i, &packed, 4);
+    }
+    #endif
+    for(; i < count; i++) {
+        float v = std::min(std::max(src[i] * 255.0f, 0.0f), 255.0f);
+        dst[i] = (unsigned char)lrintf(v);
+    }
+}
+
+// RGBA8 to RGBA floats, with the colors converted from sRGB to linear light
+inline void _rgba8_to_floats_srgb(const unsigned char* src, float* dst, size_t count) {
+    const float* lut = _srgb_to_linear_lut();
+    for(size_t i = 0; i < count; i++) {
+        dst[i * 4] = lut[src[i * 4]];
+        dst[i * 4 + 1] = lut[src[i * 4 + 1]];
+        dst[i * 4 + 2] = lut[src[i * 4 + 2]];
+        dst[i * 4 + 3] = src[i * 4 + 3] * (1.0f / 255.0f);
+    }
+}
+
+// RGBA floats in linear light to RGBA8, with the colors stored as sRGB
+inline void _floats_to_rgba8_srgb(const float* src, unsigned char* dst, size_t count) {
+    const unsigned char* lut = _linear_to_srgb_lut();
+    const float lut_scale = _LINEAR_TO_SRGB_LUT_SIZE - 1;
+    for(size_t i = 0; i < count; i++) {
+        for(int c = 0; c < 3; c++) {
+            float v = std::min(std::max(src[i * 4 + c], 0.0f), 1.0f);
+            dst[i * 4 + c] = lut[(int)(v * lut_scale + 0.5f)];
+        }
+        dst[i * 4 + 3] = (unsigned char)lrintf(std::min(std::max(src[i * 4 + 3], 0.0f), 1.0f) * 255.0f);
+    }
+}
+
+inline void _premultiply_rgba_floats(float* values, size_t count) {
+    size_t i = 0;
+    #if defined(__SSE2__)
+    const __m128 color_mask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+    const __m128 alpha_one = _mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f);
+    for(; i < count; i++) {
+        __m128 v = _mm_loadu_ps(values + i * 4);
+        __m128 alpha = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+        __m128 factor = _mm_or_ps(_mm_and_ps(color_mask, alpha), alpha_one);
+        _mm_storeu_ps(values + i * 4, _mm_mul_ps(v, factor));
+    }
+    #endif
+    for(; i < count; i++) {
+        float alpha = values[i * 4 + 3];
+        values[i * 4] *= alpha;
+        values[i * 4 + 1] *= alpha;
+        values[i * 4 + 2] *= alpha;
+    }
+}
+
+inline void _unpremultiply_rgba_floats(float* values, size_t count) {
+    size_t i = 0;
+    #if defined(__SSE2__)
+    const __m128 color_mask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+    const __m128 alpha_one = _mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f);
+    const __m128 zero = _mm_setzero_ps();
+    for(; i < count; i++) {
+        __m128 v = _mm_loadu_ps(values + i * 4);
+        __m128 alpha = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+        __m128 divisor = _mm_or_ps(_mm_and_ps(color_mask, alpha), alpha_one);
+        // Pixels with zero alpha would divide by zero, they get black instead
+        __m128 valid = _mm_cmpgt_ps(alpha, zero);
+        __m128 result = _mm_or_ps(_mm_and_ps(valid, _mm_div_ps(v, divisor)), _mm_andnot_ps(color_mask, v));
+        _mm_storeu_ps(values + i * 4, result);
+    }
+    #endif
+    for(; i < count; i++) {
+        float alpha = values[i * 4 + 3];
+        for(int c = 0; c < 3; c++) {
+            values[i * 4 + c] = alpha > 0.0f ? values[i * 4 + c] / alpha : 0.0f;
+        }
+    }
+}
+
+// Buffers reused between the rows converted by one worker
+struct _PixelConvertBuffers {
+    std::vector<unsigned char> rgba8;
+    std::vector<float> rgba_float;
+    std::vector<float> gray_float;
+};
+
+// Convert between two 8 bit formats, through RGBA8 if neither of them is RGBA8
+inline void _convert_row_8bit(const unsigned char* src, PixelFormat src_format, unsigned char* dst, PixelFormat dst_format, int w, _PixelConvertBuffers& buffers) {
+    if(src_format == dst_format) {
+        if(src != dst) {
+            std::memcpy(dst, src, (size_t)w * get_pixel_format_size(src_format));
+        }
+        return;
+    }
+    const unsigned char* rgba = src;
+    if(src_format != PIXEL_FORMAT_RGBA8) {
+        unsigned char* rgba_out = dst_format == PIXEL_FORMAT_RGBA8 ? dst : buffers.rgba8.data();
+        switch(src_format) {
+            case PIXEL_FORMAT_BGRA8: _swap_red_blue(src, rgba_out, w); break;
+            case PIXEL_FORMAT_RGB8: _rgb8_to_rgba8(src, rgba_out, w); break;
+            case PIXEL_FORMAT_GRAY8: _gray8_to_rgba8(src, rgba_out, w); break;
+            default: break;
+        }
+        rgba = rgba_out;
+    }
+    switch(dst_format) {
+        case PIXEL_FORMAT_BGRA8: _swap_red_blue(rgba, dst, w); break;
+        case PIXEL_FORMAT_RGB8: _rgba8_to_rgb8(rgba, dst, w); break;
+        case PIXEL_FORMAT_GRAY8: _rgba8_to_gray8(rgba, dst, w); break;
+        default: break;
+    }
+}
+
+// Read one row of any format as RGBA floats
+inline void _decode_row_to_floats(const unsigned char* src, PixelFormat format, int w, bool srgb_to_linear, float* out, _PixelConvertBuffers& buffers) {
+    const size_t count = (size_t)w;
+    if(_is_8bit_pixel_format(format)) {
+        const unsigned char* rgba = src;
+        if(format != PIXEL_FORMAT_RGBA8) {
+            _convert_row_8bit(src, format, buffers.rgba8.data(), PIXEL_FORMAT_RGBA8, w, buffers);
+            rgba = buffers.rgba8.data();
+        }
+        if(srgb_to_linear) {
+            _rgba8_to_floats_srgb(rgba, out, count);
+        }
+        else {
+            _bytes_to_floats(rgba, out, count * 4);
+        }
+        return;
+    }
+    const float* gray = nullptr;
+    switch(format) {
+        case PIXEL_FORMAT_RGBA_FLOAT: std::memcpy(out, src, count * 4 * sizeof(float)); break;
+        case PIXEL_FORMAT_RGBA_HALF: _halves_to_floats((const uint16_t*)src, count * 4, out); break;
+        case PIXEL_FORMAT_GRAY_FLOAT: gray = (const float*)src; break;
+        case PIXEL_FORMAT_GRAY_HALF: 
+            _halves_to_floats((const uint16_t*)src, count, buffers.gray_float.data());
+            gray = buffers.gray_float.data();
+            break;
+        default: break;
+    }
+    if(gray) {
+        for(size_t i = 0; i < count; i++) {
+            out[i * 4] = out[i * 4 + 1] = out[i * 4 + 2] = gray[i];
+            out[i * 4 + 3] = 1.0f;
+        }
+    }
+    if(srgb_to_linear) {
+        for(size_t i = 0; i < count; i++) {
+            for(int c = 0; c < 3; c++) {
+                out[i * 4 + c] = _srgb_to_linear(out[i * 4 + c]);
+            }
+        }
+    }
+}
+
+// Write one row of RGBA floats in any format, values may be modified
+inline void _encode_row_from_floats(float* values, PixelFormat format, int w, bool linear_to_srgb, unsigned char* dst, _PixelConvertBuffers& buffers) {
+    const size_t count = (size_t)w;
+    if(_is_8bit_pixel_format(format)) {
+        unsigned char* rgba = format == PIXEL_FORMAT_RGBA8 ? dst : buffers.rgba8.data();
+        if(linear_to_srgb) {
+            _floats_to_rgba8_srgb(values, rgba, count);
+        }
+        else {
+            _floats_to_bytes(values, rgba, count * 4);
+        }
+        if(format != PIXEL_FORMAT_RGBA8) {
+            _convert_row_8bit(rgba, PIXEL_FORMAT_RGBA8, dst, format, w, buffers);
+        }
+        return;
+    }
+    if(linear_to_srgb) {
+        for(size_t i = 0; i < count; i++) {
+            for(int c = 0; c < 3; c++) {
+                values[i * 4 + c] = _linear_to_srgb(std::max(values[i * 4 + c], 0.0f));
+            }
+        }
+    }
+    float* gray = format == PIXEL_FORMAT_GRAY_FLOAT ? (float*)dst : buffers.gray_float.data();
+    if(format == PIXEL_FORMAT_GRAY_FLOAT || format == PIXEL_FORMAT_GRAY_HALF) {
+        for(size_t i = 0; i < count; i++) {
+            gray[i] = values[i * 4] * 0.299f + values[i * 4 + 1] * 0.587f + values[i * 4 + 2] * 0.114f;
+        }
+    }
+    switch(format) {
+        case PIXEL_FORMAT_RGBA_FLOAT: std::memcpy(dst, values, count * 4 * sizeof(float)); break;
+        case PIXEL_FORMAT_RGBA_HALF: _floats_to_halves(values, count * 4, (uint16_t*)dst); break;
+        case PIXEL_FORMAT_GRAY_HALF: _floats_to_halves(gray, count, (uint16_t*)dst); break;
+        default: break;
+    }
+}
+
+inline void _convert_pixel_row(const unsigned char* src, PixelFormat src_format, unsigned char* dst, PixelFormat dst_format, int w, 
+                               const PixelConvertOptions& options, _PixelConvertBuffers& buffers) {
+    if(!options._needs_float_row()) {
+        // Direct conversions without going through floats
+        if(_is_8bit_pixel_format(src_format) && _is_8bit_pixel_format(dst_format)) {
+            _convert_row_8bit(src, src_format, dst, dst_format, w, buffers);
+            return;
+        }
+        if(src_format == dst_format) {
+            if(src != dst) {
+                std::memcpy(dst, src, (size_t)w * get_pixel_format_size(src_format));
+            }
+            return;
+        }
+        size_t values = (size_t)w * get_pixel_format_channels(src_format);
+        if(get_pixel_format_channels(src_format) == get_pixel_format_channels(dst_format)) {
+            if(src_format == PIXEL_FORMAT_RGBA_FLOAT || src_format == PIXEL_FORMAT_GRAY_FLOAT) {
+                if(dst_format == PIXEL_FORMAT_RGBA_HALF || dst_format == PIXEL_FORMAT_GRAY_HALF) {
+                    _floats_to_halves((const float*)src, values, (uint16_t*)dst);
+                    return;
+                }
+                if(dst_format == PIXEL_FORMAT_RGBA8 || dst_format == PIXEL_FORMAT_GRAY8) {
+                    _floats_to_bytes((const float*)src, dst, values);
+                    return;
+                }
+            }
+            if((src_format == PIXEL_FORMAT_RGBA_HALF || src_format == PIXEL_FORMAT_GRAY_HALF) && 
+               (dst_format == PIXEL_FORMAT_RGBA_FLOAT || dst_format == PIXEL_FORMAT_GRAY_FLOAT)) {
+                _halves_to_floats((const uint16_t*)src, values, (float*)dst);
+                return;
+            }
+            if((src_format == PIXEL_FORMAT_RGBA8 || src_format == PIXEL_FORMAT_GRAY8) && 
+               (dst_format == PIXEL_FORMAT_RGBA_FLOAT || dst_format == PIXEL_FORMAT_GRAY_FLOAT)) {
+                _bytes_to_floats(src, (float*)dst, values);
+                return;
+            }
+        }
+    }
+    float* row = buffers.rgba_float.data();
+    _decode_row_to_floats(src, src_format, w, options.srgb_to_linear, row, buffers);
+    if(options.premultiply_alpha) {
+        _premultiply_rgba_floats(row, w);
+    }
+    if(options.unpremultiply_alpha) {
+        _unpremultiply_rgba_floats(row, w);
+    }
+    _encode_row_from_floats(row, dst_format, w, options.linear_to_srgb, dst, buffers);
+}
+
+/**
+ * Convert the pixels in src to the format of dst, the views must have the same size
+ * Large images are split into bands of rows that are converted on the worker pool
+ * src and dst may only overlap if they are the same pixels in the same format(e.g. to premultiply an image in place),
+ *  and not when flip_vertical is set
+ * 
+ * e.g. convert_pixels(PixelView(bgra_bytes, PIXEL_FORMAT_BGRA8, w, h), image) to load BGRA data into an ImageRGBA_UChar
+*/
+void convert_pixels(const PixelView& src, const PixelView& dst, const PixelConvertOptions& options = PixelConvertOptions()) {
+    Assert(src.w == dst.w && src.h == dst.h);
+    if(src.empty()) {
+        return;
+    }
+    auto convert_rows = [&](size_t y_begin, size_t y_end) {
+        _PixelConvertBuffers buffers = _PixelConvertBuffers();
+        buffers.rgba8.resize((size_t)src.w * 4);
+        buffers.gray_float.resize(src.w);
+        if(options._needs_float_row() || !_is_8bit_pixel_format(src.format) || !_is_8bit_pixel_format(dst.format)) {
+            buffers.rgba_float.resize((size_t)src.w * 4);
+        }
+        for(size_t y = y_begin; y < y_end; y++) {
+            int dst_y = options.flip_vertical ? dst.h - 1 - (int)y : (int)y;
+            _convert_pixel_row(src.get_row(y), src.format, dst.get_row(dst_y), dst.format, src.w, options, buffers);
+        }
+    };
+    const size_t min_pixels_per_band = 64 * 1024;
+    size_t band_rows = std::max((size_t)1, min_pixels_per_band / src.w);
+    if(!options.multithreaded || (size_t)src.h <= band_rows) {
+        convert_rows(0, src.h);
+        return;
+    }
+    vicmil::parallel_for(0, src.h, convert_rows, band_rows);
+}
+
+// Convert in place, e.g. to premultiply the alpha of an image
+void convert_pixels(const PixelView& image, const PixelConvertOptions& options) {
+    convert_pixels(image, image, options);
+}
+
+// Measure how many megapixels per second convert_pixels handles between two formats, e.g. to compare the SIMD paths
+double benchmark_convert_pixels_mpixels_per_s(PixelFormat src_format, PixelFormat dst_format, int w = 1024, int h = 1024, 
+                                               const PixelConvertOptions& options = PixelConvertOptions(), int iterations = 10) {
+    std::vector<unsigned char> src_data = std::vector<unsigned char>((size_t)w * h * get_pixel_format_size(src_format));
+    std::vector<unsigned char> dst_data = std::vector<unsigned char>((size_t)w * h * get_pixel_format_size(dst_format));
+    if(_is_8bit_pixel_format(src_format)) {
+        for(size_t i = 0; i < src_data.size(); i++) {
+            src_data[i] = (unsigned char)(i * 7);
+        }
+    }
+    PixelView src = PixelView(src_data.data(), src_format, w, h);
+    PixelView dst = PixelView(dst_data.data(), dst_format, w, h);
+    double time_s = vicmil::time_function_s([&]() {
+        convert_pixels(src, dst, options);
+    }, iterations);
+    return (double(w) * h) / time_s / 1000000.0;
+}
+
+// ============================================================
+//                      Blurring images
+// ============================================================
+
+/**
+ * Separable filters(convolution, box blur and gaussian blur) for ImageRGBA_UChar and Image_float
+ * The image is split into tiles that are filtered on the worker pool, each tile filters the rows it needs(plus a margin)
+ *  along x into a small float buffer, which is then filtered along y, so the buffers stay in the cache
+ * Tip! Blur images with premultiplied alpha(see convert_pixels) to avoid dark fringes around transparent pixels
+ * Note! src and dst must not overlap, blur a copy to filter an image in place
+*/
+enum BlurEdgeMode {
+    BLUR_EDGE_CLAMP, // Pixels outside the image repeat the closest edge pixel
+    BLUR_EDGE_ZERO   // Pixels outside the image are zero(transparent), e.g. for drop shadows
+};
+
+// Normalized gaussian kernel with 2 * radius + 1 weights, the radius defaults to 3 sigma. A negative sigma is the same as 0
+std::vector<float> get_gaussian_kernel(float sigma, int radius = -1) {
+    sigma = std::max(sigma, 0.0f);
+    if(radius < 0) {
+        radius = (int)std::ceil(sigma * 3.0f);
+    }
+    std::vector<float> kernel = std::vector<float>(2 * radius + 1);
+    double sum = 0;
+    for(int i = -radius; i <= radius; i++) {
+        double weight = sigma > 0 ? std::exp(-(double)i * i / (2.0 * sigma * sigma)) : (i == 0 ? 1.0 : 0.0);
+        kernel[i + radius] = weight;
+        sum += weight;
+    }
+    for(size_t i = 0; i < kernel.size(); i++) {
+        kernel[i] /= sum;
+    }
+    return kernel;
+}
+
+std::vector<float> get_box_kernel(int radius) {
+    return std::vector<float>(2 * radius + 1, 1.0f / (2 * radius + 1));
+}
+
+/**
+ * Radii of three box blurs that together approximate a gaussian blur with sigma
+ * See "Fast Almost-Gaussian Filtering" by Peter Kovesi
+*/
+inline void _gaussian_box_radii(float sigma, int radii[3]) {
+    sigma = std::max(sigma, 0.0f);
+    double ideal_width = std::sqrt(12.0 * sigma * sigma / 3.0 + 1.0);
+    int lower_width = (int)std::floor(ideal_width);
+    if(lower_width % 2 == 0) {
+        lower_width--;
+    }
+    int upper_width = lower_width + 2;
+    double ideal_lower_count = (12.0 * sigma * sigma - 3.0 * lower_width * lower_width - 12.0 * lower_width - 9.0) / (-4.0 * lower_width - 4.0);
+    int lower_count = (int)std::round(ideal_lower_count);
+    for(int i = 0; i < 3; i++) {
+        radii[i] = ((i < lower_count ? lower_width : upper_width) - 1) / 2;
+    }
+}
+
+// out += in * weight
+inline void _row_multiply_add(float* out, const float* in, float weight, size_t count) {
+    size_t i = 0;
+    #if defined(__AVX2__)
+    const __m256 weight_8 = _mm256_set1_ps(weight);
+    for(; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(_mm256_loadu_ps(in + i), weight_8)));
+    }
+    #endif
+    #if defined(__SSE2__)
+    const __m128 weight_4 = _mm_set1_ps(weight);
+    for(; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), weight_4)));
+    }
+    #endif
+    for(; i < count; i++) {
+        out[i] += in[i] * weight;
+    }
+}
+
+// out = in * scale
+inline void _row_scale(const float* in, float scale, float* out, size_t count) {
+    size_t i = 0;
+    #if defined(__AVX2__)
+    const __m256 scale_8 = _mm256_set1_ps(scale);
+    for(; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(in + i), scale_8));
+    }
+    #endif
+    #if defined(__SSE2__)
+    const __m128 scale_4 = _mm_set1_ps(scale);
+    for(; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(in + i), scale_4));
+    }
+    #endif
+    for(; i < count; i++) {
+        out[i] = in[i] * scale;
+    }
+}
+
+// sums += add - subtract
+inline void _row_add_subtract(float* sums, const float* add, const float* subtract, size_t count) {
+    size_t i = 0;
+    #if defined(__AVX2__)
+    for(; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(sums + i, _mm256_add_ps(_mm256_loadu_ps(sums + i), _mm256_sub_ps(_mm256_loadu_ps(add + i), _mm256_loadu_ps(subtract + i))));
+    }
+    #endif
+    #if defined(__SSE2__)
+    for(; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(sums + i, _mm_add_ps(_mm_loadu_ps(sums + i), _mm_sub_ps(_mm_loadu_ps(add + i), _mm_loadu_ps(subtract + i))));
+    }
+    #endif
+    for(; i < count; i++) {
+        sums[i] += add[i] - subtract[i];
+    }
+}
+
+/**
+ * Convolve a row with channels floats per pixel, in has kernel_size - 1 extra pixels of margin
+ * out[i] = sum(kernel[k] * in[i + k * channels])
+*/
+inline void _convolve_row_x(const float* in, int pixel_count, int channels, const float* kernel, int kernel_size, float* out) {
+    size_t count = (size_t)pixel_count * channels;
+    size_t i = 0;
+    #if defined(__AVX2__)
+    for(; i + 8 <= count; i += 8) {
+        __m256 sum = _mm256_setzero_ps();
+        for(int k = 0; k < kernel_size; k++) {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(in + i + k * channels), _mm256_set1_ps(kernel[k])));
+        }
+        _mm256_storeu_ps(out + i, sum);
+    }
+    #endif
+    #if defined(__SSE2__)
+    for(; i + 4 <= count; i += 4) {
+        __m128 sum = _mm_setzero_ps();
+        for(int k = 0; k < kernel_size; k++) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(in + i + k * channels), _mm_set1_ps(kernel[k])));
+        }
+        _mm_storeu_ps(out + i, sum);
+    }
+    #endif
+    for(; i < count; i++) {
+        float sum = 0;
+        for(int k = 0; k < kernel_size; k++) {
+            sum += in[i + k * channels] * kernel[k];
+        }
+        out[i] = sum;
+    }
+}
+
+// Convolve rows of row_floats floats along y, in has kernel_size - 1 extra rows of margin
+inline void _convolve_rows_y(const float* in, int out_rows, size_t row_floats, const float* kernel, int kernel_size, float* out) {
+    for(int y = 0; y < out_rows; y++) {
+        float* out_row = out + y * row_floats;
+        std::fill(out_row, out_row + row_floats, 0.0f);
+        for(int k = 0; k < kernel_size; k++) {
+            _row_multiply_add(out_row, in + (y + k) * row_floats, kernel[k], row_floats);
+        }
+    }
+}
+
+// Box filter a row using a running sum, constant time per pixel regardless of the radius. in has 2 * radius pixels of margin
+inline void _box_filter_row_x(const float* in, int pixel_count, int channels, int radius, float* out) {
+    const int window = 2 * radius + 1;
+    const float inv_window = 1.0f / window;
+    #if defined(__SSE2__)
+    if(channels == 4) {
+        // All 4 channels of a pixel are summed at once
+        __m128 sum = _mm_setzero_ps();
+        for(int k = 0; k < window; k++) {
+            sum = _mm_add_ps(sum, _mm_loadu_ps(in + k * 4));
+        }
+        const __m128 inv_window_4 = _mm_set1_ps(inv_window);
+        for(int x = 0; x < pixel_count; x++) {
+            _mm_storeu_ps(out + x * 4, _mm_mul_ps(sum, inv_window_4));
+            if(x + 1 < pixel_count) {
+                sum = _mm_add_ps(sum, _mm_sub_ps(_mm_loadu_ps(in + (x + window) * 4), _mm_loadu_ps(in + x * 4)));
+            }
+        }
+        return;
+    }
+    #endif
+    for(int c = 0; c < channels; c++) {
+        float sum = 0;
+        for(int k = 0; k < window; k++) {
+            sum += in[k * channels + c];
+        }
+        for(int x = 0; x < pixel_count; x++) {
+            out[x * channels + c] = sum * inv_window;
+            if(x + 1 < pixel_count) {
+                sum += in[(x + window) * channels + c] - in[x * channels + c];
+            }
+        }
+    }
+}
+
+// Box filter rows along y using running sums of whole rows, in has 2 * radius rows of margin
+inline void _box_filter_rows_y(const float* in, int out_rows, size_t row_floats, int radius, float* out, std::vector<float>& sums) {
+    const int window = 2 * radius + 1;
+    sums.assign(row_floats, 0.0f);
+    for(int k = 0; k < window; k++) {
+        _row_multiply_add(sums.data(), in + k * row_floats, 1.0f, row_floats);
+    }
+    for(int y = 0; y < out_rows; y++) {
+        _row_scale(sums.data(), 1.0f / window, out + y * row_floats, row_floats);
+        if(y + 1 < out_rows) {
+            _row_add_subtract(sums.data(), in + (y + window) * row_floats, in + y * row_floats, row_floats);
+        }
+    }
+}
+
+// Filters for the tiles, margin_x/margin_y is how many pixels outside the tile the filter reads
+struct _SeparableFilter {
+    enum Type {CONVOLVE, BOX, GAUSSIAN_BOXES};
+    Type type = CONVOLVE;
+    std::vector<float> kernel_x;
+    std::vector<float> kernel_y;
+    int radii_x[3] = {0, 0, 0}; // The box radii, only the first is used for BOX
+    int radii_y[3] = {0, 0, 0};
+    int box_count = 1;
+    int margin_x = 0;
+    int margin_y = 0;
+
+    static _SeparableFilter convolve(const std::vector<float>& kernel_x, const std::vector<float>& kernel_y) {
+        Assert(kernel_x.size() % 2 == 1 && kernel_y.size() % 2 == 1);
+        _SeparableFilter filter = _SeparableFilter();
+        filter.type = CONVOLVE;
+        filter.kernel_x = kernel_x;
+        filter.kernel_y = kernel_y;
+        filter.margin_x = kernel_x.size() / 2;
+        filter.margin_y = kernel_y.size() / 2;
+        return filter;
+    }
+    static _SeparableFilter box(int radius_x, int radius_y) {
+        _SeparableFilter filter = _SeparableFilter();
+        filter.type = BOX;
+        filter.radii_x[0] = std::max(radius_x, 0);
+        filter.radii_y[0] = std::max(radius_y, 0);
+        filter.margin_x = filter.radii_x[0];
+        filter.margin_y = filter.radii_y[0];
+        return filter;
+    }
+    static _SeparableFilter gaussian_boxes(float sigma) {
+        _SeparableFilter filter = _SeparableFilter();
+        filter.type = GAUSSIAN_BOXES;
+        filter.box_count = 3;
+        _gaussian_box_radii(sigma, filter.radii_x);
+        _gaussian_box_radii(sigma, filter.radii_y);
+        filter.margin_x = filter.radii_x[0] + filter.radii_x[1] + filter.radii_x[2];
+        filter.margin_y = filter.radii_y[0] + filter.radii_y[1] + filter.radii_y[2];
+        return filter;
+    }
+
+    // Per tile buffers, reused between the tiles handled by one worker
+    struct Buffers {
+        std::vector<float> ping; // Between the box passes
+        std::vector<float> pong;
+        std::vector<float> sums; // Running sums for _box_filter_rows_y
+    };
+
+    // Filter a row with margin_x pixels of margin on both sides
+    void filter_x(const float* in, int pixel_count, int channels, float* out, Buffers& buffers) const {
+        if(type == CONVOLVE) {
+            _convolve_row_x(in, pixel_count, channels, kernel_x.data(), kernel_x.size(), out);
+            return;
+        }
+        // Each box pass shrinks the margin by its radius, the passes alternate between two buffers
+        int remaining_margin = margin_x;
+        const float* pass_in = in;
+        for(int i = 0; i < box_count; i++) {
+            remaining_margin -= radii_x[i];
+            float* pass_out = out;
+            if(i + 1 != box_count) {
+                std::vector<float>& buffer = i % 2 == 0 ? buffers.ping : buffers.pong;
+                buffer.resize((size_t)(pixel_count + 2 * remaining_margin) * channels);
+                pass_out = buffer.data();
+            }
+            _box_filter_row_x(pass_in, pixel_count + 2 * remaining_margin, channels, radii_x[i], pass_out);
+            pass_in = pass_out;
+        }
+    }
+    // Filter rows with margin_y rows of margin on both sides
+    void filter_y(const float* in, int out_rows, size_t row_floats, float* out, Buffers& buffers) const {
+        if(type == CONVOLVE) {
+            _convolve_rows_y(in, out_rows, row_floats, kernel_y.data(), kernel_y.size(), out);
+            return;
+        }
+        int remaining_margin = margin_y;
+        const float* pass_in = in;
+        for(int i = 0; i < box_count; i++) {
+            remaining_margin -= radii_y[i];
+            float* pass_out = out;
+            if(i + 1 != box_count) {
+                std::vector<float>& buffer = i % 2 == 0 ? buffers.ping : buffers.pong;
+                buffer.resize((out_rows + 2 * remaining_margin) * row_floats);
+                pass_out = buffer.data();
+            }
+            _box_filter_rows_y(pass_in, out_rows + 2 * remaining_margin, row_floats, radii_y[i], pass_out, buffers.sums);
+            pass_in = pass_out;
+        }
+    }
+};
+
+/**
+ * Run a separable filter over an image in tiles on the worker pool
+ * read_row(y, x, count, out) reads count pixels of row y starting at x(all inside the image) as floats
+ * write_row(y, x, count, in) writes them back
+*/
+template<class READ_ROW, class WRITE_ROW>
+void _filter_separable_tiled(int w, int h, int channels, const _SeparableFilter& filter, BlurEdgeMode edge, READ_ROW read_row, WRITE_ROW write_row) {
+    if(w <= 0 || h <= 0) {
+        return;
+    }
+    const int tile_w = channels == 1 ? 1024 : 256;
+    const int tile_h = std::max(64, 2 * filter.margin_y);
+    const int tiles_x = (w + tile_w - 1) / tile_w;
+    const int tiles_y = (h + tile_h - 1) / tile_h;
+    vicmil::parallel_for(0, (size_t)tiles_x * tiles_y, [&](size_t tile_begin, size_t tile_end) {
+        _SeparableFilter::Buffers buffers = _SeparableFilter::Buffers();
+        std::vector<float> padded_row;
+        std::vector<float> rows_x;
+        std::vector<float> rows_out;
+        for(size_t tile = tile_begin; tile < tile_end; tile++) {
+            const int x0 = (tile % tiles_x) * tile_w;
+            const int y0 = (tile / tiles_x) * tile_h;
+            const int tw = std::min(tile_w, w - x0);
+            const int th = std::min(tile_h, h - y0);
+            const size_t row_floats = (size_t)tw * channels;
+            const int rows_in = th + 2 * filter.margin_y;
+            padded_row.resize((size_t)(tw + 2 * filter.margin_x) * channels);
+            rows_x.resize(rows_in * row_floats);
+            rows_out.resize(th * row_floats);
+
+            // Filter along x, including the rows above and below the tile that filter_y needs
+            for(int j = 0; j < rows_in; j++) {
+                int y = y0 - filter.margin_y + j;
+                float* row_x = &rows_x[j * row_floats];
+                if(y < 0 || y >= h) {
+                    if(edge == BLUR_EDGE_ZERO) {
+                        std::fill(row_x, row_x + row_floats, 0.0f);
+                        continue;
+                    }
+                    y = std::min(std::max(y, 0), h - 1);
+                }
+                // The pixels the filter reads, with the parts outside the image filled according to the edge mode
+                int read_begin = std::max(x0 - filter.margin_x, 0);
+                int read_end = std::min(x0 + tw + filter.margin_x, w);
+                int pad_left = read_begin - (x0 - filter.margin_x);
+                int pad_right = (x0 + tw + filter.margin_x) - read_end;
+                read_row(y, read_begin, read_end - read_begin, &padded_row[(size_t)pad_left * channels]);
+                for(int p = 0; p < pad_left; p++) {
+                    for(int c = 0; c < channels; c++) {
+                        padded_row[p * channels + c] = edge == BLUR_EDGE_ZERO ? 0.0f : padded_row[pad_left * channels + c];
+                    }
+                }
+                size_t right_begin = (size_t)(pad_left + read_end - read_begin) * channels;
+                for(int p = 0; p < pad_right; p++) {
+                    for(int c = 0; c < channels; c++) {
+                        padded_row[right_begin + p * channels + c] = edge == BLUR_EDGE_ZERO ? 0.0f : padded_row[right_begin - channels + c];
+                    }
+                }
+                filter.filter_x(padded_row.data(), tw, channels, row_x, buffers);
+            }
+
+            filter.filter_y(rows_x.data(), th, row_floats, rows_out.data(), buffers);
+            for(int j = 0; j < th; j++) {
+                write_row(y0 + j, x0, tw, &rows_out[j * row_floats]);
+            }
+        }
+    }, 1);
+}
+
+inline void _filter_separable(ConstImageViewRGBA src, ImageViewRGBA dst, const _SeparableFilter& filter, BlurEdgeMode edge) {
+    Assert(src.w == dst.w && src.h == dst.h);
+    _filter_separable_tiled(src.w, src.h, 4, filter, edge, 
+        [&](int y, int x, int count, float* out) {
+            _bytes_to_floats((const unsigned char*)src.get_pixel(x, y), out, (size_t)count * 4);
+        },
+        [&](int y, int x, int count, const float* in) {
+            _floats_to_bytes(in, (unsigned char*)dst.get_pixel(x, y), (size_t)count * 4);
+        });
+}
+
+inline void _filter_separable(const Image_float& src, Image_float& dst, const _SeparableFilter& filter, BlurEdgeMode edge) {
+    dst.resize(src.w, src.h);
+    _filter_separable_tiled(src.w, src.h, 1, filter, edge, 
+        [&](int y, int x, int count, float* out) {
+            std::memcpy(out, &src.pixels[(size_t)y * src.w + x], count * sizeof(float));
+        },
+        [&](int y, int x, int count, const float* in) {
+            std::memcpy(&dst.pixels[(size_t)y * dst.w + x], in, count * sizeof(float));
+        });
+}
+
+/**
+ * Convolve with kernel_x along x and then kernel_y along y, the kernels must have an odd size and are centered
+ * e.g. convolve_separable(src, dst, get_gaussian_kernel(2.0f), get_gaussian_kernel(2.0f))
+*/
+void convolve_separable(ConstImageViewRGBA src, ImageViewRGBA dst, const std::vector<float>& kernel_x, const std::vector<float>& kernel_y, BlurEdgeMode edge = BLUR_EDGE_CLAMP) {
+    _filter_separable(src, dst, _SeparableFilter::convolve(kernel_x, kernel_y), edge);
+}
+void convolve_separable(const Image_float& src, Image_float& dst, const std::vector<float>& kernel_x, const std::vector<float>& kernel_y, BlurEdgeMode edge = BLUR_EDGE_CLAMP) {
+    _filter_separable(src, dst, _SeparableFilter::convolve(kernel_x, kernel_y), edge);
+}
+
+// Average of the (2 * radius_x + 1) * (2 * radius_y + 1) pixels around each pixel, the cost does not depend on the radius
+void box_blur(ConstImageViewRGBA src, ImageViewRGBA dst, int radius_x, int radius_y, BlurEdgeMode edge = BLUR_EDGE_CLAMP) {
+    _filter_separable(src, dst, _SeparableFilter::box(radius_x, radius_y), edge);
+}
+void box_blur(const Image_float& src, Image_float& dst, int radius_x, int radius_y, BlurEdgeMode edge = BLUR_EDGE_CLAMP) {
+    _filter_separable(src, dst, _SeparableFilter::box(radius_x, radius_y), edge);
+}
+
+/**
+ * Approximate a gaussian blur with three box blurs, the cost does not depend on sigma
+ * Use convolve_separable with get_gaussian_kernel for an exact gaussian
+*/
+void gaussian_blur(ConstImageViewRGBA src, ImageViewRGBA dst, float sigma, BlurEdgeMode edge = BLUR_EDGE_CLAMP) {
+    _filter_separable(src, dst, _SeparableFilter::gaussian_boxes(sigma), edge);
+}
+void gaussian_blur(const Image_float& src, Image_float& dst, float sigma, BlurEdgeMode edge = BLUR_EDGE_CLAMP) {
+    _filter_separable(src, dst, _SeparableFilter::gaussian_boxes(sigma), edge);
+}
+
+// Measure how many megapixels per second gaussian_blur handles, exact is the convolution with a gaussian kernel instead
+double benchmark_blur_mpixels_per_s(float sigma, bool exact = false, int w = 1024, int h = 1024, int iterations = 5) {
+    ImageRGBA_UChar src = ImageRGBA_UChar();
+    src.resize(w, h);
+    for(size_t i = 0; i < src.pixels.size(); i++) {
+        src.pixels[i] = ColorRGBA_UChar(i & 255, (i >> 8) & 255, (i * 7) & 255, 255);
+    }
+    ImageRGBA_UChar dst = ImageRGBA_UChar();
+    dst.resize(w, h);
+    std::vector<float> kernel = get_gaussian_kernel(sigma);
+    double time_s = vicmil::time_function_s([&]() {
+        if(exact) {
+            convolve_separable(src, dst, kernel, kernel);
+        }
+        else {
+            gaussian_blur(src, dst, sigma);
+        }
+    }, iterations);
+    return (double(w) * h) / time_s / 1000000.0;
+}
+
+void TEST_blur() {
+    // Brute force 2d convolution of floats with the edges extended, as the reference
+    auto convolve_reference = [](const std::vector<float>& src, int w, int h, int channels, const std::vector<float>& kernel_x, 
+                                 const std::vector<float>& kernel_y, BlurEdgeMode edge) {
+        std::vector<float> out = std::vector<float>(src.size());
+        int radius_x = kernel_x.size() / 2;
+        int radius_y = kernel_y.size() / 2;
+        for(int y = 0; y < h; y++) {
+            for(int x = 0; x < w; x++) {
+                for(int c = 0; c < channels; c++) {
+                    double sum = 0;
+                    for(int j = -radius_y; j <= radius_y; j++) {
+                        for(int i = -radius_x; i <= radius_x; i++) {
+                            int sx = x + i;
+                            int sy = y + j;
+                            if(sx < 0 || sx >= w || sy < 0 || sy >= h) {
+                                if(edge == BLUR_EDGE_ZERO) {
+                                    continue;
+                                }
+                                sx = std::min(std::max(sx, 0), w - 1);
+                                sy = std::min(std::max(sy, 0), h - 1);
+                            }
+                            sum += (double)kernel_x[i + radius_x] * kernel_y[j + radius_y] * src[((size_t)sy * w + sx) * channels + c];
+                        }
+                    }
+                    out[((size_t)y * w + x) * channels + c] = sum;
+                }
+            }
+        }
+        return out;
+    };
+    auto convolve_kernels = [](const std::vector<float>& a, const std::vector<float>& b) {
+        std::vector<float> out = std::vector<float>(a.size() + b.size() - 1, 0.0f);
+        for(size_t i = 0; i < a.size(); i++) {
+            for(size_t j = 0; j < b.size(); j++) {
+                out[i + j] += a[i] * b[j];
+            }
+        }
+        return out;
+    };
+    // Three box blurs are the same as one convolution with the three box kernels convolved
+    const float sigma = 2.5f;
+    int radii[3];
+    _gaussian_box_radii(sigma, radii);
+    std::vector<float> boxes_kernel = convolve_kernels(convolve_kernels(get_box_kernel(radii[0]), get_box_kernel(radii[1])), get_box_kernel(radii[2]));
+    std::vector<float> gaussian_kernel = get_gaussian_kernel(sigma);
+    std::vector<float> box_kernel_x = get_box_kernel(3);
+    std::vector<float> box_kernel_y = get_box_kernel(1);
+    PCG32 random = PCG32(42);
+
+    // Several tiles along x and y
+    ImageRGBA_UChar src = ImageRGBA_UChar();
+    src.resize(300, 80);
+    std::vector<float> src_floats;
+    for(ColorRGBA_UChar& pixel : src.pixels) {
+        pixel = ColorRGBA_UChar(random.next_bounded(256), random.next_bounded(256), random.next_bounded(256), random.next_bounded(256));
+        const unsigned char channels[4] = {pixel.r, pixel.g, pixel.b, pixel.a};
+        for(int c = 0; c < 4; c++) {
+            src_floats.push_back(channels[c] / 255.0f);
+        }
+    }
+    ImageRGBA_UChar dst = ImageRGBA_UChar();
+    dst.resize(src.w, src.h);
+    for(BlurEdgeMode edge : {BLUR_EDGE_CLAMP, BLUR_EDGE_ZERO}) {
+        for(int method = 0; method < 3; method++) {
+            std::vector<float> expected;
+            if(method == 0) {
+                convolve_separable(src, dst, gaussian_kernel, gaussian_kernel, edge);
+                expected = convolve_reference(src_floats, src.w, src.h, 4, gaussian_kernel, gaussian_kernel, edge);
+            }
+            else if(method == 1) {
+                box_blur(src, dst, 3, 1, edge);
+                expected = convolve_reference(src_floats, src.w, src.h, 4, box_kernel_x, box_kernel_y, edge);
+            }
+            else {
+                gaussian_blur(src, dst, sigma, edge);
+                expected = convolve_reference(src_floats, src.w, src.h, 4, boxes_kernel, boxes_kernel, edge);
+            }
+            const unsigned char* actual = (const unsigned char*)dst.pixels.data();
+            for(size_t i = 0; i < expected.size(); i++) {
+                Assert(std::abs(actual[i] - expected[i] * 255.0f) <= 1.0f);
+            }
+        }
+    }
+
+    Image_float float_src = Image_float();
+    float_src.resize(1030, 70);
+    for(float& pixel : float_src.pixels) {
+        pixel = random.next_float();
+    }
+    Image_float float_dst = Image_float();
+    for(BlurEdgeMode edge : {BLUR_EDGE_CLAMP, BLUR_EDGE_ZERO}) {
+        convolve_separable(float_src, float_dst, gaussian_kernel, box_kernel_y, edge);
+        std::vector<float> expected = convolve_reference(float_src.pixels, float_src.w, float_src.h, 1, gaussian_kernel, box_kernel_y, edge);
+        for(size_t i = 0; i < expected.size(); i++) {
+            Assert(std::abs(float_dst.pixels[i] - expected[i]) < 1e-5f);
+        }
+        gaussian_blur(float_src, float_dst, sigma, edge);
+        expected = convolve_reference(float_src.pixels, float_src.w, float_src.h, 1, boxes_kernel, boxes_kernel, edge);
+        for(size_t i = 0; i < expected.size(); i++) {
+            Assert(std::abs(float_dst.pixels[i] - expected[i]) < 1e-5f);
+        }
+    }
+
+    // A negative sigma is the same as no blur
+    Assert(get_gaussian_kernel(-1.0f).size() == 1);
+    gaussian_blur(src, dst, -1.0f);
+    Assert(dst.pixels.size() == src.pixels.size() && std::memcmp(dst.pixels.data(), src.pixels.data(), src.pixels.size() * sizeof(ColorRGBA_UChar)) == 0);
+}
+AddTest(TEST_blur);
+
+// ============================================================
+//                      Procedural noise
+// ============================================================
+
+/**
+ * The noise functions are written once as templates, and evaluated either on single floats
+ *  or on 4 floats at a time using SSE2 (_NoiseF4/_NoiseU4) when available
+*/
+#if defined(__SSE2__)
+struct _NoiseF4 {
+    __m128 v;
+    _NoiseF4(__m128 v_) : v(v_) {}
+    explicit _NoiseF4(float f) : v(_mm_set1_ps(f)) {}
+};
+struct _NoiseU4 {
+    __m128i v;
+    _NoiseU4(__m128i v_) : v(v_) {}
+    explicit _NoiseU4(uint32_t u) : v(_mm_set1_epi32((int)u)) {}
+};
+inline _NoiseF4 operator+(_NoiseF4 a, _NoiseF4 b) { return _mm_add_ps(a.v, b.v); }
+inline _NoiseF4 operator-(_NoiseF4 a, _NoiseF4 b) { return _mm_sub_ps(a.v, b.v); }
+inline _NoiseF4 operator*(_NoiseF4 a, _NoiseF4 b) { return _mm_mul_ps(a.v, b.v); }
+inline _NoiseU4 operator+(_NoiseU4 a, _NoiseU4 b) { return _mm_add_epi32(a.v, b.v); }
+inline _NoiseU4 operator^(_NoiseU4 a, _NoiseU4 b) { return _mm_xor_si128(a.v, b.v); }
+inline _NoiseU4 operator>>(_NoiseU4 a, int shift) { return _mm_srli_epi32(a.v, shift); }
+inline _NoiseU4 operator*(_NoiseU4 a, _NoiseU4 b) {
+    // SSE2 has no 32 bit multiply, so multiply the even and odd lanes separately
+    __m128i even = _mm_mul_epu32(a.v, b.v);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a.v, 32), _mm_srli_epi64(b.v, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+inline _NoiseF4 _noise_floor(_NoiseF4 x) {
+    __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(x.v));
+    return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, x.v), _mm_set1_ps(1.0f)));
+}
+inline _NoiseU4 _noise_to_u(_NoiseF4 x) { return _mm_cvttps_epi32(x.v); }
+inline _NoiseF4 _noise_to_f(_NoiseU4 x) { return _mm_cvtepi32_ps(x.v); }
+inline _NoiseF4 _noise_max0(_NoiseF4 x) { return _mm_max_ps(x.v, _mm_setzero_ps()); }
+inline _NoiseF4 _noise_greater_as_one(_NoiseF4 a, _NoiseF4 b) { return _mm_and_ps(_mm_cmpgt_ps(a.v, b.v), _mm_set1_ps(1.0f)); }
+// Negate x if the selected bit of h is set
+inline _NoiseF4 _noise_flip_sign(_NoiseF4 x, _NoiseU4 h, int bit) {
+    return _mm_xor_ps(x.v, _mm_castsi128_ps(_mm_slli_epi32(_mm_srli_epi32(h.v, bit), 31)));
+}
+#endif
+
+inline float _noise_floor(float x) { return floorf(x); }
+inline uint32_t _noise_to_u(float x) { return (uint32_t)(int32_t)x; }
+inline float _noise_to_f(uint32_t x) { return (float)(int32_t)x; }
+inline float _noise_max0(float x) { return x > 0.0f ? x : 0.0f; }
+inline float _noise_greater_as_one(float a, float b) { return a > b ? 1.0f : 0.0f; }
+inline float _noise_flip_sign(float x, uint32_t h, int bit) { return ((h >> bit) & 1) ? -x : x; }
+
+template<class U>
+inline U _noise_hash(U x, U y, U seed) {
+    U h = seed ^ (x * U(0x27D4EB2Du)) ^ (y * U(0x165667B1u));
+    h = (h ^ (h >> 15)) * U(0x85EBCA77u);
+    return h ^ (h >> 13);
+}
+
+// Random value in [-1, 1) from a hash
+template<class F, class U>
+inline F _noise_hash_to_float(U h) {
+    return _noise_to_f(h >> 8) * F(1.0f / 8388608.0f) - F(1.0f);
+}
+
+// Dot product with one of the four diagonal gradients (+-1, +-1)
+template<class F, class U>
+inline F _noise_gradient(U h, F x, F y) {
+    return _noise_flip_sign(x, h, 0) + _noise_flip_sign(y, h, 1);
+}
+
+template<class F, class U>
+F _value_noise(F x, F y, U seed) {
+    F x_floor = _noise_floor(x);
+    F y_floor = _noise_floor(y);
+    U xi = _noise_to_u(x_floor);
+    U yi = _noise_to_u(y_floor);
+    F tx = x - x_floor;
+    F ty = y - y_floor;
+    F sx = tx * tx * (F(3.0f) - F(2.0f) * tx);
+    F sy = ty * ty * (F(3.0f) - F(2.0f) * ty);
+    F v00 = _noise_hash_to_float<F>(_noise_hash(xi, yi, seed));
+    F v10 = _noise_hash_to_float<F>(_noise_hash(xi + U(1), yi, seed));
+    F v01 = _noise_hash_to_float<F>(_noise_hash(xi, yi + U(1), seed));
+    F v11 = _noise_hash_to_float<F>(_noise_hash(xi + U(1), yi + U(1), seed));
+    F a = v00 + sx * (v10 - v00);
+    F b = v01 + sx * (v11 - v01);
+    return a + sy * (b - a);
+}
+
+template<class F, class U>
+F _perlin_noise(F x, F y, U seed) {
+    F x_floor = _noise_floor(x);
+    F y_floor = _noise_floor(y);
+    U xi = _noise_to_u(x_floor);
+    U yi = _noise_to_u(y_floor);
+    F tx = x - x_floor;
+    F ty = y - y_floor;
+    F sx = tx * tx * tx * (tx * (tx * F(6.0f) - F(15.0f)) + F(10.0f));
+    F sy = ty * ty * ty * (ty * (ty * F(6.0f) - F(15.0f)) + F(10.0f));
+    F g00 = _noise_gradient(_noise_hash(xi, yi, seed), tx, ty);
+    F g10 = _noise_gradient(_noise_hash(xi + U(1), yi, seed), tx - F(1.0f), ty);
+    F g01 = _noise_gradient(_noise_hash(xi, yi + U(1), seed), tx, ty - F(1.0f));
+    F g11 = _noise_gradient(_noise_hash(xi + U(1), yi + U(1), seed), tx - F(1.0f), ty - F(1.0f));
+    F a = g00 + sx * (g10 - g00);
+    F b = g01 + sx * (g11 - g01);
+    return a + sy * (b - a);
+}
+
+template<class F, class U>
+F _simplex_noise(F x, F y, U seed) {
+    const float F2 = 0.366025403f; // (sqrt(3) - 1) / 2
+    const float G2 = 0.211324865f; // (3 - sqrt(3)) / 6
+    // Find which simplex (triangle) the point is in
+    F s = (x + y) * F(F2);
+    F i = _noise_floor(x + s);
+    F j = _noise_floor(y + s);
+    F t = (i + j) * F(G2);
+    F x0 = x - (i - t);
+    F y0 = y - (j - t);
+    F i1 = _noise_greater_as_one(x0, y0);
+    F j1 = F(1.0f) - i1;
+    F x1 = x0 - i1 + F(G2);
+    F y1 = y0 - j1 + F(G2);
+    F x2 = x0 - F(1.0f - 2.0f * G2);
+    F y2 = y0 - F(1.0f - 2.0f * G2);
+    U ii = _noise_to_u(i);
+    U jj = _noise_to_u(j);
+    // Sum the contribution from the three corners
+    F t0 = _noise_max0(F(0.5f) - x0 * x0 - y0 * y0);
+    F t1 = _noise_max0(F(0.5f) - x1 * x1 - y1 * y1);
+    F t2 = _noise_max0(F(0.5f) - x2 * x2 - y2 * y2);
+    t0 = t0 * t0;
+    t1 = t1 * t1;
+    t2 = t2 * t2;
+    F n0 = t0 * t0 * _noise_gradient(_noise_hash(ii, jj, seed), x0, y0);
+    F n1 = t1 * t1 * _noise_gradient(_noise_hash(ii + _noise_to_u(i1), jj + _noise_to_u(j1), seed), x1, y1);
+    F n2 = t2 * t2 * _noise_gradient(_noise_hash(ii + U(1), jj + U(1), seed), x2, y2);
+    return F(70.0f) * (n0 + n1 + n2);
+}
+
+enum NoiseType {
+    NOISE_VALUE,   // Interpolated random values, blocky
+    NOISE_PERLIN,  // Gradient noise
+    NOISE_SIMPLEX  // Gradient noise on a triangle grid, fewer directional artifacts than perlin
+};
+
+struct NoiseParameters {
+    NoiseType type = NOISE_PERLIN;
+    uint32_t seed = 0;
+    float frequency = 1.0f / 32.0f; // Noise features per pixel
+    float offset_x = 0.0f;
+    float offset_y = 0.0f;
+    int octaves = 1; // Layers of noise added together (fractal brownian motion), each with higher frequency and lower amplitude
+    float lacunarity = 2.0f; // Frequency multiplier between octaves
+    float gain = 0.5f; // Amplitude multiplier between octaves
+};
+
+template<class F, class U>
+F _noise_fbm(const NoiseParameters& params, F x, F y) {
+    F sum = F(0.0f);
+    float frequency = params.frequency;
+    float amplitude = 1.0f;
+    float amplitude_sum = 0.0f;
+    for(int octave = 0; octave < std::max(params.octaves, 1); octave++) {
+        U seed = U(params.seed + (uint32_t)octave * 0x9E3779B9u);
+        F fx = x * F(frequency);
+        F fy = y * F(frequency);
+        F value = F(0.0f);
+        if(params.type == NOISE_VALUE) {
+            value = _value_noise(fx, fy, seed);
+        }
+        else if(params.type == NOISE_PERLIN) {
+            value = _perlin_noise(fx, fy, seed);
+        }
+        else {
+            value = _simplex_noise(fx, fy, seed);
+        }
+        sum = sum + value * F(amplitude);
+        amplitude_sum += amplitude;
+        frequency *= params.lacunarity;
+        amplitude *= params.gain;
+    }
+    return sum * F(1.0f / amplitude_sum);
+}
+
+/**
+ * Evaluate noise for count pixels along a row starting at pixel (x, y), output is roughly in [-1, 1]
+*/
+void noise_row(const NoiseParameters& params, float x, float y, int count, float* out) {
+    int i = 0;
+    float py = y + params.offset_y;
+    #if defined(__SSE2__)
+    const __m128 lane_offsets = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    for(; i + 4 <= count; i += 4) {
+        _NoiseF4 px = _NoiseF4(_mm_add_ps(_mm_set1_ps(x + params.offset_x + i), lane_offsets));
+        _NoiseF4 value = _noise_fbm<_NoiseF4, _NoiseU4>(params, px, _NoiseF4(py));
+        _mm_storeu_ps(out + i, value.v);
+    }
+    #endif
+    for(; i < count; i++) {
+        out[i] = _noise_fbm<float, uint32_t>(params, x + params.offset_x + i, py);
+    }
+}
+
+/**
+ * Fill the image with noise mapped to [0, 1], rows are generated in parallel bands on the worker pool
+ * NOTE! The image must already have its size set
+*/
+void fill_noise(Image_float& image, const NoiseParameters& params) {
+    vicmil::parallel_for(0, image.h, [&](size_t y_begin, size_t y_end) {
+        for(size_t y = y_begin; y < y_end; y++) {
+            float* row = image.get_pixel(0, y);
+            noise_row(params, 0.0f, (float)y, image.w, row);
+            for(int x = 0; x < image.w; x++) {
+                row[x] = std::min(std::max(row[x] * 0.5f + 0.5f, 0.0f), 1.0f);
+            }
+        }
+    }, 16);
+}
+
+/**
+ * Fill the image with noise, interpolating between color0 (noise value -1) and color1 (noise value 1)
+ * NOTE! The image must already have its size set
+*/
+void fill_noise(ImageRGBA_UChar& image, const NoiseParameters& params, 
+        ColorRGBA_UChar color0 = ColorRGBA_UChar(0, 0, 0, 255), ColorRGBA_UChar color1 = ColorRGBA_UChar(255, 255, 255, 255)) {
+    vicmil::parallel_for(0, image.h, [&](size_t y_begin, size_t y_end) {
+        std::vector<float> row_values = std::vector<float>(image.w);
+        for(size_t y = y_begin; y < y_end; y++) {
+            noise_row(params, 0.0f, (float)y, image.w, row_values.data());
+            ColorRGBA_UChar* row = image.get_pixel(0, y);
+            for(int x = 0; x < image.w; x++) {
+                float t = std::min(std::max(row_values[x] * 0.5f + 0.5f, 0.0f), 1.0f);
+                row[x] = ColorRGBA_UChar(
+                    color0.r + (color1.r - color0.r) * t + 0.5f,
+                    color0.g + (color1.g - color0.g) * t + 0.5f,
+                    color0.b + (color1.b - color0.b) * t + 0.5f,
+                    color0.a + (color1.a - color0.a) * t + 0.5f);
+            }
+        }
+    }, 16);
+}
+
+/**
+ * Measure how many noise samples per second fill_noise produces
+*/
+double benchmark_noise_samples_per_s(const NoiseParameters& params, int w = 1024, int h = 1024, int iterations = 5) {
+    Image_float image;
+    image.w = w;
+    image.h = h;
+    image.pixels.resize(w * h);
+    double time_s = vicmil::time_function_s([&]() {
+        fill_noise(image, params);
+    }, iterations);
+    return (double(w) * h) / time_s;
+}
+
+// ============================================================
+//                      Encoding png
+// ============================================================
+
+/**
+ * If miniz is available the png encoder below is used: the rows are split into bands that are
+ *  filtered and deflated in parallel, and the bands are joined into one standard zlib stream.
+ * Otherwise it falls back to stb_image_write on one thread
+*/
+
+// Filter one row with one of the png filters, prev_row is nullptr for the first row of the image
+inline void _png_filter_row(int filter, const unsigned char* row, const unsigned char* prev_row, size_t row_bytes, size_t bytes_per_pixel, unsigned char* out) {
+    size_t i = 0;
+    switch(filter) {
+        case PNG_FILTER_NONE:
+            std::memcpy(out, row, row_bytes);
+            break;
+        case PNG_FILTER_SUB:
+            for(; i < bytes_per_pixel && i < row_bytes; i++) {
+                out[i] = row[i];
+            }
+            #if defined(__SSE2__)
+            for(; i + 16 <= row_bytes; i += 16) {
+                __m128i current = _mm_loadu_si128((const __m128i*)(row + i));
+                __m128i left = _mm_loadu_si128((const __m128i*)(row + i - bytes_per_pixel));
+                _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(current, left));
+            }
+            #endif
+            for(; i < row_bytes; i++) {
+                out[i] = row[i] - row[i - bytes_per_pixel];
+            }
+            break;
+        case PNG_FILTER_UP:
+            if(prev_row == nullptr) {
+                std::memcpy(out, row, row_bytes);
+                break;
+            }
+            #if defined(__SSE2__)
+            for(; i + 16 <= row_bytes; i += 16) {
+                __m128i current = _mm_loadu_si128((const __m128i*)(row + i));
+                __m128i up = _mm_loadu_si128((const __m128i*)(prev_row + i));
+                _mm_storeu_si128((__m128i*)(out + i), _mm_sub_epi8(current, up));
+            }
+            #endif
+            for(; i < row_bytes; i++) {
+                out[i] = row[i] - prev_row[i];
+            }
+            break;
+        case PNG_FILTER_AVERAGE:
+            for(; i < row_bytes; i++) {
+                int left = i >= bytes_per_pixel ? row[i - bytes_per_pixel] : 0;
+                int up = prev_row ? prev_row[i] : 0;
+                out[i] = row[i] - ((left + up) >> 1);
+            }
+            break;
+        case PNG_FILTER_PAETH:
+            for(; i < row_bytes; i++) {
+                int left = i >= bytes_per_pixel ? row[i - bytes_per_pixel] : 0;
+                int up = prev_row ? prev_row[i] : 0;
+                int up_left = (prev_row && i >= bytes_per_pixel) ? prev_row[i - bytes_per_pixel] : 0;
+                int p = left + up - up_left;
+                int distance_left = std::abs(p - left);
+                int distance_up = std::abs(p - up);
+                int distance_up_left = std::abs(p - up_left);
+                int predictor = (distance_left <= distance_up && distance_left <= distance_up_left) ? left : (distance_up <= distance_up_left ? up : up_left);
+                out[i] = row[i] - predictor;
+            }
+            break;
+    }
+}
+
+// The usual png heuristic for picking a filter, the sum of the filtered bytes seen as signed values
+inline size_t _png_filter_cost(const unsigned char* filtered, size_t row_bytes) {
+    size_t cost = 0;
+    size_t i = 0;
+    #if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = _mm_setzero_si128();
+    for(; i + 16 <= row_bytes; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(filtered + i));
+        __m128i magnitude = _mm_min_epu8(v, _mm_sub_epi8(zero, v)); // |v| when v is seen as signed
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(magnitude, zero));
+    }
+    uint64_t sums[2];
+    _mm_storeu_si128((__m128i*)sums, sum);
+    cost = sums[0] + sums[1];
+    #endif
+    for(; i < row_bytes; i++) {
+        cost += filtered[i] < 128 ? filtered[i] : 256 - filtered[i];
+    }
+    return cost;
+}
+
+/**
+ * Write the filter byte and the filtered row to out(1 + row_bytes bytes)
+*/
+inline void _png_filter_row_with_heuristic(PNGFilter filter, const unsigned char* row, const unsigned char* prev_row, size_t row_bytes, size_t bytes_per_pixel, unsigned char* out, std::vector<unsigned char>& scratch) {
+    if(filter != PNG_FILTER_ADAPTIVE) {
+        out[0] = (unsigned char)filter;
+        _png_filter_row(filter, row, prev_row, row_bytes, bytes_per_pixel, out + 1);
+        return;
+    }
+    scratch.resize(row_bytes);
+    size_t best_cost = (size_t)-1;
+    for(int candidate = PNG_FILTER_NONE; candidate <= PNG_FILTER_PAETH; candidate++) {
+        _png_filter_row(candidate, row, prev_row, row_bytes, bytes_per_pixel, scratch.data());
+        size_t cost = _png_filter_cost(scratch.data(), row_bytes);
+        if(cost < best_cost) {
+            best_cost = cost;
+            out[0] = (unsigned char)candidate;
+            std::memcpy(out + 1, scratch.data(), row_bytes);
+        }
+    }
+}
+
+inline void _png_append_u32(std::vector<unsigned char>& out, uint32_t value) {
+    unsigned char bytes[4] = {(unsigned char)(value >> 24), (unsigned char)(value >> 16), (unsigned char)(value >> 8), (unsigned char)value};
+    out.insert(out.end(), bytes, bytes + 4);
+}
+
+#if defined(VICMIL_USE_MINIZ_PNG)
+// Add a png chunk, the crc covers the type and the data
+inline void _png_append_chunk(std::vector<unsigned char>& out, const char* type, const unsigned char* prefix, size_t prefix_size, const unsigned char* data, size_t data_size) {
+    _png_append_u32(out, prefix_size + data_size);
+    size_t crc_begin = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), prefix, prefix + prefix_size);
+    out.insert(out.end(), data, data + data_size);
+    mz_ulong crc = mz_crc32(MZ_CRC32_INIT, &out[crc_begin], out.size() - crc_begin);
+    _png_append_u32(out, crc);
+}
+
+// The adler32 of two buffers after each other, from the adler32 of each of them(same as zlib's adler32_combine)
+inline uint32_t _adler32_combine(uint32_t adler1, uint32_t adler2, size_t length2) {
+    const uint32_t base = 65521;
+    uint32_t remainder = length2 % base;
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = (uint32_t)(((uint64_t)remainder * sum1) % base);
+    sum1 += (adler2 & 0xffff) + base - 1;
+    sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + base - remainder;
+    if(sum1 >= base) sum1 -= base;
+    if(sum1 >= base) sum1 -= base;
+    if(sum2 >= (base << 1)) sum2 -= (base << 1);
+    if(sum2 >= base) sum2 -= base;
+    return sum1 | (sum2 << 16);
+}
+
+inline mz_bool _png_deflate_output(const void* data, int size, void* user) {
+    std::vector<unsigned char>* out = (std::vector<unsigned char>*)user;
+    out->insert(out->end(), (const unsigned char*)data, (const unsigned char*)data + size);
+    return MZ_TRUE;
+}
+
+struct _PNGBand {
+    std::vector<unsigned char> compressed;
+    uint32_t adler = 1;
+    size_t filtered_size = 0;
+    bool failed = false;
+};
+
+// Filter and deflate the rows [y_begin, y_end). Bands other than the last end with a sync flush, so their outputs can be joined
+inline void _png_encode_band(const unsigned char* pixels, int w, int h, size_t stride_in_bytes, int channels, int y_begin, int y_end, const PNGEncodeOptions& options, _PNGBand& band) {
+    size_t row_bytes = (size_t)w * channels;
+    std::vector<unsigned char> filtered = std::vector<unsigned char>((y_end - y_begin) * (row_bytes + 1));
+    std::vector<unsigned char> scratch;
+    for(int y = y_begin; y < y_end; y++) {
+        const unsigned char* row = pixels + y * stride_in_bytes;
+        const unsigned char* prev_row = y > 0 ? row - stride_in_bytes : nullptr; // Rows in other bands are read straight from the image
+        _png_filter_row_with_heuristic(options.filter, row, prev_row, row_bytes, channels, &filtered[(y - y_begin) * (row_bytes + 1)], scratch);
+    }
+    band.filtered_size = filtered.size();
+    band.adler = mz_adler32(MZ_ADLER32_INIT, filtered.data(), filtered.size());
+
+    tdefl_compressor* compressor = tdefl_compressor_alloc();
+    if(compressor == nullptr) {
+        band.failed = true;
+        return;
+    }
+    int window_bits = -15; // Raw deflate, the zlib header and checksum are added when the bands are joined
+    int flags = tdefl_create_comp_flags_from_zip_params(std::min(std::max(options.level, 0), 10), window_bits, MZ_DEFAULT_STRATEGY);
+    tdefl_init(compressor, _png_deflate_output, &band.compressed, flags);
+    tdefl_status status = tdefl_compress_buffer(compressor, filtered.data(), filtered.size(), y_end == h ? TDEFL_FINISH : TDEFL_SYNC_FLUSH);
+    band.failed = !(status == TDEFL_STATUS_OKAY || status == TDEFL_STATUS_DONE);
+    tdefl_compressor_free(compressor);
+}
+
+/**
+ * Filter and deflate the image in bands of band_rows rows on the worker pool
+ * The bands joined after each other, between a zlib header and the returned adler32, are one zlib stream
+*/
+inline bool _png_encode_bands(const unsigned char* pixels, int w, int h, size_t stride_in_bytes, int channels, int band_rows, const PNGEncodeOptions& options, 
+                              std::vector<_PNGBand>& bands, uint32_t& adler) {
+    int band_count = (h + band_rows - 1) / band_rows;
+    bands.assign(band_count, _PNGBand());
+    auto encode_bands = [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++) {
+            int y_begin = i * band_rows;
+            _png_encode_band(pixels, w, h, stride_in_bytes, channels, y_begin, std::min(y_begin + band_rows, h), options, bands[i]);
+        }
+    };
+    if(options.multithreaded) {
+        vicmil::parallel_for(0, band_count, encode_bands, 1);
+    }
+    else {
+        encode_bands(0, band_count);
+    }
+    adler = 1;
+    for(int i = 0; i < band_count; i++) {
+        if(bands[i].failed) {
+            return false;
+        }
+        adler = _adler32_combine(adler, bands[i].adler, bands[i].filtered_size);
+    }
+    return true;
+}
+
+inline bool _append_png_miniz(const unsigned char* pixels, int w, int h, size_t stride_in_bytes, int channels, std::vector<unsigned char>& out, const PNGEncodeOptions& options) {
+    size_t row_bytes = (size_t)w * channels;
+    // Each band should be large enough that splitting it up barely changes the compression ratio
+    int thread_count = options.multithreaded ? vicmil::get_worker_pool().thread_count() + 1 : 1;
+    int min_band_rows = std::max((int)((256 * 1024) / (row_bytes + 1)), 16);
+    int band_rows = std::max((h + thread_count - 1) / thread_count, min_band_rows);
+    std::vector<_PNGBand> bands;
+    uint32_t adler = 1;
+    if(!_png_encode_bands(pixels, w, h, stride_in_bytes, channels, band_rows, options, bands, adler)) {
+        return false;
+    }
+    int band_count = bands.size();
+    size_t compressed_size = 0;
+    for(int i = 0; i < band_count; i++) {
+        compressed_size += bands[i].compressed.size();
+    }
+    out.reserve(out.size() + compressed_size + 128 + band_count * 12);
+
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    out.insert(out.end(), signature, signature + 8);
+
+    const unsigned char color_types[5] = {0, 0, 4, 2, 6}; // gray, gray + alpha, rgb, rgba
+    unsigned char header[13];
+    header[0] = w >> 24; header[1] = w >> 16; header[2] = w >> 8; header[3] = w;
+    header[4] = h >> 24; header[5] = h >> 16; header[6] = h >> 8; header[7] = h;
+    header[8] = 8; // Bits per channel
+    header[9] = color_types[channels];
+    header[10] = 0; // Compression method
+    header[11] = 0; // Filter method
+    header[12] = 0; // No interlacing
+    _png_append_chunk(out, "IHDR", nullptr, 0, header, sizeof(header));
+
+    // One IDAT chunk per band, with the zlib header before the first band and the checksum in a chunk of its own at the end
+    const unsigned char zlib_header[2] = {0x78, 0x01};
+    for(int i = 0; i < band_count; i++) {
+        _png_append_chunk(out, "IDAT", zlib_header, i == 0 ? 2 : 0, bands[i].compressed.data(), bands[i].compressed.size());
+    }
+    unsigned char adler_bytes[4] = {(unsigned char)(adler >> 24), (unsigned char)(adler >> 16), (unsigned char)(adler >> 8), (unsigned char)adler};
+    _png_append_chunk(out, "IDAT", nullptr, 0, adler_bytes, 4);
+    _png_append_chunk(out, "IEND", nullptr, 0, nullptr, 0);
+    return true;
+}
+
+void TEST_png_bands() {
+    // A view into a larger image, so the rows are not next to each other in memory
+    ImageRGBA_UChar image = ImageRGBA_UChar();
+    image.resize(16, 20);
+    PCG32 random = PCG32(35);
+    for(int y = 0; y < image.h; y++) {
+        for(int x = 0; x < image.w; x++) {
+            *image.get_pixel(x, y) = ColorRGBA_UChar(x * 9, y * 11, random.next_bounded(256), 255 - x - y);
+        }
+    }
+    ConstImageViewRGBA view = image.sub_view(1, 0, 13, 20);
+    const unsigned char* pixels = (const unsigned char*)view.data;
+    size_t stride_in_bytes = view.stride * sizeof(ColorRGBA_UChar);
+    size_t row_bytes = view.w * 4;
+    const PNGFilter filters[] = {PNG_FILTER_ADAPTIVE, PNG_FILTER_PAETH};
+    for(PNGFilter filter : filters) {
+        PNGEncodeOptions options = PNGEncodeOptions();
+        options.filter = filter;
+        std::vector<unsigned char> filtered = std::vector<unsigned char>(view.h * (row_bytes + 1));
+        std::vector<unsigned char> scratch;
+        for(int y = 0; y < view.h; y++) {
+            const unsigned char* row = pixels + y * stride_in_bytes;
+            _png_filter_row_with_heuristic(filter, row, y > 0 ? row - stride_in_bytes : nullptr, row_bytes, 4, &filtered[y * (row_bytes + 1)], scratch);
+        }
+        // 7 bands, the last one with 2 rows
+        std::vector<_PNGBand> bands;
+        uint32_t adler = 0;
+        Assert(_png_encode_bands(pixels, view.w, view.h, stride_in_bytes, 4, 3, options, bands, adler));
+        Assert(bands.size() == 7);
+        Assert(adler == mz_adler32(MZ_ADLER32_INIT, filtered.data(), filtered.size()));
+        std::vector<unsigned char> zlib_stream = {0x78, 0x01};
+        for(const _PNGBand& band : bands) {
+            zlib_stream.insert(zlib_stream.end(), band.compressed.begin(), band.compressed.end());
+        }
+        _png_append_u32(zlib_stream, adler);
+        // Inflating checks the adler32 trailer as well
+        std::vector<unsigned char> inflated = std::vector<unsigned char>(filtered.size());
+        mz_ulong inflated_size = inflated.size();
+        Assert(mz_uncompress(inflated.data(), &inflated_size, zlib_stream.data(), zlib_stream.size()) == MZ_OK);
+        Assert(inflated_size == filtered.size() && inflated == filtered);
+    }
+}
+AddTest(TEST_png_bands);
+#endif
+
+/**
+ * Encode the image as png and add it to the end of out
+ * Returns false if it failed, then out may contain a partial image
+*/
+bool append_png(ConstImageViewRGBA image, std::vector<unsigned char>& out, const PNGEncodeOptions& options) {
+    if(image.empty()) {
+        return false;
+    }
+    int comp = 4; // r, g, b, a
+    int stride_in_bytes = image.stride * sizeof(ColorRGBA_UChar);
+    #if defined(VICMIL_USE_MINIZ_PNG)
+        return _append_png_miniz((const unsigned char*)image.data, image.w, image.h, stride_in_bytes, comp, out, options);
+    #else
+        // Note! These are global settings in stb, so encoding on several threads at once may mix up the settings
+        int previous_level = stbi_write_png_compression_level;
+        int previous_filter = stbi_write_force_png_filter;
+        stbi_write_png_compression_level = std::max(options.level, 1);
+        stbi_write_force_png_filter = options.filter == PNG_FILTER_ADAPTIVE ? -1 : (int)options.filter;
+        int success = stbi_write_png_to_func(_write_to_vector, &out, image.w, image.h, comp, image.data, stride_in_bytes);
+        stbi_write_png_compression_level = previous_level;
+        stbi_write_force_png_filter = previous_filter;
+        return success != 0;
+    #endif
+}
+
+std::vector<unsigned char> to_png_as_bytes(ConstImageViewRGBA image, const PNGEncodeOptions& options) {
+    std::vector<unsigned char> vec = std::vector<unsigned char>();
+    append_png(image, vec, options);
+    return vec;
+}
+
+// Save a view as a png file, the rows do not have to be next to each other in memory
+bool save_as_png(ConstImageViewRGBA image, std::string filename, const PNGEncodeOptions& options) {
+    std::vector<unsigned char> bytes = std::vector<unsigned char>();
+    if(!append_png(image, bytes, options)) {
+        return false;
+    }
+    std::ofstream file = std::ofstream(filename, std::ios::binary);
+    file.write((const char*)bytes.data(), bytes.size());
+    return file.good();
+}
+
+/**
+ * Measure how fast images are encoded, in megapixels per second
+*/
+double benchmark_png_encode_mpixels_per_s(const PNGEncodeOptions& options, int w = 2048, int h = 2048, int iterations = 3) {
+    ImageRGBA_UChar image = ImageRGBA_UChar();
+    image.resize(w, h);
+    NoiseParameters noise = NoiseParameters(); // Something in between random data and flat color
+    fill_noise(image, noise, ColorRGBA_UChar(20, 40, 200, 255), ColorRGBA_UChar(250, 220, 30, 255));
+    std::vector<unsigned char> bytes;
+    double time_s = vicmil::time_function_s([&]() {
+        bytes.clear();
+        append_png(image, bytes, options);
+    }, iterations);
+    return (double(w) * h) / time_s / 1000000.0;
+}
+
+// ============================================================
+//                      Decoding images
+// ============================================================
+
+/**
+ * stb_image allocates through _StbiAllocator(see the top of the file). It keeps a few freed blocks per thread, so
+ *  decoding many images reuses the same scratch memory. While decoding into a buffer, the allocation for the decoded
+ *  pixels is handed that buffer instead, so the pixels are written directly to where they should end up
+*/
+struct _StbiAllocator {
+    static const size_t header_size = 16; // Stores the capacity of the block, and keeps the memory 16 byte aligned
+    static const size_t max_cached_blocks = 8;
+    static const size_t max_cached_bytes = 64 * 1024 * 1024;
+
+    std::vector<unsigned char*> cached_blocks; // Points to the start of the headers
+    size_t cached_bytes = 0;
+
+    unsigned char* target = nullptr; // Where the decoded pixels should be written
+    size_t target_size = 0;
+    bool target_in_use = false;
+
+    _StbiAllocator() {}
+    _StbiAllocator(const _StbiAllocator&) = delete;
+    _StbiAllocator& operator=(const _StbiAllocator&) = delete;
+    ~_StbiAllocator() {
+        for(size_t i = 0; i < cached_blocks.size(); i++) {
+            std::free(cached_blocks[i]);
+        }
+    }
+    static size_t& _block_capacity(unsigned char* block) {
+        return *(size_t*)block;
+    }
+    void* _allocate_block(size_t size) {
+        // Reuse the smallest cached block that is large enough
+        int best = -1;
+        for(size_t i = 0; i < cached_blocks.size(); i++) {
+            size_t capacity = _block_capacity(cached_blocks[i]);
+            if(capacity >= size && (best == -1 || capacity < _block_capacity(cached_blocks[best]))) {
+                best = i;
+            }
+        }
+        unsigned char* block = nullptr;
+        if(best != -1) {
+            block = cached_blocks[best];
+            cached_bytes -= _block_capacity(block);
+            cached_blocks.erase(cached_blocks.begin() + best);
+        }
+        else {
+            block = (unsigned char*)std::malloc(size + header_size);
+            if(block == nullptr) {
+                return nullptr;
+            }
+            _block_capacity(block) = size;
+        }
+        return block + header_size;
+    }
+    void* allocate(size_t size) {
+        // The decoded pixels are the only allocation of exactly this size in the common cases, if something else
+        //  gets the target it is handled when the decoding is done
+        if(target != nullptr && !target_in_use && size == target_size) {
+            target_in_use = true;
+            return target;
+        }
+        return _allocate_block(size);
+    }
+    void release(void* ptr) {
+        if(ptr == nullptr) {
+            return;
+        }
+        if(ptr == target) {
+            target_in_use = false;
+            return;
+        }
+        unsigned char* block = (unsigned char*)ptr - header_size;
+        size_t capacity = _block_capacity(block);
+        if(capacity > max_cached_bytes) {
+            std::free(block);
+            return;
+        }
+        // Prefer keeping large blocks, growing buffers leave a trail of small ones behind
+        while(cached_blocks.size() >= max_cached_blocks || cached_bytes + capacity > max_cached_bytes) {
+            size_t smallest = 0;
+            for(size_t i = 1; i < cached_blocks.size(); i++) {
+                if(_block_capacity(cached_blocks[i]) < _block_capacity(cached_blocks[smallest])) {
+                    smallest = i;
+                }
+            }
+            if(_block_capacity(cached_blocks[smallest]) > capacity) {
+                std::free(block);
+                return;
+            }
+            cached_bytes -= _block_capacity(cached_blocks[smallest]);
+            std::free(cached_blocks[smallest]);
+            cached_blocks.erase(cached_blocks.begin() + smallest);
+        }
+        cached_blocks.push_back(block);
+        cached_bytes += capacity;
+    }
+    void* reallocate(void* ptr, size_t new_size) {
+        if(ptr == nullptr) {
+            return allocate(new_size);
+        }
+        size_t old_size = target_size;
+        if(ptr != target) {
+            old_size = _block_capacity((unsigned char*)ptr - header_size);
+        }
+        if(new_size <= old_size) {
+            return ptr;
+        }
+        void* new_ptr = _allocate_block(new_size);
+        if(new_ptr == nullptr) {
+            return nullptr;
+        }
+        std::memcpy(new_ptr, ptr, old_size);
+        release(ptr);
+        return new_ptr;
+    }
+};
+
+inline _StbiAllocator& _get_stbi_allocator() {
+    static thread_local _StbiAllocator allocator;
+    return allocator;
+}
+
+void* _stbi_malloc(size_t size) {
+    return _get_stbi_allocator().allocate(size);
+}
+void* _stbi_realloc(void* ptr, size_t new_size) {
+    return _get_stbi_allocator().reallocate(ptr, new_size);
+}
+void _stbi_free(void* ptr) {
+    _get_stbi_allocator().release(ptr);
+}
+
+inline void _set_decode_error(std::string* error, std::string message) {
+    if(error != nullptr) {
+        const char* reason = stbi_failure_reason();
+        *error = reason ? message + ": " + reason : message;
+    }
+}
+
+/**
+ * Decode with load_func(which calls stbi_load...) into dst, which should be the size of the image
+*/
+template<class LOAD_FUNC>
+bool _decode_into_view(ImageViewRGBA dst, bool flip_vertical, std::string* error, LOAD_FUNC load_func) {
+    const int comp = 4; // r, g, b, a
+    size_t row_bytes = (size_t)dst.w * sizeof(ColorRGBA_UChar);
+    _StbiAllocator& allocator = _get_stbi_allocator();
+    if(dst.is_contiguous() && !dst.empty()) {
+        allocator.target = (unsigned char*)dst.data;
+        allocator.target_size = row_bytes * dst.h;
+        allocator.target_in_use = false;
+    }
+    int w = 0;
+    int h = 0;
+    int n = 0;
+    unsigned char* data = load_func(&w, &h, &n, comp);
+    bool decoded_in_place = data != nullptr && data == allocator.target;
+    allocator.target = nullptr;
+    allocator.target_size = 0;
+    allocator.target_in_use = false;
+
+    if(data == nullptr) {
+        _set_decode_error(error, "Failed to decode image");
+        return false;
+    }
+    if(w != dst.w || h != dst.h) {
+        if(!decoded_in_place) {
+            stbi_image_free(data);
+        }
+        _set_decode_error(error, "Image size changed while decoding");
+        return false;
+    }
+    if(decoded_in_place) {
+        if(flip_vertical) {
+            _flip_rows_vertical(data, h, row_bytes);
+        }
+        return true;
+    }
+    // Fall back to copying, e.g. if the destination has a stride
+    for(int y = 0; y < h; y++) {
+        int src_y = flip_vertical ? h - 1 - y : y;
+        std::memcpy(dst.get_row(y), data + src_y * row_bytes, row_bytes);
+    }
+    stbi_image_free(data);
+    return true;
+}
+
+/**
+ * Get the size of an encoded image(png, jpg, bmp, etc.) without decoding it
+*/
+bool decode_image_info(const unsigned char* bytes, int length, int* w, int* h) {
+    int n = 0;
+    return stbi_info_from_memory(bytes, length, w, h, &n) != 0;
+}
+
+/**
+ * Decode an image into memory owned by the caller, dst has to have the same size as the image(see decode_image_info)
+ * The pixels are written directly into dst if its rows are next to each other in memory
+ * @return false if it failed, with the reason in error if it is not nullptr
+*/
+bool decode_image_into(const unsigned char* bytes, int length, ImageViewRGBA dst, bool flip_vertical, std::string* error) {
+    int w = 0;
+    int h = 0;
+    if(!decode_image_info(bytes, length, &w, &h)) {
+        _set_decode_error(error, "Failed to read image header");
+        return false;
+    }
+    if(w != dst.w || h != dst.h) {
+        if(error != nullptr) {
+            *error = "Image is " + std::to_string(w) + "x" + std::to_string(h) + " but the destination is " + std::to_string(dst.w) + "x" + std::to_string(dst.h);
+        }
+        return false;
+    }
+    return _decode_into_view(dst, flip_vertical, error, [&](int* x, int* y, int* n, int comp) {
+        return stbi_load_from_memory(bytes, length, x, y, n, comp);
+    });
+}
+
+/**
+ * Decode an image into out, reusing the memory out already has
+ * If it fails out will be empty(w = 0, h = 0)
+*/
+bool decode_image(const unsigned char* bytes, int length, ImageRGBA_UChar& out, bool flip_vertical, std::string* error) {
+    int w = 0;
+    int h = 0;
+    if(!decode_image_info(bytes, length, &w, &h)) {
+        _set_decode_error(error, "Failed to read image header");
+        out.resize(0, 0);
+        return false;
+    }
+    out.resize(w, h);
+    bool success = _decode_into_view(out.view(), flip_vertical, error, [&](int* x, int* y, int* n, int comp) {
+        return stbi_load_from_memory(bytes, length, x, y, n, comp);
+    });
+    if(!success) {
+        out.resize(0, 0);
+    }
+    return success;
+}
+
+bool decode_image_file(std::string filename, ImageRGBA_UChar& out, bool flip_vertical, std::string* error) {
+    int w = 0;
+    int h = 0;
+    int n = 0;
+    if(!stbi_info(filename.c_str(), &w, &h, &n)) {
+        _set_decode_error(error, "Failed to read image header of " + filename);
+        out.resize(0, 0);
+        return false;
+    }
+    out.resize(w, h);
+    bool success = _decode_into_view(out.view(), flip_vertical, error, [&](int* x, int* y, int* n_, int comp) {
+        return stbi_load(filename.c_str(), x, y, n_, comp);
+    });
+    if(!success) {
+        out.resize(0, 0);
+    }
+    return success;
+}
+
+/**
+ * Keeps the pixel memory of images that are no longer used, so new images can be created without allocating
+ * Thread safe
+*/
+class ImagePool {
+    std::mutex _mutex;
+    std::vector<std::vector<ColorRGBA_UChar>> _free_pixels;
+public:
+    size_t max_cached_images = 16;
+
+    // Get an empty image, that may already have memory for its pixels
+    ImageRGBA_UChar acquire() {
+        ImageRGBA_UChar image = ImageRGBA_UChar();
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_free_pixels.size() != 0) {
+            image.pixels.swap(_free_pixels.back());
+            _free_pixels.pop_back();
+            image.pixels.clear();
+        }
+        return image;
+    }
+    // Give back the memory of an image, the image is empty afterwards
+    void release(ImageRGBA_UChar& image) {
+        std::vector<ColorRGBA_UChar> pixels = std::vector<ColorRGBA_UChar>();
+        pixels.swap(image.pixels);
+        image.resize(0, 0);
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_free_pixels.size() < max_cached_images) {
+            _free_pixels.push_back(std::vector<ColorRGBA_UChar>());
+            _free_pixels.back().swap(pixels);
+        }
+    }
+    size_t cached_image_count() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _free_pixels.size();
+    }
+};
+
+struct ImageDecodeJob {
+    const unsigned char* bytes = nullptr; // The encoded image, if it is nullptr the image is loaded from filename
+    int length = 0;
+    std::string filename;
+    ImageRGBA_UChar* out = nullptr;
+    bool flip_vertical = false;
+
+    // Set by decode_batch
+    bool success = false;
+    std::string error;
+
+    ImageDecodeJob() {}
+    ImageDecodeJob(const std::vector<unsigned char>& bytes_, ImageRGBA_UChar* out_, bool flip_vertical_ = false) {
+        bytes = bytes_.data();
+        length = bytes_.size();
+        out = out_;
+        flip_vertical = flip_vertical_;
+    }
+    ImageDecodeJob(std::string filename_, ImageRGBA_UChar* out_, bool flip_vertical_ = false) {
+        filename = filename_;
+        out = out_;
+        flip_vertical = flip_vertical_;
+    }
+};
+
+/**
+ * Decode several images at the same time on the worker pool
+ * Each job gets its own success flag and error, one image failing does not affect the others
+ * @return the number of images that were decoded successfully
+*/
+int decode_batch(std::vector<ImageDecodeJob>& jobs) {
+    std::atomic<int> success_count = ATOMIC_VAR_INIT(0);
+    vicmil::parallel_for(0, jobs.size(), [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++) {
+            ImageDecodeJob& job = jobs[i];
+            job.error = "";
+            if(job.out == nullptr) {
+                job.success = false;
+                job.error = "No output image";
+                continue;
+            }
+            if(job.bytes != nullptr) {
+                job.success = decode_image(job.bytes, job.length, *job.out, job.flip_vertical, &job.error);
+            }
+            else {
+                job.success = decode_image_file(job.filename, *job.out, job.flip_vertical, &job.error);
+            }
+            if(job.success) {
+                success_count++;
+            }
+        }
+    }, 1);
+    return success_count;
+}
+
+// ============================================================
+//                      Block compression
+// ============================================================
+
+/**
+ * Encode images to formats the GPU can sample from directly, using 4x4 pixel blocks
+ * BC1 is 4 bits per pixel(with 1 bit alpha), BC3 and ETC2 RGBA are 8 bits per pixel, compared to 32 for GL_RGBA
+ * BC1/BC3 are supported on desktop, ETC2 on OpenGL ES 3 and WebGL 2 on mobile
+*/
+enum CompressedFormat {
+    COMPRESSED_BC1,       // Also known as DXT1
+    COMPRESSED_BC3,       // Also known as DXT5
+    COMPRESSED_ETC2_RGBA  // ETC2 colors with EAC alpha
+};
+
+enum CompressionQuality {
+    COMPRESSION_FAST,   // Bounding box endpoints, only the basic ETC modes
+    COMPRESSION_NORMAL, // Endpoints along the main axis of the colors
+    COMPRESSION_HIGH    // Also refines the endpoints and tries more modes, several times slower
+};
+
+struct CompressedImage {
+    CompressedFormat format = COMPRESSED_BC1;
+    int w = 0;
+    int h = 0;
+    std::vector<unsigned char> data; // The blocks row by row, starting with the top left corner
+
+    static int block_bytes(CompressedFormat format) {
+        return format == COMPRESSED_BC1 ? 8 : 16;
+    }
+    int blocks_x() const {
+        return (w + 3) / 4;
+    }
+    int blocks_y() const {
+        return (h + 3) / 4;
+    }
+    unsigned char* get_block(int block_x, int block_y) {
+        return &data[((size_t)block_y * blocks_x() + block_x) * block_bytes(format)];
+    }
+    const unsigned char* get_block(int block_x, int block_y) const {
+        return &data[((size_t)block_y * blocks_x() + block_x) * block_bytes(format)];
+    }
+};
+
+inline int _clamp_255(int value) {
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+inline int _color_distance_squared(const ColorRGBA_UChar& a, int r, int g, int b) {
+    return (a.r - r) * (a.r - r) + (a.g - g) * (a.g - g) + (a.b - b) * (a.b - b);
+}
+
+// Get the 16 pixels of a block, pixels outside the image repeat the closest pixel inside it
+inline void _get_block_pixels(ConstImageViewRGBA image, int block_x, int block_y, ColorRGBA_UChar out[16]) {
+    for(int y = 0; y < 4; y++) {
+        const ColorRGBA_UChar* row = image.get_row(std::min(block_y * 4 + y, image.h - 1));
+        for(int x = 0; x < 4; x++) {
+            out[y * 4 + x] = row[std::min(block_x * 4 + x, image.w - 1)];
+        }
+    }
+}
+
+// ----- BC1 and BC3 -----
+
+// Round a color to the closest 5:6:5 bit color
+inline uint16_t _to_rgb565(float r, float g, float b) {
+    int r5 = std::min(std::max((int)(r * 31.0f / 255.0f + 0.5f), 0), 31);
+    int g6 = std::min(std::max((int)(g * 63.0f / 255.0f + 0.5f), 0), 63);
+    int b5 = std::min(std::max((int)(b * 31.0f / 255.0f + 0.5f), 0), 31);
+    return (uint16_t)((r5 << 11) | (g6 << 5) | b5);
+}
+
+inline ColorRGBA_UChar _from_rgb565(uint16_t color) {
+    int r = (color >> 11) & 31;
+    int g = (color >> 5) & 63;
+    int b = color & 31;
+    return ColorRGBA_UChar((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2), 255);
+}
+
+/**
+ * The colors of a BC1 block, four_colors is always true for BC3
+ * With three colors the last one is transparent black
+*/
+inline void _bc1_palette(uint16_t color0, uint16_t color1, bool four_colors, ColorRGBA_UChar palette[4]) {
+    palette[0] = _from_rgb565(color0);
+    palette[1] = _from_rgb565(color1);
+    const ColorRGBA_UChar& c0 = palette[0];
+    const ColorRGBA_UChar& c1 = palette[1];
+    if(four_colors) {
+        palette[2] = ColorRGBA_UChar((2 * c0.r + c1.r) / 3, (2 * c0.g + c1.g) / 3, (2 * c0.b + c1.b) / 3, 255);
+        palette[3] = ColorRGBA_UChar((c0.r + 2 * c1.r) / 3, (c0.g + 2 * c1.g) / 3, (c0.b + 2 * c1.b) / 3, 255);
+    }
+    else {
+        palette[2] = ColorRGBA_UChar((c0.r + c1.r) / 2, (c0.g + c1.g) / 2, (c0.b + c1.b) / 2, 255);
+        palette[3] = ColorRGBA_UChar(0, 0, 0, 0);
+    }
+}
+
+/**
+ * Pick the closest palette color for each pixel, returns the total squared error
+ * Pixels with skip set get index skip_index(the transparent color)
+*/
+inline int _bc1_pick_indices(const ColorRGBA_UChar pixels[16], const bool skip[16], const ColorRGBA_UChar palette[4], int palette_size, int skip_index, uint32_t& out_indices) {
+    int total_error = 0;
+    out_indices = 0;
+    for(int i = 0; i < 16; i++) {
+        int best_index = skip_index;
+        if(!skip[i]) {
+            int best_error = INT32_MAX;
+            for(int j = 0; j < palette_size; j++) {
+                int error = _color_distance_squared(pixels[i], palette[j].r, palette[j].g, palette[j].b);
+                if(error < best_error) {
+                    best_error = error;
+                    best_index = j;
+                }
+            }
+            total_error += best_error;
+        }
+        out_indices |= (uint32_t)best_index << (2 * i);
+    }
+    return total_error;
+}
+
+/**
+ * Fit the line between two colors to the pixels with least squares, given how far along the line each pixel is
+ * Returns false if the endpoints could not be solved for(e.g. all pixels using the same index)
+*/
+inline bool _bc1_refine_endpoints(const ColorRGBA_UChar pixels[16], const bool skip[16], uint32_t indices, bool four_colors, float out_start[3], float out_end[3]) {
+    const float weights_4[4] = {0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f};
+    const float weights_3[4] = {0.0f, 1.0f, 0.5f, 0.0f};
+    const float* weights = four_colors ? weights_4 : weights_3;
+    float aa = 0, ab = 0, bb = 0;
+    float ax[3] = {0, 0, 0};
+    float bx[3] = {0, 0, 0};
+    for(int i = 0; i < 16; i++) {
+        int index = (indices >> (2 * i)) & 3;
+        if(skip[i] || (!four_colors && index == 3)) {
+            continue;
+        }
+        float t = weights[index];
+        float s = 1.0f - t;
+        aa += s * s;
+        ab += s * t;
+        bb += t * t;
+        const float values[3] = {(float)pixels[i].r, (float)pixels[i].g, (float)pixels[i].b};
+        for(int c = 0; c < 3; c++) {
+            ax[c] += s * values[c];
+            bx[c] += t * values[c];
+        }
+    }
+    float determinant = aa * bb - ab * ab;
+    if(std::fabs(determinant) < 1e-6f) {
+        return false;
+    }
+    for(int c = 0; c < 3; c++) {
+        out_start[c] = (ax[c] * bb - bx[c] * ab) / determinant;
+        out_end[c] = (bx[c] * aa - ax[c] * ab) / determinant;
+    }
+    return true;
+}
+
+struct _BC1Candidate {
+    uint16_t color0 = 0;
+    uint16_t color1 = 0;
+    uint32_t indices = 0;
+    int error = INT32_MAX;
+};
+
+/**
+ * Find the indices for the endpoints, and order the endpoints so the block is decoded in the intended mode
+*/
+inline _BC1Candidate _bc1_evaluate(const ColorRGBA_UChar pixels[16], const bool skip[16], uint16_t color0, uint16_t color1, bool transparent) {
+    _BC1Candidate candidate = _BC1Candidate();
+    // Four colors are used when color0 > color1, and three colors plus transparent otherwise
+    if(transparent ? color0 > color1 : color0 < color1) {
+        std::swap(color0, color1);
+    }
+    candidate.color0 = color0;
+    candidate.color1 = color1;
+    ColorRGBA_UChar palette[4];
+    if(color0 == color1) {
+        // Only one color either way, use index 0 which means the same in both modes
+        _bc1_palette(color0, color1, true, palette);
+        candidate.error = _bc1_pick_indices(pixels, skip, palette, 1, 3, candidate.indices);
+        return candidate;
+    }
+    _bc1_palette(color0, color1, !transparent, palette);
+    candidate.error = _bc1_pick_indices(pixels, skip, palette, transparent ? 3 : 4, 3, candidate.indices);
+    return candidate;
+}
+
+/**
+ * Encode the colors of a block into 8 bytes
+ * @arg allow_transparent: pixels with alpha < 128 become transparent(BC1 only, in BC3 the alpha is stored separately)
+*/
+inline void _encode_bc1_color_block(const ColorRGBA_UChar pixels[16], CompressionQuality quality, bool allow_transparent, unsigned char* out) {
+    bool skip[16];
+    bool transparent = false;
+    int count = 0;
+    float mean[3] = {0, 0, 0};
+    int min_color[3] = {255, 255, 255};
+    int max_color[3] = {0, 0, 0};
+    for(int i = 0; i < 16; i++) {
+        skip[i] = allow_transparent && pixels[i].a < 128;
+        transparent = transparent || skip[i];
+        if(skip[i]) {
+            continue;
+        }
+        const int values[3] = {pixels[i].r, pixels[i].g, pixels[i].b};
+        for(int c = 0; c < 3; c++) {
+            mean[c] += values[c];
+            min_color[c] = std::min(min_color[c], values[c]);
+            max_color[c] = std::max(max_color[c], values[c]);
+        }
+        count++;
+    }
+
+    _BC1Candidate best = _BC1Candidate();
+    if(count == 0) {
+        best.indices = 0xffffffff; // All transparent
+    }
+    else {
+        for(int c = 0; c < 3; c++) {
+            mean[c] /= count;
+        }
+        float start[3];
+        float end[3];
+        if(quality == COMPRESSION_FAST) {
+            // The diagonal of the bounding box, flipped along the axes that go the other way
+            float covariance_rg = 0;
+            float covariance_bg = 0;
+            for(int i = 0; i < 16; i++) {
+                if(!skip[i]) {
+                    covariance_rg += (pixels[i].r - mean[0]) * (pixels[i].g - mean[1]);
+                    covariance_bg += (pixels[i].b - mean[2]) * (pixels[i].g - mean[1]);
+                }
+            }
+            for(int c = 0; c < 3; c++) {
+                start[c] = min_color[c];
+                end[c] = max_color[c];
+            }
+            if(covariance_rg < 0) {
+                std::swap(start[0], end[0]);
+            }
+            if(covariance_bg < 0) {
+                std::swap(start[2], end[2]);
+            }
+        }
+        else {
+            // The main axis of the colors, using power iteration on the covariance matrix
+            float covariance[6] = {0, 0, 0, 0, 0, 0}; // rr, rg, rb, gg, gb, bb
+            for(int i = 0; i < 16; i++) {
+                if(skip[i]) {
+                    continue;
+                }
+                float r = pixels[i].r - mean[0];
+                float g = pixels[i].g - mean[1];
+                float b = pixels[i].b - mean[2];
+                covariance[0] += r * r;
+                covariance[1] += r * g;
+                covariance[2] += r * b;
+                covariance[3] += g * g;
+                covariance[4] += g * b;
+                covariance[5] += b * b;
+            }
+            float axis[3] = {(float)(max_color[0] - min_color[0]), (float)(max_color[1] - min_color[1]), (float)(max_color[2] - min_color[2])};
+            for(int iteration = 0; iteration < 4; iteration++) {
+                float next[3] = {
+                    covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+                    covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+                    covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2]
+                };
+                float length = std::max(std::max(std::fabs(next[0]), std::fabs(next[1])), std::fabs(next[2]));
+                if(length < 1e-6f) {
+                    break;
+                }
+                for(int c = 0; c < 3; c++) {
+                    axis[c] = next[c] / length;
+                }
+            }
+            float min_t = INFINITY;
+            float max_t = -INFINITY;
+            for(int i = 0; i < 16; i++) {
+                if(skip[i]) {
+                    continue;
+                }
+                float t = (pixels[i].r - mean[0]) * axis[0] + (pixels[i].g - mean[1]) * axis[1] + (pixels[i].b - mean[2]) * axis[2];
+                min_t = std::min(min_t, t);
+                max_t = std::max(max_t, t);
+            }
+            float axis_length_squared = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+            if(axis_length_squared < 1e-6f) {
+                axis_length_squared = 1.0f; // All pixels have the same color
+                min_t = 0.0f;
+                max_t = 0.0f;
+            }
+            for(int c = 0; c < 3; c++) {
+                start[c] = mean[c] + axis[c] * min_t / axis_length_squared;
+                end[c] = mean[c] + axis[c] * max_t / axis_length_squared;
+            }
+        }
+        best = _bc1_evaluate(pixels, skip, _to_rgb565(start[0], start[1], start[2]), _to_rgb565(end[0], end[1], end[2]), transparent);
+
+        if(quality == COMPRESSION_HIGH) {
+            for(int iteration = 0; iteration < 2 && best.error > 0; iteration++) {
+                bool four_colors = !transparent && best.color0 != best.color1;
+                if(!_bc1_refine_endpoints(pixels, skip, best.indices, four_colors, start, end)) {
+                    break;
+                }
+                _BC1Candidate refined = _bc1_evaluate(pixels, skip, _to_rgb565(start[0], start[1], start[2]), _to_rgb565(end[0], end[1], end[2]), transparent);
+                if(refined.error >= best.error) {
+                    break;
+                }
+                best = refined;
+            }
+            // Nudge the endpoints one step at a time, helps with flat areas where the color is between two 5:6:5 colors
+            const int shifts[3] = {11, 5, 0};
+            for(int round = 0; round < 4 && best.error > 0; round++) {
+                bool improved = false;
+                for(int endpoint = 0; endpoint < 2; endpoint++) {
+                    for(int c = 0; c < 3; c++) {
+                        for(int step = -1; step <= 1; step += 2) {
+                            uint16_t colors[2] = {best.color0, best.color1};
+                            int max_value = c == 1 ? 63 : 31;
+                            int value = ((colors[endpoint] >> shifts[c]) & max_value) + step;
+                            if(value < 0 || value > max_value) {
+                                continue;
+                            }
+                            colors[endpoint] = (colors[endpoint] & ~(max_value << shifts[c])) | (value << shifts[c]);
+                            _BC1Candidate nudged = _bc1_evaluate(pixels, skip, colors[0], colors[1], transparent);
+                            if(nudged.error < best.error) {
+                                best = nudged;
+                                improved = true;
+                            }
+                        }
+                    }
+                }
+                if(!improved) {
+                    break;
+                }
+            }
+        }
+    }
+    out[0] = best.color0 & 0xff;
+    out[1] = best.color0 >> 8;
+    out[2] = best.color1 & 0xff;
+    out[3] = best.color1 >> 8;
+    for(int i = 0; i < 4; i++) {
+        out[4 + i] = (best.indices >> (8 * i)) & 0xff;
+    }
+}
+
+// The 8 alpha values of a BC3 alpha block
+inline void _bc3_alpha_palette(int alpha0, int alpha1, int palette[8]) {
+    palette[0] = alpha0;
+    palette[1] = alpha1;
+    if(alpha0 > alpha1) {
+        for(int i = 1; i < 7; i++) {
+            palette[i + 1] = ((7 - i) * alpha0 + i * alpha1) / 7;
+        }
+    }
+    else {
+        for(int i = 1; i < 5; i++) {
+            palette[i + 1] = ((5 - i) * alpha0 + i * alpha1) / 5;
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+inline int _bc3_alpha_pick_indices(const unsigned char alphas[16], int alpha0, int alpha1, uint64_t& out_indices) {
+    int palette[8];
+    _bc3_alpha_palette(alpha0, alpha1, palette);
+    int total_error = 0;
+    out_indices = 0;
+    for(int i = 0; i < 16; i++) {
+        int best_index = 0;
+        int best_error = INT32_MAX;
+        for(int j = 0; j < 8; j++) {
+            int error = (alphas[i] - palette[j]) * (alphas[i] - palette[j]);
+            if(error < best_error) {
+                best_error = error;
+                best_index = j;
+            }
+        }
+        total_error += best_error;
+        out_indices |= (uint64_t)best_index << (3 * i);
+    }
+    return total_error;
+}
+
+// Encode the alpha of a block into 8 bytes
+inline void _encode_bc3_alpha_block(const ColorRGBA_UChar pixels[16], CompressionQuality quality, unsigned char* out) {
+    unsigned char alphas[16];
+    int min_alpha = 255;
+    int max_alpha = 0;
+    int min_inner = 255; // Not counting 0 and 255, which the six value mode has as fixed values
+    int max_inner = 0;
+    for(int i = 0; i < 16; i++) {
+        alphas[i] = pixels[i].a;
+        min_alpha = std::min(min_alpha, (int)alphas[i]);
+        max_alpha = std::max(max_alpha, (int)alphas[i]);
+        if(alphas[i] != 0 && alphas[i] != 255) {
+            min_inner = std::min(min_inner, (int)alphas[i]);
+            max_inner = std::max(max_inner, (int)alphas[i]);
+        }
+    }
+    int alpha0 = max_alpha;
+    int alpha1 = min_alpha;
+    uint64_t indices = 0;
+    int error = _bc3_alpha_pick_indices(alphas, alpha0, alpha1, indices);
+    if(quality != COMPRESSION_FAST && error > 0) {
+        // Six interpolated values, plus exact 0 and 255
+        if(min_inner > max_inner) {
+            min_inner = max_inner = min_alpha;
+        }
+        uint64_t six_indices = 0;
+        int six_error = _bc3_alpha_pick_indices(alphas, min_inner, max_inner, six_indices);
+        if(six_error < error) {
+            alpha0 = min_inner;
+            alpha1 = max_inner;
+            indices = six_indices;
+            error = six_error;
+        }
+    }
+    if(quality == COMPRESSION_HIGH && error > 0 && alpha0 > alpha1) {
+        // Try moving the endpoints inwards, the extremes are often better served by the interpolated values
+        int max_shrink = std::min((alpha0 - alpha1) / 8, 4);
+        for(int shrink0 = 0; shrink0 <= max_shrink; shrink0++) {
+            for(int shrink1 = 0; shrink1 <= max_shrink; shrink1++) {
+                if(alpha0 - shrink0 <= alpha1 + shrink1) {
+                    continue;
+                }
+                uint64_t new_indices = 0;
+                int new_error = _bc3_alpha_pick_indices(alphas, max_alpha - shrink0, min_alpha + shrink1, new_indices);
+                if(new_error < error) {
+                    error = new_error;
+                    indices = new_indices;
+                    alpha0 = max_alpha - shrink0;
+                    alpha1 = min_alpha + shrink1;
+                }
+            }
+        }
+    }
+    out[0] = alpha0;
+    out[1] = alpha1;
+    for(int i = 0; i < 6; i++) {
+        out[2 + i] = (indices >> (8 * i)) & 0xff;
+    }
+}
+
+inline void _decode_bc1_color_block(const unsigned char* block, bool force_four_colors, ColorRGBA_UChar out[16]) {
+    uint16_t color0 = block[0] | (block[1] << 8);
+    uint16_t color1 = block[2] | (block[3] << 8);
+    ColorRGBA_UChar palette[4];
+    _bc1_palette(color0, color1, force_four_colors || color0 > color1, palette);
+    uint32_t indices = block[4] | (block[5] << 8) | (block[6] << 16) | ((uint32_t)block[7] << 24);
+    for(int i = 0; i < 16; i++) {
+        out[i] = palette[(indices >> (2 * i)) & 3];
+    }
+}
+
+inline void _decode_bc3_alpha_block(const unsigned char* block, ColorRGBA_UChar out[16]) {
+    int palette[8];
+    _bc3_alpha_palette(block[0], block[1], palette);
+    uint64_t indices = 0;
+    for(int i = 0; i < 6; i++) {
+        indices |= (uint64_t)block[2 + i] << (8 * i);
+    }
+    for(int i = 0; i < 16; i++) {
+        out[i].a = palette[(indices >> (3 * i)) & 7];
+    }
+}
+
+// ----- ETC2 RGBA -----
+
+// ETC blocks are stored as big endian 64 bit values, with the pixel indices going down the columns first
+const int _ETC_MODIFIER_TABLES[8][4] = {
+    {2, 8, -2, -8}, {5, 17, -5, -17}, {9, 29, -9, -29}, {13, 42, -13, -42},
+    {18, 60, -18, -60}, {24, 80, -24, -80}, {33, 106, -33, -106}, {47, 183, -47, -183}
+};
+const int _ETC_DISTANCE_TABLE[8] = {3, 6, 11, 16, 23, 32, 41, 64}; // For the T and H modes
+
+const int _EAC_MODIFIER_TABLES[16][8] = {
+    {-3, -6, -9, -15, 2, 5, 8, 14}, {-3, -7, -10, -13, 2, 6, 9, 12}, {-2, -5, -8, -13, 1, 4, 7, 12}, {-2, -4, -6, -13, 1, 3, 5, 12},
+    {-3, -6, -8, -12, 2, 5, 7, 11}, {-3, -7, -9, -11, 2, 6, 8, 10}, {-4, -7, -8, -11, 3, 6, 7, 10}, {-3, -5, -8, -11, 2, 4, 7, 10},
+    {-2, -6, -8, -10, 1, 5, 7, 9}, {-2, -5, -8, -10, 1, 4, 7, 9}, {-2, -4, -8, -10, 1, 3, 7, 9}, {-2, -5, -7, -10, 1, 4, 6, 9},
+    {-3, -4, -7, -10, 2, 3, 6, 9}, {-1, -2, -3, -10, 0, 1, 2, 9}, {-4, -6, -8, -9, 3, 5, 7, 8}, {-3, -5, -7, -9, 2, 4, 6, 8}
+};
+
+inline uint64_t _read_u64_big_endian(const unsigned char* bytes) {
+    uint64_t value = 0;
+    for(int i = 0; i < 8; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+inline void _write_u64_big_endian(uint64_t value, unsigned char* bytes) {
+    for(int i = 7; i >= 0; i--) {
+        bytes[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+inline int _etc_bits(uint64_t block, int high_bit, int bit_count) {
+    return (int)((block >> (high_bit - bit_count + 1)) & ((1u << bit_count) - 1));
+}
+
+inline int _etc_signed_3_bits(int value) {
+    return value >= 4 ? value - 8 : value;
+}
+
+inline int _extend_4_bits(int value) {
+    return (value << 4) | value;
+}
+inline int _extend_5_bits(int value) {
+    return (value << 3) | (value >> 2);
+}
+inline int _extend_6_bits(int value) {
+    return (value << 2) | (value >> 4);
+}
+inline int _extend_7_bits(int value) {
+    return (value << 1) | (value >> 6);
+}
+
+// The pixel index(0 to 3) of pixel i, counting row by row
+inline int _etc_pixel_index(uint64_t block, int i) {
+    int bit = (i % 4) * 4 + i / 4;
+    return (int)(((block >> (bit + 16)) & 1) << 1 | ((block >> bit) & 1));
+}
+
+inline void _decode_etc2_rgb_block(uint64_t block, ColorRGBA_UChar out[16]) {
+    bool differential = (block >> 33) & 1;
+    if(differential) {
+        // Check for the modes that are flagged by the differential colors going out of range
+        int r = _etc_bits(block, 63, 5) + _etc_signed_3_bits(_etc_bits(block, 58, 3));
+        int g = _etc_bits(block, 55, 5) + _etc_signed_3_bits(_etc_bits(block, 50, 3));
+        int b = _etc_bits(block, 47, 5) + _etc_signed_3_bits(_etc_bits(block, 42, 3));
+        if(r < 0 || r > 31) {
+            // T mode
+            int c1[3] = {
+                _extend_4_bits(_etc_bits(block, 60, 2) << 2 | _etc_bits(block, 57, 2)),
+                _extend_4_bits(_etc_bits(block, 55, 4)),
+                _extend_4_bits(_etc_bits(block, 51, 4))
+            };
+            int c2[3] = {_extend_4_bits(_etc_bits(block, 47, 4)), _extend_4_bits(_etc_bits(block, 43, 4)), _extend_4_bits(_etc_bits(block, 39, 4))};
+            int distance = _ETC_DISTANCE_TABLE[_etc_bits(block, 35, 2) << 1 | _etc_bits(block, 32, 1)];
+            ColorRGBA_UChar palette[4] = {
+                ColorRGBA_UChar(c1[0], c1[1], c1[2], 255),
+                ColorRGBA_UChar(_clamp_255(c2[0] + distance), _clamp_255(c2[1] + distance), _clamp_255(c2[2] + distance), 255),
+                ColorRGBA_UChar(c2[0], c2[1], c2[2], 255),
+                ColorRGBA_UChar(_clamp_255(c2[0] - distance), _clamp_255(c2[1] - distance), _clamp_255(c2[2] - distance), 255)
+            };
+            for(int i = 0; i < 16; i++) {
+                out[i] = palette[_etc_pixel_index(block, i)];
+            }
+            return;
+        }
+        if(g < 0 || g > 31) {
+            // H mode
+            int r1 = _etc_bits(block, 62, 4);
+            int g1 = _etc_bits(block, 58, 3) << 1 | _etc_bits(block, 52, 1);
+            int b1 = _etc_bits(block, 51, 1) << 3 | _etc_bits(block, 49, 3);
+            int r2 = _etc_bits(block, 46, 4);
+            int g2 = _etc_bits(block, 42, 4);
+            int b2 = _etc_bits(block, 38, 4);
+            int order = ((r1 << 8) | (g1 << 4) | b1) >= ((r2 << 8) | (g2 << 4) | b2) ? 1 : 0;
+            int distance = _ETC_DISTANCE_TABLE[_etc_bits(block, 34, 1) << 2 | _etc_bits(block, 32, 1) << 1 | order];
+            int c1[3] = {_extend_4_bits(r1), _extend_4_bits(g1), _extend_4_bits(b1)};
+            int c2[3] = {_extend_4_bits(r2), _extend_4_bits(g2), _extend_4_bits(b2)};
+            ColorRGBA_UChar palette[4] = {
+                ColorRGBA_UChar(_clamp_255(c1[0] + distance), _clamp_255(c1[1] + distance), _clamp_255(c1[2] + distance), 255),
+                ColorRGBA_UChar(_clamp_255(c1[0] - distance), _clamp_255(c1[1] - distance), _clamp_255(c1[2] - distance), 255),
+                ColorRGBA_UChar(_clamp_255(c2[0] + distance), _clamp_255(c2[1] + distance), _clamp_255(c2[2] + distance), 255),
+                ColorRGBA_UChar(_clamp_255(c2[0] - distance), _clamp_255(c2[1] - distance), _clamp_255(c2[2] - distance), 255)
+            };
+            for(int i = 0; i < 16; i++) {
+                out[i] = palette[_etc_pixel_index(block, i)];
+            }
+            return;
+        }
+        if(b < 0 || b > 31) {
+            // Planar mode, a gradient over the block
+            int origin[3] = {
+                _extend_6_bits(_etc_bits(block, 62, 6)),
+                _extend_7_bits(_etc_bits(block, 56, 1) << 6 | _etc_bits(block, 54, 6)),
+                _extend_6_bits(_etc_bits(block, 48, 1) << 5 | _etc_bits(block, 44, 2) << 3 | _etc_bits(block, 41, 3))
+            };
+            int horizontal[3] = {
+                _extend_6_bits(_etc_bits(block, 38, 5) << 1 | _etc_bits(block, 32, 1)),
+                _extend_7_bits(_etc_bits(block, 31, 7)),
+                _extend_6_bits(_etc_bits(block, 24, 6))
+            };
+            int vertical[3] = {_extend_6_bits(_etc_bits(block, 18, 6)), _extend_7_bits(_etc_bits(block, 12, 7)), _extend_6_bits(_etc_bits(block, 5, 6))};
+            for(int i = 0; i < 16; i++) {
+                int x = i % 4;
+                int y = i / 4;
+                int values[3];
+                for(int c = 0; c < 3; c++) {
+                    values[c] = _clamp_255((x * (horizontal[c] - origin[c]) + y * (vertical[c] - origin[c]) + 4 * origin[c] + 2) >> 2);
+                }
+                out[i] = ColorRGBA_UChar(values[0], values[1], values[2], 255);
+            }
+            return;
+        }
+    }
+    // Individual or differential mode, two sub blocks with a base color and a modifier table each
+    int base[2][3];
+    if(differential) {
+        for(int c = 0; c < 3; c++) {
+            int value = _etc_bits(block, 63 - 8 * c, 5);
+            base[0][c] = _extend_5_bits(value);
+            base[1][c] = _extend_5_bits(value + _etc_signed_3_bits(_etc_bits(block, 58 - 8 * c, 3)));
+        }
+    }
+    else {
+        for(int c = 0; c < 3; c++) {
+            base[0][c] = _extend_4_bits(_etc_bits(block, 63 - 8 * c, 4));
+            base[1][c] = _extend_4_bits(_etc_bits(block, 59 - 8 * c, 4));
+        }
+    }
+    int tables[2] = {_etc_bits(block, 39, 3), _etc_bits(block, 36, 3)};
+    bool flip = (block >> 32) & 1;
+    for(int i = 0; i < 16; i++) {
+        int x = i % 4;
+        int y = i / 4;
+        int sub_block = flip ? (y >= 2) : (x >= 2);
+        int modifier = _ETC_MODIFIER_TABLES[tables[sub_block]][_etc_pixel_index(block, i)];
+        out[i] = ColorRGBA_UChar(_clamp_255(base[sub_block][0] + modifier), _clamp_255(base[sub_block][1] + modifier), _clamp_255(base[sub_block][2] + modifier), 255);
+    }
+}
+
+inline void _decode_eac_alpha_block(uint64_t block, ColorRGBA_UChar out[16]) {
+    int base = _etc_bits(block, 63, 8);
+    int multiplier = _etc_bits(block, 55, 4);
+    const int* table = _EAC_MODIFIER_TABLES[_etc_bits(block, 51, 4)];
+    for(int i = 0; i < 16; i++) {
+        int bit = 45 - ((i % 4) * 4 + i / 4) * 3;
+        out[i].a = _clamp_255(base + table[(block >> bit) & 7] * multiplier);
+    }
+}
+
+/**
+ * Find the best modifier table and pixel indices for a sub block with the given base color
+ * @arg sub_block_mask: bit i is set for the pixels(row by row) in the sub block
+*/
+inline int _etc_fit_sub_block(const ColorRGBA_UChar pixels[16], int sub_block_mask, const int base[3], int& out_table, uint32_t& out_indices) {
+    int best_error = INT32_MAX;
+    for(int table = 0; table < 8; table++) {
+        int palette[4][3];
+        for(int index = 0; index < 4; index++) {
+            for(int c = 0; c < 3; c++) {
+                palette[index][c] = _clamp_255(base[c] + _ETC_MODIFIER_TABLES[table][index]);
+            }
+        }
+        int error = 0;
+        uint32_t indices = 0;
+        for(int i = 0; i < 16 && error < best_error; i++) {
+            if(((sub_block_mask >> i) & 1) == 0) {
+                continue;
+            }
+            int best_pixel_error = INT32_MAX;
+            int best_index = 0;
+            for(int index = 0; index < 4; index++) {
+                int pixel_error = _color_distance_squared(pixels[i], palette[index][0], palette[index][1], palette[index][2]);
+                if(pixel_error < best_pixel_error) {
+                    best_pixel_error = pixel_error;
+                    best_index = index;
+                }
+            }
+            error += best_pixel_error;
+            int bit = (i % 4) * 4 + i / 4;
+            indices |= (uint32_t)((best_index >> 1) << (bit + 16)) | (uint32_t)((best_index & 1) << bit);
+        }
+        if(error < best_error) {
+            best_error = error;
+            out_table = table;
+            out_indices = indices;
+        }
+    }
+    return best_error;
+}
+
+struct _ETCCandidate {
+    uint64_t block = 0;
+    int error = INT32_MAX;
+};
+
+/**
+ * Try the individual(4 bit colors) or differential(5 bit colors close to each other) mode for one flip direction
+*/
+inline _ETCCandidate _etc_encode_sub_blocks(const ColorRGBA_UChar pixels[16], bool flip, bool differential, bool refine) {
+    int masks[2] = {0, 0};
+    float mean[2][3] = {{0, 0, 0}, {0, 0, 0}};
+    for(int i = 0; i < 16; i++) {
+        int sub_block = flip ? (i / 4 >= 2) : (i % 4 >= 2);
+        masks[sub_block] |= 1 << i;
+        mean[sub_block][0] += pixels[i].r / 8.0f;
+        mean[sub_block][1] += pixels[i].g / 8.0f;
+        mean[sub_block][2] += pixels[i].b / 8.0f;
+    }
+    int max_value = differential ? 31 : 15;
+    int quantized[2][3];
+    for(int s = 0; s < 2; s++) {
+        for(int c = 0; c < 3; c++) {
+            quantized[s][c] = std::min(std::max((int)(mean[s][c] * max_value / 255.0f + 0.5f), 0), max_value);
+        }
+    }
+    _ETCCandidate candidate = _ETCCandidate();
+    int tables[2] = {0, 0};
+    uint32_t indices[2] = {0, 0};
+    int errors[2] = {0, 0};
+    for(int s = 0; s < 2; s++) {
+        if(differential && s == 1) {
+            // The first base color may have been moved by the refinement
+            for(int c = 0; c < 3; c++) {
+                quantized[1][c] = quantized[0][c] + std::min(std::max(quantized[1][c] - quantized[0][c], -4), 3);
+            }
+        }
+        auto fit = [&](const int q[3], int& table, uint32_t& sub_indices) {
+            int base[3];
+            for(int c = 0; c < 3; c++) {
+                base[c] = differential ? _extend_5_bits(q[c]) : _extend_4_bits(q[c]);
+            }
+            return _etc_fit_sub_block(pixels, masks[s], base, table, sub_indices);
+        };
+        errors[s] = fit(quantized[s], tables[s], indices[s]);
+        if(!refine) {
+            continue;
+        }
+        // Move the base color one step at a time while it improves
+        for(int round = 0; round < 4 && errors[s] > 0; round++) {
+            bool improved = false;
+            for(int c = 0; c < 3; c++) {
+                for(int step = -1; step <= 1; step += 2) {
+                    int q[3] = {quantized[s][0], quantized[s][1], quantized[s][2]};
+                    q[c] += step;
+                    bool valid = q[c] >= 0 && q[c] <= max_value;
+                    if(differential && s == 1) {
+                        valid = valid && q[c] - quantized[0][c] >= -4 && q[c] - quantized[0][c] <= 3;
+                    }
+                    if(!valid) {
+                        continue;
+                    }
+                    int table = 0;
+                    uint32_t sub_indices = 0;
+                    int error = fit(q, table, sub_indices);
+                    if(error < errors[s]) {
+                        errors[s] = error;
+                        tables[s] = table;
+                        indices[s] = sub_indices;
+                        quantized[s][c] = q[c];
+                        improved = true;
+                    }
+                }
+            }
+            if(!improved) {
+                break;
+            }
+        }
+    }
+
+    uint64_t block = 0;
+    for(int c = 0; c < 3; c++) {
+        if(differential) {
+            int delta = quantized[1][c] - quantized[0][c];
+            block |= (uint64_t)quantized[0][c] << (59 - 8 * c);
+            block |= (uint64_t)(delta & 7) << (56 - 8 * c);
+        }
+        else {
+            block |= (uint64_t)quantized[0][c] << (60 - 8 * c);
+            block |= (uint64_t)quantized[1][c] << (56 - 8 * c);
+        }
+    }
+    block |= (uint64_t)tables[0] << 37;
+    block |= (uint64_t)tables[1] << 34;
+    block |= (uint64_t)(differential ? 1 : 0) << 33;
+    block |= (uint64_t)(flip ? 1 : 0) << 32;
+    block |= indices[0] | indices[1];
+    candidate.block = block;
+    candidate.error = errors[0] + errors[1];
+    return candidate;
+}
+
+/**
+ * Planar mode, fits a gradient to the block, good for smooth areas
+*/
+inline _ETCCandidate _etc_encode_planar(const ColorRGBA_UChar pixels[16]) {
+    // Least squares fit of value = a + b * x + c * y, then origin = a, horizontal = a + 4b, vertical = a + 4c
+    const int bits[3] = {6, 7, 6};
+    int quantized[3][3]; // origin, horizontal, vertical for r, g, b
+    for(int c = 0; c < 3; c++) {
+        float sum = 0, sum_x = 0, sum_y = 0;
+        for(int i = 0; i < 16; i++) {
+            float value = c == 0 ? pixels[i].r : (c == 1 ? pixels[i].g : pixels[i].b);
+            sum += value;
+            sum_x += value * (i % 4 - 1.5f);
+            sum_y += value * (i / 4 - 1.5f);
+        }
+        float slope_x = sum_x / 20.0f; // sum of (x - 1.5)^2 over the block
+        float slope_y = sum_y / 20.0f;
+        float a = sum / 16.0f - 1.5f * slope_x - 1.5f * slope_y;
+        float points[3] = {a, a + 4 * slope_x, a + 4 * slope_y};
+        int max_value = (1 << bits[c]) - 1;
+        for(int p = 0; p < 3; p++) {
+            quantized[p][c] = std::min(std::max((int)(points[p] * max_value / 255.0f + 0.5f), 0), max_value);
+        }
+    }
+    int origin_r = quantized[0][0], origin_g = quantized[0][1], origin_b = quantized[0][2];
+    uint64_t block = 0;
+    block |= (uint64_t)origin_r << 57;
+    block |= (uint64_t)(origin_g >> 6) << 56;
+    block |= (uint64_t)(origin_g & 63) << 49;
+    block |= (uint64_t)(origin_b >> 5) << 48;
+    block |= (uint64_t)((origin_b >> 3) & 3) << 43;
+    block |= (uint64_t)(origin_b & 7) << 39;
+    block |= (uint64_t)(quantized[1][0] >> 1) << 34;
+    block |= (uint64_t)1 << 33;
+    block |= (uint64_t)(quantized[1][0] & 1) << 32;
+    block |= (uint64_t)quantized[1][1] << 25;
+    block |= (uint64_t)quantized[1][2] << 19;
+    block |= (uint64_t)quantized[2][0] << 13;
+    block |= (uint64_t)quantized[2][1] << 6;
+    block |= (uint64_t)quantized[2][2];
+
+    // The unused bits have to be set so red and green stay in range, and blue goes out of range(which flags planar mode)
+    if(_etc_bits(block, 62, 4) + _etc_signed_3_bits(_etc_bits(block, 58, 3)) < 0) {
+        block |= (uint64_t)1 << 63;
+    }
+    if(_etc_bits(block, 54, 4) + _etc_signed_3_bits(_etc_bits(block, 50, 3)) < 0) {
+        block |= (uint64_t)1 << 55;
+    }
+    if(_etc_bits(block, 44, 2) + _etc_bits(block, 41, 2) < 4) {
+        block |= (uint64_t)1 << 42; // Blue below zero
+    }
+    else {
+        block |= (uint64_t)7 << 45; // Blue above 31
+    }
+
+    _ETCCandidate candidate = _ETCCandidate();
+    candidate.block = block;
+    ColorRGBA_UChar decoded[16];
+    _decode_etc2_rgb_block(block, decoded);
+    candidate.error = 0;
+    for(int i = 0; i < 16; i++) {
+        candidate.error += _color_distance_squared(pixels[i], decoded[i].r, decoded[i].g, decoded[i].b);
+    }
+    return candidate;
+}
+
+inline uint64_t _encode_etc2_rgb_block(const ColorRGBA_UChar pixels[16], CompressionQuality quality) {
+    _ETCCandidate best = _ETCCandidate();
+    int best_flip = 0;
+    int best_differential = 1;
+    for(int flip = 0; flip < 2; flip++) {
+        for(int differential = 1; differential >= 0; differential--) {
+            _ETCCandidate candidate = _etc_encode_sub_blocks(pixels, flip, differential, false);
+            if(candidate.error < best.error) {
+                best = candidate;
+                best_flip = flip;
+                best_differential = differential;
+            }
+            if(quality == COMPRESSION_FAST) {
+                break; // Only the differential mode, which works for most blocks
+            }
+        }
+    }
+    if(quality == COMPRESSION_HIGH && best.error > 0) {
+        // Refine the base colors of the best layout, and try a gradient
+        _ETCCandidate refined = _etc_encode_sub_blocks(pixels, best_flip, best_differential, true);
+        if(refined.error < best.error) {
+            best = refined;
+        }
+        _ETCCandidate planar = _etc_encode_planar(pixels);
+        if(planar.error < best.error) {
+            best = planar;
+        }
+    }
+    return best.block;
+}
+
+inline uint64_t _encode_eac_alpha_block(const ColorRGBA_UChar pixels[16], CompressionQuality quality) {
+    int min_alpha = 255;
+    int max_alpha = 0;
+    for(int i = 0; i < 16; i++) {
+        min_alpha = std::min(min_alpha, (int)pixels[i].a);
+        max_alpha = std::max(max_alpha, (int)pixels[i].a);
+    }
+    if(min_alpha == max_alpha) {
+        // Table 13 has a zero modifier, so every pixel can be exactly the base value
+        uint64_t block = (uint64_t)min_alpha << 56 | (uint64_t)1 << 52 | (uint64_t)13 << 48;
+        for(int i = 0; i < 16; i++) {
+            block |= (uint64_t)4 << (45 - 3 * i);
+        }
+        return block;
+    }
+    uint64_t best_block = 0;
+    int best_error = INT32_MAX;
+    int range = max_alpha - min_alpha;
+    int table_step = quality == COMPRESSION_FAST ? 15 : 1; // With fast quality only the first and last tables are tried
+    for(int table = 0; table < 16; table += table_step) {
+        const int* modifiers = _EAC_MODIFIER_TABLES[table];
+        int table_range = modifiers[7] - modifiers[3];
+        int base_multiplier = std::max(1, std::min(15, (range + table_range / 2) / table_range));
+        int multiplier_search = quality == COMPRESSION_HIGH ? 1 : 0;
+        for(int multiplier = std::max(1, base_multiplier - multiplier_search); multiplier <= std::min(15, base_multiplier + multiplier_search); multiplier++) {
+            // Center the table over the range of the values
+            int center = (min_alpha + max_alpha + 1) / 2 - (modifiers[7] + modifiers[3]) * multiplier / 2;
+            int base = _clamp_255(center);
+            int values[8];
+            for(int index = 0; index < 8; index++) {
+                values[index] = _clamp_255(base + modifiers[index] * multiplier);
+            }
+            int error = 0;
+            uint64_t block = (uint64_t)base << 56 | (uint64_t)multiplier << 52 | (uint64_t)table << 48;
+            for(int i = 0; i < 16 && error < best_error; i++) {
+                int best_pixel_error = INT32_MAX;
+                int best_index = 0;
+                int x = i % 4;
+                int y = i / 4;
+                int alpha = pixels[i].a;
+                for(int index = 0; index < 8; index++) {
+                    int pixel_error = (alpha - values[index]) * (alpha - values[index]);
+                    if(pixel_error < best_pixel_error) {
+                        best_pixel_error = pixel_error;
+                        best_index = index;
+                    }
+                }
+                error += best_pixel_error;
+                block |= (uint64_t)best_index << (45 - 3 * (x * 4 + y));
+            }
+            if(error < best_error) {
+                best_error = error;
+                best_block = block;
+            }
+        }
+    }
+    return best_block;
+}
+
+// ----- Whole images -----
+
+inline void _encode_block(const ColorRGBA_UChar pixels[16], CompressedFormat format, CompressionQuality quality, unsigned char* out) {
+    if(format == COMPRESSED_BC1) {
+        _encode_bc1_color_block(pixels, quality, true, out);
+    }
+    else if(format == COMPRESSED_BC3) {
+        _encode_bc3_alpha_block(pixels, quality, out);
+        _encode_bc1_color_block(pixels, quality, false, out + 8);
+    }
+    else {
+        _write_u64_big_endian(_encode_eac_alpha_block(pixels, quality), out);
+        _write_u64_big_endian(_encode_etc2_rgb_block(pixels, quality), out + 8);
+    }
+}
+
+inline void _decode_block(const unsigned char* block, CompressedFormat format, ColorRGBA_UChar out[16]) {
+    if(format == COMPRESSED_BC1) {
+        _decode_bc1_color_block(block, false, out);
+    }
+    else if(format == COMPRESSED_BC3) {
+        _decode_bc1_color_block(block + 8, true, out);
+        _decode_bc3_alpha_block(block, out);
+    }
+    else {
+        _decode_etc2_rgb_block(_read_u64_big_endian(block + 8), out);
+        _decode_eac_alpha_block(_read_u64_big_endian(block), out);
+    }
+}
+
+/**
+ * Compress an image into 4x4 blocks, each row of blocks is encoded in parallel on the worker pool
+ * Images that are not a multiple of 4 in size are padded by repeating the edge pixels
+*/
+CompressedImage compress_image(ConstImageViewRGBA image, CompressedFormat format, CompressionQuality quality = COMPRESSION_NORMAL, bool multithreaded = true) {
+    CompressedImage compressed = CompressedImage();
+    compressed.format = format;
+    compressed.w = image.w;
+    compressed.h = image.h;
+    if(image.empty()) {
+        return compressed;
+    }
+    compressed.data.resize((size_t)compressed.blocks_x() * compressed.blocks_y() * CompressedImage::block_bytes(format));
+    auto encode_rows = [&](size_t begin, size_t end) {
+        ColorRGBA_UChar pixels[16];
+        for(size_t block_y = begin; block_y < end; block_y++) {
+            for(int block_x = 0; block_x < compressed.blocks_x(); block_x++) {
+                _get_block_pixels(image, block_x, block_y, pixels);
+                _encode_block(pixels, format, quality, compressed.get_block(block_x, block_y));
+            }
+        }
+    };
+    if(multithreaded) {
+        vicmil::parallel_for(0, compressed.blocks_y(), encode_rows, 1);
+    }
+    else {
+        encode_rows(0, compressed.blocks_y());
+    }
+    return compressed;
+}
+
+/**
+ * Decode a compressed image on the cpu, e.g. if the GPU does not support the format, or to check the quality
+*/
+ImageRGBA_UChar decompress_image(const CompressedImage& compressed) {
+    ImageRGBA_UChar image = ImageRGBA_UChar();
+    image.resize(compressed.w, compressed.h);
+    ColorRGBA_UChar pixels[16];
+    for(int block_y = 0; block_y < compressed.blocks_y(); block_y++) {
+        for(int block_x = 0; block_x < compressed.blocks_x(); block_x++) {
+            _decode_block(compressed.get_block(block_x, block_y), compressed.format, pixels);
+            for(int y = 0; y < 4 && block_y * 4 + y < image.h; y++) {
+                for(int x = 0; x < 4 && block_x * 4 + x < image.w; x++) {
+                    *image.get_pixel(block_x * 4 + x, block_y * 4 + y) = pixels[y * 4 + x];
+                }
+            }
+        }
+    }
+    return image;
+}
+
+/**
+ * Peak signal to noise ratio between two images of the same size in decibel, higher is better
+ * Returns INFINITY if the images are identical
+*/
+double get_psnr(ConstImageViewRGBA a, ConstImageViewRGBA b, bool include_alpha = true) {
+    Assert(a.w == b.w && a.h == b.h);
+    double squared_error = 0;
+    for(int y = 0; y < a.h; y++) {
+        const ColorRGBA_UChar* row_a = a.get_row(y);
+        const ColorRGBA_UChar* row_b = b.get_row(y);
+        for(int x = 0; x < a.w; x++) {
+            squared_error += _color_distance_squared(row_a[x], row_b[x].r, row_b[x].g, row_b[x].b);
+            if(include_alpha) {
+                squared_error += (row_a[x].a - row_b[x].a) * (row_a[x].a - row_b[x].a);
+            }
+        }
+    }
+    double mean_squared_error = squared_error / ((double)a.w * a.h * (include_alpha ? 4 : 3));
+    if(mean_squared_error == 0) {
+        return INFINITY;
+    }
+    return 10.0 * std::log10(255.0 * 255.0 / mean_squared_error);
+}
+
+void TEST_compress_image() {
+    // A smooth gradient with varying alpha, not a multiple of 4 in size so the edge blocks are padded
+    ImageRGBA_UChar image = ImageRGBA_UChar();
+    image.resize(62, 46);
+    for(int y = 0; y < image.h; y++) {
+        for(int x = 0; x < image.w; x++) {
+            *image.get_pixel(x, y) = ColorRGBA_UChar(x * 4, y * 4, (x + y) * 2, 255 - x * 2);
+        }
+    }
+    const CompressedFormat formats[] = {COMPRESSED_BC1, COMPRESSED_BC3, COMPRESSED_ETC2_RGBA};
+    for(int i = 0; i < 3; i++) {
+        CompressedImage compressed = compress_image(image.view(), formats[i], COMPRESSION_NORMAL, false);
+        Assert(compressed.data.size() == (size_t)16 * 12 * CompressedImage::block_bytes(formats[i]));
+        ImageRGBA_UChar decompressed = decompress_image(compressed);
+        Assert(decompressed.w == image.w && decompressed.h == image.h);
+        bool include_alpha = formats[i] != COMPRESSED_BC1; // BC1 only has 1 bit alpha
+        Assert(get_psnr(image.view(), decompressed.view(), include_alpha) > 37.0);
+    }
+    // HIGH uses the planar mode of ETC2, which is made for gradients
+    CompressedImage compressed = compress_image(image.view(), COMPRESSED_ETC2_RGBA, COMPRESSION_HIGH, false);
+    Assert(get_psnr(image.view(), decompress_image(compressed).view()) > 45.0);
+}
+AddTest(TEST_compress_image);
+
+// ============================================================
+//                      Texture cache
+// ============================================================
+
+/**
+ * Cache of decoded images on disk, so that later runs can skip decoding(e.g. inflating pngs) at startup
+ * An entry is stored per source file and set of options. It records the content hash of the source file,
+ *  so when the source changes the entry is stale, and it is rebuilt and overwritten on the next load
+ * The pixel data in an entry is 64 byte aligned, and entries are memory mapped when read,
+ *  so a warm start can upload the pixels straight from the file, see GPUTexture::from_cached_texture
+ * 
+ * TextureCache cache = TextureCache("texture_cache"); // The directory must exist
+ * CachedTexture texture = cache.load("assets/image.png");
+*/
+enum TextureCacheContent {
+    TEXTURE_CACHE_RGBA,       // The decoded image
+    TEXTURE_CACHE_MIP_CHAIN,  // All mip levels of the decoded image, see build_mip_chain
+    TEXTURE_CACHE_COMPRESSED  // The decoded image block compressed, see compress_image
+};
+
+struct TextureCacheOptions {
+    TextureCacheContent content = TEXTURE_CACHE_RGBA;
+    bool flip_vertical = false;
+    ResampleOptions mip_options = ResampleOptions(RESAMPLE_BOX); // Used for TEXTURE_CACHE_MIP_CHAIN
+    CompressedFormat compressed_format = COMPRESSED_BC3; // Used for TEXTURE_CACHE_COMPRESSED
+    CompressionQuality compression_quality = COMPRESSION_NORMAL; // Used for TEXTURE_CACHE_COMPRESSED
+    TextureCacheOptions() {}
+    TextureCacheOptions(TextureCacheContent content_) {
+        content = content_;
+    }
+    // Everything that changes what is stored in an entry
+    Hash128 get_hash() const {
+        return HashBuilder().add((int)content).add(flip_vertical)
+            .add((int)mip_options.filter).add(mip_options.gamma_correct).add(mip_options.premultiply_alpha)
+            .add((int)compressed_format).add((int)compression_quality).get_hash128();
+    }
+};
+
+const int _TEXTURE_CACHE_VERSION = 1;
+const uint32_t _TEXTURE_CACHE_BYTE_ORDER = 0x01020304; // Entries written with another byte order are rebuilt
+const size_t _TEXTURE_CACHE_ALIGNMENT = 64;
+
+struct _TextureCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t content_hash_low;
+    uint64_t content_hash_high;
+    uint64_t options_hash_low;
+    uint64_t options_hash_high;
+    uint32_t content;
+    uint32_t compressed_format;
+    int32_t w;
+    int32_t h;
+    uint32_t level_count;
+    uint32_t reserved;
+    uint64_t file_size;
+};
+
+struct _TextureCacheLevel {
+    uint64_t offset; // From the start of the file
+    uint64_t size;   // In bytes
+    int32_t w;
+    int32_t h;
+};
+
+static_assert(sizeof(_TextureCacheHeader) == 80, "The texture cache header must have the same size on all platforms");
+static_assert(sizeof(_TextureCacheLevel) == 24, "The texture cache levels must have the same size on all platforms");
+
+inline size_t _texture_cache_align(size_t offset) {
+    return (offset + _TEXTURE_CACHE_ALIGNMENT - 1) / _TEXTURE_CACHE_ALIGNMENT * _TEXTURE_CACHE_ALIGNMENT;
+}
+
+/**
+ * An image loaded through the TextureCache
+ * The levels point into the memory mapped cache entry, which is kept alive as long as any copy of the CachedTexture
+*/
+class CachedTexture {
+public:
+    std::shared_ptr<MappedFile> _file; // The entry, if it was read from disk
+    std::shared_ptr<std::vector<unsigned char> > _owned_data; // The entry, if it could not be read back from disk
+    TextureCacheContent content = TEXTURE_CACHE_RGBA;
+    CompressedFormat compressed_format = COMPRESSED_BC3;
+    int w = 0;
+    int h = 0;
+    std::vector<const unsigned char*> level_data;
+    std::vector<size_t> level_sizes;
+    std::vector<int> level_widths;
+    std::vector<int> level_heights;
+    bool from_cache = false; // True if the entry existed and was valid, false if the source had to be decoded
+
+    bool empty() const {
+        return level_data.size() == 0;
+    }
+    int level_count() const {
+        return level_data.size();
+    }
+    // The pixels of a level, for TEXTURE_CACHE_RGBA and TEXTURE_CACHE_MIP_CHAIN
+    ConstImageViewRGBA level(int i) const {
+        Assert(content != TEXTURE_CACHE_COMPRESSED);
+        return ConstImageViewRGBA((const ColorRGBA_UChar*)level_data[i], level_widths[i], level_heights[i]);
+    }
+    // Copy the first level into an image, decompressing it if needed
+    ImageRGBA_UChar to_image_rgba() const {
+        if(empty()) {
+            return ImageRGBA_UChar();
+        }
+        if(content == TEXTURE_CACHE_COMPRESSED) {
+            return decompress_image(to_compressed_image());
+        }
+        return ImageRGBA_UChar::from_view(level(0));
+    }
+    // Copy the blocks, for TEXTURE_CACHE_COMPRESSED
+    CompressedImage to_compressed_image() const {
+        Assert(content == TEXTURE_CACHE_COMPRESSED);
+        CompressedImage compressed = CompressedImage();
+        compressed.format = compressed_format;
+        compressed.w = w;
+        compressed.h = h;
+        compressed.data.assign(level_data[0], level_data[0] + level_sizes[0]);
+        return compressed;
+    }
+
+    // The size in bytes a level must have, or UINT64_MAX if its dimensions do not match the previous level
+    uint64_t _get_expected_level_size(uint32_t i, int level_w, int level_h) const {
+        int expected_w = i == 0 ? w : std::max(level_widths[i - 1] / 2, 1);
+        int expected_h = i == 0 ? h : std::max(level_heights[i - 1] / 2, 1);
+        if(level_w != expected_w || level_h != expected_h || (i != 0 && level_widths[i - 1] == 1 && level_heights[i - 1] == 1)) {
+            return UINT64_MAX;
+        }
+        if(content == TEXTURE_CACHE_COMPRESSED) {
+            return (uint64_t)((level_w + 3) / 4) * ((level_h + 3) / 4) * CompressedImage::block_bytes(compressed_format);
+        }
+        return (uint64_t)level_w * level_h * sizeof(ColorRGBA_UChar);
+    }
+
+    /**
+     * Point the texture at the entry in data, if it is a valid entry for the content hash and options
+     * Returns false if the entry is missing, stale, from another version, truncated or corrupt
+    */
+    bool _parse_entry(const unsigned char* data, size_t size, const Hash128& content_hash, const Hash128& options_hash) {
+        if(data == nullptr || size < sizeof(_TextureCacheHeader)) {
+            return false;
+        }
+        _TextureCacheHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        if(std::memcmp(header.magic, "VMTEXCAC", 8) != 0 || header.version != _TEXTURE_CACHE_VERSION || 
+           header.byte_order != _TEXTURE_CACHE_BYTE_ORDER || header.file_size != size) {
+            return false;
+        }
+        if(Hash128(header.content_hash_low, header.content_hash_high) != content_hash || 
+           Hash128(header.options_hash_low, header.options_hash_high) != options_hash) {
+            return false; // Stale, the source or the options have changed
+        }
+        if(header.level_count == 0 || sizeof(_TextureCacheHeader) + (size_t)header.level_count * sizeof(_TextureCacheLevel) > size) {
+            return false;
+        }
+        // Everything read from the entry is checked before it is used, so a corrupt entry is rebuilt instead of read out of bounds
+        if(header.content > TEXTURE_CACHE_COMPRESSED || header.compressed_format > COMPRESSED_ETC2_RGBA || header.w < 0 || header.h < 0) {
+            return false;
+        }
+        if(header.content != TEXTURE_CACHE_MIP_CHAIN && header.level_count != 1) {
+            return false;
+        }
+        content = (TextureCacheContent)header.content;
+        compressed_format = (CompressedFormat)header.compressed_format;
+        w = header.w;
+        h = header.h;
+        level_data.clear();
+        level_sizes.clear();
+        level_widths.clear();
+        level_heights.clear();
+        for(uint32_t i = 0; i < header.level_count; i++) {
+            _TextureCacheLevel level_info;
+            std::memcpy(&level_info, data + sizeof(_TextureCacheHeader) + i * sizeof(_TextureCacheLevel), sizeof(level_info));
+            if(level_info.offset > size || level_info.size > size - level_info.offset || 
+               level_info.size != _get_expected_level_size(i, level_info.w, level_info.h)) {
+                level_data.clear();
+                return false;
+            }
+            level_data.push_back(data + level_info.offset);
+            level_sizes.push_back(level_info.size);
+            level_widths.push_back(level_info.w);
+            level_heights.push_back(level_info.h);
+        }
+        return true;
+    }
+};
+
+class TextureCache {
+public:
+    std::string directory;
+    int hit_count = 0;
+    int miss_count = 0;
+
+    TextureCache() {}
+    TextureCache(std::string directory_) {
+        directory = directory_;
+    }
+
+    // The entry for a source file and options, one per pair so stale entries are overwritten instead of piling up
+    std::string get_entry_filename(const std::string& source_filename, const TextureCacheOptions& options) const {
+        Hash128 key = HashBuilder().add(source_filename).add(options.get_hash()).get_hash128();
+        return directory + "/" + key.to_string() + ".vtc";
+    }
+
+    /**
+     * Load the source image through the cache
+     * The source file is only hashed(memory mapped) on a warm start, it is decoded and stored if the entry is missing or stale
+     * Returns an empty texture if the source could not be read or decoded
+    */
+    CachedTexture load(const std::string& source_filename, const TextureCacheOptions& options = TextureCacheOptions(), std::string* error = nullptr) {
+        MappedFile source;
+        if(!source.open(source_filename)) {
+            _set_decode_error(error, "could not open " + source_filename);
+            return CachedTexture();
+        }
+        return load_from_memory(source_filename, source.data, source.size, options, error);
+    }
+
+    // Same as load, but the source bytes are already in memory(e.g. from an archive), the name is only used as the key
+    CachedTexture load_from_memory(const std::string& source_name, const unsigned char* bytes, size_t length, 
+                                   const TextureCacheOptions& options = TextureCacheOptions(), std::string* error = nullptr) {
+        Hash128 content_hash = hash128(bytes, length);
+        Hash128 options_hash = options.get_hash();
+        std::string entry_filename = get_entry_filename(source_name, options);
+
+        CachedTexture texture = CachedTexture();
+        std::shared_ptr<MappedFile> entry = std::make_shared<MappedFile>();
+        if(file_exists(entry_filename) && entry->open(entry_filename) && texture._parse_entry(entry->data, entry->size, content_hash, options_hash)) {
+            texture._file = entry;
+            texture.from_cache = true;
+            hit_count++;
+            return texture;
+        }
+        entry.reset();
+        miss_count++;
+
+        ImageRGBA_UChar image = ImageRGBA_UChar();
+        if(!decode_image(bytes, length, image, options.flip_vertical, error)) {
+            return CachedTexture();
+        }
+        std::shared_ptr<std::vector<unsigned char> > entry_data = std::make_shared<std::vector<unsigned char> >();
+        build_entry(image, options, content_hash, *entry_data);
+        _write_entry(entry_filename, *entry_data);
+        texture._parse_entry(entry_data->data(), entry_data->size(), content_hash, options_hash);
+        texture._owned_data = entry_data;
+        return texture;
+    }
+
+    // Serialize an entry for image, converting it according to the options
+    static void build_entry(const ImageRGBA_UChar& image, const TextureCacheOptions& options, const Hash128& content_hash, std::vector<unsigned char>& out) {
+        std::vector<const unsigned char*> levels;
+        std::vector<size_t> sizes;
+        std::vector<int> widths;
+        std::vector<int> heights;
+        MipChain mip_chain = MipChain();
+        CompressedImage compressed = CompressedImage();
+        if(options.content == TEXTURE_CACHE_MIP_CHAIN) {
+            mip_chain = build_mip_chain(image, options.mip_options);
+            for(int i = 0; i < mip_chain.level_count(); i++) {
+                ConstImageViewRGBA level = mip_chain.level(i);
+                levels.push_back((const unsigned char*)level.data);
+                sizes.push_back((size_t)level.w * level.h * sizeof(ColorRGBA_UChar));
+                widths.push_back(level.w);
+                heights.push_back(level.h);
+            }
+        }
+        else if(options.content == TEXTURE_CACHE_COMPRESSED) {
+            compressed = compress_image(image, options.compressed_format, options.compression_quality);
+            levels.push_back(compressed.data.data());
+            sizes.push_back(compressed.data.size());
+            widths.push_back(image.w);
+            heights.push_back(image.h);
+        }
+        else {
+            levels.push_back(image.get_pixel_data_const());
+            sizes.push_back(image.pixels.size() * sizeof(ColorRGBA_UChar));
+            widths.push_back(image.w);
+            heights.push_back(image.h);
+        }
+
+        // Header, level table, then each level at an aligned offset
+        size_t offset = _texture_cache_align(sizeof(_TextureCacheHeader) + levels.size() * sizeof(_TextureCacheLevel));
+        std::vector<_TextureCacheLevel> level_infos = std::vector<_TextureCacheLevel>(levels.size());
+        for(size_t i = 0; i < levels.size(); i++) {
+            level_infos[i].offset = offset;
+            level_infos[i].size = sizes[i];
+            level_infos[i].w = widths[i];
+            level_infos[i].h = heights[i];
+            offset = _texture_cache_align(offset + sizes[i]);
+        }
+        _TextureCacheHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "VMTEXCAC", 8);
+        header.version = _TEXTURE_CACHE_VERSION;
+        header.byte_order = _TEXTURE_CACHE_BYTE_ORDER;
+        header.content_hash_low = content_hash.low;
+        header.content_hash_high = content_hash.high;
+        Hash128 options_hash = options.get_hash();
+        header.options_hash_low = options_hash.low;
+        header.options_hash_high = options_hash.high;
+        header.content = options.content;
+        header.compressed_format = options.compressed_format;
+        header.w = image.w;
+        header.h = image.h;
+        header.level_count = levels.size();
+        header.file_size = offset;
+
+        out.assign(offset, 0);
+        std::memcpy(out.data(), &header, sizeof(header));
+        if(level_infos.size() > 0) {
+            std::memcpy(out.data() + sizeof(header), level_infos.data(), level_infos.size() * sizeof(_TextureCacheLevel));
+        }
+        for(size_t i = 0; i < levels.size(); i++) {
+            if(sizes[i] > 0) {
+                std::memcpy(out.data() + level_infos[i].offset, levels[i], sizes[i]);
+            }
+        }
+    }
+
+    // Write to a temporary file first and then rename it, so a crash never leaves a half written entry behind
+    static bool _write_entry(const std::string& entry_filename, const std::vector<unsigned char>& data) {
+        std::string temp_filename = entry_filename + ".tmp";
+        {
+            std::ofstream file(temp_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+            if(!file.is_open()) {
+                return false;
+            }
+            file.write((const char*)data.data(), data.size());
+            if(!file.good()) {
+                file.close();
+                std::remove(temp_filename.c_str());
+                return false;
+            }
+        }
+        std::remove(entry_filename.c_str()); // rename does not replace existing files on all platforms
+        return std::rename(temp_filename.c_str(), entry_filename.c_str()) == 0;
+    }
+
+    // Delete the entry for a source file, e.g. to force it to be decoded again
+    void remove_entry(const std::string& source_filename, const TextureCacheOptions& options = TextureCacheOptions()) {
+        std::remove(get_entry_filename(source_filename, options).c_str());
+    }
+};
+
+// ============================================================
+//                      Tiled images
+// ============================================================
+
+/**
+ * Images that are too large to decode at once(ImageRGBA_UChar is limited by int sizes and a single allocation)
+ * The image is stored on disk as square tiles, together with a pyramid of downscaled levels where
+ *  level 0 is the full image and every level after it is half the size, until the level fits in one tile
+ * Tiles are read lazily and kept in an LRU cache, so only the part that is viewed has to be in memory
+ * 
+ * TiledImageWriter writer;
+ * writer.open("large.vti", 100000, 100000); // Then write_tile for every tile of level 0
+ * writer.finish(); // Builds the pyramid
+ * 
+ * TiledImage image;
+ * image.open("large.vti");
+ * std::shared_ptr<const ImageRGBA_UChar> tile = image.get_tile(level, tx, ty);
+ * 
+ * See TiledImageViewer in util_opengl.hpp to draw the visible part of the image
+*/
+enum TileCompression {
+    TILE_RAW, // The pixels as they are, fastest to read
+    TILE_PNG  // Lossless, smaller on disk
+};
+
+const int _TILED_IMAGE_VERSION = 1;
+
+struct _TiledImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    int64_t w;
+    int64_t h;
+    uint32_t tile_size;
+    uint32_t level_count;
+    uint32_t compression;
+    uint32_t reserved;
+    uint64_t index_offset; // The tile index is stored at the end of the file, after all tiles
+    uint64_t tile_count;
+};
+
+struct _TiledImageIndexEntry {
+    uint64_t offset; // From the start of the file
+    uint64_t size;   // In bytes, zero if the tile was never written(it is then fully transparent)
+};
+
+static_assert(sizeof(_TiledImageHeader) == 64, "The tiled image header must have the same size on all platforms");
+static_assert(sizeof(_TiledImageIndexEntry) == 16, "The tiled image index must have the same size on all platforms");
+
+// The number of levels needed for a w*h image, so that the last level is a single tile
+inline int _tiled_image_level_count(int64_t w, int64_t h, int tile_size) {
+    int level_count = 1;
+    while(w > tile_size || h > tile_size) {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        level_count++;
+    }
+    return level_count;
+}
+
+inline int64_t _tiled_image_level_size(int64_t size, int level) {
+    for(int i = 0; i < level; i++) {
+        size = (size + 1) / 2;
+    }
+    return std::max<int64_t>(size, 1);
+}
+
+inline bool _encode_tile(ConstImageViewRGBA tile, TileCompression compression, const PNGEncodeOptions& png_options, std::vector<unsigned char>& out) {
+    out.clear();
+    if(compression == TILE_PNG) {
+        return append_png(tile, out, png_options);
+    }
+    out.resize((size_t)tile.w * tile.h * sizeof(ColorRGBA_UChar));
+    for(int y = 0; y < tile.h; y++) {
+        std::memcpy(&out[(size_t)y * tile.w * sizeof(ColorRGBA_UChar)], tile.get_row(y), tile.w * sizeof(ColorRGBA_UChar));
+    }
+    return true;
+}
+
+// Decode a tile that is expected to be w*h pixels, returns false if the data is corrupt
+inline bool _decode_tile(const unsigned char* bytes, size_t size, TileCompression compression, int w, int h, ImageRGBA_UChar& out) {
+    if(compression == TILE_PNG) {
+        return decode_image(bytes, size, out) && out.w == w && out.h == h;
+    }
+    if(size != (size_t)w * h * sizeof(ColorRGBA_UChar)) {
+        return false;
+    }
+    out.resize(w, h);
+    std::memcpy(out.get_pixel_data(), bytes, size);
+    return true;
+}
+
+/**
+ * Write a tiled image, one level 0 tile at a time so the full image never has to be in memory
+ * Tiles can be written in any order, tiles that are never written are fully transparent
+*/
+class TiledImageWriter {
+public:
+    std::fstream file;
+    int64_t w = 0;
+    int64_t h = 0;
+    int tile_size = 256;
+    int level_count = 0;
+    TileCompression compression = TILE_PNG;
+    PNGEncodeOptions png_options = PNGEncodeOptions::fast();
+    std::vector<std::vector<_TiledImageIndexEntry> > index; // [level][ty * tiles_x + tx]
+    uint64_t _end_offset = 0;
+
+    TiledImageWriter() {}
+    TiledImageWriter(const TiledImageWriter&) = delete;
+    TiledImageWriter& operator=(const TiledImageWriter&) = delete;
+
+    /**
+     * Create the file, replacing any existing file
+     * @arg tile_size: Must be a power of two, so that the tiles can be uploaded as textures directly
+    */
+    bool open(const std::string& filename, int64_t w_, int64_t h_, int tile_size_ = 256, TileCompression compression_ = TILE_PNG) {
+        Assert(w_ > 0 && h_ > 0);
+        Assert(vicmil::is_power_of_two(tile_size_) == true);
+        w = w_;
+        h = h_;
+        tile_size = tile_size_;
+        compression = compression_;
+        level_count = _tiled_image_level_count(w, h, tile_size);
+        index.clear();
+        for(int level = 0; level < level_count; level++) {
+            index.push_back(std::vector<_TiledImageIndexEntry>((size_t)tiles_x(level) * tiles_y(level), _TiledImageIndexEntry{0, 0}));
+        }
+        file.open(filename, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+        if(!file.is_open()) {
+            return false;
+        }
+        // The header is rewritten by finish, once the index offset is known
+        _TiledImageHeader header;
+        std::memset(&header, 0, sizeof(header));
+        file.write((const char*)&header, sizeof(header));
+        _end_offset = sizeof(header);
+        return file.good();
+    }
+
+    int64_t level_width(int level) const {
+        return _tiled_image_level_size(w, level);
+    }
+    int64_t level_height(int level) const {
+        return _tiled_image_level_size(h, level);
+    }
+    int64_t tiles_x(int level) const {
+        return (level_width(level) + tile_size - 1) / tile_size;
+    }
+    int64_t tiles_y(int level) const {
+        return (level_height(level) + tile_size - 1) / tile_size;
+    }
+    // Tiles at the right and bottom edge are smaller than tile_size if the level is not a multiple of it
+    int tile_width(int level, int64_t tx) const {
+        return std::min<int64_t>(tile_size, level_width(level) - tx * tile_size);
+    }
+    int tile_height(int level, int64_t ty) const {
+        return std::min<int64_t>(tile_size, level_height(level) - ty * tile_size);
+    }
+
+    /**
+     * Write a tile of level 0, the tile must be tile_width(0, tx) * tile_height(0, ty) pixels
+     * Writing the same tile again stores the new version, the old one is left unused in the file
+    */
+    bool write_tile(int64_t tx, int64_t ty, ConstImageViewRGBA tile) {
+        if(tx < 0 || ty < 0 || tx >= tiles_x(0) || ty >= tiles_y(0) || tile.w != tile_width(0, tx) || tile.h != tile_height(0, ty)) {
+            return false;
+        }
+        std::vector<unsigned char> bytes;
+        return _encode_tile(tile, compression, png_options, bytes) && _write_encoded_tile(0, tx, ty, bytes);
+    }
+
+    bool _write_encoded_tile(int level, int64_t tx, int64_t ty, const std::vector<unsigned char>& bytes) {
+        file.seekp(_end_offset);
+        file.write((const char*)bytes.data(), bytes.size());
+        index[level][ty * tiles_x(level) + tx] = _TiledImageIndexEntry{_end_offset, bytes.size()};
+        _end_offset += bytes.size();
+        return file.good();
+    }
+
+    // Read back a tile written earlier, missing tiles are returned as transparent
+    bool _read_tile(int level, int64_t tx, int64_t ty, ImageRGBA_UChar& out) {
+        const _TiledImageIndexEntry& entry = index[level][ty * tiles_x(level) + tx];
+        if(entry.size == 0) {
+            out = ImageRGBA_UChar();
+            out.resize(tile_width(level, tx), tile_height(level, ty));
+            return true;
+        }
+        std::vector<unsigned char> bytes = std::vector<unsigned char>(entry.size);
+        file.seekg(entry.offset);
+        file.read((char*)bytes.data(), bytes.size());
+        return file.good() && _decode_tile(bytes.data(), bytes.size(), compression, tile_width(level, tx), tile_height(level, ty), out);
+    }
+
+    /**
+     * Build the downscaled levels from level 0, then write the index and header
+     * Every tile is the box filtered 2x2 tiles below it. The tiles are built in batches of one tile per worker,
+     *  so only the children of those tiles are in memory at a time
+    */
+    bool finish() {
+        if(!file.is_open()) {
+            return false;
+        }
+        const int64_t batch_size = vicmil::get_worker_pool().thread_count() + 1;
+        std::vector<ImageRGBA_UChar> children;
+        std::vector<std::vector<unsigned char> > encoded = std::vector<std::vector<unsigned char> >(batch_size);
+        std::vector<char> has_content = std::vector<char>(batch_size); // Not vector<bool>, it is written from several threads
+        for(int level = 1; level < level_count; level++) {
+            int64_t child_tiles_x = tiles_x(level - 1);
+            int64_t child_tiles_y = tiles_y(level - 1);
+            for(int64_t ty = 0; ty < tiles_y(level); ty++) {
+                for(int64_t batch_begin = 0; batch_begin < tiles_x(level); batch_begin += batch_size) {
+                    // Read the children of the batch, then downscale and encode them in parallel
+                    int64_t batch_end = std::min(batch_begin + batch_size, tiles_x(level));
+                    children.assign((batch_end - batch_begin) * 4, ImageRGBA_UChar());
+                    for(int64_t tx = batch_begin; tx < batch_end; tx++) {
+                        int64_t b = tx - batch_begin;
+                        // Tiles where all children are missing are left missing, so sparse images stay cheap
+                        has_content[b] = false;
+                        for(int i = 0; i < 4; i++) {
+                            int64_t child_x = tx * 2 + i % 2;
+                            int64_t child_y = ty * 2 + i / 2;
+                            if(child_x < child_tiles_x && child_y < child_tiles_y && index[level - 1][child_y * child_tiles_x + child_x].size != 0) {
+                                has_content[b] = true;
+                            }
+                        }
+                        for(int i = 0; i < 4 && has_content[b]; i++) {
+                            int64_t child_x = tx * 2 + i % 2;
+                            int64_t child_y = ty * 2 + i / 2;
+                            if(child_x < child_tiles_x && child_y < child_tiles_y && !_read_tile(level - 1, child_x, child_y, children[b * 4 + i])) {
+                                return false;
+                            }
+                        }
+                    }
+                    std::atomic<bool> encode_failed = ATOMIC_VAR_INIT(false);
+                    vicmil::parallel_for(0, batch_end - batch_begin, [&](size_t begin, size_t end) {
+                        for(size_t b = begin; b < end; b++) {
+                            if(!has_content[b]) {
+                                continue;
+                            }
+                            // Combine the children and scale them down by half
+                            int combined_w = children[b * 4].w + children[b * 4 + 1].w;
+                            int combined_h = children[b * 4].h + children[b * 4 + 2].h;
+                            ImageRGBA_UChar combined = ImageRGBA_UChar();
+                            combined.resize(combined_w, combined_h);
+                            for(int i = 0; i < 4; i++) {
+                                blit(children[b * 4 + i], combined, (i % 2) * tile_size, (i / 2) * tile_size);
+                            }
+                            ImageRGBA_UChar tile = ImageRGBA_UChar();
+                            tile.resize(tile_width(level, batch_begin + b), tile_height(level, ty));
+                            resample(combined, tile, ResampleOptions(RESAMPLE_BOX));
+                            if(!_encode_tile(tile, compression, png_options, encoded[b])) {
+                                encode_failed = true;
+                            }
+                        }
+                    }, 1);
+                    if(encode_failed) {
+                        return false;
+                    }
+                    for(int64_t tx = batch_begin; tx < batch_end; tx++) {
+                        if(has_content[tx - batch_begin] && !_write_encoded_tile(level, tx, ty, encoded[tx - batch_begin])) {
+                            return false;
+                        }
+                    }
+                }
+            }
+        }
+
+        _TiledImageHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "VMTILED", 8);
+        header.version = _TILED_IMAGE_VERSION;
+        header.byte_order = _TEXTURE_CACHE_BYTE_ORDER;
+        header.w = w;
+        header.h = h;
+        header.tile_size = tile_size;
+        header.level_count = level_count;
+        header.compression = compression;
+        header.index_offset = _end_offset;
+        header.tile_count = 0;
+        file.seekp(_end_offset);
+        for(int level = 0; level < level_count; level++) {
+            file.write((const char*)index[level].data(), index[level].size() * sizeof(_TiledImageIndexEntry));
+            header.tile_count += index[level].size();
+        }
+        file.seekp(0);
+        file.write((const char*)&header, sizeof(header));
+        bool success = file.good();
+        file.close();
+        return success;
+    }
+
+    // Store an image that fits in memory as a tiled image, e.g. to view it with TiledImageViewer
+    static bool create_from_image(const std::string& filename, ConstImageViewRGBA image, int tile_size = 256, TileCompression compression = TILE_PNG) {
+        TiledImageWriter writer;
+        if(image.empty() || !writer.open(filename, image.w, image.h, tile_size, compression)) {
+            return false;
+        }
+        std::vector<std::vector<unsigned char> > encoded = std::vector<std::vector<unsigned char> >(writer.tiles_x(0));
+        std::atomic<bool> encode_failed = ATOMIC_VAR_INIT(false);
+        for(int64_t ty = 0; ty < writer.tiles_y(0); ty++) {
+            vicmil::parallel_for(0, writer.tiles_x(0), [&](size_t begin, size_t end) {
+                for(size_t tx = begin; tx < end; tx++) {
+                    ConstImageViewRGBA tile = image.sub_view(tx * tile_size, ty * tile_size, tile_size, tile_size);
+                    if(!_encode_tile(tile, compression, writer.png_options, encoded[tx])) {
+                        encode_failed = true;
+                    }
+                }
+            }, 1);
+            if(encode_failed) {
+                return false;
+            }
+            for(int64_t tx = 0; tx < writer.tiles_x(0); tx++) {
+                if(!writer._write_encoded_tile(0, tx, ty, encoded[tx])) {
+                    return false;
+                }
+            }
+        }
+        return writer.finish();
+    }
+};
+
+/**
+ * Read a tiled image written by TiledImageWriter
+ * Tiles are decoded when requested and kept in an LRU cache with a budget in bytes
+ * get_tile and read_region can be called from several threads at once(e.g. to prefetch tiles in the background)
+*/
+class TiledImage {
+public:
+    std::ifstream file;
+    std::mutex _file_mutex;
+    int64_t w = 0;
+    int64_t h = 0;
+    int tile_size = 0;
+    int level_count = 0;
+    TileCompression compression = TILE_PNG;
+    std::vector<std::vector<_TiledImageIndexEntry> > index; // [level][ty * tiles_x + tx]
+    LRUCache<uint64_t, std::shared_ptr<const ImageRGBA_UChar> > cache;
+    std::mutex _cache_mutex;
+
+    TiledImage() {}
+    TiledImage(const TiledImage&) = delete;
+    TiledImage& operator=(const TiledImage&) = delete;
+
+    /**
+     * Read the header and tile index, the tiles themselves are read when they are needed
+     * @arg cache_budget_bytes: The decoded tiles to keep in memory, the least recently used tiles are freed first
+    */
+    bool open(const std::string& filename, size_t cache_budget_bytes = 256 * 1024 * 1024) {
+        std::lock_guard<std::mutex> lock(_file_mutex);
+        file.close();
+        index.clear();
+        clear_cache();
+        cache.budget = cache_budget_bytes;
+        file.open(filename, std::ios::in | std::ios::binary);
+        if(!file.is_open()) {
+            return false;
+        }
+        _TiledImageHeader header;
+        file.read((char*)&header, sizeof(header));
+        if(!file.good() || std::memcmp(header.magic, "VMTILED", 8) != 0 || header.version != _TILED_IMAGE_VERSION || 
+           header.byte_order != _TEXTURE_CACHE_BYTE_ORDER || header.w <= 0 || header.h <= 0 || 
+           !vicmil::is_power_of_two((unsigned int)header.tile_size)) {
+            file.close();
+            return false;
+        }
+        w = header.w;
+        h = header.h;
+        tile_size = header.tile_size;
+        compression = (TileCompression)header.compression;
+        level_count = _tiled_image_level_count(w, h, tile_size);
+        uint64_t tile_count = 0;
+        for(int level = 0; level < level_count; level++) {
+            tile_count += tiles_x(level) * tiles_y(level);
+        }
+        if(header.level_count != (uint32_t)level_count || header.tile_count != tile_count) {
+            file.close();
+            return false;
+        }
+        // The tiles are between the header and the index, and the index is at the end of the file
+        file.seekg(0, std::ios::end);
+        uint64_t file_size = (uint64_t)file.tellg();
+        if(header.index_offset < sizeof(header) || header.index_offset > file_size || 
+           tile_count > (file_size - header.index_offset) / sizeof(_TiledImageIndexEntry)) {
+            file.close();
+            return false;
+        }
+        file.seekg(header.index_offset);
+        for(int level = 0; level < level_count; level++) {
+            index.push_back(std::vector<_TiledImageIndexEntry>(tiles_x(level) * tiles_y(level)));
+            file.read((char*)index[level].data(), index[level].size() * sizeof(_TiledImageIndexEntry));
+            for(const _TiledImageIndexEntry& entry : index[level]) {
+                if(entry.size != 0 && (entry.offset < sizeof(header) || entry.offset > header.index_offset || entry.size > header.index_offset - entry.offset)) {
+                    file.close();
+                    index.clear();
+                    return false;
+                }
+            }
+        }
+        if(!file.good()) {
+            file.close();
+            index.clear();
+            return false;
+        }
+        return true;
+    }
+    bool is_open() const {
+        return index.size() != 0;
+    }
+
+    int64_t level_width(int level) const {
+        return _tiled_image_level_size(w, level);
+    }
+    int64_t level_height(int level) const {
+        return _tiled_image_level_size(h, level);
+    }
+    int64_t tiles_x(int level) const {
+        return (level_width(level) + tile_size - 1) / tile_size;
+    }
+    int64_t tiles_y(int level) const {
+        return (level_height(level) + tile_size - 1) / tile_size;
+    }
+    int tile_width(int level, int64_t tx) const {
+        return std::min<int64_t>(tile_size, level_width(level) - tx * tile_size);
+    }
+    int tile_height(int level, int64_t ty) const {
+        return std::min<int64_t>(tile_size, level_height(level) - ty * tile_size);
+    }
+    bool is_valid_tile(int level, int64_t tx, int64_t ty) const {
+        return level >= 0 && level < level_count && tx >= 0 && ty >= 0 && tx < tiles_x(level) && ty < tiles_y(level);
+    }
+    // A unique key for every tile, e.g. for caching tiles(supports up to 2^28 tiles in each direction)
+    static uint64_t get_tile_key(int level, int64_t tx, int64_t ty) {
+        return ((uint64_t)level << 56) | ((uint64_t)ty << 28) | (uint64_t)tx;
+    }
+
+    /**
+     * Get a tile, decoding it if it is not in the cache
+     * Returns nullptr if the tile is outside the image or could not be read
+     * The tile stays valid while it is used, even if it is evicted from the cache
+    */
+    std::shared_ptr<const ImageRGBA_UChar> get_tile(int level, int64_t tx, int64_t ty) {
+        if(!is_valid_tile(level, tx, ty)) {
+            return nullptr;
+        }
+        uint64_t key = get_tile_key(level, tx, ty);
+        {
+            std::lock_guard<std::mutex> lock(_cache_mutex);
+            std::shared_ptr<const ImageRGBA_UChar>* cached = cache.get(key);
+            if(cached != nullptr) {
+                return *cached;
+            }
+        }
+        const _TiledImageIndexEntry& entry = index[level][ty * tiles_x(level) + tx];
+        std::shared_ptr<ImageRGBA_UChar> tile = std::make_shared<ImageRGBA_UChar>();
+        if(entry.size == 0) {
+            tile->resize(tile_width(level, tx), tile_height(level, ty)); // Transparent
+        }
+        else {
+            std::vector<unsigned char> bytes = std::vector<unsigned char>(entry.size);
+            {
+                std::lock_guard<std::mutex> lock(_file_mutex);
+                file.clear();
+                file.seekg(entry.offset);
+                file.read((char*)bytes.data(), bytes.size());
+                if(!file.good()) {
+                    return nullptr;
+                }
+            }
+            // Decode outside the locks, so several threads can decode tiles at once
+            if(!_decode_tile(bytes.data(), bytes.size(), compression, tile_width(level, tx), tile_height(level, ty), *tile)) {
+                return nullptr;
+            }
+        }
+        std::lock_guard<std::mutex> lock(_cache_mutex);
+        cache.put(key, tile, tile->pixels.size() * sizeof(ColorRGBA_UChar));
+        return tile;
+    }
+    bool is_tile_cached(int level, int64_t tx, int64_t ty) {
+        std::lock_guard<std::mutex> lock(_cache_mutex);
+        return cache.contains(get_tile_key(level, tx, ty));
+    }
+    void clear_cache() {
+        std::lock_guard<std::mutex> lock(_cache_mutex);
+        cache.clear();
+    }
+
+    /**
+     * Copy a rectangle of a level into dst, with its top left corner at x, y of the level
+     * Parts outside the image are left unchanged, returns false if a tile could not be read
+    */
+    bool read_region(int level, int64_t x, int64_t y, ImageViewRGBA dst) {
+        if(level < 0 || level >= level_count || dst.empty()) {
+            return false;
+        }
+        int64_t min_tx = std::max<int64_t>(x, 0) / tile_size;
+        int64_t min_ty = std::max<int64_t>(y, 0) / tile_size;
+        int64_t max_tx = std::min<int64_t>(tiles_x(level) - 1, (x + dst.w - 1) / tile_size);
+        int64_t max_ty = std::min<int64_t>(tiles_y(level) - 1, (y + dst.h - 1) / tile_size);
+        bool success = true;
+        for(int64_t ty = min_ty; ty <= max_ty; ty++) {
+            for(int64_t tx = min_tx; tx <= max_tx; tx++) {
+                std::shared_ptr<const ImageRGBA_UChar> tile = get_tile(level, tx, ty);
+                if(!tile) {
+                    success = false;
+                    continue;
+                }
+                // Offsets are within one tile of dst, so they fit in an int
+                blit(*tile, dst, (int)(tx * tile_size - x), (int)(ty * tile_size - y));
+            }
+        }
+        return success;
+    }
+};
+
+// ============================================================
+//                      Recording frames
+// ============================================================
+
+/**
+ * Encode a sequence of frames(e.g. screenshots for debugging or demos) on worker threads
+ * Frames are handed over through a bounded queue, so submitting never waits for encoding.
+ *  When the queue is full the frame is dropped and counted in dropped_count, instead of stalling the app
+ * See FrameRecorder in util_opengl.hpp for grabbing the frames from the screen
+ * 
+ * FrameEncoderOptions options = FrameEncoderOptions();
+ * options.path = "recording"; // The directory must exist
+ * FrameEncoder encoder;
+ * encoder.start(options);
+ * ImageRGBA_UChar frame = encoder.acquire_frame(); // Reuses the memory of frames that have been encoded
+ * // ... Fill in the frame
+ * encoder.submit(frame);
+ * encoder.finish(); // Waits for the queued frames to be written
+*/
+enum FrameOutputFormat {
+    FRAME_OUTPUT_PNG_FILES,  // One png file per frame, see FrameEncoder::get_frame_filename
+    FRAME_OUTPUT_RAW_STREAM, // All frames in one file, uncompressed, see FrameStreamReader
+    FRAME_OUTPUT_PNG_STREAM  // All frames in one file, each compressed as a png
+};
+
+struct FrameEncoderOptions {
+    FrameOutputFormat format = FRAME_OUTPUT_PNG_FILES;
+    std::string path = "frames"; // The directory for png files, or the filename of the stream
+    int max_queued_frames = 8; // Frames waiting to be encoded, more frames than this are dropped
+    int thread_count = 2;
+    PNGEncodeOptions png_options = PNGEncodeOptions::fast();
+};
+
+const int _FRAME_STREAM_VERSION = 1;
+
+struct _FrameStreamHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+};
+
+struct _FrameStreamFrame {
+    uint32_t format; // FRAME_OUTPUT_RAW_STREAM or FRAME_OUTPUT_PNG_STREAM
+    int32_t w;
+    int32_t h;
+    uint32_t reserved;
+    uint64_t frame_index;
+    uint64_t size; // The bytes of the frame that follow
+};
+
+static_assert(sizeof(_FrameStreamHeader) == 16, "The frame stream header must have the same size on all platforms");
+static_assert(sizeof(_FrameStreamFrame) == 32, "The frame stream frames must have the same size on all platforms");
+
+class FrameEncoder {
+public:
+    struct _QueuedFrame {
+        ImageRGBA_UChar image;
+        bool flip_vertical = false;
+        uint64_t frame_index = 0;
+    };
+    FrameEncoderOptions options;
+    ImagePool image_pool; // The memory of encoded frames, reused by acquire_frame
+    std::atomic<int> submitted_count = ATOMIC_VAR_INIT(0);
+    std::atomic<int> dropped_count = ATOMIC_VAR_INIT(0); // Frames not recorded because the queue was full
+    std::atomic<int> written_count = ATOMIC_VAR_INIT(0);
+    std::atomic<int> failed_count = ATOMIC_VAR_INIT(0); // Frames that could not be encoded or written
+
+    std::vector<std::thread> _workers;
+    std::list<_QueuedFrame> _queue;
+    std::mutex _mutex; // Protects the queue, never held while encoding or writing so submit does not block
+    std::condition_variable _queue_condition;
+    std::mutex _write_mutex; // Lets the workers write their frames to the stream in order
+    std::condition_variable _write_condition;
+    bool _stop = false;
+    bool _started = false;
+    uint64_t _next_frame_index = 0;
+    uint64_t _next_write_index = 0; // Frames are encoded in parallel, but written to the stream in order
+    std::ofstream _stream;
+
+    FrameEncoder() {}
+    FrameEncoder(const FrameEncoder&) = delete;
+    FrameEncoder& operator=(const FrameEncoder&) = delete;
+    ~FrameEncoder() {
+        finish();
+    }
+
+    // Start the workers, and create the stream file if recording to a stream
+    bool start(const FrameEncoderOptions& options_) {
+        finish();
+        options = options_;
+        _stop = false;
+        submitted_count = 0;
+        dropped_count = 0;
+        written_count = 0;
+        failed_count = 0;
+        _next_frame_index = 0;
+        _next_write_index = 0;
+        if(options.format != FRAME_OUTPUT_PNG_FILES) {
+            _stream.open(options.path, std::ios::out | std::ios::binary | std::ios::trunc);
+            if(!_stream.is_open()) {
+                return false;
+            }
+            _FrameStreamHeader header;
+            std::memset(&header, 0, sizeof(header));
+            std::memcpy(header.magic, "VMFRAMES", 8);
+            header.version = _FRAME_STREAM_VERSION;
+            header.byte_order = _TEXTURE_CACHE_BYTE_ORDER;
+            _stream.write((const char*)&header, sizeof(header));
+        }
+        for(int i = 0; i < std::max(options.thread_count, 1); i++) {
+            _workers.push_back(std::thread([this]() { _worker_loop(); }));
+        }
+        _started = true;
+        return true;
+    }
+    bool is_started() const {
+        return _started;
+    }
+
+    // Get an image to fill in with the next frame, it may already have memory for the pixels
+    ImageRGBA_UChar acquire_frame() {
+        return image_pool.acquire();
+    }
+    bool is_queue_full() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _queue.size() >= (size_t)options.max_queued_frames;
+    }
+    /**
+     * Queue a frame to be encoded, the pixels are moved into the queue so frame is empty afterwards
+     * Returns false and counts the frame as dropped if the queue is full
+     * @arg flip_vertical: Flip the frame while encoding, e.g. for frames read from OpenGL which are upside down
+    */
+    bool submit(ImageRGBA_UChar& frame, bool flip_vertical = false) {
+        if(!_started) {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        if(_queue.size() >= (size_t)options.max_queued_frames) {
+            lock.unlock();
+            dropped_count++;
+            image_pool.release(frame);
+            return false;
+        }
+        _queue.push_back(_QueuedFrame());
+        _queue.back().image.w = frame.w;
+        _queue.back().image.h = frame.h;
+        _queue.back().image.pixels.swap(frame.pixels);
+        _queue.back().flip_vertical = flip_vertical;
+        _queue.back().frame_index = _next_frame_index++;
+        frame.resize(0, 0);
+        lock.unlock();
+        submitted_count++;
+        _queue_condition.notify_one();
+        return true;
+    }
+
+    // The file a frame is written to with FRAME_OUTPUT_PNG_FILES, e.g. frames/frame_000042.png
+    std::string get_frame_filename(uint64_t frame_index) const {
+        std::string number = std::to_string(frame_index);
+        if(number.size() < 6) {
+            number = std::string(6 - number.size(), '0') + number;
+        }
+        return options.path + "/frame_" + number + ".png";
+    }
+
+    void _worker_loop() {
+        while(true) {
+            _QueuedFrame frame = _QueuedFrame();
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _queue_condition.wait(lock, [this]() { return _stop || !_queue.empty(); });
+                if(_queue.empty()) {
+                    return; // Stopped, and every frame has been encoded
+                }
+                frame.image.w = _queue.front().image.w;
+                frame.image.h = _queue.front().image.h;
+                frame.image.pixels.swap(_queue.front().image.pixels);
+                frame.flip_vertical = _queue.front().flip_vertical;
+                frame.frame_index = _queue.front().frame_index;
+                _queue.pop_front();
+            }
+            if(_encode_frame(frame)) {
+                written_count++;
+            }
+            else {
+                failed_count++;
+            }
+            image_pool.release(frame.image);
+        }
+    }
+
+    bool _encode_frame(_QueuedFrame& frame) {
+        if(frame.flip_vertical) {
+            frame.image.flip_vertical();
+        }
+        if(options.format == FRAME_OUTPUT_PNG_FILES) {
+            return frame.image.save_as_png(get_frame_filename(frame.frame_index), options.png_options);
+        }
+        std::vector<unsigned char> bytes;
+        bool success = true;
+        if(options.format == FRAME_OUTPUT_PNG_STREAM) {
+            success = frame.image.append_png(bytes, options.png_options);
+        }
+        _FrameStreamFrame frame_header;
+        std::memset(&frame_header, 0, sizeof(frame_header));
+        frame_header.format = options.format;
+        frame_header.w = frame.image.w;
+        frame_header.h = frame.image.h;
+        frame_header.frame_index = frame.frame_index;
+        frame_header.size = options.format == FRAME_OUTPUT_RAW_STREAM ? frame.image.pixels.size() * sizeof(ColorRGBA_UChar) : bytes.size();
+
+        // Wait for the frames before this one to be written, a failed frame still takes its turn so the others are not blocked
+        std::unique_lock<std::mutex> lock(_write_mutex);
+        _write_condition.wait(lock, [&]() { return _next_write_index == frame.frame_index; });
+        if(success) {
+            _stream.write((const char*)&frame_header, sizeof(frame_header));
+            if(options.format == FRAME_OUTPUT_RAW_STREAM) {
+                _stream.write((const char*)frame.image.pixels.data(), frame_header.size);
+            }
+            else {
+                _stream.write((const char*)bytes.data(), bytes.size());
+            }
+            success = _stream.good();
+        }
+        _next_write_index++;
+        _write_condition.notify_all();
+        return success;
+    }
+
+    // Encode and write all queued frames, then stop the workers. Returns true if no frame failed
+    bool finish() {
+        if(!_started) {
+            return failed_count == 0;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _queue_condition.notify_all();
+        for(size_t i = 0; i < _workers.size(); i++) {
+            _workers[i].join();
+        }
+        _workers.clear();
+        if(_stream.is_open()) {
+            _stream.close();
+        }
+        _started = false;
+        return failed_count == 0;
+    }
+};
+
+/**
+ * Read the frames of a FRAME_OUTPUT_RAW_STREAM or FRAME_OUTPUT_PNG_STREAM recording, one at a time
+ * 
+ * FrameStreamReader reader;
+ * reader.open("recording.vfs");
+ * ImageRGBA_UChar frame;
+ * while(reader.read_frame(frame)) { ... }
+*/
+class FrameStreamReader {
+public:
+    std::ifstream file;
+    uint64_t file_size = 0;
+
+    bool open(const std::string& filename) {
+        file.close();
+        file.open(filename, std::ios::in | std::ios::binary | std::ios::ate);
+        if(!file.is_open()) {
+            return false;
+        }
+        file_size = (uint64_t)file.tellg();
+        file.seekg(0);
+        _FrameStreamHeader header;
+        file.read((char*)&header, sizeof(header));
+        return file.good() && std::memcmp(header.magic, "VMFRAMES", 8) == 0 && header.version == _FRAME_STREAM_VERSION &&
+               header.byte_order == _TEXTURE_CACHE_BYTE_ORDER;
+    }
+    // Read the next frame, returns false at the end of the stream or if the frame is corrupt
+    bool read_frame(ImageRGBA_UChar& out, uint64_t* frame_index = nullptr) {
+        _FrameStreamFrame frame_header;
+        file.read((char*)&frame_header, sizeof(frame_header));
+        if(!file.good() || frame_header.w <= 0 || frame_header.h <= 0) {
+            return false;
+        }
+        // A corrupt size must not be allocated
+        uint64_t position = (uint64_t)file.tellg();
+        if(position > file_size || frame_header.size > file_size - position) {
+            return false;
+        }
+        if(frame_index != nullptr) {
+            *frame_index = frame_header.frame_index;
+        }
+        if(frame_header.format == FRAME_OUTPUT_RAW_STREAM) {
+            if(frame_header.size != (uint64_t)frame_header.w * frame_header.h * sizeof(ColorRGBA_UChar)) {
+                return false;
+            }
+            out.resize(frame_header.w, frame_header.h);
+            file.read((char*)out.get_pixel_data(), frame_header.size);
+            return file.good();
+        }
+        std::vector<unsigned char> bytes = std::vector<unsigned char>(frame_header.size);
+        file.read((char*)bytes.data(), bytes.size());
+        return file.good() && decode_image(bytes.data(), bytes.size(), out);
+    }
+};
+
+// ============================================================
+//                           Loading fonts
+// ============================================================
+
+// The metrics of a glyph at the line height of a FontLoader, see FontLoader::get_glyph_metrics
+struct GlyphMetrics {
+    int glyph_index = 0; // 0 if the character is not part of the font
+    int advance_width = 0; // How much to advance to the right after the character
+    int left_side_bearing = 0;
+    RectT<int> bounding_box; // The bitmap box relative to the baseline, see FontLoader::_get_character_bounding_box
+};
+
+/**
+ * Options for signed distance field(sdf) glyphs, see FontLoader::get_character_sdf
+ * Each pixel stores the distance to the outline of the glyph, on_edge_value on the outline and larger inside.
+ *  So a glyph is only rendered once, at line_height, and the shader can draw sharp edges at any size
+ *  (several times larger than line_height) as well as outlines and shadows
+*/
+struct GlyphSDFOptions {
+    int line_height = 48; // The size the glyphs are rendered at
+    int padding = 6; // Pixels around each glyph, outlines and shadows can extend at most this far(at line_height)
+    unsigned char on_edge_value = 128;
+
+    // How much the stored value changes per pixel at line_height, so the distance reaches 0 at the edge of the padding
+    float get_value_per_pixel() const {
+        return (float)on_edge_value / padding;
+    }
+};
+
+// For loading true type fonts (.ttf, and .otf fonts)
+struct FontLoader {
+    stbtt_fontinfo info;
+    std::vector<unsigned char> font_data;
+
+    // Calculated from line height
+    int line_height;
+    float scale;
+    int ascent; // Line spacing in y direction
+    int descent;
+    int lineGap;
+
+    /**
+     * Glyph metrics at the current line height, computed the first time a character is used and cleared by set_line_height
+     * Characters in the basic multilingual plane are looked up directly in pages of 256 characters, the rest in a hash map
+    */
+    std::vector<std::vector<GlyphMetrics> > _bmp_metric_pages;
+    std::unordered_map<int, GlyphMetrics> _other_metrics;
+    // Kerning at the current line height, keyed by (glyph1 << 32) | glyph2
+    std::unordered_map<uint64_t, int> _kerning_pairs;
+    bool _kerning_precomputed = false; // True if every pair with kerning is in _kerning_pairs, otherwise pairs are added as they are used
+
+    /**
+     * info points into font_data, so a copy sets it up again for its own font_data
+     * A move keeps the buffer of font_data, and is noexcept so that std::vector<FontLoader> moves instead of copies when it grows
+    */
+    FontLoader() : info(), line_height(0), scale(0), ascent(0), descent(0), lineGap(0) {}
+    FontLoader(const FontLoader& other) : FontLoader() {
+        *this = other;
+    }
+    FontLoader(FontLoader&& other) noexcept : FontLoader() {
+        *this = std::move(other);
+    }
+    FontLoader& operator=(const FontLoader& other) {
+        if(this == &other) {
+            return *this;
+        }
+        info = other.info;
+        font_data = other.font_data;
+        if(font_data.size() != 0) {
+            stbtt_InitFont(&info, &font_data[0], 0);
+        }
+        line_height = other.line_height;
+        scale = other.scale;
+        ascent = other.ascent;
+        descent = other.descent;
+        lineGap = other.lineGap;
+        _bmp_metric_pages = other._bmp_metric_pages;
+        _other_metrics = other._other_metrics;
+        _kerning_pairs = other._kerning_pairs;
+        _kerning_precomputed = other._kerning_precomputed;
+        return *this;
+    }
+    // Swaps, since unlike their move assignment, swapping the hash maps never throws
+    FontLoader& operator=(FontLoader&& other) noexcept {
+        std::swap(info, other.info);
+        font_data.swap(other.font_data);
+        std::swap(line_height, other.line_height);
+        std::swap(scale, other.scale);
+        std::swap(ascent, other.ascent);
+        std::swap(descent, other.descent);
+        std::swap(lineGap, other.lineGap);
+        _bmp_metric_pages.swap(other._bmp_metric_pages);
+        _other_metrics.swap(other._other_metrics);
+        _kerning_pairs.swap(other._kerning_pairs);
+        std::swap(_kerning_precomputed, other._kerning_precomputed);
+        return *this;
     }
 
-    // Get image of character
-    ImageRGBA_UChar get_character_image_rgba(const int character, ColorRGBA_UChar color_mask=ColorRGBA_UChar(255, 255, 255, 255)) {
+    void load_font_from_memory(unsigned char* fontBuffer_, int size, int line_height_=64) {
+        // Load font into buffer
+        font_data.resize(size);
+        memcpy(&font_data[0], fontBuffer_, size);
+
+        // Prepare font
+        if (!stbtt_InitFont(&info, &font_data[0], 0))
+        {
+            printf("failed\n");
+        }
+        set_line_height(line_height_); // Set default line height
+    }
+    void load_font_from_file(std::string filepath, int line_height_=64) {
+        vicmil::FileManager file = vicmil::FileManager(filepath);
+        std::vector<char> data = file.read_entire_file();
+        load_font_from_memory((unsigned char*)&data[0], data.size(), line_height_);
+    }
+
+    void set_line_height(int new_line_height) {
+        line_height = new_line_height;
+        scale = stbtt_ScaleForPixelHeight(&info, line_height);
+        stbtt_GetFontVMetrics(&info, &ascent, &descent, &lineGap);
+        ascent = roundf(ascent * scale);
+        descent = roundf(descent * scale);
+        lineGap = roundf(lineGap * scale);
+
+        _bmp_metric_pages.clear();
+        _other_metrics.clear();
+        _kerning_pairs.clear();
+        _kerning_precomputed = false;
+        // Fonts with only a kern table(no GPOS) list all their pairs, so they can be read up front
+        if(info.kern && !info.gpos) {
+            std::vector<stbtt_kerningentry> table = std::vector<stbtt_kerningentry>(stbtt_GetKerningTableLength(&info));
+            stbtt_GetKerningTable(&info, table.data(), table.size());
+            for(size_t i = 0; i < table.size(); i++) {
+                int kern = roundf(table[i].advance * scale);
+                if(kern != 0) {
+                    _kerning_pairs[((uint64_t)table[i].glyph1 << 32) | (uint32_t)table[i].glyph2] = kern;
+                }
+            }
+            _kerning_precomputed = true;
+        }
+    }
+
+    GlyphMetrics _compute_glyph_metrics(const int character) {
+        GlyphMetrics metrics = GlyphMetrics();
+        metrics.glyph_index = stbtt_FindGlyphIndex(&info, character);
+        stbtt_GetGlyphHMetrics(&info, metrics.glyph_index, &metrics.advance_width, &metrics.left_side_bearing);
+        metrics.advance_width = roundf(metrics.advance_width * scale);
+        metrics.left_side_bearing = roundf(metrics.left_side_bearing * scale);
+        int c_x1, c_y1, c_x2, c_y2;
+        stbtt_GetGlyphBitmapBox(&info, metrics.glyph_index, scale, scale, &c_x1, &c_y1, &c_x2, &c_y2);
+        metrics.bounding_box = RectT<int>(c_x1, c_y1, c_x2 - c_x1, c_y2 - c_y1);
+        return metrics;
+    }
+
+    /**
+     * Get the metrics of a character at the current line height
+     * Only the first call for a character asks the font, later calls are a table lookup
+     * The reference stays valid until set_line_height is called
+    */
+    const GlyphMetrics& get_glyph_metrics(const int character) {
+        if(character >= 0 && character < 0x10000) {
+            if(_bmp_metric_pages.size() == 0) {
+                _bmp_metric_pages.resize(256);
+            }
+            std::vector<GlyphMetrics>& page = _bmp_metric_pages[character >> 8];
+            if(page.size() == 0) {
+                GlyphMetrics not_computed = GlyphMetrics();
+                not_computed.glyph_index = -1;
+                page.resize(256, not_computed);
+            }
+            GlyphMetrics& metrics = page[character & 255];
+            if(metrics.glyph_index < 0) {
+                metrics = _compute_glyph_metrics(character);
+            }
+            return metrics;
+        }
+        auto it = _other_metrics.find(character);
+        if(it == _other_metrics.end()) {
+            it = _other_metrics.insert(std::make_pair(character, _compute_glyph_metrics(character))).first;
+        }
+        return it->second;
+    }
+
+    // The kerning between two glyphs(see GlyphMetrics::glyph_index) at the current line height
+    int _get_glyph_kerning(const int glyph1, const int glyph2) {
+        if(!info.kern && !info.gpos) {
+            return 0; // The font has no kerning
+        }
+        uint64_t key = ((uint64_t)glyph1 << 32) | (uint32_t)glyph2;
+        auto it = _kerning_pairs.find(key);
+        if(it != _kerning_pairs.end()) {
+            return it->second;
+        }
+        if(_kerning_precomputed) {
+            return 0;
+        }
+        int kern = roundf(stbtt_GetGlyphKernAdvance(&info, glyph1, glyph2) * scale);
+        _kerning_pairs[key] = kern;
+        return kern;
+    }
+
+    void _get_character_advancement(const int character, int* advanceWidth, int* leftSideBearing) {
+        // Advance width is how much to advance to the right
+        // leftSideBearing means that it overlaps a little with the previous character
+        const GlyphMetrics& metrics = get_glyph_metrics(character);
+        *advanceWidth = metrics.advance_width;
+        *leftSideBearing = metrics.left_side_bearing;
+    }
+
+    int _get_kernal_advancement(const int character1, const int character2) {
+        return _get_glyph_kerning(get_glyph_metrics(character1).glyph_index, get_glyph_metrics(character2).glyph_index);
+    }
+
+    // Get bounding box for character (may be offset to account for chars that dip above or below the line)
+    RectT<int> _get_character_bounding_box(const int character) {
+        return get_glyph_metrics(character).bounding_box;
+    }
+
+    /**
+     * Rasterize a character straight into dst, one coverage byte per pixel
+     * dst is typically _get_character_bounding_box(character) in size, the glyph is clipped if dst is smaller
+     * dst can be a view into a larger image(e.g. a glyph atlas), so the glyph never has to be copied
+    */
+    void render_character_a8(const int character, ImageViewA8 dst) {
+        const GlyphMetrics& metrics = get_glyph_metrics(character);
+        int w = std::min(metrics.bounding_box.w, dst.w);
+        int h = std::min(metrics.bounding_box.h, dst.h);
+        if(w <= 0 || h <= 0) {
+            return;
+        }
+        stbtt_MakeGlyphBitmap(&info, dst.data, w, h, dst.stride, scale, scale, metrics.glyph_index);
+    }
+
+    /**
+     * Render the signed distance field of a character, see GlyphSDFOptions
+     * The image does not depend on the current line height, so one image per character can be used for every size
+     * Characters without an outline(e.g. space) give an empty image
+    */
+    ImageA8 get_character_sdf(const int character, const GlyphSDFOptions& options = GlyphSDFOptions()) {
+        ImageA8 return_image = ImageA8();
+        int w, h, x_offset, y_offset;
+        unsigned char* sdf = stbtt_GetGlyphSDF(&info, stbtt_ScaleForPixelHeight(&info, options.line_height), get_glyph_metrics(character).glyph_index, 
+                                               options.padding, options.on_edge_value, options.get_value_per_pixel(), &w, &h, &x_offset, &y_offset);
+        if(sdf == nullptr) {
+            return return_image;
+        }
+        return_image.resize(w, h);
+        std::memcpy(return_image.pixels.data(), sdf, (size_t)w * h);
+        stbtt_FreeSDF(sdf, info.userdata);
+        return return_image;
+    }
+    // The position and size of get_character_sdf relative to the baseline at options.line_height, without rendering it
+    RectT<int> get_character_sdf_box(const int character, const GlyphSDFOptions& options = GlyphSDFOptions()) {
+        // The sdf is the bitmap box at options.line_height, with the padding added on every side
+        int c_x1, c_y1, c_x2, c_y2;
+        float sdf_scale = stbtt_ScaleForPixelHeight(&info, options.line_height);
+        stbtt_GetGlyphBitmapBox(&info, get_glyph_metrics(character).glyph_index, sdf_scale, sdf_scale, &c_x1, &c_y1, &c_x2, &c_y2);
+        if(c_x1 == c_x2 || c_y1 == c_y2) {
+            return RectT<int>(0, 0, 0, 0);
+        }
+        return RectT<int>(c_x1 - options.padding, c_y1 - options.padding, c_x2 - c_x1 + 2 * options.padding, c_y2 - c_y1 + 2 * options.padding);
+    }
+
+    // Get image of character, as coverage only
+    ImageA8 get_character_image_a8(const int character) {
         RectT<int> bounding_box = _get_character_bounding_box(character);
-        ImageRGBA_UChar return_image = ImageRGBA_UChar();
-        std::vector<unsigned char> pixels_char_vec = std::vector<unsigned char>();
-        pixels_char_vec.resize(bounding_box.w * bounding_box.h);
-        stbtt_MakeCodepointBitmap(&info, (unsigned char*)&pixels_char_vec[0], bounding_box.w, bounding_box.h, bounding_box.w, scale, scale, character);
+        ImageA8 return_image = ImageA8();
         return_image.resize(bounding_box.w, bounding_box.h);
-        for(int i = 0; i < pixels_char_vec.size(); i++) {
-            return_image.pixels[i] = ColorRGBA_UChar(color_mask.r, color_mask.g, color_mask.b, pixels_char_vec[i] * color_mask.a / 255.0);
-        }
+        render_character_a8(character, return_image);
         return return_image;
     }
 
+    // Get image of character
+    ImageRGBA_UChar get_character_image_rgba(const int character, ColorRGBA_UChar color_mask=ColorRGBA_UChar(255, 255, 255, 255)) {
+        return get_character_image_a8(character).to_image_rgba(color_mask);
+    }
+
     // Get where font images in a text should be placed. 
     // Some fonts may take into consideration which letters are next to each other, so-called font kerning
     // Characters are specified in unicode(but normal ascii will be treated as usual)
@@ -378,22 +6310,49 @@ struct FontLoader {
             }
 
             // Get bounding box for character
-            RectT<int> image_pos = _get_character_bounding_box(characters[i]);
+            const GlyphMetrics& metrics = get_glyph_metrics(characters[i]);
+            RectT<int> image_pos = metrics.bounding_box;
             image_pos.x += x;
             image_pos.y += ascent + y;
-
-            int advanceWidth;
-            int leftSideBearing;
-            _get_character_advancement(characters[i], &advanceWidth, &leftSideBearing);
-            image_pos.x += leftSideBearing;
+            image_pos.x += metrics.left_side_bearing;
 
             // Push back bounding box
             return_vec.push_back(image_pos);
 
             // Increment position if there is another letter after
             if(i + 1 != characters.size()) {
-                x += advanceWidth;
-                x += _get_kernal_advancement(characters[i], characters[i + 1]);
+                x += metrics.advance_width;
+                x += _get_glyph_kerning(metrics.glyph_index, get_glyph_metrics(characters[i + 1]).glyph_index);
+            }
+        }
+        return return_vec;
+    }
+
+    /**
+     * Get where the sdf images(see get_character_sdf) of a text should be drawn at the current line height
+     * The images are scaled by line_height / options.line_height, the advance and kerning are the same as for get_character_image_positions
+    */
+    std::vector<RectT<float>> get_character_sdf_positions(const std::vector<int>& characters, const GlyphSDFOptions& options = GlyphSDFOptions()) {
+        std::vector<RectT<float>> return_vec = {};
+        return_vec.reserve(characters.size());
+        float sdf_scale = (float)line_height / options.line_height;
+
+        int x = 0;
+        int y = 0;
+        for(size_t i = 0; i < characters.size(); i++) {
+            if(characters[i] == '\n') {
+                return_vec.push_back(RectT<float>(0, 0, 0, 0));
+                y += line_height;
+                x = 0;
+                continue;
+            }
+            // The box already includes the left side bearing
+            const GlyphMetrics& metrics = get_glyph_metrics(characters[i]);
+            RectT<int> box = get_character_sdf_box(characters[i], options);
+            return_vec.push_back(RectT<float>(x + box.x * sdf_scale, y + ascent + box.y * sdf_scale, box.w * sdf_scale, box.h * sdf_scale));
+            if(i + 1 != characters.size()) {
+                x += metrics.advance_width;
+                x += _get_glyph_kerning(metrics.glyph_index, get_glyph_metrics(characters[i + 1]).glyph_index);
             }
         }
         return return_vec;
@@ -402,35 +6361,47 @@ struct FontLoader {
     // Get the glyph index of character
     // (Can be used to determine if two letters correspond to the same font image)
     int get_glyph_index(const int character) {
-        int glyphIndex = stbtt_FindGlyphIndex(&info, character);
-        //if (glyphIndex == 0) {
-        //    Print("Glyph not found for codepoint: " << character);
-        //}
-        return glyphIndex;
+        return get_glyph_metrics(character).glyph_index;
     }
     // Determine if a letter/character/unicode character is a part of the loaded font
     bool character_is_part_of_font(const int character) {
         return get_glyph_index(character) != 0;
     }
 };
+static_assert(std::is_nothrow_move_constructible<FontLoader>::value, "std::vector<FontLoader> must move fonts when it grows, copies set up info again");
 
 /**
  * Supports loading multiple .ttf or .otf fonts at the same time
  */
 struct MultiFontLoader {
+    // Which font supports a character, and its glyph in that font
+    struct _FontCoverage {
+        int font_index = -2; // -2 if it has not been looked up yet, -1 if no font supports the character
+        int glyph_index = 0;
+    };
+
     std::vector<FontLoader> fontLoaders;  // Stores multiple fonts
     int line_height = 64;
 
+    /**
+     * Coverage index from codepoint to font, so finding the font of a character is a table lookup instead of 
+     *  searching the character map of every font. Pages of 256 codepoints are filled in as characters are looked up,
+     *  and it is cleared when a font is added. It does not depend on the line height
+    */
+    std::vector<std::vector<_FontCoverage> > _coverage_pages;
+
     // Load a font from memory
     void load_font_from_memory(unsigned char* fontBuffer, int size) {
         fontLoaders.push_back(FontLoader());
         fontLoaders.back().load_font_from_memory(fontBuffer, size, line_height);
+        _coverage_pages.clear();
     }
 
     // Load a font from a file
     void load_font_from_file(const std::string& filepath) {
         fontLoaders.push_back(FontLoader());
         fontLoaders.back().load_font_from_file(filepath, line_height);
+        _coverage_pages.clear();
     }
 
     // Set line height for all loaded fonts
@@ -441,14 +6412,82 @@ struct MultiFontLoader {
         }
     }
 
+    _FontCoverage _find_coverage(int character) {
+        _FontCoverage coverage = _FontCoverage();
+        coverage.font_index = -1;
+        for (size_t i = 0; i < fontLoaders.size(); i++) {
+            int glyph_index = stbtt_FindGlyphIndex(&fontLoaders[i].info, character);
+            if (glyph_index != 0) {
+                coverage.font_index = (int)i;
+                coverage.glyph_index = glyph_index;
+                break;
+            }
+        }
+        return coverage;
+    }
+    _FontCoverage _get_coverage(int character) {
+        if (character < 0 || character > 0x10FFFF) {
+            return _find_coverage(character); // Outside of unicode, not worth indexing
+        }
+        if (_coverage_pages.size() == 0) {
+            _coverage_pages.resize(0x1100);
+        }
+        std::vector<_FontCoverage>& page = _coverage_pages[character >> 8];
+        if (page.size() == 0) {
+            page.resize(256);
+        }
+        _FontCoverage& coverage = page[character & 255];
+        if (coverage.font_index == -2) {
+            coverage = _find_coverage(character);
+        }
+        return coverage;
+    }
+
+    // Get the index in fontLoaders of the first font that supports a given character, -1 if no font does
+    int find_font_index(int character) {
+        return _get_coverage(character).font_index;
+    }
+
+    // Get the glyph index of a character in the font that supports it(see find_font_index), 0 if no font does
+    int get_glyph_index(int character) {
+        return _get_coverage(character).glyph_index;
+    }
+
     // Find the first font that supports a given character
     FontLoader* find_font_with_character(int character) {
-        for (auto& loader : fontLoaders) {
-            if (loader.character_is_part_of_font(character)) {
-                return &loader;
-            }
+        int font_index = find_font_index(character);
+        if (font_index < 0) {
+            return nullptr;  // No font supports the character
         }
-        return nullptr;  // No font supports the character
+        return &fontLoaders[font_index];
+    }
+
+    // Get the bounding box of character in the first font that supports it, empty if no font does
+    RectT<int> _get_character_bounding_box(int character) {
+        FontLoader* fontLoader = find_font_with_character(character);
+        if (!fontLoader) return RectT<int>(0, 0, 0, 0);
+        return fontLoader->_get_character_bounding_box(character);
+    }
+
+    // Rasterize character into dst with fallback mechanism, see FontLoader::render_character_a8
+    void render_character_a8(int character, ImageViewA8 dst) {
+        FontLoader* fontLoader = find_font_with_character(character);
+        if (!fontLoader) return;
+        fontLoader->render_character_a8(character, dst);
+    }
+
+    // Get character image as coverage only, with fallback mechanism
+    ImageA8 get_character_image_a8(int character) {
+        FontLoader* fontLoader = find_font_with_character(character);
+        if (!fontLoader) return ImageA8();  // Return empty image if no font supports the character
+        return fontLoader->get_character_image_a8(character);
+    }
+
+    // Get the signed distance field of a character with fallback mechanism, see FontLoader::get_character_sdf
+    ImageA8 get_character_sdf(int character, const GlyphSDFOptions& options = GlyphSDFOptions()) {
+        FontLoader* fontLoader = find_font_with_character(character);
+        if (!fontLoader) return ImageA8();  // Return empty image if no font supports the character
+        return fontLoader->get_character_sdf(character, options);
     }
 
     // Get character image with fallback mechanism
@@ -511,9 +6550,524 @@ struct MultiFontLoader {
         return positions;
     }
 
+    // Same as FontLoader::get_character_sdf_positions, with each character from the first font that supports it
+    std::vector<RectT<float>> get_character_sdf_positions(const std::vector<int>& characters, const GlyphSDFOptions& options = GlyphSDFOptions()) {
+        std::vector<RectT<float>> positions;
+        positions.reserve(characters.size());
+        float sdf_scale = (float)line_height / options.line_height;
+
+        int x = 0;
+        int y = 0;
+        int ascent = 0;  // Max ascent among used fonts for alignment
+        for (int c : characters) {
+            FontLoader* font = find_font_with_character(c);
+            if (font && font->ascent > ascent) {
+                ascent = font->ascent;
+            }
+        }
+
+        for (size_t i = 0; i < characters.size(); i++) {
+            if(characters[i] == '\n') {
+                positions.push_back(RectT<float>(0, 0, 0, 0));
+                y += line_height;
+                x = 0;
+                continue;
+            }
+            FontLoader* font = find_font_with_character(characters[i]);
+            if (!font) continue;  // Skip if no valid font found
+
+            RectT<int> box = font->get_character_sdf_box(characters[i], options);
+            positions.push_back(RectT<float>(x + box.x * sdf_scale, y + ascent + box.y * sdf_scale, box.w * sdf_scale, box.h * sdf_scale));
+            if (i + 1 < characters.size()) {
+                const GlyphMetrics& metrics = font->get_glyph_metrics(characters[i]);
+                x += metrics.advance_width + font->_get_glyph_kerning(metrics.glyph_index, font->get_glyph_metrics(characters[i + 1]).glyph_index);
+            }
+        }
+        return positions;
+    }
+
     // Check if a character is supported by any loaded font
     bool character_is_part_of_font(int character) {
         return find_font_with_character(character) != nullptr;
     }
 };
+
+// ============================================================
+//                         Text layout
+// ============================================================
+
+/**
+ * Text laid out with a MultiFontLoader, that can be edited without laying out the whole text again
+ * The text is split into paragraphs at '\n', and an edit only wraps the lines it touches: wrapping starts at the line
+ *  before the edit and stops at the first line that starts where an old line did, since the lines after it are unchanged
+ *  (without wrapping a paragraph is one line, so the pen positions after the edit move along with it)
+ * Finding the paragraph of a cursor or a position uses prefix sums over the paragraphs(see FenwickTree), O(log n)
+ * 
+ * A cursor is an index into the text from 0 to size(), a cursor at i is just before character i
+ * Positions are in pixels, with the same origin and character positions as MultiFontLoader::get_character_image_positions
+ *  except that the baseline is aligned to the largest ascent of all the loaded fonts
+ * Note! Call relayout() after changing the line height of the font
+ * 
+ * TextLayout layout = TextLayout(&font_loader);
+ * layout.set_wrap_width(400); // Word wrap, 0 for no wrapping
+ * layout.set_text(characters);
+ * layout.insert(cursor, {'a'});
+ * RectT<int> cursor_rect = layout.get_cursor_rect(cursor + 1);
+*/
+class TextLayout {
+public:
+    struct _Paragraph {
+        std::vector<int> characters; // Without the '\n' at the end
+        std::vector<int> pen_x; // Where each character is placed on its line
+        std::vector<int> advance; // The distance to the next character, including kerning
+        std::vector<int> line_starts = {0}; // The first character of each line, a paragraph is wrapped into several lines
+        int end_x = 0; // Where the cursor after the last character is
+
+        int line_count() const {
+            return line_starts.size();
+        }
+        // The line that character index is on, where index = characters.size() is the end of the paragraph
+        int get_line(size_t index) const {
+            return std::upper_bound(line_starts.begin(), line_starts.end(), (int)index) - line_starts.begin() - 1;
+        }
+        size_t get_line_end(int line) const {
+            return line + 1 < line_count() ? line_starts[line + 1] : characters.size();
+        }
+    };
+    MultiFontLoader* font = nullptr;
+    int wrap_width = 0; // Break lines between words to fit within this width, 0 for no wrapping
+    std::vector<_Paragraph> paragraphs;
+    FenwickTree _paragraph_sizes; // The characters in each paragraph, including the '\n' after it
+    FenwickTree _paragraph_heights; // In pixels
+    int _line_height = 0;
+    int _ascent = 0;
+
+    TextLayout() {
+        paragraphs.assign(1, _Paragraph());
+        _paragraph_sizes = FenwickTree::from_values({1});
+        _paragraph_heights = FenwickTree::from_values({0});
+    }
+    TextLayout(MultiFontLoader* font_, int wrap_width_ = 0) {
+        font = font_;
+        wrap_width = wrap_width_;
+        set_text({});
+    }
+
+    // Replace the whole text and lay it out, O(n)
+    void set_text(const std::vector<int>& characters) {
+        paragraphs.assign(1, _Paragraph());
+        for(int character : characters) {
+            if(character == '\n') {
+                paragraphs.push_back(_Paragraph());
+            }
+            else {
+                paragraphs.back().characters.push_back(character);
+            }
+        }
+        relayout();
+    }
+    void set_wrap_width(int wrap_width_) {
+        if(wrap_width != wrap_width_) {
+            wrap_width = wrap_width_;
+            relayout();
+        }
+    }
+    // Lay out every paragraph again, e.g. after the line height of the font has changed
+    void relayout() {
+        Assert(font != nullptr);
+        _line_height = font->line_height;
+        _ascent = 0;
+        for(const FontLoader& loader : font->fontLoaders) {
+            _ascent = std::max(_ascent, loader.ascent);
+        }
+        std::vector<int64_t> sizes = std::vector<int64_t>(paragraphs.size());
+        std::vector<int64_t> heights = std::vector<int64_t>(paragraphs.size());
+        for(size_t i = 0; i < paragraphs.size(); i++) {
+            _layout_paragraph(paragraphs[i]);
+            sizes[i] = paragraphs[i].characters.size() + 1;
+            heights[i] = (int64_t)paragraphs[i].line_count() * _line_height;
+        }
+        _paragraph_sizes = FenwickTree::from_values(sizes);
+        _paragraph_heights = FenwickTree::from_values(heights);
+    }
+
+    // The distance from character i to the next one, including kerning if the next character is from the same font
+    int _get_advance(const std::vector<int>& characters, size_t i) {
+        int font_index = font->find_font_index(characters[i]);
+        if(font_index < 0) {
+            return 0;
+        }
+        FontLoader& loader = font->fontLoaders[font_index];
+        const GlyphMetrics& metrics = loader.get_glyph_metrics(characters[i]);
+        int advance = metrics.advance_width;
+        if(i + 1 < characters.size() && font->find_font_index(characters[i + 1]) == font_index) {
+            advance += loader._get_glyph_kerning(metrics.glyph_index, font->get_glyph_index(characters[i + 1]));
+        }
+        return advance;
+    }
+    int _get_width(int character) {
+        int font_index = font->find_font_index(character);
+        return font_index < 0 ? 0 : font->fontLoaders[font_index].get_glyph_metrics(character).advance_width;
+    }
+
+    /**
+     * Break the characters of a paragraph into lines from the start of first_line, using the advances
+     * After an edit, line_starts still holds the old lines(the ones after the edit not yet shifted by it), and wrapping stops
+     *  at the first new line after the edit that starts where an old line did. The lines from there on are kept
+     * @arg edit_end: the end of the changed characters, SIZE_MAX to wrap every line after first_line
+     * @arg shift: the number of characters the edit inserted, negative if it erased more than it inserted
+    */
+    void _wrap_lines(_Paragraph& paragraph, int first_line, size_t edit_end = SIZE_MAX, int64_t shift = 0) {
+        const std::vector<int>& characters = paragraph.characters;
+        std::vector<int>& line_starts = paragraph.line_starts;
+        size_t count = characters.size();
+        std::vector<int> new_line_starts;
+        size_t kept_line = line_starts.size(); // The first old line that is kept
+
+        int x = 0;
+        size_t line_start = line_starts[first_line];
+        size_t word_start = line_start; // The first character after the last space on the line, where the line can be broken
+        size_t i = line_start;
+        bool kept = false;
+        for(; i < count; i++) {
+            // Spaces may hang past the wrap width, the line is broken after them
+            // If the character still does not fit after moving the word to a new line, the word is broken there as well
+            while(wrap_width > 0 && i > line_start && characters[i] != ' ' && x + _get_width(characters[i]) > wrap_width) {
+                size_t new_line_start = word_start > line_start ? word_start : i; // Break within the word if it does not fit on one line
+                int line_shift = new_line_start < i ? paragraph.pen_x[new_line_start] : x;
+                for(size_t j = new_line_start; j < i; j++) {
+                    paragraph.pen_x[j] -= line_shift;
+                }
+                x -= line_shift;
+                line_start = new_line_start;
+                if(line_start >= edit_end) {
+                    // The lines only depend on the characters from their start, which are the same as before the edit
+                    int64_t old_line_start = (int64_t)line_start - shift;
+                    auto it = std::lower_bound(line_starts.begin() + first_line + 1, line_starts.end(), old_line_start);
+                    if(it != line_starts.end() && *it == old_line_start) {
+                        kept_line = it - line_starts.begin();
+                        kept = true;
+                        break;
+                    }
+                }
+                new_line_starts.push_back(line_start);
+            }
+            if(kept) {
+                break;
+            }
+            paragraph.pen_x[i] = x;
+            x += paragraph.advance[i];
+            if(characters[i] == ' ') {
+                word_start = i + 1;
+            }
+        }
+        if(i == count) {
+            paragraph.end_x = x;
+        }
+        for(size_t line = kept_line; line < line_starts.size(); line++) {
+            line_starts[line] += shift;
+        }
+        line_starts.erase(line_starts.begin() + first_line + 1, line_starts.begin() + kept_line);
+        line_starts.insert(line_starts.begin() + first_line + 1, new_line_starts.begin(), new_line_starts.end());
+    }
+    void _layout_paragraph(_Paragraph& paragraph) {
+        size_t count = paragraph.characters.size();
+        paragraph.pen_x.resize(count);
+        paragraph.advance.resize(count);
+        for(size_t i = 0; i < count; i++) {
+            paragraph.advance[i] = _get_advance(paragraph.characters, i);
+        }
+        paragraph.line_starts.assign(1, 0);
+        _wrap_lines(paragraph, 0);
+    }
+    void _update_paragraph_sums(size_t index) {
+        _paragraph_sizes.set(index, paragraphs[index].characters.size() + 1);
+        _paragraph_heights.set(index, (int64_t)paragraphs[index].line_count() * _line_height);
+    }
+    /**
+     * Replace erase_count characters at position in a paragraph with inserted, and wrap the lines that changed
+     * Only the advances next to the edit change, the line before the edit is wrapped again since a shorter word may now fit on it
+    */
+    void _edit_paragraph(size_t index, size_t position, size_t erase_count, const std::vector<int>& inserted) {
+        _Paragraph& paragraph = paragraphs[index];
+        int first_line = std::max(paragraph.get_line(position) - 1, 0);
+        paragraph.characters.erase(paragraph.characters.begin() + position, paragraph.characters.begin() + position + erase_count);
+        paragraph.characters.insert(paragraph.characters.begin() + position, inserted.begin(), inserted.end());
+        paragraph.pen_x.erase(paragraph.pen_x.begin() + position, paragraph.pen_x.begin() + position + erase_count);
+        paragraph.pen_x.insert(paragraph.pen_x.begin() + position, inserted.size(), 0);
+        paragraph.advance.erase(paragraph.advance.begin() + position, paragraph.advance.begin() + position + erase_count);
+        paragraph.advance.insert(paragraph.advance.begin() + position, inserted.size(), 0);
+        for(size_t i = position > 0 ? position - 1 : 0; i < position + inserted.size() && i < paragraph.characters.size(); i++) {
+            paragraph.advance[i] = _get_advance(paragraph.characters, i);
+        }
+        _wrap_lines(paragraph, first_line, position + inserted.size(), (int64_t)inserted.size() - (int64_t)erase_count);
+        _update_paragraph_sums(index);
+    }
+    // Find the paragraph of a cursor, and the index within the paragraph
+    size_t _find_paragraph(size_t cursor, size_t* index_in_paragraph) const {
+        size_t paragraph = std::min(_paragraph_sizes.find(cursor), paragraphs.size() - 1);
+        *index_in_paragraph = std::min(cursor - _paragraph_sizes.prefix_sum(paragraph), paragraphs[paragraph].characters.size());
+        return paragraph;
+    }
+    int _get_paragraph_y(size_t paragraph) const {
+        return _paragraph_heights.prefix_sum(paragraph);
+    }
+
+    // The number of characters, including '\n'
+    size_t size() const {
+        return paragraphs.size() == 0 ? 0 : _paragraph_sizes.total() - 1;
+    }
+    int get_height() const {
+        return _paragraph_heights.total();
+    }
+    int get_character(size_t index) const {
+        size_t index_in_paragraph;
+        const _Paragraph& paragraph = paragraphs[_find_paragraph(index, &index_in_paragraph)];
+        return index_in_paragraph < paragraph.characters.size() ? paragraph.characters[index_in_paragraph] : '\n';
+    }
+    std::vector<int> get_text() const {
+        std::vector<int> text;
+        text.reserve(size());
+        for(size_t i = 0; i < paragraphs.size(); i++) {
+            if(i != 0) {
+                text.push_back('\n');
+            }
+            text.insert(text.end(), paragraphs[i].characters.begin(), paragraphs[i].characters.end());
+        }
+        return text;
+    }
+
+    // Insert characters at cursor, only the lines around cursor and the new paragraphs are laid out
+    void insert(size_t cursor, const std::vector<int>& characters) {
+        size_t index;
+        size_t first = _find_paragraph(std::min(cursor, size()), &index);
+        std::vector<std::vector<int> > segments = std::vector<std::vector<int> >(1); // The characters for each paragraph
+        for(int character : characters) {
+            if(character == '\n') {
+                segments.push_back(std::vector<int>());
+            }
+            else {
+                segments.back().push_back(character);
+            }
+        }
+        if(segments.size() == 1) {
+            _edit_paragraph(first, index, 0, segments[0]);
+            return;
+        }
+        // The characters after cursor move to the last new paragraph
+        std::vector<_Paragraph> new_paragraphs = std::vector<_Paragraph>(segments.size() - 1);
+        std::vector<int64_t> sizes;
+        std::vector<int64_t> heights;
+        std::vector<int>& first_characters = paragraphs[first].characters;
+        segments.back().insert(segments.back().end(), first_characters.begin() + index, first_characters.end());
+        for(size_t i = 0; i < new_paragraphs.size(); i++) {
+            new_paragraphs[i].characters.swap(segments[i + 1]);
+            _layout_paragraph(new_paragraphs[i]);
+            sizes.push_back(new_paragraphs[i].characters.size() + 1);
+            heights.push_back((int64_t)new_paragraphs[i].line_count() * _line_height);
+        }
+        _edit_paragraph(first, index, first_characters.size() - index, segments[0]);
+        paragraphs.insert(paragraphs.begin() + first + 1, new_paragraphs.begin(), new_paragraphs.end());
+        _paragraph_sizes.insert(first + 1, sizes);
+        _paragraph_heights.insert(first + 1, heights);
+    }
+    // Erase count characters after cursor, paragraphs are joined if a '\n' is erased
+    void erase(size_t cursor, size_t count) {
+        cursor = std::min(cursor, size());
+        count = std::min(count, size() - cursor);
+        if(count == 0) {
+            return;
+        }
+        size_t first_index;
+        size_t last_index;
+        size_t first = _find_paragraph(cursor, &first_index);
+        size_t last = _find_paragraph(cursor + count, &last_index);
+        if(first == last) {
+            _edit_paragraph(first, first_index, last_index - first_index, {});
+            return;
+        }
+        std::vector<int> tail = std::vector<int>(paragraphs[last].characters.begin() + last_index, paragraphs[last].characters.end());
+        paragraphs.erase(paragraphs.begin() + first + 1, paragraphs.begin() + last + 1);
+        _paragraph_sizes.erase(first + 1, last - first);
+        _paragraph_heights.erase(first + 1, last - first);
+        _edit_paragraph(first, first_index, paragraphs[first].characters.size() - first_index, tail);
+    }
+
+    // Where the cursor is drawn, x and the top of its line, with the height of a line
+    RectT<int> get_cursor_rect(size_t cursor) const {
+        size_t index;
+        size_t paragraph_index = _find_paragraph(cursor, &index);
+        const _Paragraph& paragraph = paragraphs[paragraph_index];
+        int x = index < paragraph.characters.size() ? paragraph.pen_x[index] : paragraph.end_x;
+        int y = _get_paragraph_y(paragraph_index) + paragraph.get_line(index) * _line_height;
+        return RectT<int>(x, y, 0, _line_height);
+    }
+    // The cursor closest to a position, e.g. where the text was clicked
+    size_t get_cursor_at(int x, int y) const {
+        size_t paragraph_index = std::min(_paragraph_heights.find(std::max(y, 0)), paragraphs.size() - 1);
+        const _Paragraph& paragraph = paragraphs[paragraph_index];
+        int line = (y - _get_paragraph_y(paragraph_index)) / std::max(_line_height, 1);
+        line = std::max(0, std::min(line, paragraph.line_count() - 1));
+
+        // The first character whose center is to the right of x
+        size_t line_start = paragraph.line_starts[line];
+        size_t line_end = paragraph.get_line_end(line);
+        size_t lo = line_start;
+        size_t hi = line_end;
+        while(lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if(paragraph.pen_x[mid] + paragraph.advance[mid] / 2 > x) {
+                hi = mid;
+            }
+            else {
+                lo = mid + 1;
+            }
+        }
+        // The end of a wrapped line is the start of the next line, stay before the space the line was broken after
+        if(lo == line_end && line + 1 < paragraph.line_count() && lo > line_start && paragraph.characters[lo - 1] == ' ') {
+            lo--;
+        }
+        return _paragraph_sizes.prefix_sum(paragraph_index) + lo;
+    }
+
+    RectT<int> _get_character_position(const _Paragraph& paragraph, size_t index, int line_y) const {
+        if(index >= paragraph.characters.size()) {
+            return RectT<int>(paragraph.end_x, line_y, 0, 0); // '\n'
+        }
+        int character = paragraph.characters[index];
+        int font_index = font->find_font_index(character);
+        if(font_index < 0) {
+            return RectT<int>(paragraph.pen_x[index], line_y, 0, 0);
+        }
+        const GlyphMetrics& metrics = font->fontLoaders[font_index].get_glyph_metrics(character);
+        RectT<int> position = metrics.bounding_box;
+        position.x += paragraph.pen_x[index] + metrics.left_side_bearing;
+        position.y += line_y + _ascent;
+        return position;
+    }
+    // Where the image of a character is drawn, see MultiFontLoader::get_character_image_positions
+    RectT<int> get_character_position(size_t index) const {
+        size_t index_in_paragraph;
+        size_t paragraph_index = _find_paragraph(index, &index_in_paragraph);
+        const _Paragraph& paragraph = paragraphs[paragraph_index];
+        int line_y = _get_paragraph_y(paragraph_index) + paragraph.get_line(index_in_paragraph) * _line_height;
+        return _get_character_position(paragraph, index_in_paragraph, line_y);
+    }
+    /**
+     * Call func(index, character, position) for each character on the lines between y_min and y_max, except '\n'
+     * Only the visible lines are visited, so drawing part of a large text does not depend on its size
+    */
+    void for_each_character(int y_min, int y_max, const std::function<void(size_t, int, RectT<int>)>& func) const {
+        size_t paragraph_index = _paragraph_heights.find(std::max(y_min, 0));
+        if(paragraph_index >= paragraphs.size()) {
+            return;
+        }
+        size_t paragraph_start = _paragraph_sizes.prefix_sum(paragraph_index);
+        int paragraph_y = _get_paragraph_y(paragraph_index);
+        for(; paragraph_index < paragraphs.size() && paragraph_y < y_max; paragraph_index++) {
+            const _Paragraph& paragraph = paragraphs[paragraph_index];
+            int first_line = std::max(0, (y_min - paragraph_y) / std::max(_line_height, 1));
+            for(int line = first_line; line < paragraph.line_count(); line++) {
+                int line_y = paragraph_y + line * _line_height;
+                if(line_y >= y_max) {
+                    break;
+                }
+                for(size_t i = paragraph.line_starts[line]; i < paragraph.get_line_end(line); i++) {
+                    func(paragraph_start + i, paragraph.characters[i], _get_character_position(paragraph, i, line_y));
+                }
+            }
+            paragraph_start += paragraph.characters.size() + 1;
+            paragraph_y += paragraph.line_count() * _line_height;
+        }
+    }
+};
+
+void TEST_text_layout() {
+    // A font where every character advances 6 pixels, filled in directly so no font file is needed
+    // 'a' followed by 'b' is kerned, and 'x' is not part of the font
+    MultiFontLoader font = MultiFontLoader();
+    font.line_height = 10;
+    font.fontLoaders.push_back(FontLoader());
+    FontLoader& loader = font.fontLoaders.back();
+    loader.line_height = 10;
+    loader.ascent = 8;
+    loader.info.kern = 1;
+    loader._kerning_precomputed = true;
+    loader._kerning_pairs[((uint64_t)'a' << 32) | (uint32_t)'b'] = -2;
+    loader._bmp_metric_pages.resize(256);
+    loader._bmp_metric_pages[0].resize(256);
+    font._coverage_pages.resize(0x1100);
+    font._coverage_pages[0].resize(256);
+    for(int character = 0; character < 256; character++) {
+        font._coverage_pages[0][character].font_index = -1;
+    }
+    const std::vector<int> alphabet = {'a', 'b', 'c', ' ', ' ', '\n', 'x'};
+    for(int character : alphabet) {
+        if(character == 'x') {
+            continue;
+        }
+        font._coverage_pages[0][character].font_index = 0;
+        font._coverage_pages[0][character].glyph_index = character;
+        GlyphMetrics& metrics = loader._bmp_metric_pages[0][character];
+        metrics.glyph_index = character;
+        metrics.advance_width = 6;
+        metrics.bounding_box = RectT<int>(0, -8, 5, 10);
+    }
+
+    PCG32 random = PCG32(49);
+    for(int wrap_width : {0, 40}) {
+        TextLayout layout = TextLayout(&font, wrap_width);
+        std::vector<int> text;
+        for(int edit = 0; edit < 400; edit++) {
+            size_t cursor = random.next_bounded(text.size() + 1);
+            if(random.next_bounded(3) != 0) {
+                std::vector<int> inserted = std::vector<int>(1 + random.next_bounded(12));
+                for(int& character : inserted) {
+                    character = alphabet[random.next_bounded(alphabet.size())];
+                }
+                layout.insert(cursor, inserted);
+                text.insert(text.begin() + cursor, inserted.begin(), inserted.end());
+            }
+            else {
+                size_t count = std::min((size_t)1 + random.next_bounded(12), text.size() - cursor);
+                layout.erase(cursor, count);
+                text.erase(text.begin() + cursor, text.begin() + cursor + count);
+            }
+
+            // The edited layout is the same as laying out the whole text again
+            TextLayout expected = TextLayout(&font, wrap_width);
+            expected.set_text(text);
+            Assert(layout.get_text() == text);
+            Assert(layout.size() == text.size());
+            Assert(layout.get_height() == expected.get_height());
+            Assert(layout.paragraphs.size() == expected.paragraphs.size());
+            for(size_t i = 0; i < layout.paragraphs.size(); i++) {
+                const TextLayout::_Paragraph& paragraph = layout.paragraphs[i];
+                const TextLayout::_Paragraph& expected_paragraph = expected.paragraphs[i];
+                Assert(paragraph.characters == expected_paragraph.characters);
+                Assert(paragraph.pen_x == expected_paragraph.pen_x);
+                Assert(paragraph.advance == expected_paragraph.advance);
+                Assert(paragraph.line_starts == expected_paragraph.line_starts);
+                Assert(paragraph.end_x == expected_paragraph.end_x);
+            }
+
+            // Clicking where a cursor is drawn gives back the cursor
+            // A cursor before 'x' is drawn at the same place as the one after it, since 'x' has no width
+            for(size_t i = 0; i <= text.size(); i++) {
+                if(i < text.size() && text[i] == 'x') {
+                    continue;
+                }
+                RectT<int> rect = layout.get_cursor_rect(i);
+                Assert(rect == expected.get_cursor_rect(i));
+                Assert(layout.get_cursor_at(rect.x, rect.y + rect.h / 2) == i);
+            }
+            // Clicking to the right of a line stays on it, unless a word was broken there and its end is the start of the next line
+            for(int y = 0; y < layout.get_height(); y += font.line_height) {
+                size_t cursor = layout.get_cursor_at(1000, y);
+                Assert(layout.get_cursor_rect(cursor).y == y || (cursor > 0 && text[cursor - 1] != ' '));
+            }
+        }
+    }
+}
+AddTest(TEST_text_layout);
 }
\ No newline at end of file
@@ -33,10 +33,27 @@ Everything should be supported in C++11 and newer versions across most major pla
 #include <thread>       // Includes functions for handling multi-thread applications
 #include <mutex>        // Support library for using threads, includes locks
 #include <future>       // Support library for using threads, used for asynchronous retrieval of values
+#include <condition_variable> // For letting threads wait for each other
+#include <atomic>       // For sharing simple values between threads without locks
+#include <functional>   // Contains std::function
+#include <memory>       // Contains std::shared_ptr
+#include <algorithm>    // Contains std::min, std::max and std::sort
 #include <complex.h>    // For supporting complex number operations
 
 #include <typeindex>    // For getting the index of different types, and other type information
 #include <random>       // For generating random numbers
+#include <cstdint>      // Contains fixed size integers such as uint64_t
+#include <type_traits>  // For checking properties of types at compile time
+
+#if defined(__SSE2__)
+#include <emmintrin.h>  // SSE2 intrinsics, used by vectorized code paths when available
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>  // SSSE3 byte shuffles, used to convert between 3 and 4 channel pixels
+#endif
+#if defined(__AVX2__) || defined(__F16C__)
+#include <immintrin.h>  // AVX2 and F16C intrinsics, only used if compiled with -mavx2 or -mf16c
+#endif
 
 #ifdef __EMSCRIPTEN__
 #include "emscripten.h" // Include emscripten if available, needed to set the main loop function in case of emscripten
@@ -48,6 +65,14 @@ Everything should be supported in C++11 and newer versions across most major pla
     #define OS_Windows
 #endif
 
+#if defined(OS_Linux) || defined(__APPLE__)
+    #define VICMIL_HAS_MMAP             /* Memory mapped files are supported */
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
 // ============================================================
 //                      Debug
 // ============================================================
@@ -669,6 +694,93 @@ public:
     }
 };
 
+/**
+ * Read-only view of the entire content of a file
+ * Uses mmap where available, so the os pages in the file lazily and no copy is made.
+ * On other platforms the file is read into memory instead
+*/
+class MappedFile {
+    bool _is_open = false;
+    bool _is_mapped = false;
+    std::vector<unsigned char> _read_data; // Used if the file could not be mapped
+public:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+
+    MappedFile() {}
+    MappedFile(const std::string& filename) {
+        open(filename);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        close();
+    }
+
+    // Returns false if the file could not be opened
+    bool open(const std::string& filename) {
+        close();
+        #ifdef VICMIL_HAS_MMAP
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if(fd != -1) {
+            struct stat file_stat;
+            if(fstat(fd, &file_stat) == 0) {
+                size = file_stat.st_size;
+                _is_open = true;
+                if(size > 0) {
+                    void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if(ptr != MAP_FAILED) {
+                        data = (const unsigned char*)ptr;
+                        _is_mapped = true;
+                    }
+                    else {
+                        _is_open = false; // Fall back to reading the file
+                    }
+                }
+            }
+            ::close(fd);
+            if(_is_open) {
+                return true;
+            }
+        }
+        #endif
+        std::ifstream file(filename, std::ios::in | std::ios::binary);
+        if(!file.is_open()) {
+            std::cerr << "Error: Unable to open file " << filename << std::endl;
+            size = 0;
+            return false;
+        }
+        file.seekg(0, std::ios::end);
+        _read_data.resize((size_t)file.tellg());
+        file.seekg(0, std::ios::beg);
+        if(_read_data.size() > 0) {
+            file.read((char*)&_read_data[0], _read_data.size());
+            data = &_read_data[0];
+        }
+        size = _read_data.size();
+        _is_open = true;
+        return true;
+    }
+    void close() {
+        #ifdef VICMIL_HAS_MMAP
+        if(_is_mapped) {
+            munmap((void*)data, size);
+        }
+        #endif
+        _read_data = std::vector<unsigned char>();
+        _is_mapped = false;
+        _is_open = false;
+        data = nullptr;
+        size = 0;
+    }
+    bool is_open() const {
+        return _is_open;
+    }
+    bool is_memory_mapped() const {
+        return _is_mapped;
+    }
+};
+
 // ============================================================
 //                           Time
 // ============================================================
@@ -689,6 +801,20 @@ double get_time_since_epoch_ms() {
     return get_time_since_epoch_s() * 1000;
 }
 
+/**
+ * Measure how long it takes to run a function, in seconds
+ * The function is run one time first as a warmup, then the average over all iterations is returned
+*/
+template<class FUNC>
+double time_function_s(FUNC func, int iterations = 1) {
+    func();
+    double start_time = get_time_since_epoch_s();
+    for(int i = 0; i < iterations; i++) {
+        func();
+    }
+    return (get_time_since_epoch_s() - start_time) / iterations;
+}
+
 void sleep_s(double sleep_time_s) {
     #ifndef __EMSCRIPTEN__
     double time_ms = sleep_time_s * 1000;
@@ -707,6 +833,256 @@ void TEST_sleep() {
 }
 
 
+// ============================================================
+//                      Multithreading
+// ============================================================
+
+/**
+ * The number of threads to use for parallel work
+ * Returns 1 when threads are not available, e.g. with emscripten without pthreads
+*/
+inline int get_thread_count() {
+    #if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+    return 1;
+    #else
+    unsigned int thread_count = std::thread::hardware_concurrency();
+    return thread_count == 0 ? 1 : (int)thread_count;
+    #endif
+}
+
+/**
+ * A fixed set of worker threads that run tasks from a shared queue
+ * Tasks must not block waiting on other tasks in the queue, use parallel_for for that instead
+*/
+class ThreadPool {
+    std::vector<std::thread> _workers;
+    std::list<std::function<void()>> _tasks;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    bool _stop = false;
+public:
+    ThreadPool(int thread_count) {
+        for(int i = 0; i < thread_count; i++) {
+            _workers.push_back(std::thread([this]() { _worker_loop(); }));
+        }
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _condition.notify_all();
+        for(size_t i = 0; i < _workers.size(); i++) {
+            _workers[i].join();
+        }
+    }
+    int thread_count() const {
+        return _workers.size();
+    }
+    void submit(std::function<void()> task) {
+        if(_workers.size() == 0) {
+            task(); // No threads available, run it directly
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _tasks.push_back(std::move(task));
+        }
+        _condition.notify_one();
+    }
+    void _worker_loop() {
+        while(true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _condition.wait(lock, [this]() { return _stop || !_tasks.empty(); });
+                if(_stop && _tasks.empty()) {
+                    return;
+                }
+                task = std::move(_tasks.front());
+                _tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+/**
+ * The shared pool used by parallel_for, created the first time it is used
+ * The calling thread also does work in parallel_for, so the pool has one thread less than the hardware
+*/
+inline ThreadPool& get_worker_pool() {
+    static ThreadPool pool(get_thread_count() - 1);
+    return pool;
+}
+
+struct _ParallelForState {
+    std::function<void(size_t, size_t)> func;
+    size_t begin = 0;
+    size_t end = 0;
+    size_t chunk_size = 1;
+    size_t chunk_count = 0;
+    std::atomic<size_t> next_chunk;
+    std::atomic<size_t> chunks_done;
+    std::mutex mutex;
+    std::condition_variable done_condition;
+
+    // Process chunks until there are none left
+    void run_chunks() {
+        while(true) {
+            size_t chunk = next_chunk.fetch_add(1);
+            if(chunk >= chunk_count) {
+                return;
+            }
+            size_t chunk_begin = begin + chunk * chunk_size;
+            func(chunk_begin, std::min(chunk_begin + chunk_size, end));
+            if(chunks_done.fetch_add(1) + 1 == chunk_count) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done_condition.notify_all();
+            }
+        }
+    }
+};
+
+/**
+ * Split the range [begin, end) into chunks, and call func(chunk_begin, chunk_end) for each chunk on the worker pool
+ * Returns once all chunks are done. The calling thread also processes chunks, so it is safe to call from inside another parallel_for
+ * @arg chunk_size: how many indices to process per call, 0 means split evenly across the threads
+*/
+template<class FUNC>
+void parallel_for(size_t begin, size_t end, FUNC func, size_t chunk_size = 0) {
+    if(end <= begin) {
+        return;
+    }
+    ThreadPool& pool = get_worker_pool();
+    int thread_count = pool.thread_count() + 1;
+    if(chunk_size == 0) {
+        chunk_size = (end - begin + thread_count - 1) / thread_count;
+    }
+    size_t chunk_count = (end - begin + chunk_size - 1) / chunk_size;
+    if(thread_count == 1 || chunk_count == 1) {
+        for(size_t i = begin; i < end; i += chunk_size) {
+            func(i, std::min(i + chunk_size, end));
+        }
+        return;
+    }
+    std::shared_ptr<_ParallelForState> state = std::make_shared<_ParallelForState>();
+    state->func = func;
+    state->begin = begin;
+    state->end = end;
+    state->chunk_size = chunk_size;
+    state->chunk_count = chunk_count;
+    state->next_chunk = 0;
+    state->chunks_done = 0;
+    size_t helper_count = std::min((size_t)thread_count - 1, chunk_count - 1);
+    for(size_t i = 0; i < helper_count; i++) {
+        pool.submit([state]() { state->run_chunks(); });
+    }
+    state->run_chunks();
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->done_condition.wait(lock, [&state]() { return state->chunks_done.load() == state->chunk_count; });
+}
+
+/**
+ * Pass whole objects from one producer thread to one consumer thread, without either of them waiting for the other
+ * The producer fills get_write_buffer() and calls publish(), the consumer calls acquire() and reads get_read_buffer()
+ * If the producer publishes twice before the consumer acquires, the older object is dropped (and counted)
+ * Note! The write buffer is reused, it contains an old object that has to be overwritten
+*/
+template<class T>
+class TripleBuffer {
+    T _buffers[3];
+    int _write_index = 0;
+    int _ready_index = 1;
+    int _read_index = 2;
+    bool _has_new = false;
+    uint64_t _dropped_count = 0;
+    std::mutex _mutex;
+    std::condition_variable _consumed_condition;
+public:
+    TripleBuffer() {}
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+    // Producer side
+    T& get_write_buffer() {
+        return _buffers[_write_index];
+    }
+    void publish() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::swap(_write_index, _ready_index);
+        if(_has_new) {
+            _dropped_count++;
+        }
+        _has_new = true;
+    }
+    /**
+     * Wait until the consumer has acquired the last published object, or the timeout has passed
+     * Lets the producer stay at most one object ahead of the consumer
+     * @return true if it was consumed
+    */
+    bool wait_until_consumed(double timeout_s) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _consumed_condition.wait_for(lock, std::chrono::duration<double>(timeout_s), [this]() { return !_has_new; });
+    }
+
+    // Consumer side
+    /**
+     * Switch to the latest published object
+     * @return false if nothing new has been published since last time, then the read buffer is unchanged
+    */
+    bool acquire() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if(!_has_new) {
+                return false;
+            }
+            std::swap(_read_index, _ready_index);
+            _has_new = false;
+        }
+        _consumed_condition.notify_all();
+        return true;
+    }
+    T& get_read_buffer() {
+        return _buffers[_read_index];
+    }
+    uint64_t dropped_count() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _dropped_count;
+    }
+};
+
+/**
+ * A queue that can be pushed to and popped from by different threads
+*/
+template<class T>
+class ConcurrentQueue {
+    std::vector<T> _items;
+    std::mutex _mutex;
+public:
+    void push(const T& item) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _items.push_back(item);
+    }
+    void push_all(const std::vector<T>& items) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _items.insert(_items.end(), items.begin(), items.end());
+    }
+    // Take everything in the queue, in the order it was pushed
+    std::vector<T> pop_all() {
+        std::vector<T> items;
+        std::lock_guard<std::mutex> lock(_mutex);
+        items.swap(_items);
+        return items;
+    }
+    size_t size() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _items.size();
+    }
+};
+
 // ============================================================
 //                           Math
 // ============================================================
@@ -896,6 +1272,1278 @@ void vec_insert(std::vector<T>& vec,int index, T val){
     vec.insert(vec.begin()+index, val);
 }
 
+// ============================================================
+//                      Random numbers
+// ============================================================
+
+inline uint64_t _splitmix64(uint64_t& state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+inline uint64_t _rotl64(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/**
+ * xoshiro256** random number generator, much faster than std::mt19937 with a small state
+ * Can be used with the distributions in <random>, e.g. std::normal_distribution
+ * 
+ * For independent streams on several threads, seed one generator and call jump() once per stream,
+ *  (or use create_streams) each jump skips 2^128 numbers ahead
+*/
+class Xoshiro256 {
+public:
+    typedef uint64_t result_type;
+    uint64_t s[4];
+
+    Xoshiro256(uint64_t seed = 0) {
+        set_seed(seed);
+    }
+    void set_seed(uint64_t seed) {
+        uint64_t splitmix_state = seed;
+        for(int i = 0; i < 4; i++) {
+            s[i] = _splitmix64(splitmix_state);
+        }
+    }
+    static constexpr uint64_t min() {
+        return 0;
+    }
+    static constexpr uint64_t max() {
+        return UINT64_MAX;
+    }
+    uint64_t operator()() {
+        return next_u64();
+    }
+    uint64_t next_u64() {
+        const uint64_t result = _rotl64(s[1] * 5, 7) * 9;
+        const uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = _rotl64(s[3], 45);
+        return result;
+    }
+    // Uniform in [0, 1)
+    double next_double() {
+        return (next_u64() >> 11) * (1.0 / 9007199254740992.0);
+    }
+    // Uniform in [0, 1)
+    float next_float() {
+        return (next_u64() >> 40) * (1.0f / 16777216.0f);
+    }
+    // Uniform in [min_v, max_v)
+    float next_float(float min_v, float max_v) {
+        return min_v + (max_v - min_v) * next_float();
+    }
+    // Uniform integer in [min_v, max_v]
+    int64_t next_int(int64_t min_v, int64_t max_v) {
+        uint64_t range = (uint64_t)(max_v - min_v) + 1;
+        if(range == 0) {
+            return (int64_t)next_u64(); // The full 64 bit range
+        }
+        // Reject the values that would make the modulo biased
+        uint64_t threshold = (0 - range) % range;
+        while(true) {
+            uint64_t r = next_u64();
+            if(r >= threshold) {
+                return min_v + (int64_t)(r % range);
+            }
+        }
+    }
+    // Advance 2^128 steps, equivalent to 2^128 calls to next_u64
+    void jump() {
+        static const uint64_t JUMP[] = {0x180EC6D33CFD0ABAULL, 0xD5A61266F0C9392CULL, 0xA9582618E03FC9AAULL, 0x39ABDC4529B1661CULL};
+        _jump(JUMP);
+    }
+    // Advance 2^192 steps, can be used to create 2^64 starting points that each have 2^64 jumps
+    void long_jump() {
+        static const uint64_t LONG_JUMP[] = {0x76E15D3EFEFDCBBFULL, 0xC5004E441C522FB3ULL, 0x77710069854EE241ULL, 0x39109BB02ACBE635ULL};
+        _jump(LONG_JUMP);
+    }
+    void _jump(const uint64_t* jump_polynomial) {
+        uint64_t s0 = 0;
+        uint64_t s1 = 0;
+        uint64_t s2 = 0;
+        uint64_t s3 = 0;
+        for(int i = 0; i < 4; i++) {
+            for(int b = 0; b < 64; b++) {
+                if(jump_polynomial[i] & (1ULL << b)) {
+                    s0 ^= s[0];
+                    s1 ^= s[1];
+                    s2 ^= s[2];
+                    s3 ^= s[3];
+                }
+                next_u64();
+            }
+        }
+        s[0] = s0;
+        s[1] = s1;
+        s[2] = s2;
+        s[3] = s3;
+    }
+    /**
+     * Create generators that produce non-overlapping sequences, e.g. one per thread
+    */
+    static std::vector<Xoshiro256> create_streams(uint64_t seed, int stream_count) {
+        std::vector<Xoshiro256> streams = std::vector<Xoshiro256>();
+        streams.reserve(stream_count);
+        Xoshiro256 generator = Xoshiro256(seed);
+        for(int i = 0; i < stream_count; i++) {
+            streams.push_back(generator);
+            generator.jump();
+        }
+        return streams;
+    }
+};
+
+/**
+ * PCG32 random number generator, 32 bit output with 64 bit state
+ * Different stream_id values give independent sequences, and advance() can jump any number of steps in O(log n)
+*/
+class PCG32 {
+public:
+    typedef uint32_t result_type;
+    uint64_t state = 0;
+    uint64_t increment = 1;
+
+    PCG32(uint64_t seed = 0, uint64_t stream_id = 0) {
+        set_seed(seed, stream_id);
+    }
+    void set_seed(uint64_t seed, uint64_t stream_id = 0) {
+        state = 0;
+        increment = (stream_id << 1) | 1;
+        next_u32();
+        state += seed;
+        next_u32();
+    }
+    static constexpr uint32_t min() {
+        return 0;
+    }
+    static constexpr uint32_t max() {
+        return UINT32_MAX;
+    }
+    uint32_t operator()() {
+        return next_u32();
+    }
+    uint32_t next_u32() {
+        uint64_t old_state = state;
+        state = old_state * 6364136223846793005ULL + increment;
+        uint32_t xorshifted = (uint32_t)(((old_state >> 18) ^ old_state) >> 27);
+        uint32_t rot = (uint32_t)(old_state >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((0 - rot) & 31));
+    }
+    // Uniform in [0, 1)
+    float next_float() {
+        return (next_u32() >> 8) * (1.0f / 16777216.0f);
+    }
+    // Uniform in [min_v, max_v)
+    float next_float(float min_v, float max_v) {
+        return min_v + (max_v - min_v) * next_float();
+    }
+    // Uniform integer in [0, bound), bound must be above 0
+    uint32_t next_bounded(uint32_t bound) {
+        Assert(bound > 0);
+        uint32_t threshold = (0 - bound) % bound;
+        while(true) {
+            uint32_t r = next_u32();
+            if(r >= threshold) {
+                return r % bound;
+            }
+        }
+    }
+    // Jump delta steps ahead (or back, since the arithmetic wraps around)
+    void advance(uint64_t delta) {
+        uint64_t cur_mult = 6364136223846793005ULL;
+        uint64_t cur_plus = increment;
+        uint64_t acc_mult = 1;
+        uint64_t acc_plus = 0;
+        while(delta > 0) {
+            if(delta & 1) {
+                acc_mult *= cur_mult;
+                acc_plus = acc_plus * cur_mult + cur_plus;
+            }
+            cur_plus = (cur_mult + 1) * cur_plus;
+            cur_mult *= cur_mult;
+            delta /= 2;
+        }
+        state = acc_mult * state + acc_plus;
+    }
+};
+
+void TEST_random() {
+    Xoshiro256 generator1 = Xoshiro256(123);
+    Xoshiro256 generator2 = Xoshiro256(123);
+    Assert(generator1.next_u64() == generator2.next_u64());
+    generator2.jump();
+    Assert(generator1.next_u64() != generator2.next_u64());
+    for(int i = 0; i < 1000; i++) {
+        int64_t v = generator1.next_int(-3, 3);
+        Assert(v >= -3 && v <= 3);
+        float f = generator1.next_float();
+        Assert(f >= 0.0f && f < 1.0f);
+    }
+
+    // Advancing should be the same as stepping
+    PCG32 pcg1 = PCG32(42, 7);
+    PCG32 pcg2 = PCG32(42, 7);
+    for(int i = 0; i < 1000; i++) {
+        pcg1.next_u32();
+    }
+    pcg2.advance(1000);
+    Assert(pcg1.next_u32() == pcg2.next_u32());
+}
+AddTest(TEST_random);
+
+// ============================================================
+//                           Hashing
+// ============================================================
+
+/**
+ * Fast non-cryptographic hashing, using the same construction as xxHash3
+ * The input is split into 64 byte stripes that are mixed into 8 independent 64 bit lanes,
+ *  which maps directly onto SSE2/AVX2 registers. Every 16 stripes the lanes are scrambled.
+ * The scalar and SIMD versions give identical results, so hashes can be stored on disk
+ * NOTE! Assumes a little endian platform, and is not suitable for anything security related
+*/
+const uint64_t _HASH_PRIME32_1 = 0x9E3779B1ULL;
+const uint64_t _HASH_PRIME32_2 = 0x85EBCA77ULL;
+const uint64_t _HASH_PRIME32_3 = 0xC2B2AE3DULL;
+const uint64_t _HASH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t _HASH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t _HASH_PRIME64_3 = 0x165667B19E3779F9ULL;
+const uint64_t _HASH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t _HASH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+const int _HASH_STRIPE_SIZE = 64;
+const int _HASH_STRIPES_PER_BLOCK = 16;
+
+// Stripe n is mixed with _hash_secret[n..n+7], the block scramble uses _hash_secret[16..23]
+static const uint64_t _hash_secret[24] = {
+    0xC584133AC916AB3CULL, 0x3EE5789041C98AC3ULL, 0xF3B8488C368CB0A6ULL,
+    0x657EECDD3CB13D09ULL, 0xC2D326E0055BDEF6ULL, 0x8621A03FE0BBDB7BULL,
+    0x8E1F7555983AA92FULL, 0xB54E0F1600CC4D19ULL, 0x84BB3F97971D80ABULL,
+    0x7D29825C75521255ULL, 0xC3CF17102B7F7F86ULL, 0x3466E9A083914F64ULL,
+    0xD81A8D2B5A4485ACULL, 0xDB01602B100B9ED7ULL, 0xA9038A921825F10DULL,
+    0xEDF5F1D90DCA2F6AULL, 0x54496AD67BD2634CULL, 0xDD7C01D4F5407269ULL,
+    0x935E82F1DB4C4F7BULL, 0x69B82EBC92233300ULL, 0x40D29EB57DE1D510ULL,
+    0xA2F09DABB45C6316ULL, 0xEE521D7A0F4D3872ULL, 0xF16952EE72F3454FULL,
+};
+
+inline uint64_t _hash_read64(const unsigned char* ptr) {
+    uint64_t val;
+    std::memcpy(&val, ptr, sizeof(val));
+    return val;
+}
+
+// Multiply two 64 bit values to a 128 bit value, and xor the upper and lower half together
+inline uint64_t _hash_mul128_fold64(uint64_t a, uint64_t b) {
+    #if defined(__SIZEOF_INT128__)
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+    #else
+    uint64_t lo_lo = (a & 0xFFFFFFFFULL) * (b & 0xFFFFFFFFULL);
+    uint64_t hi_lo = (a >> 32) * (b & 0xFFFFFFFFULL);
+    uint64_t lo_hi = (a & 0xFFFFFFFFULL) * (b >> 32);
+    uint64_t hi_hi = (a >> 32) * (b >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFFULL) + lo_hi;
+    uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFFULL);
+    return lower ^ upper;
+    #endif
+}
+
+inline uint64_t _hash_avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * Mix stripe_count stripes of 64 bytes into the accumulator lanes
+ * @arg key: the secret for the first stripe, the key is shifted by one lane for every stripe after that
+*/
+inline void _hash_accumulate(uint64_t* acc, const unsigned char* input, size_t stripe_count, const uint64_t* key) {
+    #if defined(__AVX2__)
+    __m256i acc_vec[2];
+    acc_vec[0] = _mm256_loadu_si256((const __m256i*)acc);
+    acc_vec[1] = _mm256_loadu_si256((const __m256i*)acc + 1);
+    for(size_t s = 0; s < stripe_count; s++) {
+        const __m256i* data_ptr = (const __m256i*)(input + s * _HASH_STRIPE_SIZE);
+        const __m256i* key_ptr = (const __m256i*)(key + s);
+        for(int i = 0; i < 2; i++) {
+            __m256i data_vec = _mm256_loadu_si256(data_ptr + i);
+            __m256i data_key = _mm256_xor_si256(data_vec, _mm256_loadu_si256(key_ptr + i));
+            __m256i data_key_hi = _mm256_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+            __m256i product = _mm256_mul_epu32(data_key, data_key_hi);
+            __m256i data_swap = _mm256_shuffle_epi32(data_vec, _MM_SHUFFLE(1, 0, 3, 2));
+            acc_vec[i] = _mm256_add_epi64(acc_vec[i], _mm256_add_epi64(product, data_swap));
+        }
+    }
+    _mm256_storeu_si256((__m256i*)acc, acc_vec[0]);
+    _mm256_storeu_si256((__m256i*)acc + 1, acc_vec[1]);
+    #elif defined(__SSE2__)
+    __m128i acc_vec[4];
+    for(int i = 0; i < 4; i++) {
+        acc_vec[i] = _mm_loadu_si128((const __m128i*)acc + i);
+    }
+    for(size_t s = 0; s < stripe_count; s++) {
+        const __m128i* data_ptr = (const __m128i*)(input + s * _HASH_STRIPE_SIZE);
+        const __m128i* key_ptr = (const __m128i*)(key + s);
+        for(int i = 0; i < 4; i++) {
+            __m128i data_vec = _mm_loadu_si128(data_ptr + i);
+            __m128i data_key = _mm_xor_si128(data_vec, _mm_loadu_si128(key_ptr + i));
+            __m128i data_key_hi = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+            __m128i product = _mm_mul_epu32(data_key, data_key_hi);
+            __m128i data_swap = _mm_shuffle_epi32(data_vec, _MM_SHUFFLE(1, 0, 3, 2));
+            acc_vec[i] = _mm_add_epi64(acc_vec[i], _mm_add_epi64(product, data_swap));
+        }
+    }
+    for(int i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i*)acc + i, acc_vec[i]);
+    }
+    #else
+    for(size_t s = 0; s < stripe_count; s++) {
+        const unsigned char* stripe = input + s * _HASH_STRIPE_SIZE;
+        for(int i = 0; i < 8; i++) {
+            uint64_t data_val = _hash_read64(stripe + 8 * i);
+            uint64_t data_key = data_val ^ key[s + i];
+            acc[i ^ 1] += data_val;
+            acc[i] += (data_key & 0xFFFFFFFFULL) * (data_key >> 32);
+        }
+    }
+    #endif
+}
+
+// Scramble the accumulator lanes at the end of each block, so that bits from the upper half spread downwards
+inline void _hash_scramble(uint64_t* acc, const uint64_t* key) {
+    #if defined(__SSE2__)
+    const __m128i prime32 = _mm_set1_epi32((int)_HASH_PRIME32_1);
+    for(int i = 0; i < 4; i++) {
+        __m128i acc_vec = _mm_loadu_si128((const __m128i*)acc + i);
+        acc_vec = _mm_xor_si128(acc_vec, _mm_srli_epi64(acc_vec, 47));
+        __m128i data_key = _mm_xor_si128(acc_vec, _mm_loadu_si128((const __m128i*)key + i));
+        __m128i data_key_hi = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+        __m128i product_lo = _mm_mul_epu32(data_key, prime32);
+        __m128i product_hi = _mm_mul_epu32(data_key_hi, prime32);
+        _mm_storeu_si128((__m128i*)acc + i, _mm_add_epi64(product_lo, _mm_slli_epi64(product_hi, 32)));
+    }
+    #else
+    for(int i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= key[i];
+        a *= _HASH_PRIME32_1;
+        acc[i] = a;
+    }
+    #endif
+}
+
+inline uint64_t _hash_merge(const uint64_t* acc, const uint64_t* key, uint64_t start) {
+    uint64_t result = start;
+    for(int i = 0; i < 4; i++) {
+        result += _hash_mul128_fold64(acc[2 * i] ^ key[2 * i], acc[2 * i + 1] ^ key[2 * i + 1]);
+    }
+    return _hash_avalanche(result);
+}
+
+inline std::string _to_hex_str(uint64_t value) {
+    static const char* const hex_chars = "0123456789abcdef";
+    std::string str(16, '0');
+    for(int i = 15; i >= 0; i--) {
+        str[i] = hex_chars[value & 0xF];
+        value >>= 4;
+    }
+    return str;
+}
+
+struct Hash128 {
+    uint64_t low = 0;
+    uint64_t high = 0;
+    Hash128() {}
+    Hash128(uint64_t low_, uint64_t high_) {
+        low = low_;
+        high = high_;
+    }
+    bool operator==(const Hash128& other) const {
+        return low == other.low && high == other.high;
+    }
+    bool operator!=(const Hash128& other) const {
+        return !(*this == other);
+    }
+    bool operator<(const Hash128& other) const { // So it can be used as a key in std::map
+        return high < other.high || (high == other.high && low < other.low);
+    }
+    // 32 character hex string, e.g. for using the hash as a filename
+    std::string to_string() const {
+        return _to_hex_str(high) + _to_hex_str(low);
+    }
+};
+
+/**
+ * Hash data that arrives in pieces, the result is the same as hashing all the data at once
+ * 
+ * StreamingHash hasher;
+ * hasher.update(data1, size1);
+ * hasher.update(data2, size2);
+ * uint64_t hash = hasher.digest64();
+*/
+class StreamingHash {
+public:
+    uint64_t acc[8];
+    unsigned char buffer[_HASH_STRIPE_SIZE]; // The last stripe is kept back until more data arrives, or digest is called
+    size_t buffer_size = 0;
+    size_t stripe_in_block = 0;
+    uint64_t total_length = 0;
+
+    StreamingHash(uint64_t seed = 0) {
+        reset(seed);
+    }
+    void reset(uint64_t seed = 0) {
+        const uint64_t init_acc[8] = {
+            _HASH_PRIME32_3, _HASH_PRIME64_1, _HASH_PRIME64_2, _HASH_PRIME64_3,
+            _HASH_PRIME64_4, _HASH_PRIME32_2, _HASH_PRIME64_5, _HASH_PRIME32_1
+        };
+        for(int i = 0; i < 8; i++) {
+            acc[i] = (i % 2 == 0) ? init_acc[i] + seed : init_acc[i] - seed;
+        }
+        buffer_size = 0;
+        stripe_in_block = 0;
+        total_length = 0;
+    }
+    void update(const void* data, size_t size_in_bytes) {
+        const unsigned char* input = (const unsigned char*)data;
+        total_length += size_in_bytes;
+        if(buffer_size + size_in_bytes <= _HASH_STRIPE_SIZE) {
+            if(size_in_bytes > 0) {
+                std::memcpy(buffer + buffer_size, input, size_in_bytes);
+            }
+            buffer_size += size_in_bytes;
+            return;
+        }
+        if(buffer_size > 0) {
+            // Complete the buffered stripe
+            size_t fill_size = _HASH_STRIPE_SIZE - buffer_size;
+            std::memcpy(buffer + buffer_size, input, fill_size);
+            input += fill_size;
+            size_in_bytes -= fill_size;
+            _consume_stripes(buffer, 1);
+        }
+        // Hash directly from the input, but keep at least one byte so the last stripe is handled by digest
+        size_t stripe_count = (size_in_bytes - 1) / _HASH_STRIPE_SIZE;
+        _consume_stripes(input, stripe_count);
+        input += stripe_count * _HASH_STRIPE_SIZE;
+        size_in_bytes -= stripe_count * _HASH_STRIPE_SIZE;
+        std::memcpy(buffer, input, size_in_bytes);
+        buffer_size = size_in_bytes;
+    }
+    uint64_t digest64() const {
+        uint64_t final_acc[8];
+        _final_accumulate(final_acc);
+        return _hash_merge(final_acc, _hash_secret + 3, total_length * _HASH_PRIME64_1);
+    }
+    Hash128 digest128() const {
+        uint64_t final_acc[8];
+        _final_accumulate(final_acc);
+        return Hash128(
+            _hash_merge(final_acc, _hash_secret + 3, total_length * _HASH_PRIME64_1),
+            _hash_merge(final_acc, _hash_secret + 11, ~(total_length * _HASH_PRIME64_2))
+        );
+    }
+
+    void _consume_stripes(const unsigned char* input, size_t stripe_count) {
+        while(stripe_count > 0) {
+            size_t stripes_now = std::min(stripe_count, (size_t)_HASH_STRIPES_PER_BLOCK - stripe_in_block);
+            _hash_accumulate(acc, input, stripes_now, _hash_secret + stripe_in_block);
+            input += stripes_now * _HASH_STRIPE_SIZE;
+            stripe_count -= stripes_now;
+            stripe_in_block += stripes_now;
+            if(stripe_in_block == _HASH_STRIPES_PER_BLOCK) {
+                _hash_scramble(acc, _hash_secret + 16);
+                stripe_in_block = 0;
+            }
+        }
+    }
+    // Mix in the remaining buffered bytes, zero padded. (The length is part of the final merge, so the padding is not ambiguous)
+    void _final_accumulate(uint64_t* out_acc) const {
+        std::memcpy(out_acc, acc, sizeof(acc));
+        if(buffer_size > 0) {
+            unsigned char last_stripe[_HASH_STRIPE_SIZE] = {0};
+            std::memcpy(last_stripe, buffer, buffer_size);
+            _hash_accumulate(out_acc, last_stripe, 1, _hash_secret + stripe_in_block);
+        }
+    }
+};
+
+uint64_t hash64(const void* data, size_t size_in_bytes, uint64_t seed = 0) {
+    StreamingHash hasher = StreamingHash(seed);
+    hasher.update(data, size_in_bytes);
+    return hasher.digest64();
+}
+uint64_t hash64(const std::string& str, uint64_t seed = 0) {
+    return hash64(str.data(), str.size(), seed);
+}
+uint64_t hash64(const std::vector<unsigned char>& data, uint64_t seed = 0) {
+    return hash64(data.data(), data.size(), seed);
+}
+
+Hash128 hash128(const void* data, size_t size_in_bytes, uint64_t seed = 0) {
+    StreamingHash hasher = StreamingHash(seed);
+    hasher.update(data, size_in_bytes);
+    return hasher.digest128();
+}
+Hash128 hash128(const std::string& str, uint64_t seed = 0) {
+    return hash128(str.data(), str.size(), seed);
+}
+Hash128 hash128(const std::vector<unsigned char>& data, uint64_t seed = 0) {
+    return hash128(data.data(), data.size(), seed);
+}
+
+// Combine two hashes into one, the order matters
+inline uint64_t hash_combine(uint64_t hash1, uint64_t hash2) {
+    return _hash_avalanche(_hash_mul128_fold64(hash1 ^ _hash_secret[0], hash2 ^ _hash_secret[1]) + hash2);
+}
+
+/**
+ * Hash the content of a file, the file is memory mapped if the platform supports it
+ * Returns an all zero hash if the file could not be opened
+*/
+Hash128 hash_file(const std::string& filename, uint64_t seed = 0) {
+    MappedFile file;
+    if(!file.open(filename)) {
+        return Hash128();
+    }
+    return hash128(file.data, file.size, seed);
+}
+
+/**
+ * Build a hash out of several fields, such as when creating a key for a cache
+ * Strings and vectors are prefixed with their length, so {"ab", "c"} and {"a", "bc"} hash differently
+ * 
+ * Hash128 key = HashBuilder().add(filename).add(width).add(height).get_hash128();
+*/
+class HashBuilder {
+public:
+    StreamingHash hasher;
+    HashBuilder(uint64_t seed = 0) : hasher(seed) {}
+
+    // NOTE! Padding bytes inside structs are also hashed, so prefer adding each member separately
+    template<class T>
+    HashBuilder& add(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "HashBuilder::add requires a trivially copyable type");
+        hasher.update(&value, sizeof(T));
+        return *this;
+    }
+    HashBuilder& add(const std::string& str) {
+        return add_bytes(str.data(), str.size());
+    }
+    HashBuilder& add(const char* str) {
+        return add_bytes(str, strlen(str));
+    }
+    template<class T>
+    HashBuilder& add(const std::vector<T>& vec) {
+        static_assert(std::is_trivially_copyable<T>::value, "HashBuilder::add requires a trivially copyable type");
+        return add_bytes(vec.data(), vec.size() * sizeof(T));
+    }
+    HashBuilder& add(const Hash128& hash) {
+        add<uint64_t>(hash.low);
+        return add<uint64_t>(hash.high);
+    }
+    HashBuilder& add_bytes(const void* data, size_t size_in_bytes) {
+        add<uint64_t>(size_in_bytes);
+        hasher.update(data, size_in_bytes);
+        return *this;
+    }
+    uint64_t get_hash64() const {
+        return hasher.digest64();
+    }
+    Hash128 get_hash128() const {
+        return hasher.digest128();
+    }
+};
+
+/**
+ * Measure the hashing throughput in GB/s
+*/
+double benchmark_hash_gbps(size_t size_in_bytes = 64 * 1024 * 1024, int iterations = 10) {
+    std::vector<unsigned char> data = std::vector<unsigned char>(size_in_bytes);
+    for(size_t i = 0; i < data.size(); i++) {
+        data[i] = (unsigned char)(i * 31 + (i >> 8));
+    }
+    volatile uint64_t sink = 0;
+    double time_s = time_function_s([&]() {
+        sink = sink + hash64(data);
+    }, iterations);
+    return (size_in_bytes / time_s) / (1000.0 * 1000.0 * 1000.0);
+}
+
+void TEST_hash() {
+    std::vector<unsigned char> data = std::vector<unsigned char>(5000);
+    for(size_t i = 0; i < data.size(); i++) {
+        data[i] = (unsigned char)(i * 7);
+    }
+    // Hashing in pieces should give the same result as hashing all at once
+    for(int split : {0, 1, 63, 64, 65, 1024, 4999}) {
+        StreamingHash hasher;
+        hasher.update(&data[0], split);
+        hasher.update(&data[split], data.size() - split);
+        Assert(hasher.digest64() == hash64(data));
+        Assert(hasher.digest128() == hash128(data));
+    }
+    Assert(hash64("a") != hash64("b"));
+    Assert(hash64("") != hash64(std::string(1, '\0')));
+    Assert(hash64("abc", 1) != hash64("abc", 2));
+    Assert(HashBuilder().add("ab").add("c").get_hash64() != HashBuilder().add("a").add("bc").get_hash64());
+}
+AddTest(TEST_hash);
+
+// ============================================================
+//                      Serialization
+// ============================================================
+
+/**
+ * Binary serialization of values to bytes and back, e.g. for caching things on disk or sending them over sockets
+ * Supports arithmetic types, trivially copyable structs, std::string, std::vector, std::map and std::pair,
+ *  as well as structs that list their fields using SerializeFields(...)
+ * 
+ * struct AtlasCache {
+ *     int w = 0;
+ *     int h = 0;
+ *     std::vector<ColorRGBA_UChar> pixels;
+ *     std::map<std::string, RectT<int>> entries;
+ *     SerializeFields(w, h, pixels, entries)
+ * };
+ * std::vector<unsigned char> bytes = vicmil::serialize(atlas_cache, ATLAS_CACHE_VERSION);
+ * bool success = vicmil::deserialize(bytes, atlas_cache, ATLAS_CACHE_VERSION);
+ * 
+ * Layout: a 32 byte header (magic, format version, data version, payload size) followed by the payload.
+ * Sizes are stored as uint64, and vectors of trivially copyable types are stored as a single block
+ *  aligned to 16 bytes from the start of the header. That way they can be read in place
+ *  from a memory mapped file with BinaryReader::read_array_view, without any deserialization
+ * NOTE! Assumes a little endian platform
+*/
+const uint32_t SERIALIZATION_FORMAT_VERSION = 1;
+const size_t SERIALIZATION_ARRAY_ALIGNMENT = 16;
+
+struct SerializationHeader {
+    char magic[4] = {'V', 'M', 'S', 'R'};
+    uint32_t format_version = SERIALIZATION_FORMAT_VERSION;
+    uint32_t data_version = 0; // Version of the serialized data, chosen by the user. Loading fails if it does not match
+    uint32_t header_size = sizeof(SerializationHeader);
+    uint64_t payload_size = 0;
+    uint64_t reserved = 0;
+};
+
+/**
+ * List the fields of a struct that should be serialized, place it inside the struct
+ * struct MyStruct { int a; std::string b; SerializeFields(a, b) };
+*/
+#define SerializeFields(...) \
+    typedef void _serialize_fields_tag; \
+    template<class VISITOR> void _serialize_fields(VISITOR& visitor) const { visitor.fields(__VA_ARGS__); } \
+    template<class VISITOR> void _serialize_fields(VISITOR& visitor) { visitor.fields(__VA_ARGS__); }
+
+template<class T>
+struct _has_serialize_fields {
+    template<class U> static char test(typename U::_serialize_fields_tag*);
+    template<class U> static long test(...);
+    static const bool value = sizeof(test<T>(nullptr)) == sizeof(char);
+};
+
+// Types that are written as raw bytes
+template<class T>
+struct _is_raw_serializable {
+    static const bool value = std::is_trivially_copyable<T>::value && !_has_serialize_fields<T>::value;
+};
+
+template<class T, class ENABLE = void>
+struct Serializer {
+    static_assert(sizeof(T) == 0, "No Serializer for type, add SerializeFields(...) to it or specialize vicmil::Serializer");
+};
+
+/**
+ * Read-only view of an array that lives somewhere else, for example inside a memory mapped file
+*/
+template<class T>
+struct ArrayView {
+    const T* data = nullptr;
+    size_t size = 0;
+    ArrayView() {}
+    ArrayView(const T* data_, size_t size_) {
+        data = data_;
+        size = size_;
+    }
+    const T* begin() const {
+        return data;
+    }
+    const T* end() const {
+        return data + size;
+    }
+    const T& operator[](size_t i) const {
+        return data[i];
+    }
+    std::vector<T> to_vector() const {
+        return std::vector<T>(begin(), end());
+    }
+};
+
+class BinaryWriter {
+public:
+    std::vector<unsigned char>* buffer;
+    size_t start_offset; // Alignment is relative to where the writer started
+    BinaryWriter(std::vector<unsigned char>* buffer_) {
+        buffer = buffer_;
+        start_offset = buffer->size();
+    }
+    void write_raw(const void* data, size_t size_in_bytes) {
+        if(size_in_bytes == 0) {
+            return;
+        }
+        size_t old_size = buffer->size();
+        buffer->resize(old_size + size_in_bytes);
+        std::memcpy(&(*buffer)[old_size], data, size_in_bytes);
+    }
+    // Pad with zeros until the position is a multiple of alignment
+    void align(size_t alignment) {
+        size_t position = buffer->size() - start_offset;
+        size_t padding = (alignment - position % alignment) % alignment;
+        buffer->resize(buffer->size() + padding, 0);
+    }
+    template<class T>
+    void write(const T& value) {
+        Serializer<T>::write(*this, value);
+    }
+    template<class... ARGS>
+    void fields(const ARGS&... args) {
+        int expand[] = {0, (write(args), 0)...};
+        (void)expand;
+    }
+};
+
+class BinaryReader {
+public:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+    size_t position = 0;
+    bool failed = false; // Set if reading went out of bounds or the data was invalid, all later reads will fail
+    BinaryReader(const unsigned char* data_, size_t size_) {
+        data = data_;
+        size = size_;
+    }
+    size_t remaining() const {
+        return size - position;
+    }
+    bool read_raw(void* out, size_t size_in_bytes) {
+        if(failed || size_in_bytes > remaining()) {
+            failed = true;
+            return false;
+        }
+        if(size_in_bytes > 0) {
+            std::memcpy(out, data + position, size_in_bytes);
+        }
+        position += size_in_bytes;
+        return true;
+    }
+    void align(size_t alignment) {
+        size_t padding = (alignment - position % alignment) % alignment;
+        if(padding > remaining()) {
+            failed = true;
+            return;
+        }
+        position += padding;
+    }
+    template<class T>
+    bool read(T& value) {
+        if(!failed) {
+            Serializer<T>::read(*this, value);
+        }
+        return !failed;
+    }
+    template<class... ARGS>
+    void fields(ARGS&... args) {
+        int expand[] = {0, (read(args), 0)...};
+        (void)expand;
+    }
+    // Read how many elements follow, and fail if there cannot be that many elements left
+    uint64_t read_count(size_t min_element_size) {
+        uint64_t count = 0;
+        read_raw(&count, sizeof(count));
+        if(min_element_size > 0 && count > remaining() / min_element_size) {
+            failed = true;
+            return 0;
+        }
+        return count;
+    }
+    /**
+     * Read a vector of trivially copyable values without copying it, the view points directly into the data
+     * Fails if the data is not aligned for T in memory (memory mapped files are always aligned)
+    */
+    template<class T>
+    ArrayView<T> read_array_view() {
+        static_assert(_is_raw_serializable<T>::value, "read_array_view requires a trivially copyable type");
+        uint64_t count = 0;
+        read_raw(&count, sizeof(count));
+        align(SERIALIZATION_ARRAY_ALIGNMENT);
+        if(failed || count > remaining() / sizeof(T) || ((uintptr_t)(data + position)) % alignof(T) != 0) {
+            failed = true;
+            return ArrayView<T>();
+        }
+        ArrayView<T> view = ArrayView<T>((const T*)(data + position), count);
+        position += count * sizeof(T);
+        return view;
+    }
+    /**
+     * Read and verify the header written by serialize
+     * After this the reader is limited to the payload
+    */
+    bool read_header(uint32_t data_version = 0) {
+        SerializationHeader header;
+        SerializationHeader expected_header;
+        if(!read_raw(&header, sizeof(header))) {
+            return false;
+        }
+        if(std::memcmp(header.magic, expected_header.magic, sizeof(header.magic)) != 0 ||
+            header.format_version != SERIALIZATION_FORMAT_VERSION ||
+            header.data_version != data_version ||
+            header.header_size < sizeof(header) ||
+            header.header_size > size ||
+            header.payload_size > size - header.header_size) {
+            failed = true;
+            return false;
+        }
+        position = header.header_size;
+        size = header.header_size + header.payload_size;
+        return true;
+    }
+};
+
+template<class T>
+struct Serializer<T, typename std::enable_if<_is_raw_serializable<T>::value>::type> {
+    static void write(BinaryWriter& writer, const T& value) {
+        writer.write_raw(&value, sizeof(T));
+    }
+    static void read(BinaryReader& reader, T& value) {
+        reader.read_raw(&value, sizeof(T));
+    }
+};
+
+template<class T>
+struct Serializer<T, typename std::enable_if<_has_serialize_fields<T>::value>::type> {
+    static void write(BinaryWriter& writer, const T& value) {
+        value._serialize_fields(writer);
+    }
+    static void read(BinaryReader& reader, T& value) {
+        value._serialize_fields(reader);
+    }
+};
+
+template<>
+struct Serializer<std::string> {
+    static void write(BinaryWriter& writer, const std::string& value) {
+        writer.write<uint64_t>(value.size());
+        writer.write_raw(value.data(), value.size());
+    }
+    static void read(BinaryReader& reader, std::string& value) {
+        uint64_t size = reader.read_count(1);
+        value.resize(size);
+        if(size > 0) {
+            reader.read_raw(&value[0], size);
+        }
+    }
+};
+
+template<class T>
+struct Serializer<std::vector<T>> {
+    static void write(BinaryWriter& writer, const std::vector<T>& value) {
+        _write(writer, value, std::integral_constant<bool, _is_raw_serializable<T>::value>());
+    }
+    static void read(BinaryReader& reader, std::vector<T>& value) {
+        _read(reader, value, std::integral_constant<bool, _is_raw_serializable<T>::value>());
+    }
+    // Trivially copyable elements are stored as one aligned block
+    static void _write(BinaryWriter& writer, const std::vector<T>& value, std::true_type) {
+        writer.write<uint64_t>(value.size());
+        writer.align(SERIALIZATION_ARRAY_ALIGNMENT);
+        writer.write_raw(value.data(), value.size() * sizeof(T));
+    }
+    static void _read(BinaryReader& reader, std::vector<T>& value, std::true_type) {
+        uint64_t count = 0;
+        reader.read_raw(&count, sizeof(count));
+        reader.align(SERIALIZATION_ARRAY_ALIGNMENT);
+        if(reader.failed || count > reader.remaining() / sizeof(T)) {
+            reader.failed = true;
+            return;
+        }
+        value.resize(count);
+        reader.read_raw(value.data(), count * sizeof(T));
+    }
+    static void _write(BinaryWriter& writer, const std::vector<T>& value, std::false_type) {
+        writer.write<uint64_t>(value.size());
+        for(size_t i = 0; i < value.size(); i++) {
+            writer.write(value[i]);
+        }
+    }
+    static void _read(BinaryReader& reader, std::vector<T>& value, std::false_type) {
+        uint64_t count = reader.read_count(1);
+        value.clear();
+        value.reserve(count);
+        for(uint64_t i = 0; i < count && !reader.failed; i++) {
+            value.push_back(T());
+            reader.read(value.back());
+        }
+    }
+};
+
+// Written with the same layout as std::vector<T>, so it can be read back as either
+template<class T>
+struct Serializer<ArrayView<T>> {
+    static void write(BinaryWriter& writer, const ArrayView<T>& value) {
+        static_assert(_is_raw_serializable<T>::value, "ArrayView can only be serialized for trivially copyable types");
+        writer.write<uint64_t>(value.size);
+        writer.align(SERIALIZATION_ARRAY_ALIGNMENT);
+        writer.write_raw(value.data, value.size * sizeof(T));
+    }
+    static void read(BinaryReader& reader, ArrayView<T>& value) {
+        value = reader.read_array_view<T>();
+    }
+};
+
+template<class T1, class T2>
+struct Serializer<std::pair<T1, T2>, typename std::enable_if<!_is_raw_serializable<std::pair<T1, T2>>::value>::type> {
+    static void write(BinaryWriter& writer, const std::pair<T1, T2>& value) {
+        writer.write(value.first);
+        writer.write(value.second);
+    }
+    static void read(BinaryReader& reader, std::pair<T1, T2>& value) {
+        reader.read(value.first);
+        reader.read(value.second);
+    }
+};
+
+template<class K, class V>
+struct Serializer<std::map<K, V>> {
+    static void write(BinaryWriter& writer, const std::map<K, V>& value) {
+        writer.write<uint64_t>(value.size());
+        for(typename std::map<K, V>::const_iterator it = value.begin(); it != value.end(); it++) {
+            writer.write(it->first);
+            writer.write(it->second);
+        }
+    }
+    static void read(BinaryReader& reader, std::map<K, V>& value) {
+        uint64_t count = reader.read_count(1);
+        value.clear();
+        for(uint64_t i = 0; i < count && !reader.failed; i++) {
+            K key = K();
+            V val = V();
+            reader.read(key);
+            reader.read(val);
+            value[key] = std::move(val);
+        }
+    }
+};
+
+/**
+ * Serialize a value, with a header, and append it to the end of out
+*/
+template<class T>
+void serialize_append(std::vector<unsigned char>& out, const T& value, uint32_t data_version = 0) {
+    size_t start = out.size();
+    BinaryWriter writer = BinaryWriter(&out);
+    SerializationHeader header;
+    header.data_version = data_version;
+    writer.write_raw(&header, sizeof(header));
+    writer.write(value);
+    header.payload_size = out.size() - start - sizeof(header);
+    std::memcpy(&out[start], &header, sizeof(header));
+}
+
+template<class T>
+std::vector<unsigned char> serialize(const T& value, uint32_t data_version = 0) {
+    std::vector<unsigned char> out = std::vector<unsigned char>();
+    serialize_append(out, value, data_version);
+    return out;
+}
+
+/**
+ * Deserialize a value written by serialize
+ * Returns false if the data is invalid or the data version does not match
+*/
+template<class T>
+bool deserialize(const unsigned char* data, size_t size_in_bytes, T& out_value, uint32_t data_version = 0) {
+    BinaryReader reader = BinaryReader(data, size_in_bytes);
+    if(!reader.read_header(data_version)) {
+        return false;
+    }
+    return reader.read(out_value);
+}
+
+template<class T>
+bool deserialize(const std::vector<unsigned char>& data, T& out_value, uint32_t data_version = 0) {
+    return deserialize(data.data(), data.size(), out_value, data_version);
+}
+
+template<class T>
+bool save_serialized_to_file(const std::string& filename, const T& value, uint32_t data_version = 0) {
+    std::vector<unsigned char> bytes = serialize(value, data_version);
+    std::ofstream file(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!file.is_open()) {
+        std::cerr << "Error: Unable to open file " << filename << std::endl;
+        return false;
+    }
+    file.write((const char*)bytes.data(), bytes.size());
+    return file.good();
+}
+
+template<class T>
+bool load_serialized_from_file(const std::string& filename, T& out_value, uint32_t data_version = 0) {
+    MappedFile file;
+    if(!file.open(filename)) {
+        return false;
+    }
+    return deserialize(file.data, file.size, out_value, data_version);
+}
+
+struct _TestSerializeStruct {
+    int id = 0;
+    std::string name;
+    std::vector<float> values;
+    std::map<std::string, std::vector<std::string>> tags;
+    SerializeFields(id, name, values, tags)
+};
+
+void TEST_serialize() {
+    _TestSerializeStruct value;
+    value.id = 42;
+    value.name = "mesh";
+    value.values = {1.0f, 2.5f, -3.0f};
+    value.tags["a"] = {"x", "y"};
+    std::vector<unsigned char> bytes = serialize(value, 3);
+
+    _TestSerializeStruct loaded;
+    Assert(deserialize(bytes, loaded, 3));
+    Assert(loaded.id == 42 && loaded.name == "mesh" && loaded.values == value.values && loaded.tags == value.tags);
+    Assert(!deserialize(bytes, loaded, 4)); // Wrong version
+    bytes.resize(bytes.size() - 1);
+    Assert(!deserialize(bytes, loaded, 3)); // Truncated
+
+    // Read a vector in place
+    std::vector<unsigned char> view_bytes = serialize(value.values);
+    BinaryReader reader = BinaryReader(view_bytes.data(), view_bytes.size());
+    Assert(reader.read_header());
+    ArrayView<float> view = reader.read_array_view<float>();
+    Assert(!reader.failed && view.size == 3 && view[1] == 2.5f);
+}
+AddTest(TEST_serialize);
+
+// ============================================================
+//                           LRU cache
+// ============================================================
+
+/**
+ * Keeps the most recently used values within a budget, where every value has a cost(e.g. its size in bytes)
+ * When the total cost goes over the budget, the least recently used values are evicted
+ * Note! Not thread safe, protect it with a mutex if it is shared between threads
+ * 
+ * LRUCache<int, std::string> cache = LRUCache<int, std::string>(2);
+ * cache.put(1, "a");
+ * std::string* value = cache.get(1); // nullptr if it has been evicted
+*/
+template<class KEY, class VALUE, class HASH = std::hash<KEY> >
+class LRUCache {
+public:
+    struct Entry {
+        KEY key;
+        VALUE value;
+        size_t cost;
+    };
+    std::list<Entry> entries; // The most recently used first
+    std::unordered_map<KEY, typename std::list<Entry>::iterator, HASH> lookup;
+    size_t budget = SIZE_MAX;
+    size_t total_cost = 0;
+    std::function<void(const KEY&, VALUE&)> on_evict; // Optional, called before a value is evicted(e.g. to free gpu memory)
+
+    LRUCache() {}
+    LRUCache(size_t budget_) {
+        budget = budget_;
+    }
+    // Get a value and mark it as the most recently used, nullptr if it is not in the cache
+    VALUE* get(const KEY& key) {
+        auto it = lookup.find(key);
+        if(it == lookup.end()) {
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->value;
+    }
+    bool contains(const KEY& key) const {
+        return lookup.count(key) != 0;
+    }
+    /**
+     * Add or replace a value as the most recently used, then evict other values until the cache is within budget
+     * The added value itself is kept even if its cost alone is above the budget
+    */
+    VALUE& put(const KEY& key, VALUE value, size_t cost = 1) {
+        erase(key);
+        entries.push_front(Entry{key, std::move(value), cost});
+        lookup[key] = entries.begin();
+        total_cost += cost;
+        evict_to(budget, 1);
+        return entries.front().value;
+    }
+    void erase(const KEY& key) {
+        auto it = lookup.find(key);
+        if(it == lookup.end()) {
+            return;
+        }
+        total_cost -= it->second->cost;
+        entries.erase(it->second);
+        lookup.erase(it);
+    }
+    // Evict the least recently used values until the total cost is at most target_cost, but keep at least keep_count values
+    void evict_to(size_t target_cost, size_t keep_count = 0) {
+        while(total_cost > target_cost && entries.size() > keep_count) {
+            Entry& entry = entries.back();
+            if(on_evict) {
+                on_evict(entry.key, entry.value);
+            }
+            total_cost -= entry.cost;
+            lookup.erase(entry.key);
+            entries.pop_back();
+        }
+    }
+    void clear() {
+        evict_to(0);
+    }
+    size_t size() const {
+        return entries.size();
+    }
+};
+
+void TEST_lru_cache() {
+    LRUCache<int, int> cache = LRUCache<int, int>(3);
+    int evicted = 0;
+    cache.on_evict = [&](const int&, int&) { evicted++; };
+    cache.put(1, 10);
+    cache.put(2, 20);
+    cache.put(3, 30);
+    Assert(cache.get(1) != nullptr); // 1 is now the most recently used, so 2 is evicted next
+    cache.put(4, 40);
+    Assert(cache.get(2) == nullptr && evicted == 1);
+    Assert(*cache.get(1) == 10 && *cache.get(3) == 30 && *cache.get(4) == 40);
+    cache.put(5, 50, 3); // Larger than the budget, everything else is evicted
+    Assert(cache.size() == 1 && cache.total_cost == 3 && evicted == 4);
+}
+AddTest(TEST_lru_cache);
+
+// ============================================================
+//                          Prefix sums
+// ============================================================
+
+/**
+ * Fenwick tree(binary indexed tree), keeps the prefix sums of a list of values up to date as the values change
+ * Changing a value, getting a prefix sum and finding which value a position is in are all O(log n)
+ *  e.g. to find which paragraph of a text a character or a pixel row is in
+ * 
+ * FenwickTree tree = FenwickTree::from_values({3, 1, 4});
+ * tree.prefix_sum(2); // 3 + 1 = 4
+ * tree.find(5); // 2, position 5 is within the third value(prefix sums 4 <= 5 < 8)
+*/
+class FenwickTree {
+public:
+    std::vector<int64_t> values;
+    std::vector<int64_t> tree; // tree[i - 1] is the sum of the values in (i - (i & -i), i]
+
+    FenwickTree() {}
+    // O(n)
+    static FenwickTree from_values(const std::vector<int64_t>& values_) {
+        FenwickTree new_tree = FenwickTree();
+        new_tree.values = values_;
+        new_tree._build();
+        return new_tree;
+    }
+    void _build() {
+        tree = values;
+        for(size_t i = 1; i <= tree.size(); i++) {
+            size_t parent = i + (i & (~i + 1));
+            if(parent <= tree.size()) {
+                tree[parent - 1] += tree[i - 1];
+            }
+        }
+    }
+    size_t size() const {
+        return values.size();
+    }
+    int64_t get(size_t index) const {
+        return values[index];
+    }
+    void add(size_t index, int64_t delta) {
+        values[index] += delta;
+        for(size_t i = index + 1; i <= tree.size(); i += i & (~i + 1)) {
+            tree[i - 1] += delta;
+        }
+    }
+    void set(size_t index, int64_t value) {
+        add(index, value - values[index]);
+    }
+    // The sum of the first count values
+    int64_t prefix_sum(size_t count) const {
+        int64_t sum = 0;
+        for(size_t i = count; i > 0; i -= i & (~i + 1)) {
+            sum += tree[i - 1];
+        }
+        return sum;
+    }
+    int64_t total() const {
+        return prefix_sum(size());
+    }
+    /**
+     * Find the value that position is within, the largest index where prefix_sum(index) <= position
+     * Returns size() if position >= total(). Note! Only works if no value is negative
+    */
+    size_t find(int64_t position) const {
+        size_t step = 1;
+        while(step * 2 <= tree.size()) {
+            step *= 2;
+        }
+        size_t index = 0;
+        for(; step > 0; step /= 2) {
+            if(index + step <= tree.size() && tree[index + step - 1] <= position) {
+                index += step;
+                position -= tree[index - 1];
+            }
+        }
+        return index;
+    }
+    // Inserting and erasing values rebuilds the tree, O(n)
+    void insert(size_t index, const std::vector<int64_t>& new_values) {
+        values.insert(values.begin() + index, new_values.begin(), new_values.end());
+        _build();
+    }
+    void erase(size_t index, size_t count = 1) {
+        values.erase(values.begin() + index, values.begin() + index + count);
+        _build();
+    }
+};
+
+void TEST_fenwick_tree() {
+    FenwickTree tree = FenwickTree::from_values({3, 1, 4, 0, 5});
+    Assert(tree.prefix_sum(0) == 0 && tree.prefix_sum(2) == 4 && tree.total() == 13);
+    Assert(tree.find(0) == 0 && tree.find(2) == 0 && tree.find(3) == 1 && tree.find(5) == 2);
+    Assert(tree.find(8) == 4); // Skips the empty value
+    Assert(tree.find(13) == 5);
+    tree.set(1, 10);
+    Assert(tree.prefix_sum(2) == 13 && tree.find(12) == 1 && tree.total() == 22);
+    tree.insert(1, {2});
+    Assert(tree.size() == 6 && tree.prefix_sum(3) == 15 && tree.find(4) == 1);
+    tree.erase(0, 2);
+    Assert(tree.size() == 4 && tree.total() == 19 && tree.find(10) == 1);
+}
+AddTest(TEST_fenwick_tree);
+
 // ============================================================
 //                    Emscripten support
 // ============================================================